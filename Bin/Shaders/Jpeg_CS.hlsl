@@ -28,9 +28,15 @@ struct BSResult
 	BitString BS[6];
 };
 
+#if DETERMINISTIC
+groupshared int TransformedPixelData[64];
+groupshared int DCT_MatrixTmp[64];
+groupshared int DCT_Coefficients[64];
+#else
 groupshared float TransformedPixelData[64];
 groupshared float DCT_MatrixTmp[64];
 groupshared float DCT_Coefficients[64];
+#endif
 
 groupshared int QuantizedComponents[64];
 groupshared uint ZeroMask[64];
@@ -39,7 +45,14 @@ groupshared uint ScanArray[64];
 groupshared int RemappedValues[64];
 groupshared uint PrevIndex[64];
 
-groupshared uint EntropyResult[32];
+//room for the largest possible block, 63 codes of 26 bits
+groupshared uint EntropyResult[64];
+
+//overflow slot of the block, see CopyToDeviceMemory
+groupshared uint OverflowSlot;
+
+//payload words per thread of ScanBlocks
+groupshared uint BlockWordSums[1024];
 
 
 
@@ -67,53 +80,171 @@ cbuffer cbImageInfo								: register(b0)
 	uint numBlocksY;
 
 	uint EntropyBlockSize;
+
+	//index of the overflow counter, the slots follow it
+	uint OverflowBase;
+	uint NumOverflowSlots;
+
+	//buffer layout of the packed blocks, see JpegEntropySlots.h
+	uint NumEntropyBlocks;
+	uint SlotBase;
+	uint OffsetBase;
 };
 
-float Get_YCbCr_Component_From_RGB(float3 RGB)
+//ints per overflow slot, JPEG_OVERFLOW_SLOT_WORDS in JpegEntropySlots.h
+#define OVERFLOW_SLOT_WORDS 52
+
+//groups per row of the CompactBlocks dispatch, JPEG_COMPACT_GROUPS_X
+#define COMPACT_GROUPS_X 256
+
+//MCU_H x MCU_V Y blocks followed by one Cb and one Cr block per MCU,
+//the sampling factors come from the encoder's MCU layout
+uint GetOutputIndex(uint GroupIndex : SV_GroupIndex, uint3 GroupID : SV_GroupID)
 {
+	int EBS = EntropyBlockSize;
+	int blocksPerMCU = MCU_H * MCU_V + 2;
+
 #ifdef COMPONENT_Y
-	return dot(RGB,float3(0.299,0.587,0.114)) * 255.0f;
+	int mcuIndex = (GroupID.y / MCU_V) * (numBlocksX / MCU_H) + GroupID.x / MCU_H;
+	int block = (GroupID.y % MCU_V) * MCU_H + GroupID.x % MCU_H;
 #elif COMPONENT_CB
-	return dot(RGB,float3(-0.168736,-0.331264,0.5)) * 255.0f + 128.0f;
+	int mcuIndex = GroupID.y * numBlocksX + GroupID.x;
+	int block = MCU_H * MCU_V;
 #elif COMPONENT_CR
-	return dot(RGB,float3(0.5,-0.418688,-0.081312)) * 255.0f + 128.0f;
+	int mcuIndex = GroupID.y * numBlocksX + GroupID.x;
+	int block = MCU_H * MCU_V + 1;
 #endif
+
+	return SlotBase + (mcuIndex * blocksPerMCU + block) * EBS + GroupIndex;
 }
 
-uint GetOutputIndex(uint GroupIndex : SV_GroupIndex, uint3 GroupID : SV_GroupID)
+#if DETERMINISTIC
+//Integer only path, selected with JENC_OPTION_DETERMINISTIC. Every step below
+//is the exact integer math of the CPU encoder (ConvertMCURow, the islow FDCT and
+//QuantizeBlock), so both produce the same bytes on any GPU and driver.
+
+//BT.601 weights in 1.15 fixed point, same constants as JpegEncoderCPU.cpp
+static const int3 FIX_Y  = int3(  9798,  19235,   3735);
+static const int3 FIX_CB = int3( -5529, -10855,  16384);
+static const int3 FIX_CR = int3( 16384, -13720,  -2664);
+
+//8 bit RGB of image pixel (x, y), pixels beyond the image repeat the last
+//one and the texel is the one the point sampler would pick for that pixel
+int3 LoadRGB(uint x, uint y)
 {
-	int EBS = EntropyBlockSize;
-	int outputIndex = 0;
+	uint texWidth, texHeight;
+	InputTex.GetDimensions(texWidth, texHeight);
+
+	uint imageWidth = (uint)ImageWidth;
+	uint imageHeight = (uint)ImageHeight;
+
+	x = min(x, imageWidth - 1);
+	y = min(y, imageHeight - 1);
+
+	int2 texel = int2(x * texWidth / imageWidth, y * texHeight / imageHeight);
+	return (int3)(InputTex.Load(int3(texel, 0)).xyz * 255.0f + 0.5f);
+}
+
+//level shifted component, chroma sums the RGB of the MCU_H x MCU_V pixels it
+//covers before weighting, which rounds the same as the CPU encoder
+int Get_Transformed_YCbCr_Component(uint3 DispatchThreadID)
+{
+#ifdef COMPONENT_Y
+	int3 rgb = LoadRGB(DispatchThreadID.x, DispatchThreadID.y);
+	return ((dot(rgb, FIX_Y) + (1 << 14)) >> 15) - 128;
+#else
+	int3 sum = 0;
+	[unroll] for(uint sy = 0; sy < MCU_V; sy++)
+		[unroll] for(uint sx = 0; sx < MCU_H; sx++)
+			sum += LoadRGB(DispatchThreadID.x * MCU_H + sx, DispatchThreadID.y * MCU_V + sy);
+
+	int numSummed = MCU_H * MCU_V;
+	int shift = 15 + (numSummed == 4 ? 2 : numSummed == 2 ? 1 : 0);
+
+#ifdef COMPONENT_CB
+	int3 weights = FIX_CB;
+#else
+	int3 weights = FIX_CR;
+#endif
+
+	return clamp((dot(sum, weights) + numSummed * (1 << 14)) >> shift, -128, 127);
+#endif
+}
+
+//libjpeg's jfdctint.c, 13 bit constants and 2 extra bits between the passes
+#define ISLOW_CONST_BITS	13
+#define ISLOW_PASS1_BITS	2
+
+#define DESCALE(x, n)		(((x) + (1 << ((n) - 1))) >> (n))
+
+void ISlow1D(int pass, int v[8], out int o[8])
+{
+	int tmp0 = v[0] + v[7];
+	int tmp7 = v[0] - v[7];
+	int tmp1 = v[1] + v[6];
+	int tmp6 = v[1] - v[6];
+	int tmp2 = v[2] + v[5];
+	int tmp5 = v[2] - v[5];
+	int tmp3 = v[3] + v[4];
+	int tmp4 = v[3] - v[4];
+
+	int descale = pass == 1 ? ISLOW_CONST_BITS - ISLOW_PASS1_BITS : ISLOW_CONST_BITS + ISLOW_PASS1_BITS;
+
+	//even part
+	int tmp10 = tmp0 + tmp3;
+	int tmp13 = tmp0 - tmp3;
+	int tmp11 = tmp1 + tmp2;
+	int tmp12 = tmp1 - tmp2;
+
+	if(pass == 1)
+	{
+		o[0] = (tmp10 + tmp11) << ISLOW_PASS1_BITS;
+		o[4] = (tmp10 - tmp11) << ISLOW_PASS1_BITS;
+	}
+	else
+	{
+		o[0] = DESCALE(tmp10 + tmp11, ISLOW_PASS1_BITS);
+		o[4] = DESCALE(tmp10 - tmp11, ISLOW_PASS1_BITS);
+	}
 
+	int z1 = (tmp12 + tmp13) * 4433;
+	o[2] = DESCALE(z1 + tmp13 * 6270, descale);
+	o[6] = DESCALE(z1 + tmp12 * -15137, descale);
+
+	//odd part
+	z1 = tmp4 + tmp7;
+	int z2 = tmp5 + tmp6;
+	int z3 = tmp4 + tmp6;
+	int z4 = tmp5 + tmp7;
+	int z5 = (z3 + z4) * 9633;
+
+	tmp4 *= 2446;
+	tmp5 *= 16819;
+	tmp6 *= 25172;
+	tmp7 *= 12299;
+	z1 *= -7373;
+	z2 *= -20995;
+	z3 *= -16069;
+	z4 *= -3196;
+
+	z3 += z5;
+	z4 += z5;
+
+	o[7] = DESCALE(tmp4 + z1 + z3, descale);
+	o[5] = DESCALE(tmp5 + z2 + z4, descale);
+	o[3] = DESCALE(tmp6 + z2 + z3, descale);
+	o[1] = DESCALE(tmp7 + z1 + z4, descale);
+}
+#else
+float Get_YCbCr_Component_From_RGB(float3 RGB)
+{
 #ifdef COMPONENT_Y
-	#ifdef C_4_4_4
-		outputIndex = (GroupID.y * numBlocksX + GroupID.x) * EBS * 3 + GroupIndex;
-	#elif C_4_2_2
-		int row_pitch = EBS * numBlocksX * 2;
-		outputIndex = GroupID.y * row_pitch + (GroupID.x / 2) * EBS * 4 + (GroupID.x % 2) * EBS + GroupIndex;
-	#elif C_4_2_0
-		int row_pitch = EBS * numBlocksX *3;
-		outputIndex = (GroupID.y / 2) * row_pitch + (GroupID.x / 2) * EBS * 6 + (GroupID.x % 2) * EBS + (EBS*2 * (GroupID.y%2)) + GroupIndex;
-	#endif
+	return dot(RGB,float3(0.299,0.587,0.114)) * 255.0f;
 #elif COMPONENT_CB
-	#ifdef C_4_4_4
-		outputIndex = (GroupID.y * numBlocksX + GroupID.x) * EBS * 3 + GroupIndex + EBS;
-	#elif C_4_2_2
-		outputIndex = EBS*2 + numBlocksX * 4 * EBS * GroupID.y + GroupID.x * (EBS*4) + GroupIndex;
-	#elif C_4_2_0
-		outputIndex = EBS*4 + numBlocksX * 6 * EBS * GroupID.y + GroupID.x * EBS * 6 + GroupIndex;
-	#endif
+	return dot(RGB,float3(-0.168736,-0.331264,0.5)) * 255.0f + 128.0f;
 #elif COMPONENT_CR
-	#ifdef C_4_4_4
-		outputIndex = (GroupID.y * numBlocksX + GroupID.x) * EBS * 3 + GroupIndex + EBS * 2;
-	#elif C_4_2_2
-		outputIndex = EBS*2 + numBlocksX * 4 * EBS * GroupID.y + GroupID.x * (EBS*4) + GroupIndex + EBS;
-	#elif C_4_2_0
-		outputIndex = EBS*4 + numBlocksX * 6 * EBS * GroupID.y + GroupID.x * EBS * 6 + GroupIndex + EBS;
-	#endif
+	return dot(RGB,float3(0.5,-0.418688,-0.081312)) * 255.0f + 128.0f;
 #endif
-
-	return outputIndex;
 }
 
 float2 GetTexCoord(uint3 DispatchThreadID)
@@ -199,6 +330,7 @@ float Get_Transformed_YCbCr_Component(uint3 DispatchThreadID)
 
 	return max(-128.0f, min(127.0f, yuv_component - 128.0f));
 }
+#endif
 
 void Sum(int thid)
 {
@@ -240,7 +372,7 @@ void Sum(int thid)
             int ai = offset*(2*thid+1)-1;
             int bi = offset*(2*thid+2)-1;
 
-            float t   = ScanArray[ai];
+            uint t   = ScanArray[ai];
             ScanArray[ai]  = ScanArray[bi];
             ScanArray[bi] += t;
         }
@@ -303,8 +435,7 @@ void InitSharedMemory(uint GroupIndex)
 	RemappedValues[GroupIndex] = 0;
 	PrevIndex[GroupIndex] = 0;
 
-	EntropyResult[GroupIndex*2] = 0;
-	EntropyResult[GroupIndex*2+1] = 0;
+	EntropyResult[GroupIndex] = 0;
 }
 
 void ComputeColorTransform(uint GroupIndex, uint3 DispatchThreadID)
@@ -316,6 +447,36 @@ void ComputeColorTransform(uint GroupIndex, uint3 DispatchThreadID)
 
 void ComputeFDCT(uint GroupIndex, uint3 GroupThreadID)
 {
+#if DETERMINISTIC
+	//rows then columns, one thread per row or column
+	int v[8], o[8];
+
+	if(GroupIndex < 8)
+	{
+		[unroll] for(int k = 0; k < 8; k++)
+			v[k] = TransformedPixelData[GroupIndex*8+k];
+
+		ISlow1D(1, v, o);
+
+		[unroll] for(int k = 0; k < 8; k++)
+			DCT_MatrixTmp[GroupIndex*8+k] = o[k];
+	}
+
+	GroupMemoryBarrierWithGroupSync();
+
+	if(GroupIndex < 8)
+	{
+		[unroll] for(int k = 0; k < 8; k++)
+			v[k] = DCT_MatrixTmp[k*8+GroupIndex];
+
+		ISlow1D(2, v, o);
+
+		[unroll] for(int k = 0; k < 8; k++)
+			DCT_Coefficients[k*8+GroupIndex] = o[k];
+	}
+
+	GroupMemoryBarrierWithGroupSync();
+#else
 	DCT_MatrixTmp[GroupIndex] = 0;
 	[unroll] for(int k = 0; k < 8; k++)
 		DCT_MatrixTmp[GroupIndex] += DCT_matrix[GroupThreadID.y*8+k] * TransformedPixelData[k*8+GroupThreadID.x];
@@ -327,14 +488,24 @@ void ComputeFDCT(uint GroupIndex, uint3 GroupThreadID)
 		DCT_Coefficients[GroupIndex] += DCT_MatrixTmp[GroupThreadID.y*8+k] * DCT_matrix_transpose[k*8+GroupThreadID.x];
 
 	GroupMemoryBarrierWithGroupSync();
+#endif
 }
 
 void ComputeQuantization(int GroupIndex)
 {
-	//divide and round to nearest integer
+#if DETERMINISTIC
+	//islow output is 8 * DCT, divide the magnitude rounding ties towards zero
+	int divisor = (int)Quantization_Table[GroupIndex] * 8;
+	int coefficient = DCT_Coefficients[ZigZagIndices[GroupIndex]];
+	int quantized = (abs(coefficient) + (divisor - 1) / 2) / divisor;
+
+	QuantizedComponents[GroupIndex] = coefficient < 0 ? -quantized : quantized;
+#else
+	//multiply with the reciprocal and round to nearest integer
 	QuantizedComponents[GroupIndex] =
-		round(DCT_Coefficients[ZigZagIndices[GroupIndex]] /
+		round(DCT_Coefficients[ZigZagIndices[GroupIndex]] *
 			Quantization_Table[GroupIndex]);
+#endif
 }
 
 void StreamCompactQuantizedData(int GroupIndex)
@@ -434,14 +605,36 @@ void EntropyCodeAC(int GroupIndex, BSResult result)
 	GroupMemoryBarrierWithGroupSync();
 }
 
+//A block with more AC bits than its slot holds takes the next overflow slot
+//from the counter at OverflowBase and leaves the slot index in its first AC
+//word. The counter is never reset, the slot is masked, so the CPU only has to
+//check that no more blocks overflowed than there are slots.
 void CopyToDeviceMemory(int GroupIndex, uint3 GroupID, BSResult result)
 {
 	uint outIndex = GetOutputIndex(GroupIndex, GroupID);
+	bool overflow = ScanArray[63] > (EntropyBlockSize - 2) * 32;
+
+	if(overflow && GroupIndex == 0)
+	{
+		int slot;
+		InterlockedAdd(EntropyOut[OverflowBase], 1, slot);
+		OverflowSlot = slot;
+	}
 
-	if(GroupIndex > 0 && GroupIndex < (int)EntropyBlockSize-1)
+	GroupMemoryBarrierWithGroupSync();
+
+	if(overflow)
+	{
+		if(GroupIndex < OVERFLOW_SLOT_WORDS)
+			EntropyOut[OverflowBase + 1 + (OverflowSlot & (NumOverflowSlots - 1)) * OVERFLOW_SLOT_WORDS + GroupIndex] = ConvertEndian(EntropyResult[GroupIndex]);
+
+		if(GroupIndex == 1)
+			EntropyOut[outIndex] = OverflowSlot;
+	}
+	else if(GroupIndex > 0 && GroupIndex < (int)EntropyBlockSize-1)
 		EntropyOut[outIndex] = ConvertEndian(EntropyResult[GroupIndex-1]);
 
-	else if(GroupIndex == 0)
+	if(GroupIndex == 0)
 		EntropyOut[outIndex] = QuantizedComponents[0];
 	else if(GroupIndex == 63)
 		EntropyOut[outIndex - 64 + EntropyBlockSize] = ScanArray[GroupIndex];
@@ -480,4 +673,70 @@ void ComputeJPEG(
 
 	//move result from shared memory to device memory
 	CopyToDeviceMemory(GroupIndex, GroupID, result);
-}
\ No newline at end of file
+}
+
+//Packs the block slots to the front of the buffer after all components are
+//done, JpegEntropySlotSizer::PackBlocks is the same on the CPU. One group,
+//every thread scans a run of blocks, the runs are added up in shared memory.
+[numthreads(1024, 1, 1)]
+void ScanBlocks(uint GroupIndex : SV_GroupIndex)
+{
+	uint EBS = EntropyBlockSize;
+	uint blocksPerThread = (NumEntropyBlocks + 1023) / 1024;
+	uint first = min(GroupIndex * blocksPerThread, NumEntropyBlocks);
+	uint last = min(first + blocksPerThread, NumEntropyBlocks);
+
+	uint numWords = 0;
+	uint i;
+	for(i = first; i < last; i++)
+		numWords += (EntropyOut[SlotBase + i * EBS + EBS - 1] + 31) / 32;
+
+	BlockWordSums[GroupIndex] = numWords;
+
+	for(uint d = 1; d < 1024; d *= 2)
+	{
+		GroupMemoryBarrierWithGroupSync();
+		uint sum = GroupIndex >= d ? BlockWordSums[GroupIndex - d] : 0;
+
+		GroupMemoryBarrierWithGroupSync();
+		BlockWordSums[GroupIndex] += sum;
+	}
+
+	uint offset = BlockWordSums[GroupIndex] - numWords;
+	for(i = first; i < last; i++)
+	{
+		uint DU = SlotBase + i * EBS;
+		uint numBits = EntropyOut[DU + EBS - 1];
+
+		EntropyOut[i] = (numBits << 16) | (EntropyOut[DU] & 0xffff);
+		EntropyOut[OffsetBase + i] = offset;
+		offset += (numBits + 31) / 32;
+	}
+
+	if(GroupIndex == 1023)
+		EntropyOut[NumEntropyBlocks] = BlockWordSums[1023];
+}
+
+//one group per block, a thread per AC word
+[numthreads(64, 1, 1)]
+void CompactBlocks(uint GroupIndex : SV_GroupIndex, uint3 GroupID : SV_GroupID)
+{
+	uint EBS = EntropyBlockSize;
+	uint block = GroupID.y * COMPACT_GROUPS_X + GroupID.x;
+	if(block >= NumEntropyBlocks)
+		return;
+
+	uint DU = SlotBase + block * EBS;
+	uint numBits = EntropyOut[DU + EBS - 1];
+	if(GroupIndex >= (numBits + 31) / 32)
+		return;
+
+	uint AC = DU + 1;
+	if(numBits > (EBS - 2) * 32)
+		AC = OverflowBase + 1 + (EntropyOut[DU + 1] & (NumOverflowSlots - 1)) * OVERFLOW_SLOT_WORDS;
+
+	//only a frame that ran out of overflow slots can get past the payload, it is encoded again
+	uint offset = EntropyOut[OffsetBase + block] + GroupIndex;
+	if(offset < SlotBase - NumEntropyBlocks - 1)
+		EntropyOut[NumEntropyBlocks + 1 + offset] = EntropyOut[AC + GroupIndex];
+}
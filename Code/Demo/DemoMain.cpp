@@ -32,6 +32,8 @@ Encoder*				gEncJEnc			= NULL;
 int						gScreenRefreshRate = 60; //manual vsync for cpu side
 int						gLockedFrameRate	= 60;
 float					gJpegQuality		= 85;
+unsigned int			gRecordBitRate		= 8000000; //bits per second of recorded movies, 0 = record at gJpegQuality
+JEncRateControl*		gRateControl		= NULL;
 float					gOutputScale		= 1.0f;
 CHROMA_SUBSAMPLE		gChromaSubsampling	= CHROMA_SUBSAMPLE_4_2_0;
 
@@ -53,6 +55,7 @@ D3DProfiler* ComputeListProfiler = NULL;
 D3DProfiler* DirectListProfiler = NULL;
 
 EncodeResult gRes;
+int gResQuality = 0;
 std::mutex resultMutex;
 
 bool running = true;
@@ -88,8 +91,11 @@ void						InitDX12Profilers();
 HRESULT				RenderDX12(float deltaTime, HWND hwnd);
 void						PopulateComputeList(ID3D12GraphicsCommandList * pCompCmdList);
 void						PopulateDirectList(ID3D12GraphicsCommandList * pDirectCmdList);
+void						RecordCommandLists(int index, int threadIndex, void* userData);
 void						WorkerThread();
 void						DumpCPUFrameTimesToFile();
+int						GetEncodeQuality();
+void						StartRateControl();
 
 HRESULT				UpdateDX12(float deltaTime, HWND hwnd);
 HRESULT				CreateBackBufferPSO();
@@ -129,6 +135,9 @@ HRESULT Init(HWND hwnd, int width, int height)
 			jencEncoder = myNew DX12_EncoderJEnc(&gSurfacePrepDX12);
 			jencEncoder->Init(&gD3D12);
 
+			//the frames are the back buffer at most
+			jencEncoder->Reserve(width, height);
+
 			InitDX12Profilers();
 
 			return S_OK;
@@ -152,6 +161,9 @@ HRESULT Init(HWND hwnd, int width, int height)
 		gEncJEnc = myNew EncoderJEnc(&gSurfacePrep);
 		gEncJEnc->Init(&gD3D);
 
+		//the frames are the back buffer at most
+		gEncJEnc->Reserve(width, height);
+
 		//create sample with default values
 		D3D11_SAMPLER_DESC samplerDesc;
 		ZeroMemory(&samplerDesc, sizeof(samplerDesc));
@@ -196,6 +208,7 @@ HRESULT Cleanup()
 
 	SAFE_DELETE(jencEncoder);
 	SAFE_DELETE(gEncJEnc);
+	SAFE_DELETE(gRateControl);
 	SAFE_DELETE(gTexture);
 	SAFE_DELETE(gBackbufferShader);
 	SAFE_DELETE(gComputeWrap);
@@ -315,7 +328,8 @@ HRESULT Render(float deltaTime, HWND hwnd)
 	gD3D.GetDeviceContext()->CSSetUnorderedAccessViews(0, 1, uav, NULL);
 
 	d3d11Profiler->BeginTimestamp(DX11_Encoding);
-	EncodeResult res = gEncJEnc->Encode(gD3D.GetBackBuffer(), gChromaSubsampling, gOutputScale, (int)gJpegQuality);
+	int quality = GetEncodeQuality();
+	EncodeResult res = gEncJEnc->Encode(gD3D.GetBackBuffer(), gChromaSubsampling, gOutputScale, quality);
 	d3d11Profiler->EndTimestamp(DX11_Encoding);
 
 	static int movieNum = 1;
@@ -330,12 +344,17 @@ HRESULT Render(float deltaTime, HWND hwnd)
 			gLockedFrameRate = 24;
 
 			gMJPEG.StartRecording(filename, res.ImageWidth, res.ImageHeight, gLockedFrameRate);
+			gEncJEnc->SetAbbreviatedFrames(true);
+			StartRateControl();
 		}
 	}
 
 	if(gMJPEG.IsRecording())
 	{
 		gMJPEG.AppendFrame(res.Bits, res.HeaderSize + res.DataSize);
+
+		if(gRateControl)
+			gRateControl->FrameEncoded(quality, res.HeaderSize + res.DataSize);
 	}
 
 	if(GetAsyncKeyState(VK_F3))
@@ -343,6 +362,8 @@ HRESULT Render(float deltaTime, HWND hwnd)
 		if(gMJPEG.IsRecording())
 		{
 			gMJPEG.StopRecording();
+			gEncJEnc->SetAbbreviatedFrames(false);
+			SAFE_DELETE(gRateControl);
 
 			gLockedFrameRate = gScreenRefreshRate;
 		}
@@ -370,7 +391,7 @@ HRESULT Render(float deltaTime, HWND hwnd)
 
 	TCHAR title[200];
 	_stprintf_s(title, sizeof(title) / 2, _T("JPEG DirectCompute Demo | FPS: %.0f | Quality: %d | Output scale: %.2f | Subsampling: %s"),
-		1.0f / deltaTime, (int)gJpegQuality, gOutputScale,
+		1.0f / deltaTime, quality, gOutputScale,
 		gChromaSubsampling == CHROMA_SUBSAMPLE_4_4_4 ? _T("4:4:4") :
 		gChromaSubsampling == CHROMA_SUBSAMPLE_4_2_2 ? _T("4:2:2") : 
 		gChromaSubsampling == CHROMA_SUBSAMPLE_4_2_0 ? _T("4:2:0") : _T("Undefined"));
@@ -620,6 +641,8 @@ HRESULT RenderDX12(float deltaTime, HWND hwnd)
 
 				resultMutex.lock();
 				gMJPEG.StartRecording(filename, gRes.ImageWidth, gRes.ImageHeight, gLockedFrameRate);
+				jencEncoder->SetAbbreviatedFrames(true);
+				StartRateControl();
 				resultMutex.unlock();
 			}
 		}
@@ -628,6 +651,9 @@ HRESULT RenderDX12(float deltaTime, HWND hwnd)
 		{
 			resultMutex.lock();
 			gMJPEG.AppendFrame(gRes.Bits, gRes.HeaderSize + gRes.DataSize);
+
+			if (gRateControl)
+				gRateControl->FrameEncoded(gResQuality, gRes.HeaderSize + gRes.DataSize);
 			resultMutex.unlock();
 		}
 
@@ -635,7 +661,11 @@ HRESULT RenderDX12(float deltaTime, HWND hwnd)
 		{
 			if (gMJPEG.IsRecording())
 			{
+				resultMutex.lock();
 				gMJPEG.StopRecording();
+				jencEncoder->SetAbbreviatedFrames(false);
+				SAFE_DELETE(gRateControl);
+				resultMutex.unlock();
 
 				gLockedFrameRate = gScreenRefreshRate;
 			}
@@ -664,7 +694,7 @@ HRESULT RenderDX12(float deltaTime, HWND hwnd)
 	
 	TCHAR title[200];
 	_stprintf_s(title, sizeof(title) / 2, _T("JPEG DirectCompute Demo | FPS: %.0f | Quality: %d | Output scale: %.2f | Subsampling: %s"),
-		1.0f / deltaTime, (int)gJpegQuality, gOutputScale,
+		1.0f / deltaTime, gResQuality, gOutputScale,
 		gChromaSubsampling == CHROMA_SUBSAMPLE_4_4_4 ? _T("4:4:4") :
 		gChromaSubsampling == CHROMA_SUBSAMPLE_4_2_2 ? _T("4:2:2") :
 		gChromaSubsampling == CHROMA_SUBSAMPLE_4_2_0 ? _T("4:2:0") : _T("Undefined"));
@@ -763,6 +793,14 @@ void PopulateDirectList(ID3D12GraphicsCommandList * pDirectCmdList)
 	pDirectCmdList->Close();
 }
 
+void RecordCommandLists(int index, int threadIndex, void* userData)
+{
+	if (index == 0)
+		PopulateComputeList(gD3D12.GetComputeCmdList());
+	else
+		PopulateDirectList(gD3D12.GetDirectCmdList());
+}
+
 void WorkerThread()
 {
 	//Get the necessary object pointers 
@@ -779,20 +817,19 @@ void WorkerThread()
 			ComputeListProfiler->Update();
 			DirectListProfiler->Update();
 
-			std::thread directListCommandRecording(PopulateDirectList, pDirectCmdList); //let a thread record commands for something that is later executed
-			PopulateComputeList(pCompCmdList);
+			JEncParallelFor(2, RecordCommandLists, NULL); //record both lists on the encoder thread pool
 
 			ID3D12CommandList* listsToExecute1[] = { pCompCmdList };
 			pCompCmdQ->ExecuteCommandLists(1, listsToExecute1);
 			gD3D12.WaitForGPUCompletion(pCompCmdQ, gD3D12.GetFence(0));
 
-			directListCommandRecording.join(); //wait for thread to finish before execution
 			ID3D12CommandList* listsToExecute2[] = { pDirectCmdList };
 			pDirectCmdQ->ExecuteCommandLists(1, listsToExecute2);
 			gD3D12.WaitForGPUCompletion(pDirectCmdQ, gD3D12.GetFence(1));
 
 			resultMutex.lock();
-			gRes = jencEncoder->DX12_Encode(gD3D12.GetBackBufferResource(gD3D12.GetFrameIndex()), gChromaSubsampling, gOutputScale, (int)gJpegQuality);
+			gResQuality = GetEncodeQuality();
+			gRes = jencEncoder->DX12_Encode(gD3D12.GetBackBufferResource(gD3D12.GetFrameIndex()), gChromaSubsampling, gOutputScale, gResQuality);
 			resultMutex.unlock();
 
 			DXGI_PRESENT_PARAMETERS pp = {};
@@ -803,6 +840,26 @@ void WorkerThread()
 	}
 }
 
+//the rate control picks the quality while a movie is recorded at gRecordBitRate
+int GetEncodeQuality()
+{
+	return gRateControl ? gRateControl->GetQuality() : (int)gJpegQuality;
+}
+
+void StartRateControl()
+{
+	if (gRecordBitRate == 0)
+		return;
+
+	JEncRateControlDesc desc;
+	desc.TargetBitRate = gRecordBitRate;
+	desc.FrameRate = (float)gLockedFrameRate;
+	desc.InitialQuality = (int)gJpegQuality;
+
+	SAFE_DELETE(gRateControl);
+	gRateControl = CreateJpegRateControlInstance(desc);
+}
+
 void DumpCPUFrameTimesToFile()
 {
 	static const double T = 2.0; //dump after 2 seconds
@@ -35,9 +35,6 @@ protected:
 	BYTE* destinationBuffer;
 	UINT destinationBufferSize;
 
-	int imageWidth;
-	int imageHeight;
-
 protected:
 	SurfacePreparation*	surfacePreparation;
 public:
@@ -45,23 +42,20 @@ public:
 	{
 		destinationBuffer = NULL;
 		destinationBufferSize = 0;
-		imageWidth = 0;
-		imageHeight = 0;
 
 		surfacePreparation = surfacePrep;
 	}
 	virtual ~Encoder() { SAFE_DELETE_ARRAY(destinationBuffer); };
 
-	void VerifyDestinationBuffer(int w, int h)
+	//grows by half again as much, streams that get a little bigger every frame do not reallocate every frame
+	void VerifyDestinationBuffer(UINT size)
 	{
-		if(imageWidth < w || imageHeight < h)
+		if(destinationBufferSize < size)
 		{
-			imageWidth = w;
-			imageHeight = h;
-			destinationBufferSize = imageWidth * imageHeight * 4;
+			destinationBufferSize = size + size / 2;
 
 			SAFE_DELETE_ARRAY(destinationBuffer);
-			destinationBuffer = myNew BYTE[destinationBufferSize]; //will be big enough :-)
+			destinationBuffer = myNew BYTE[destinationBufferSize];
 		}
 	}
 
@@ -72,6 +66,12 @@ public:
 
 	virtual HRESULT Init(D3D11Wrap* d3d) = 0;
 
+	//frames without the standard Huffman tables, for MJPEG recording
+	virtual void SetAbbreviatedFrames(bool abbreviated) {}
+
+	//buffers of frames up to the size, so the first frames do not wait for them
+	virtual void Reserve(int maxWidth, int maxHeight) {}
+
 	virtual char* Name() = 0;
 };
 
@@ -85,9 +85,6 @@ protected:
 	BYTE * destinationBuffer;
 	UINT destinationBufferSize;
 
-	int imageWidth;
-	int imageHeight;
-
 protected:
 	SurfacePreperationDX12 * surfacePreparation;
 public:
@@ -95,23 +92,20 @@ public:
 	{
 		destinationBuffer = NULL;
 		destinationBufferSize = 0;
-		imageWidth = 0;
-		imageHeight = 0;
 
 		surfacePreparation = surfacePrep;
 	}
 	virtual ~DX12_Encoder() { SAFE_DELETE_ARRAY(destinationBuffer); };
 
-	void VerifyDestinationBuffer(int w, int h)
+	//grows by half again as much, streams that get a little bigger every frame do not reallocate every frame
+	void VerifyDestinationBuffer(UINT size)
 	{
-		if (imageWidth < w || imageHeight < h)
+		if (destinationBufferSize < size)
 		{
-			imageWidth = w;
-			imageHeight = h;
-			destinationBufferSize = imageWidth * imageHeight * 4;
+			destinationBufferSize = size + size / 2;
 
 			SAFE_DELETE_ARRAY(destinationBuffer);
-			destinationBuffer = myNew BYTE[destinationBufferSize]; //will be big enough :-)
+			destinationBuffer = myNew BYTE[destinationBufferSize];
 		}
 	}
 	
@@ -122,5 +116,11 @@ public:
 
 	virtual HRESULT Init(D3D12Wrap* d3d) = 0;
 
+	//frames without the standard Huffman tables, for MJPEG recording
+	virtual void SetAbbreviatedFrames(bool abbreviated) {}
+
+	//buffers of frames up to the size, so the first frames do not wait for them
+	virtual void Reserve(int maxWidth, int maxHeight) {}
+
 	virtual char* Name() = 0;
 };
\ No newline at end of file
@@ -17,6 +17,8 @@ EncoderJEnc::EncoderJEnc(SurfacePreparation* surfacePrep)
 	jEncoder444 = NULL;
 	jEncoder422 = NULL;
 	jEncoder420 = NULL;
+
+	abbreviatedFrames = false;
 }
 
 EncoderJEnc::~EncoderJEnc()
@@ -39,15 +41,28 @@ EncodeResult EncoderJEnc::Encode(	ID3D11Texture2D* textureResource,
 	jD3D.Height = ps.Height;
 	jD3D.ResourceView = ps.SRV;
 
-	VerifyDestinationBuffer(ps.Width, ps.Height);
+	//a byte per pixel to start with, frames that do not fit grow the buffer and run again
+	VerifyDestinationBuffer(ps.Width * ps.Height);
+
+	JEnc* jEncoder = jEncoder420;
+		 if(subsampleType == CHROMA_SUBSAMPLE_4_4_4)	jEncoder = jEncoder444;
+	else if(subsampleType == CHROMA_SUBSAMPLE_4_2_2)	jEncoder = jEncoder422;
+
+	//set here, the DX12 demo encodes on a worker thread
+	jEncoder->SetOption(JENC_OPTION_TABLES, abbreviatedFrames ? JENC_TABLES_NO_DHT : JENC_TABLES_ALL);
 
 	jD3D.TargetMemory = destinationBuffer;
+	jD3D.TargetMemorySize = destinationBufferSize;
+
+	JEncResult jRes = jEncoder->Encode(jD3D, jpegQuality);
+	if(jRes.Overflow)
+	{
+		VerifyDestinationBuffer(jRes.HeaderSize + jRes.DataSize);
 
-	JEncResult jRes;
-	
-		 if(subsampleType == CHROMA_SUBSAMPLE_4_4_4)	jRes = jEncoder444->Encode(jD3D, jpegQuality);
-	else if(subsampleType == CHROMA_SUBSAMPLE_4_2_2)	jRes = jEncoder422->Encode(jD3D, jpegQuality);
-	else if(subsampleType == CHROMA_SUBSAMPLE_4_2_0)	jRes = jEncoder420->Encode(jD3D, jpegQuality);
+		jD3D.TargetMemory = destinationBuffer;
+		jD3D.TargetMemorySize = destinationBufferSize;
+		jRes = jEncoder->Encode(jD3D, jpegQuality);
+	}
 
 	result.Bits = jRes.Bits;
 	result.DataSize = jRes.DataSize;
@@ -70,6 +85,15 @@ HRESULT EncoderJEnc::Init(D3D11Wrap* d3d)
 	return E_FAIL;
 }
 
+void EncoderJEnc::Reserve(int maxWidth, int maxHeight)
+{
+	jEncoder444->Reserve(maxWidth, maxHeight, JENC_CHROMA_SUBSAMPLE_4_4_4);
+	jEncoder422->Reserve(maxWidth, maxHeight, JENC_CHROMA_SUBSAMPLE_4_2_2);
+	jEncoder420->Reserve(maxWidth, maxHeight, JENC_CHROMA_SUBSAMPLE_4_2_0);
+
+	VerifyDestinationBuffer(maxWidth * maxHeight);
+}
+
 /*
 	DX12 class
 */
@@ -80,6 +104,8 @@ DX12_EncoderJEnc::DX12_EncoderJEnc(SurfacePreperationDX12 * surfacePrep)
 	jEncoder444 = NULL;
 	jEncoder422 = NULL;
 	jEncoder420 = NULL;
+
+	abbreviatedFrames = false;
 }
 
 DX12_EncoderJEnc::~DX12_EncoderJEnc()
@@ -99,15 +125,27 @@ EncodeResult DX12_EncoderJEnc::DX12_Encode(ID3D12Resource * textureResource, CHR
 	jD3D.Width = ps.Width;
 	jD3D.Height = ps.Height;
 
-	VerifyDestinationBuffer(jD3D.Width, jD3D.Height);
+	//a byte per pixel to start with, frames that do not fit grow the buffer and run again
+	VerifyDestinationBuffer(jD3D.Width * jD3D.Height);
+
+	JEnc* jEncoder = jEncoder420;
+	if (subsampleType == CHROMA_SUBSAMPLE_4_4_4)	jEncoder = jEncoder444;
+	else if (subsampleType == CHROMA_SUBSAMPLE_4_2_2)	jEncoder = jEncoder422;
+
+	jEncoder->SetOption(JENC_OPTION_TABLES, abbreviatedFrames ? JENC_TABLES_NO_DHT : JENC_TABLES_ALL);
 
 	jD3D.TargetMemory = destinationBuffer;
+	jD3D.TargetMemorySize = destinationBufferSize;
 
-	JEncResult jRes;
+	JEncResult jRes = jEncoder->Encode(jD3D, jpegQuality);
+	if (jRes.Overflow)
+	{
+		VerifyDestinationBuffer(jRes.HeaderSize + jRes.DataSize);
 
-	if (subsampleType == CHROMA_SUBSAMPLE_4_4_4)	jRes = jEncoder444->Encode(jD3D, jpegQuality);
-	else if (subsampleType == CHROMA_SUBSAMPLE_4_2_2)	jRes = jEncoder422->Encode(jD3D, jpegQuality);
-	else if (subsampleType == CHROMA_SUBSAMPLE_4_2_0)	jRes = jEncoder420->Encode(jD3D, jpegQuality);
+		jD3D.TargetMemory = destinationBuffer;
+		jD3D.TargetMemorySize = destinationBufferSize;
+		jRes = jEncoder->Encode(jD3D, jpegQuality);
+	}
 
 	result.Bits = jRes.Bits;
 	result.DataSize = jRes.DataSize;
@@ -130,3 +168,12 @@ HRESULT DX12_EncoderJEnc::Init(D3D12Wrap * d3d)
 
 	return E_FAIL;
 }
+
+void DX12_EncoderJEnc::Reserve(int maxWidth, int maxHeight)
+{
+	jEncoder444->Reserve(maxWidth, maxHeight, JENC_CHROMA_SUBSAMPLE_4_4_4);
+	jEncoder422->Reserve(maxWidth, maxHeight, JENC_CHROMA_SUBSAMPLE_4_2_2);
+	jEncoder420->Reserve(maxWidth, maxHeight, JENC_CHROMA_SUBSAMPLE_4_2_0);
+
+	VerifyDestinationBuffer(maxWidth * maxHeight);
+}
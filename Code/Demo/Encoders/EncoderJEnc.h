@@ -15,6 +15,8 @@ class EncoderJEnc : public Encoder
 	JEnc*		jEncoder422;
 	JEnc*		jEncoder420;
 
+	bool		abbreviatedFrames;
+
 public:
 	EncoderJEnc(SurfacePreparation* surfacePrep);
 	virtual ~EncoderJEnc();
@@ -26,6 +28,10 @@ public:
 
 	virtual HRESULT Init(D3D11Wrap* d3d);
 
+	virtual void SetAbbreviatedFrames(bool abbreviated) { abbreviatedFrames = abbreviated; }
+
+	virtual void Reserve(int maxWidth, int maxHeight);
+
 	virtual char* Name() { return "JEnc"; }
 };
 
@@ -39,6 +45,8 @@ class DX12_EncoderJEnc : public DX12_Encoder
 	JEnc*		jEncoder422;
 	JEnc*		jEncoder420;
 
+	bool		abbreviatedFrames;
+
 public:
 	DX12_EncoderJEnc(SurfacePreperationDX12* surfacePrep);
 	virtual ~DX12_EncoderJEnc();
@@ -50,6 +58,10 @@ public:
 
 	virtual HRESULT Init(D3D12Wrap* d3d);
 
+	virtual void SetAbbreviatedFrames(bool abbreviated) { abbreviatedFrames = abbreviated; }
+
+	virtual void Reserve(int maxWidth, int maxHeight);
+
 	virtual char* Name() { return "JEnc"; }
 
 private:
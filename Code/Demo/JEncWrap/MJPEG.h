@@ -114,6 +114,7 @@ public:
 		return hr;
 	}
 
+	// frames may leave out DHT (JENC_TABLES_NO_DHT), MJPEG decoders use the standard tables then
 	HRESULT AppendFrame(void* frameData, int dataSize)
 	{
 		HRESULT hr = E_FAIL;
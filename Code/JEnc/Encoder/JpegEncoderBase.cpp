@@ -4,38 +4,71 @@
 // Copyright (c) Stefan Petersson 2012. All rights reserved.
 //--------------------------------------------------------------------------------------
 #include "JpegEncoderBase.h"
+#include "JpegThreadPool.h"
+
+#include <emmintrin.h>
+
+//segments per pool thread for WriteScanSegments, more segments balance better
+//but every one of them costs a shared byte and a memcpy call
+static const int ScanSegmentsPerThread = 4;
+
+//first size of the internal output buffer and callback chunk size when the sink leaves it open
+static const unsigned int DefaultChunkSize = 64 * 1024;
+
+struct NumBitsTable
+{
+	BYTE NumBits[32767];
+
+	NumBitsTable()
+	{
+		int tmp;
+		for(int i = 0; i < 32767; i++)
+		{
+			NumBits[i] = i == 0 ? 0 : 1;
+			tmp = i;
+			while(tmp>>=1)
+				NumBits[i]++;
+		}
+	}
+};
+
+//built once by whichever encoder comes first, read only from then on
+static const BYTE* GetNumBitsTable()
+{
+	static const NumBitsTable table;
+	return table.NumBits;
+}
 
 JpegEncoderBase::JpegEncoderBase()
 {
 	mQualitySetting = 0;
 
+	mRestartInterval = 0;
+	mDeterministic = false;
+	mDeferStuffing = false;
+	mEntropyStart = NULL;
+
 	MemoryFile = NULL;
 	MemoryFileCapacity = 0;
-	MemoryFileNumBytesWritten = 0;
+
+	mOutputType = JENC_SINK_INTERNAL;
+	mFixedMemory = NULL;
+	mFixedCapacity = 0;
+	mOutputBegin = NULL;
+	mOutputEnd = NULL;
+	mNumBytesFlushed = 0;
+	mOutputFailed = false;
+	mMaxEntropyBitsPerMCU = 0;
+	mTables = JENC_TABLES_ALL;
+	mHeaderDimensionsOffset = 0;
 
 	ComputeDCTMatrices(DCT_matrix, DCT_matrix_transpose);
 
    // Compute the Huffman tables used for encoding
-	memset(Y_DC_Huffman_Table, 0, sizeof(Y_DC_Huffman_Table));
-    ComputeHuffmanTable(Y_DC_Huffman_Table, StandardDCLuminanceValues, StandardDCLuminanceNRCodes);
-	
-	memset(Y_AC_Huffman_Table, 0, sizeof(Y_AC_Huffman_Table));
-    ComputeHuffmanTable(Y_AC_Huffman_Table, StandardACLuminanceValues, StandardACLuminanceNRCodes);
-	
-	memset(Cb_DC_Huffman_Table, 0, sizeof(Cb_DC_Huffman_Table));
-    ComputeHuffmanTable(Cb_DC_Huffman_Table, StandardDCChromianceValues, StandardDCChromianceNRCodes);
-	
-	memset(Cb_AC_Huffman_Table, 0, sizeof(Cb_AC_Huffman_Table));
-    ComputeHuffmanTable(Cb_AC_Huffman_Table, StandardACChromianceValues, StandardACChromianceNRCodes);
+	mStandardHuffmanTables = false;
+	SetStandardHuffmanTables();
 
-	int tmp;
-	for(int i = 0; i < 32767; i++)
-	{
-		NumBitsInUShort[i] = i == 0 ? 0 : 1;
-		tmp = i;
-		while(tmp>>=1)
-			NumBitsInUShort[i]++;
-	}
+	NumBitsInUShort = GetNumBitsTable();
 }
 
 JpegEncoderBase::~JpegEncoderBase()
@@ -44,38 +77,238 @@ JpegEncoderBase::~JpegEncoderBase()
 		delete [] MemoryFile;
 }
 
+bool JpegEncoderBase::SetOption(JENC_OPTIONS option, int value)
+{
+	if(option == JENC_OPTION_RESTART_INTERVAL)
+	{
+		if(value < 0 || value > 0xFFFF)
+			return false;
+
+		//DRI is part of the cached header
+		if(mRestartInterval != value)
+			mHeader.clear();
+
+		mRestartInterval = value;
+		return true;
+	}
+
+	if(option == JENC_OPTION_DETERMINISTIC)
+	{
+		if(value != 0 && value != 1)
+			return false;
+
+		mDeterministic = value != 0;
+		return true;
+	}
+
+	if(option == JENC_OPTION_DEFERRED_STUFFING)
+	{
+		if(value != 0 && value != 1)
+			return false;
+
+		mDeferStuffing = value != 0;
+		return true;
+	}
+
+	if(option == JENC_OPTION_TABLES)
+	{
+		if(value < JENC_TABLES_ALL || value > JENC_TABLES_NONE)
+			return false;
+
+		if(mTables != value)
+			mHeader.clear();
+
+		mTables = (JENC_TABLES)value;
+		return true;
+	}
+
+	return false;
+}
+
+bool JpegEncoderBase::SetOutputSink(const JEncOutputSink& sink)
+{
+	if(sink.Type == JENC_SINK_FIXED && (!sink.Memory || sink.Capacity == 0))
+		return false;
+
+	if(sink.Type == JENC_SINK_CALLBACK && !sink.Callback)
+		return false;
+
+	if(sink.Type != JENC_SINK_INTERNAL && sink.Type != JENC_SINK_FIXED && sink.Type != JENC_SINK_CALLBACK)
+		return false;
+
+	mSink = sink;
+	return true;
+}
+
+void JpegEncoderBase::CopyConfiguration(const JpegEncoderBase& other)
+{
+	mRestartInterval = other.mRestartInterval;
+	mDeterministic = other.mDeterministic;
+	mDeferStuffing = other.mDeferStuffing;
+	mTables = other.mTables;
+	mSink = other.mSink;
+
+	//the header is built by the first Encode
+	mHeader.clear();
+}
+
 void JpegEncoderBase::Reset()
 {
-	mByteBuffer = 0;
-	mCurrentBytePos = 0;
+	mBitWriter.Buffer = 0;
+	mBitWriter.NumBits = 0;
+	mBitWriter.DeferStuffing = false;
+}
+
+void JpegEncoderBase::AllocateMemoryFile(size_t capacity)
+{
+	if(MemoryFileCapacity >= capacity)
+		return;
+
+	if(MemoryFile)
+		delete [] MemoryFile;
+
+	MemoryFileCapacity = capacity;
+	MemoryFile = new BYTE[MemoryFileCapacity];
 }
 
-bool JpegEncoderBase::ValidateMemoryFile(unsigned char* targetMemory)
+void JpegEncoderBase::BeginOutput(unsigned char* targetMemory, unsigned int targetMemorySize)
 {
+	mNumBytesFlushed = 0;
+	mOutputFailed = false;
+
 	//user external memory?
-	if(!targetMemory)
+	if(targetMemory)
+	{
+		//without a size it is taken to hold GetJpegEncoderMaxOutputSize, optimized or adapted
+		//tables that go beyond it report JENC_OUTPUT_OVERFLOW
+		mFixedMemory = targetMemory;
+		mFixedCapacity = targetMemorySize;
+		if(mFixedCapacity == 0)
+			mFixedCapacity = (size_t)GetMaxOutputSize(mImageWidth, mImageHeight, mSubsampleType, mQualitySetting, mRestartInterval);
+
+		mOutputType = JENC_SINK_FIXED;
+	}
+	else if(mSink.Type == JENC_SINK_FIXED)
+	{
+		mFixedMemory = mSink.Memory;
+		mFixedCapacity = mSink.Capacity;
+
+		mOutputType = JENC_SINK_FIXED;
+	}
+	else
+	{
+		AllocateMemoryFile(mSink.ChunkSize > 0 ? mSink.ChunkSize : DefaultChunkSize);
+
+		mOutputType = mSink.Type;
+		mOutputBegin = MemoryFile;
+		mOutputEnd = MemoryFile + MemoryFileCapacity;
+	}
+
+	if(mOutputType == JENC_SINK_FIXED)
+	{
+		mOutputBegin = mFixedMemory;
+		mOutputEnd = mFixedMemory + mFixedCapacity;
+	}
+
+	mBitWriter.Walker = mOutputBegin;
+}
+
+void JpegEncoderBase::EndOutput(JEncResult& result)
+{
+	unsigned int numBytes = NumBytesWritten();
+	size_t numPending = mBitWriter.Walker - mOutputBegin;
+
+	if(mOutputType == JENC_SINK_CALLBACK && !mOutputFailed && numPending > 0)
+	{
+		if(!mSink.Callback(mOutputBegin, (unsigned int)numPending, mSink.UserData))
+			mOutputFailed = true;
+	}
+
+	//the rows that went to the internal buffer when the room got tight fit after all
+	if(mOutputType == JENC_SINK_FIXED && !mOutputFailed && mOutputBegin != mFixedMemory)
+	{
+		if(numBytes <= mFixedCapacity)
+			memcpy(mFixedMemory + mNumBytesFlushed, mOutputBegin, numPending);
+		else
+			mOutputFailed = true;
+	}
+
+	result.DataSize = numBytes - result.HeaderSize;
+	result.Overflow = mOutputFailed;
+
+	if(mOutputFailed || mOutputType == JENC_SINK_CALLBACK)
+		result.Bits = NULL;
+	else if(mOutputType == JENC_SINK_FIXED)
+		result.Bits = (void*)mFixedMemory;
+	else
+		result.Bits = (void*)MemoryFile;
+}
+
+void JpegEncoderBase::MakeRoom(EntropyWriter& writer, size_t numBytes)
+{
+	//deferred bytes are stuffed before they move or leave
+	if(writer.DeferStuffing)
 	{
-		//need to increase memory file size?
-		if(MemoryFileCapacity < mComputationWidthY * mComputationHeightY * 4)
+		writer.Walker = StuffBytes(mEntropyStart, writer.Walker);
+		mEntropyStart = writer.Walker;
+	}
+
+	if((size_t)(mOutputEnd - writer.Walker) >= numBytes)
+		return;
+
+	size_t numWritten = writer.Walker - mOutputBegin;
+
+	//the worst case of the next rows does not fit into a fixed buffer any more, so they
+	//go to the internal buffer and are copied over if they turn out to fit in the end
+	if(mOutputType == JENC_SINK_FIXED && !mOutputFailed)
+	{
+		if(mOutputBegin == mFixedMemory)
 		{
-			if(MemoryFile)
-				delete [] MemoryFile;
+			mNumBytesFlushed += numWritten;
+			numWritten = 0;
+		}
+		else if(mNumBytesFlushed + numWritten > mFixedCapacity)
+		{
+			mOutputFailed = true;
+		}
+	}
 
-			MemoryFileCapacity = mComputationWidthY * mComputationHeightY * 4;
-			MemoryFile = new BYTE[MemoryFileCapacity];
+	if(mOutputType == JENC_SINK_INTERNAL || (mOutputType == JENC_SINK_FIXED && !mOutputFailed))
+	{
+		//grow geometrically and keep what is there
+		if(MemoryFileCapacity < numWritten + numBytes)
+		{
+			size_t capacity = JPEG_MAX(2 * (numWritten + numBytes), (size_t)DefaultChunkSize);
+			BYTE* memory = new BYTE[capacity];
+			memcpy(memory, MemoryFile, numWritten);
 
-			if(!MemoryFile)
-				return false;
+			delete [] MemoryFile;
+			MemoryFile = memory;
+			MemoryFileCapacity = capacity;
 		}
+
+		mOutputBegin = MemoryFile;
+		mOutputEnd = MemoryFile + MemoryFileCapacity;
+		writer.Walker = MemoryFile + numWritten;
+		mEntropyStart = writer.Walker;
+		return;
 	}
-	else
+
+	//a callback gets the finished chunk, after a failure everything is dropped
+	//but still counted so the sizes in the result add up
+	if(mOutputType == JENC_SINK_CALLBACK && !mOutputFailed && numWritten > 0)
 	{
-		MemoryFile = targetMemory;
+		if(!mSink.Callback(mOutputBegin, (unsigned int)numWritten, mSink.UserData))
+			mOutputFailed = true;
 	}
 
-	MemoryFileWalker = MemoryFile;
-	MemoryFileNumBytesWritten = 0;
-	return true;
+	mNumBytesFlushed += numWritten;
+	AllocateMemoryFile(numBytes);
+
+	mOutputBegin = MemoryFile;
+	mOutputEnd = MemoryFile + MemoryFileCapacity;
+	writer.Walker = MemoryFile;
+	mEntropyStart = writer.Walker;
 }
 
 bool JpegEncoderBase::ValidateQuantizationTables(int quality)
@@ -93,6 +326,9 @@ bool JpegEncoderBase::ValidateQuantizationTables(int quality)
 			StandardChromianceQuantizationTable, quality);
 
 		mQualitySetting = quality;
+		mMaxEntropyBitsPerMCU = GetMaxEntropyBitsPerMCU(mSubsampleType, Y_Quantization_Table, CbCr_Quantization_Table,
+			Y_DC_Huffman_Table, Y_AC_Huffman_Table, Cb_DC_Huffman_Table, Cb_AC_Huffman_Table);
+		mHeader.clear();
 
 		//notify other parts of the change
 		QuantizationTablesChanged();
@@ -108,55 +344,24 @@ void JpegEncoderBase::CalculateComputationDimensions(int imageWidth, int imageHe
 		mImageWidth = imageWidth;
 		mImageHeight = imageHeight;
 
-		int remainder = 0;
-		if(mSubsampleType == JENC_CHROMA_SUBSAMPLE_4_4_4)
-		{
-			remainder = mImageWidth % 8;
-			mComputationWidthY = mImageWidth + (remainder > 0 ? 8 - remainder : 0);
-			remainder = mImageHeight % 8;
-			mComputationHeightY = mImageHeight + (remainder > 0 ? 8 - remainder : 0);
-			
+		JpegMCULayoutInfo layout;
+		GetMCULayoutInfo(mSubsampleType, layout);
 
-			remainder = mImageWidth % 8;
-			mComputationWidthCbCr = mImageWidth + (remainder > 0 ? 8 - remainder : 0);
-			mNumComputationBlocks_CbCr[0] = mComputationWidthCbCr / 8;
-			remainder = mImageHeight % 8;
-			mComputationHeightCbCr = mImageHeight + (remainder > 0 ? 8 - remainder : 0);
-			mNumComputationBlocks_CbCr[1] = mComputationHeightCbCr / 8;
-		}
-		else if(mSubsampleType == JENC_CHROMA_SUBSAMPLE_4_2_2)
-		{
-			remainder = mImageWidth % 16;
-			mComputationWidthY = mImageWidth + (remainder > 0 ? 16 - remainder : 0);
-			remainder = mImageHeight % 8;
-			mComputationHeightY = mImageHeight + (remainder > 0 ? 8 - remainder : 0);
-
-			remainder = mImageWidth % 16;
-			mComputationWidthCbCr = mImageWidth + (remainder > 0 ? 16 - remainder : 0);
-			mNumComputationBlocks_CbCr[0] = mComputationWidthCbCr / 16;
-			remainder = mImageHeight % 8;
-			mComputationHeightCbCr = mImageHeight + (remainder > 0 ? 8 - remainder : 0);
-			mNumComputationBlocks_CbCr[1] = mComputationHeightCbCr / 8;
-		}
-		else if(mSubsampleType == JENC_CHROMA_SUBSAMPLE_4_2_0)
-		{
-			remainder = mImageWidth % 16;
-			mComputationWidthY = mImageWidth + (remainder > 0 ? 16 - remainder : 0);
-			remainder = mImageHeight % 16;
-			mComputationHeightY = mImageHeight + (remainder > 0 ? 16 - remainder : 0);
-
-			remainder = mImageWidth % 16;
-			mComputationWidthCbCr = mImageWidth + (remainder > 0 ? 16 - remainder : 0);
-			mNumComputationBlocks_CbCr[0] = mComputationWidthCbCr / 16;
-			remainder = mImageHeight % 16;
-			mComputationHeightCbCr = mImageHeight + (remainder > 0 ? 16 - remainder : 0);
-			mNumComputationBlocks_CbCr[1] = mComputationHeightCbCr / 16;
-		}
+		//pad to whole MCUs, chroma is computed once per MCU
+		mComputationWidthY = (mImageWidth + layout.Width - 1) / layout.Width * layout.Width;
+		mComputationHeightY = (mImageHeight + layout.Height - 1) / layout.Height * layout.Height;
+
+		mComputationWidthCbCr = mComputationWidthY;
+		mComputationHeightCbCr = mComputationHeightY;
+		mNumComputationBlocks_CbCr[0] = mComputationWidthCbCr / layout.Width;
+		mNumComputationBlocks_CbCr[1] = mComputationHeightCbCr / layout.Height;
 
 		//always full resolution Y component
 		mNumComputationBlocks_Y[0] = mComputationWidthY / 8;
 		mNumComputationBlocks_Y[1] = mComputationHeightY / 8;
 
+		PatchHeaderDimensions();
+
 		//notify subclasses about change
 		ComputationDimensionsChanged();
 	}
@@ -174,21 +379,22 @@ JEncResult JpegEncoderBase::Encode(JEncRGBDataDesc rgbDataDesc, int quality)
 
 	CalculateComputationDimensions(rgbDataDesc.Width, rgbDataDesc.Height);
 
-	if(!ValidateMemoryFile(rgbDataDesc.TargetMemory))
-		return result;
+	SelectHuffmanTables(rgbDataDesc);
+
+	BeginOutput(rgbDataDesc.TargetMemory, rgbDataDesc.TargetMemorySize);
 
 	Reset();
 
 	WriteHeader();
-	result.HeaderSize = unsigned int(MemoryFileWalker - MemoryFile);
+	result.HeaderSize = NumBytesWritten();
 
 	WriteImageData(rgbDataDesc);
-	result.DataSize = unsigned int(MemoryFileWalker - MemoryFile) - result.HeaderSize;
-	result.Bits = (void*)MemoryFile;
+	EndOutput(result);
 	
 	return result;
 }
 
+#if defined(JENC_D3D)
 JEncResult JpegEncoderBase::Encode(JEncD3DDataDesc d3dDataDesc, int quality)
 {
 	JEncResult result;
@@ -201,18 +407,15 @@ JEncResult JpegEncoderBase::Encode(JEncD3DDataDesc d3dDataDesc, int quality)
 
 	CalculateComputationDimensions(d3dDataDesc.Width, d3dDataDesc.Height);
 
-	if(!ValidateMemoryFile(d3dDataDesc.TargetMemory))
-		return result;
+	BeginOutput(d3dDataDesc.TargetMemory, d3dDataDesc.TargetMemorySize);
 
 	Reset();
 
 	WriteHeader();
-	result.HeaderSize = unsigned int(MemoryFileWalker - MemoryFile);
+	result.HeaderSize = NumBytesWritten();
 
 	WriteImageData(d3dDataDesc);
-
-	result.DataSize = unsigned int(MemoryFileWalker - MemoryFile) - result.HeaderSize;
-	result.Bits = (void*)MemoryFile;
+	EndOutput(result);
 	
 	return result;
 }
@@ -229,43 +432,196 @@ JEncResult JpegEncoderBase::Encode(DX12_JEncD3DDataDesc d3dDataDesc, int quality
 
 	CalculateComputationDimensions(d3dDataDesc.Width, d3dDataDesc.Height);
 
-	if (!ValidateMemoryFile(d3dDataDesc.TargetMemory))
-		return result;
+	BeginOutput(d3dDataDesc.TargetMemory, d3dDataDesc.TargetMemorySize);
 
 	Reset();
 
 	WriteHeader();
-	result.HeaderSize = unsigned int(MemoryFileWalker - MemoryFile);
+	result.HeaderSize = NumBytesWritten();
 
 	WriteImageData(d3dDataDesc);
+	EndOutput(result);
+
+	return result;
+}
+#endif
+
+JEncResult JpegEncoderBase::EncodeTables(int quality)
+{
+	JEncResult result;
+	memset(&result, 0, sizeof(result));
+
+	if(!ValidateQuantizationTables(quality))
+		return result;
+
+	//the tables abbreviated frames leave out, optimized and adapted ones are in the frames,
+	//the tables of the encoder stay as they are
+	BYTE nrCodes[NUM_HUFFMAN_TABLES][17];
+	BYTE values[NUM_HUFFMAN_TABLES][256];
+	GetStandardHuffmanTables(nrCodes, values);
+
+	BeginOutput(NULL, 0);
+
+	Reset();
+
+	//abbreviated format for table-specification data
+	ReserveOutput(mBitWriter, 2 + (2 + 132) + (2 + 0x01A2) + 2);
+
+	WriteHex(0xFFD8);
+	WriteQuantizationInfo();
+	WriteHuffmanInfo(nrCodes, values);
+	WriteHex(0xFFD9);
+
+	result.HeaderSize = NumBytesWritten();
+	EndOutput(result);
+
+	return result;
+}
+
+bool JpegEncoderBase::Reserve(unsigned int maxWidth, unsigned int maxHeight, JENC_CHROMA_SUBSAMPLE subsampleType)
+{
+	if(subsampleType != mSubsampleType || maxWidth == 0 || maxHeight == 0 || maxWidth > 0xFFFF || maxHeight > 0xFFFF)
+		return false;
+
+	JpegMCULayoutInfo layout;
+	GetMCULayoutInfo(mSubsampleType, layout);
+
+	//the internal buffer grows to the largest frame so far and is only sized ahead for the quality
+	//in use, before the first Encode nothing tells whether it will be used at all or TargetMemory
+	//takes the frames. The callback only ever needs a chunk.
+	if(mSink.Type == JENC_SINK_INTERNAL && mQualitySetting != 0)
+		AllocateMemoryFile((size_t)GetMaxOutputSize(maxWidth, maxHeight, mSubsampleType, mQualitySetting, mRestartInterval));
+
+	return ReserveBuffers((maxWidth + layout.Width - 1) / layout.Width, (maxHeight + layout.Height - 1) / layout.Height);
+}
+
+JEncResult JpegEncoderBase::EstimateSize(JEncRGBDataDesc rgbDataDesc, int quality)
+{
+	JEncResult result;
+	memset(&result, 0, sizeof(result));
+
+	if(!ValidateQuantizationTables(quality))
+		return result;
+
+	CalculateComputationDimensions(rgbDataDesc.Width, rgbDataDesc.Height);
+
+	//the image comes first, it may pick the Huffman tables the header carries
+	uint64_t numBytes = MeasureImageData(rgbDataDesc);
+
+	//the scan is padded to a whole byte already, EOI comes on top
+	result.HeaderSize = GetMeasuredHeaderSize();
+	result.DataSize = (unsigned int)(numBytes + 2);
+
+	return result;
+}
+
+#if defined(JENC_D3D)
+JEncResult JpegEncoderBase::EstimateSize(JEncD3DDataDesc d3dDataDesc, int quality)
+{
+	JEncResult result;
+	memset(&result, 0, sizeof(result));
+
+	if(!ValidateQuantizationTables(quality))
+		return result;
+
+	CalculateComputationDimensions(d3dDataDesc.Width, d3dDataDesc.Height);
+
+	uint64_t numBytes = MeasureImageData(d3dDataDesc);
+
+	result.HeaderSize = GetMeasuredHeaderSize();
+	result.DataSize = (unsigned int)(numBytes + 2);
+
+	return result;
+}
+
+JEncResult JpegEncoderBase::EstimateSize(DX12_JEncD3DDataDesc d3dDataDesc, int quality)
+{
+	JEncResult result;
+	memset(&result, 0, sizeof(result));
+
+	if(!ValidateQuantizationTables(quality))
+		return result;
+
+	CalculateComputationDimensions(d3dDataDesc.Width, d3dDataDesc.Height);
+
+	uint64_t numBytes = MeasureImageData(d3dDataDesc);
 
-	result.DataSize = unsigned int(MemoryFileWalker - MemoryFile) - result.HeaderSize;
-	result.Bits = (void*)MemoryFile;
+	result.HeaderSize = GetMeasuredHeaderSize();
+	result.DataSize = (unsigned int)(numBytes + 2);
 
 	return result;
 }
+#endif
 
 void JpegEncoderBase::WriteHeader()
 {
-	//JPG header
+	if(mHeader.empty())
+		BuildHeader();
+
+	//a callback gets the cached header itself, nothing is pending at the start of the stream
+	if(mOutputType == JENC_SINK_CALLBACK && mBitWriter.Walker == mOutputBegin)
+	{
+		if(!mOutputFailed && !mSink.Callback(&mHeader[0], (unsigned int)mHeader.size(), mSink.UserData))
+			mOutputFailed = true;
+
+		mNumBytesFlushed += mHeader.size();
+		return;
+	}
+
+	ReserveOutput(mBitWriter, mHeader.size());
+	WriteByteArray(&mHeader[0], mHeader.size());
+}
+
+void JpegEncoderBase::BuildHeader()
+{
+	mHeader.resize(GetHeaderSize(mRestartInterval > 0));
+
+	//the JPG header goes through the usual writes, just into the cache
+	BYTE* walker = mBitWriter.Walker;
+	mBitWriter.Walker = &mHeader[0];
+
 	WriteAPP0Info();
 
-	WriteQuantizationInfo();
-	WriteHuffmanInfo();
+	if(mTables != JENC_TABLES_NONE)
+		WriteQuantizationInfo();
+
+	//decoders only fill in the standard tables
+	if(mTables == JENC_TABLES_ALL || !mStandardHuffmanTables)
+		WriteHuffmanInfo(mHuffmanNRCodes, mHuffmanValues);
+
+	if(mRestartInterval > 0)
+		WriteDRIInfo();
+
+	//height and width follow the marker, the length and the precision
+	mHeaderDimensionsOffset = mBitWriter.Walker - &mHeader[0] + 5;
+
 	WriteS0FInfo();
 	WriteS0SInfo();
+
+	mHeader.resize(mBitWriter.Walker - &mHeader[0]);
+	mBitWriter.Walker = walker;
+}
+
+void JpegEncoderBase::PatchHeaderDimensions()
+{
+	if(mHeader.empty())
+		return;
+
+	BYTE* dimensions = &mHeader[mHeaderDimensionsOffset];
+	dimensions[0] = (BYTE)(mImageHeight >> 8);
+	dimensions[1] = (BYTE)mImageHeight;
+	dimensions[2] = (BYTE)(mImageWidth >> 8);
+	dimensions[3] = (BYTE)mImageWidth;
 }
 
 inline void JpegEncoderBase::Write(BYTE b)
 {
-	//MemoryFile[MemoryFileNumBytesWritten++] = b;
-	*MemoryFileWalker++ = b;
+	*mBitWriter.Walker++ = b;
 }
 
 inline void JpegEncoderBase::Write(char c)
 {
-	//MemoryFile[MemoryFileNumBytesWritten++] = (BYTE)c;
-	*MemoryFileWalker++ = (BYTE)c;
+	*mBitWriter.Walker++ = (BYTE)c;
 }
 
 inline void JpegEncoderBase::WriteHex(unsigned short data)
@@ -274,14 +630,13 @@ inline void JpegEncoderBase::WriteHex(unsigned short data)
 	Write((BYTE)(data & 0x00ff));
 }
 
-inline void JpegEncoderBase::WriteByteArray(BYTE* arr, size_t size)
+inline void JpegEncoderBase::WriteByteArray(const BYTE* arr, size_t size)
 {
-	memcpy(MemoryFileWalker, arr, size);
-	MemoryFileWalker += size;
-	//MemoryFileNumBytesWritten += size;
+	memcpy(mBitWriter.Walker, arr, size);
+	mBitWriter.Walker += size;
 }
 
-void JpegEncoderBase::ComputeHuffmanTable(BitString* outTable, BYTE* inTable, BYTE* nrCodes)
+void JpegEncoderBase::ComputeHuffmanTable(BitString* outTable, const BYTE* inTable, const BYTE* nrCodes)
 {
     BYTE k, j;
     BYTE pos_in_table;
@@ -303,28 +658,911 @@ void JpegEncoderBase::ComputeHuffmanTable(BitString* outTable, BYTE* inTable, BY
     }            
 }
 
-void JpegEncoderBase::WriteBits(const BitString& bs)
+void JpegEncoderBase::ComputeOptimalHuffmanTable(const unsigned int* symbolCounts, BYTE* outNRCodes, BYTE* outValues)
 {
-	static BYTE b = 0;
-	mByteBuffer |= bs.value << (32 - bs.length - mCurrentBytePos);
-	mCurrentBytePos += bs.length;
+	//symbol 256 is reserved with the smallest count, so no real code ends up all ones
+	uint64_t freq[257];
+	int codeSize[257];
+	int others[257];
+
+	for(int i = 0; i < 256; i++)
+		freq[i] = symbolCounts[i];
 
-	while(mCurrentBytePos >= 8)
+	freq[256] = 1;
+	memset(codeSize, 0, sizeof(codeSize));
+	memset(others, -1, sizeof(others));
+
+	//merge the two least frequent trees until only one is left
+	for(;;)
 	{
-		b = mByteBuffer >> 24;
+		//c1 the smallest count, ties go to the larger symbol, c2 the next smallest
+		int c1 = -1;
+		int c2 = -1;
+		for(int i = 0; i <= 256; i++)
+		{
+			if(freq[i] && (c1 < 0 || freq[i] <= freq[c1]))
+				c1 = i;
+		}
+
+		for(int i = 0; i <= 256; i++)
+		{
+			if(freq[i] && i != c1 && (c2 < 0 || freq[i] <= freq[c2]))
+				c2 = i;
+		}
 
-		Write(b);
+		if(c2 < 0)
+			break;
 
+		freq[c1] += freq[c2];
+		freq[c2] = 0;
+
+		//every symbol in both trees gets a bit longer, c2's chain is appended to c1's
+		codeSize[c1]++;
+		while(others[c1] >= 0)
+		{
+			c1 = others[c1];
+			codeSize[c1]++;
+		}
 
-        // Write to stream
-        if (b == 0xFF)
-			Write((BYTE)0x00);
+		others[c1] = c2;
 
-		mByteBuffer <<= 8;
-		mCurrentBytePos -= 8;
+		codeSize[c2]++;
+		while(others[c2] >= 0)
+		{
+			c2 = others[c2];
+			codeSize[c2]++;
+		}
+	}
+
+	//codes can get up to 32 bits long here
+	int bits[33];
+	memset(bits, 0, sizeof(bits));
+	for(int i = 0; i <= 256; i++)
+	{
+		if(codeSize[i])
+			bits[codeSize[i]]++;
+	}
+
+	//down to 16 bits, a pair of the longest codes is replaced by a code one bit shorter
+	//and a shorter code is split into two one bit longer
+	for(int i = 32; i > 16; i--)
+	{
+		while(bits[i] > 0)
+		{
+			int j = i - 2;
+			while(bits[j] == 0)
+				j--;
+
+			bits[i] -= 2;
+			bits[i - 1]++;
+			bits[j + 1] += 2;
+			bits[j]--;
+		}
+	}
+
+	//the reserved symbol has one of the longest codes
+	int longest = 16;
+	while(longest > 0 && bits[longest] == 0)
+		longest--;
+
+	if(longest > 0)
+		bits[longest]--;
+
+	outNRCodes[0] = 0;
+	for(int i = 1; i <= 16; i++)
+		outNRCodes[i] = (BYTE)bits[i];
+
+	//symbols by code length, in symbol order within a length
+	int numValues = 0;
+	for(int length = 1; length <= 32; length++)
+	{
+		for(int i = 0; i < 256; i++)
+		{
+			if(codeSize[i] == length)
+				outValues[numValues++] = (BYTE)i;
+		}
 	}
 }
 
+void JpegEncoderBase::SetOptimalHuffmanTables(const unsigned int* symbolCounts)
+{
+	for(int i = 0; i < NUM_HUFFMAN_TABLES; i++)
+		ComputeOptimalHuffmanTable(symbolCounts + i * 256, mHuffmanNRCodes[i], mHuffmanValues[i]);
+
+	mStandardHuffmanTables = false;
+	UpdateHuffmanTables();
+}
+
+void JpegEncoderBase::GetStandardHuffmanTables(BYTE outNRCodes[][17], BYTE outValues[][256])
+{
+	memset(outValues, 0, NUM_HUFFMAN_TABLES * 256);
+
+	memcpy(outNRCodes[HUFFMAN_Y_DC], StandardDCLuminanceNRCodes, 17);
+	memcpy(outValues[HUFFMAN_Y_DC], StandardDCLuminanceValues, sizeof(StandardDCLuminanceValues));
+	memcpy(outNRCodes[HUFFMAN_Y_AC], StandardACLuminanceNRCodes, 17);
+	memcpy(outValues[HUFFMAN_Y_AC], StandardACLuminanceValues, sizeof(StandardACLuminanceValues));
+	memcpy(outNRCodes[HUFFMAN_CBCR_DC], StandardDCChromianceNRCodes, 17);
+	memcpy(outValues[HUFFMAN_CBCR_DC], StandardDCChromianceValues, sizeof(StandardDCChromianceValues));
+	memcpy(outNRCodes[HUFFMAN_CBCR_AC], StandardACChromianceNRCodes, 17);
+	memcpy(outValues[HUFFMAN_CBCR_AC], StandardACChromianceValues, sizeof(StandardACChromianceValues));
+}
+
+void JpegEncoderBase::SetStandardHuffmanTables()
+{
+	if(mStandardHuffmanTables)
+		return;
+
+	GetStandardHuffmanTables(mHuffmanNRCodes, mHuffmanValues);
+
+	mStandardHuffmanTables = true;
+	UpdateHuffmanTables();
+}
+
+void JpegEncoderBase::SetHuffmanTables(const BYTE nrCodes[][17], const BYTE values[][256])
+{
+	memcpy(mHuffmanNRCodes, nrCodes, sizeof(mHuffmanNRCodes));
+	memcpy(mHuffmanValues, values, sizeof(mHuffmanValues));
+
+	//the standard tables still go without DHT in abbreviated frames
+	mStandardHuffmanTables = IsStandardHuffmanTables(nrCodes, values);
+
+	UpdateHuffmanTables();
+}
+
+bool JpegEncoderBase::IsStandardHuffmanTables(const BYTE nrCodes[][17], const BYTE values[][256])
+{
+	return
+		memcmp(nrCodes[HUFFMAN_Y_DC], StandardDCLuminanceNRCodes, 17) == 0 &&
+		memcmp(values[HUFFMAN_Y_DC], StandardDCLuminanceValues, sizeof(StandardDCLuminanceValues)) == 0 &&
+		memcmp(nrCodes[HUFFMAN_Y_AC], StandardACLuminanceNRCodes, 17) == 0 &&
+		memcmp(values[HUFFMAN_Y_AC], StandardACLuminanceValues, sizeof(StandardACLuminanceValues)) == 0 &&
+		memcmp(nrCodes[HUFFMAN_CBCR_DC], StandardDCChromianceNRCodes, 17) == 0 &&
+		memcmp(values[HUFFMAN_CBCR_DC], StandardDCChromianceValues, sizeof(StandardDCChromianceValues)) == 0 &&
+		memcmp(nrCodes[HUFFMAN_CBCR_AC], StandardACChromianceNRCodes, 17) == 0 &&
+		memcmp(values[HUFFMAN_CBCR_AC], StandardACChromianceValues, sizeof(StandardACChromianceValues)) == 0;
+}
+
+void JpegEncoderBase::UpdateHuffmanTables()
+{
+	memset(Y_DC_Huffman_Table, 0, sizeof(Y_DC_Huffman_Table));
+	ComputeHuffmanTable(Y_DC_Huffman_Table, mHuffmanValues[HUFFMAN_Y_DC], mHuffmanNRCodes[HUFFMAN_Y_DC]);
+
+	memset(Y_AC_Huffman_Table, 0, sizeof(Y_AC_Huffman_Table));
+	ComputeHuffmanTable(Y_AC_Huffman_Table, mHuffmanValues[HUFFMAN_Y_AC], mHuffmanNRCodes[HUFFMAN_Y_AC]);
+
+	memset(Cb_DC_Huffman_Table, 0, sizeof(Cb_DC_Huffman_Table));
+	ComputeHuffmanTable(Cb_DC_Huffman_Table, mHuffmanValues[HUFFMAN_CBCR_DC], mHuffmanNRCodes[HUFFMAN_CBCR_DC]);
+
+	memset(Cb_AC_Huffman_Table, 0, sizeof(Cb_AC_Huffman_Table));
+	ComputeHuffmanTable(Cb_AC_Huffman_Table, mHuffmanValues[HUFFMAN_CBCR_AC], mHuffmanNRCodes[HUFFMAN_CBCR_AC]);
+
+	//the worst case MCU follows the code lengths
+	if(mQualitySetting != 0)
+	{
+		mMaxEntropyBitsPerMCU = GetMaxEntropyBitsPerMCU(mSubsampleType, Y_Quantization_Table, CbCr_Quantization_Table,
+			Y_DC_Huffman_Table, Y_AC_Huffman_Table, Cb_DC_Huffman_Table, Cb_AC_Huffman_Table);
+	}
+
+	mHeader.clear();
+
+	HuffmanTablesChanged();
+}
+
+//DHT segment of WriteHuffmanInfo, marker included
+static unsigned int GetHuffmanInfoSize(const BYTE nrCodes[][17])
+{
+	unsigned int size = 2 + 2;
+	for(int i = 0; i < JpegEncoderBase::NUM_HUFFMAN_TABLES; i++)
+	{
+		size += 1 + 16;
+		for(int j = 1; j <= 16; j++)
+			size += nrCodes[i][j];
+	}
+
+	return size;
+}
+
+unsigned int JpegEncoderBase::GetHeaderSize(const BYTE nrCodes[][17], const BYTE values[][256])
+{
+	if(mHeader.empty())
+		BuildHeader();
+
+	//BuildHeader leaves the DHT out of abbreviated frames with the standard tables
+	unsigned int size = (unsigned int)mHeader.size();
+	if(mTables == JENC_TABLES_ALL || !mStandardHuffmanTables)
+		size -= GetHuffmanInfoSize(mHuffmanNRCodes);
+
+	if(mTables == JENC_TABLES_ALL || !IsStandardHuffmanTables(nrCodes, values))
+		size += GetHuffmanInfoSize(nrCodes);
+
+	return size;
+}
+
+unsigned int JpegEncoderBase::GetMeasuredHeaderSize()
+{
+	if(mHeader.empty())
+		BuildHeader();
+
+	return (unsigned int)mHeader.size();
+}
+
+//the segment lengths of a full WriteHeader plus the two byte markers, abbreviated headers are shorter
+unsigned int JpegEncoderBase::GetHeaderSize(bool restartMarkers)
+{
+	unsigned int size = 2;		//SOI
+	size += 2 + 16;				//APP0
+	size += 2 + 132;			//DQT
+	size += 2 + 0x01A2;			//DHT
+	size += 2 + 17;				//SOF0
+	size += 2 + 12;				//SOS
+
+	if(restartMarkers)
+		size += 2 + 4;			//DRI
+
+	return size;
+}
+
+//largest quantized magnitude at the quantizer, all DCT outputs stay within +-1024
+static int MaxMagnitudeCategory(int quantizer, int maxCategory)
+{
+	int magnitude = (1024 + quantizer / 2) / quantizer;
+
+	int category = 0;
+	for(; magnitude; magnitude >>= 1)
+		category++;
+
+	return JPEG_MIN(category, maxCategory);
+}
+
+//worst case bits of one block, coefficients as large as the quantizers allow. Every AC coefficient
+//in zigzag order may follow any run of zeros, so the longest code path through the block is found
+//from the back, a position that is left out costs at most a ZRL share or the EOB.
+static uint64_t GetMaxBlockBits(const BYTE* quantizationTable, const BitString* HTDC, const BitString* HTAC)
+{
+	//DC differences span twice the DC range
+	int dcCategory = JPEG_MIN(MaxMagnitudeCategory(quantizationTable[0], 11) + 1, 11);
+
+	uint64_t dcBits = 0;
+	for(int s = 0; s <= dcCategory; s++)
+		dcBits = JPEG_MAX(dcBits, (uint64_t)(HTDC[s].length + s));
+
+	//worst[k]: coefficients k..63 after a nonzero one at k - 1
+	uint64_t worst[65];
+	worst[64] = 0;
+
+	for(int k = 63; k >= 1; k--)
+	{
+		//all zero from here on
+		worst[k] = HTAC[0x00].length;
+
+		for(int j = k; j < 64; j++)
+		{
+			int run = j - k;
+			int acCategory = MaxMagnitudeCategory(quantizationTable[j], 10);
+
+			for(int s = 1; s <= acCategory; s++)
+			{
+				uint64_t bits = (run >> 4) * HTAC[0xF0].length + HTAC[((run & 15) << 4) | s].length + s + worst[j + 1];
+				worst[k] = JPEG_MAX(worst[k], bits);
+			}
+		}
+	}
+
+	return dcBits + worst[1];
+}
+
+//symbols without a code count as zero bits, they never occur in the image the tables were built for
+uint64_t JpegEncoderBase::GetMaxEntropyBitsPerMCU(JENC_CHROMA_SUBSAMPLE subsampleType, const BYTE* YQuantizationTable, const BYTE* CbCrQuantizationTable,
+	const BitString* YDC, const BitString* YAC, const BitString* CbCrDC, const BitString* CbCrAC)
+{
+	JpegMCULayoutInfo layout;
+	if(!GetMCULayoutInfo(subsampleType, layout))
+		return 0;
+
+	return layout.NumBlocksY * GetMaxBlockBits(YQuantizationTable, YDC, YAC) +
+		2 * GetMaxBlockBits(CbCrQuantizationTable, CbCrDC, CbCrAC);
+}
+
+//a symbol the way the byte stuffing sees it: every 8 ones in a row that line up with a byte boundary
+//make a 0xFF byte and cost a stuffed 0x00, without knowing the alignment each run of r ones counts
+//as r / 8 such bytes. Runs at the ends of the code join the symbols around it.
+struct StuffingSymbol
+{
+	bool Coded;
+	int Bits;			//code and magnitude bits
+	int LeadingOnes;	//ones the code starts with
+	int InnerFFBytes;	//0xFF bytes within the runs of ones between the zeros of the code
+	int TrailingOnes;	//ones at the end, magnitude bits all ones
+};
+
+//ones a symbol may end in, a 16 bit code followed by 11 magnitude bits
+static const int MaxTrailingOnes = 32;
+
+//codes are never all ones (C.2 of the standard), one that was would be counted at both ends
+static StuffingSymbol GetStuffingSymbol(const BitString& code, int numMagnitudeBits)
+{
+	StuffingSymbol symbol;
+	memset(&symbol, 0, sizeof(symbol));
+
+	if(code.length == 0)
+		return symbol;
+
+	int lead = 0;
+	while(lead < code.length && ((code.value >> (code.length - 1 - lead)) & 1))
+		lead++;
+
+	int trail = 0;
+	while(trail < code.length && ((code.value >> trail) & 1))
+		trail++;
+
+	int run = 0;
+	for(int i = code.length - 1 - lead; i > trail; i--)
+	{
+		if((code.value >> i) & 1)
+			run++;
+		else
+		{
+			symbol.InnerFFBytes += run / 8;
+			run = 0;
+		}
+	}
+
+	symbol.Coded = true;
+	symbol.Bits = code.length + numMagnitudeBits;
+	symbol.LeadingOnes = JPEG_MIN(lead, code.length);
+	symbol.InnerFFBytes += run / 8;
+	symbol.TrailingOnes = JPEG_MIN(trail + numMagnitudeBits, MaxTrailingOnes - 1);
+
+	return symbol;
+}
+
+//AC energy of a block, 64 samples within -128..127 hold at most 64 * 127.5^2 around their mean and
+//the FDCT keeps it (Parseval)
+static const double MaxACEnergy = 64 * 127.5 * 127.5;
+
+struct BlockBoundInput
+{
+	StuffingSymbol DC[12];
+	StuffingSymbol AC[256];
+	int DCCategory;
+	double Energy[64][11];	//energy a quantized AC magnitude of each category needs, < 0 if it can't have it
+};
+
+//stuffed 0xFF bytes of a run of ones across two symbols, counted as 8 bits each
+static inline int JoinedFFBits(int trailingOnes, int leadingOnes)
+{
+	return 8 * ((trailingOnes + leadingOnes) / 8);
+}
+
+//max over all blocks of bits + stuffed bits - lambda * AC energy, the block starting after incomingOnes.
+//worst[k][t]: coefficients k..63 after a nonzero one at k - 1 whose symbol ended in t ones, the ones
+//the block ends in are left to the next block.
+static double GetMaxBlockValue(const BlockBoundInput& in, double lambda, int incomingOnes)
+{
+	static const double None = -1e30;
+
+	double worst[65][MaxTrailingOnes];
+	for(int t = 0; t < MaxTrailingOnes; t++)
+		worst[64][t] = 0.0;
+
+	const StuffingSymbol& EOB = in.AC[0x00];
+	const StuffingSymbol& ZRL = in.AC[0xF0];
+
+	for(int k = 63; k >= 1; k--)
+	{
+		//best value of the symbols the rest starts with, by the ones they start with
+		double best[17];
+		for(int l = 0; l <= 16; l++)
+			best[l] = None;
+
+		if(EOB.Coded)
+			best[EOB.LeadingOnes] = EOB.Bits + 8.0 * EOB.InnerFFBytes;
+
+		for(int j = k; j < 64; j++)
+		{
+			int run = j - k;
+			int numZRL = run >> 4;
+			if(numZRL > 0 && !ZRL.Coded)
+				break;
+
+			double zrlValue = 0.0;
+			if(numZRL > 0)
+				zrlValue = numZRL * (ZRL.Bits + 8.0 * ZRL.InnerFFBytes) + (numZRL - 1) * JoinedFFBits(ZRL.TrailingOnes, ZRL.LeadingOnes);
+
+			for(int s = 1; s <= 10; s++)
+			{
+				const StuffingSymbol& symbol = in.AC[((run & 15) << 4) | s];
+				if(!symbol.Coded || in.Energy[j][s] < 0.0)
+					continue;
+
+				double value = symbol.Bits + 8.0 * symbol.InnerFFBytes - lambda * in.Energy[j][s] + worst[j + 1][symbol.TrailingOnes];
+				int lead = symbol.LeadingOnes;
+
+				if(numZRL > 0)
+				{
+					value += zrlValue + JoinedFFBits(ZRL.TrailingOnes, symbol.LeadingOnes);
+					lead = ZRL.LeadingOnes;
+				}
+
+				best[lead] = JPEG_MAX(best[lead], value);
+			}
+		}
+
+		for(int t = 0; t < MaxTrailingOnes; t++)
+		{
+			worst[k][t] = None;
+			for(int l = 0; l <= 16; l++)
+			{
+				if(best[l] > None)
+					worst[k][t] = JPEG_MAX(worst[k][t], best[l] + JoinedFFBits(t, l));
+			}
+		}
+	}
+
+	double value = None;
+	for(int s = 0; s <= in.DCCategory; s++)
+	{
+		const StuffingSymbol& symbol = in.DC[s];
+		if(symbol.Coded)
+			value = JPEG_MAX(value, symbol.Bits + 8.0 * symbol.InnerFFBytes + JoinedFFBits(incomingOnes, symbol.LeadingOnes) + worst[1][symbol.TrailingOnes]);
+	}
+
+	return value;
+}
+
+static void GetBlockBoundInput(const BYTE* quantizationTable, const BitString* HTDC, const BitString* HTAC, BlockBoundInput& out)
+{
+	//DC differences span twice the DC range and take no AC energy
+	out.DCCategory = JPEG_MIN(MaxMagnitudeCategory(quantizationTable[0], 11) + 1, 11);
+
+	for(int s = 0; s < 12; s++)
+		out.DC[s] = GetStuffingSymbol(HTDC[s], s);
+
+	for(int symbol = 0; symbol < 256; symbol++)
+		out.AC[symbol] = GetStuffingSymbol(HTAC[symbol], symbol & 15);
+
+	//smallest DCT output a magnitude of category s quantizes from is (2^(s-1) - 1/2) * Q, ifast gets
+	//there from up to an eighth less and the integer DCTs round by a few units on top of that
+	for(int j = 1; j < 64; j++)
+	{
+		out.Energy[j][0] = 0.0;
+		for(int s = 1; s <= 10; s++)
+		{
+			double coefficient = ((1 << (s - 1)) - 0.5) * quantizationTable[j] / 1.125 - 8.0;
+			double energy = coefficient > 0.0 ? coefficient * coefficient : 0.0;
+			out.Energy[j][s] = energy <= MaxACEnergy ? energy : -1.0;
+		}
+	}
+}
+
+static int GetMaxTrailingOnes(const BlockBoundInput& in)
+{
+	int ones = 0;
+	for(int s = 0; s < 12; s++)
+		ones = JPEG_MAX(ones, in.DC[s].TrailingOnes);
+
+	for(int symbol = 0; symbol < 256; symbol++)
+		ones = JPEG_MAX(ones, in.AC[symbol].TrailingOnes);
+
+	return ones;
+}
+
+//worst case bits of one block with its stuffed bytes, the AC coefficients sharing the energy a block of
+//8 bit samples can have. For every lambda >= 0, max(bits - lambda * energy) + lambda * MaxACEnergy
+//bounds the bits of all blocks within the energy, it is convex in lambda and the smallest one is
+//searched for. Blocks start after incomingOnes ones.
+static uint64_t GetMaxStuffedBlockBits(const BlockBoundInput& in, int incomingOnes)
+{
+	double low = 0.0;
+	double high = 1e-2;
+
+	double best = GetMaxBlockValue(in, 0.0, incomingOnes);
+
+	static const double Golden = 0.6180339887;
+	double a = high - Golden * (high - low);
+	double b = low + Golden * (high - low);
+	double valueA = GetMaxBlockValue(in, a, incomingOnes) + a * MaxACEnergy;
+	double valueB = GetMaxBlockValue(in, b, incomingOnes) + b * MaxACEnergy;
+
+	for(int i = 0; i < 40; i++)
+	{
+		if(valueA <= valueB)
+		{
+			high = b;
+			b = a;
+			valueB = valueA;
+			a = high - Golden * (high - low);
+			valueA = GetMaxBlockValue(in, a, incomingOnes) + a * MaxACEnergy;
+		}
+		else
+		{
+			low = a;
+			a = b;
+			valueA = valueB;
+			b = low + Golden * (high - low);
+			valueB = GetMaxBlockValue(in, b, incomingOnes) + b * MaxACEnergy;
+		}
+
+		best = JPEG_MIN(best, JPEG_MIN(valueA, valueB));
+	}
+
+	//rounding of the sums above
+	return (uint64_t)ceil(best + 1e-6 * best + 1.0);
+}
+
+uint64_t JpegEncoderBase::GetMaxOutputSize(uint64_t numMCUs, uint64_t maxBitsPerMCU, unsigned int segmentEndBytes, int restartInterval)
+{
+	//every segment pads its last byte and all but the last end in a RSTn marker
+	uint64_t numSegments = restartInterval > 0 ? (numMCUs + restartInterval - 1) / restartInterval : 1;
+
+	uint64_t numEntropyBytes = (numMCUs * maxBitsPerMCU + 7) / 8 + numSegments * segmentEndBytes;
+
+	return GetHeaderSize(restartInterval > 0) + numEntropyBytes + 2 * (numSegments - 1) + 2;
+}
+
+struct MaxOutputBound
+{
+	bool Valid;
+	uint64_t YBlockBits;
+	uint64_t CbCrBlockBits;
+	unsigned int SegmentEndBytes;
+};
+
+//bounds of the standard Huffman tables by quality, computed on first use
+static MaxOutputBound GetStandardMaxOutputBound(int quality, const BitString* YDC, const BitString* YAC, const BitString* CbCrDC, const BitString* CbCrAC)
+{
+	static std::mutex lock;
+	static MaxOutputBound bounds[101];
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	MaxOutputBound& bound = bounds[quality];
+	if(bound.Valid)
+		return bound;
+
+	BYTE YQuantizationTable[64];
+	BYTE CbCrQuantizationTable[64];
+	ComputeQuantizationTable(YQuantizationTable, StandardLuminanceQuantizationTable, quality);
+	ComputeQuantizationTable(CbCrQuantizationTable, StandardChromianceQuantizationTable, quality);
+
+	BlockBoundInput Y, CbCr;
+	GetBlockBoundInput(YQuantizationTable, YDC, YAC, Y);
+	GetBlockBoundInput(CbCrQuantizationTable, CbCrDC, CbCrAC, CbCr);
+
+	//Y and CbCr blocks follow each other, a block starts after as many ones as any symbol ends in
+	int maxTrailingOnes = JPEG_MAX(GetMaxTrailingOnes(Y), GetMaxTrailingOnes(CbCr));
+
+	bound.YBlockBits = GetMaxStuffedBlockBits(Y, maxTrailingOnes);
+	bound.CbCrBlockBits = GetMaxStuffedBlockBits(CbCr, maxTrailingOnes);
+
+	//the padding byte, with the ones of the last symbol it may end in 0xFF bytes
+	bound.SegmentEndBytes = 1 + (maxTrailingOnes + 7) / 8;
+	bound.Valid = true;
+
+	return bound;
+}
+
+uint64_t JpegEncoderBase::GetMaxOutputSize(int width, int height, JENC_CHROMA_SUBSAMPLE subsampleType, int quality, int restartInterval)
+{
+	JpegMCULayoutInfo layout;
+	if(!GetMCULayoutInfo(subsampleType, layout))
+		return 0;
+
+	if(width <= 0 || height <= 0 || quality < 1 || quality > 100 || restartInterval < 0 || restartInterval > 0xFFFF)
+		return 0;
+
+	BitString YDC[12], YAC[256], CbCrDC[12], CbCrAC[256];
+	memset(YDC, 0, sizeof(YDC));
+	memset(YAC, 0, sizeof(YAC));
+	memset(CbCrDC, 0, sizeof(CbCrDC));
+	memset(CbCrAC, 0, sizeof(CbCrAC));
+
+	ComputeHuffmanTable(YDC, StandardDCLuminanceValues, StandardDCLuminanceNRCodes);
+	ComputeHuffmanTable(YAC, StandardACLuminanceValues, StandardACLuminanceNRCodes);
+	ComputeHuffmanTable(CbCrDC, StandardDCChromianceValues, StandardDCChromianceNRCodes);
+	ComputeHuffmanTable(CbCrAC, StandardACChromianceValues, StandardACChromianceNRCodes);
+
+	MaxOutputBound bound = GetStandardMaxOutputBound(quality, YDC, YAC, CbCrDC, CbCrAC);
+	uint64_t maxBitsPerMCU = layout.NumBlocksY * bound.YBlockBits + 2 * bound.CbCrBlockBits;
+
+	uint64_t numMCUs = (uint64_t)((width + layout.Width - 1) / layout.Width) * ((height + layout.Height - 1) / layout.Height);
+
+	return GetMaxOutputSize(numMCUs, maxBitsPerMCU, bound.SegmentEndBytes, restartInterval);
+}
+
+void JpegEncoderBase::FinalizeData()
+{
+	//stuffed last byte and EOI
+	ReserveOutput(mBitWriter, MaxEntropyBytes(0) + 2);
+
+	//write any remaining bits to complete last block
+	BitString bs;
+	bs.length = 7;
+	bs.value = 0;
+	WriteBits(bs);
+	FlushBits(mBitWriter);
+
+	//Write End of Image Marker
+	WriteHex(0xFFD9);
+}
+
+void JpegEncoderBase::BeginEntropyCoding(EntropyWriter& writer)
+{
+	//continue where the WriteBits buffer left off
+	writer = mBitWriter;
+	writer.DeferStuffing = mDeferStuffing;
+
+	mEntropyStart = writer.Walker;
+}
+
+void JpegEncoderBase::EndEntropyCoding(EntropyWriter& writer)
+{
+	//bits still in the buffer are written with WriteBits later on and stuffed right away
+	if(writer.DeferStuffing)
+		writer.Walker = StuffBytes(mEntropyStart, writer.Walker);
+
+	//hand the remaining bits back
+	mBitWriter = writer;
+	mBitWriter.DeferStuffing = false;
+}
+
+BYTE* StuffBytes(BYTE* begin, BYTE* end)
+{
+	const __m128i ff = _mm_set1_epi8((char)0xFF);
+	const __m128i zero = _mm_setzero_si128();
+
+	//count the 0xFF bytes, 16 at a time with byte counters that are summed before they can overflow
+	size_t numFF = 0;
+	BYTE* p = begin;
+	while(end - p >= 16)
+	{
+		__m128i counters = zero;
+		for(int i = 0; i < 255 && end - p >= 16; i++, p += 16)
+			counters = _mm_sub_epi8(counters, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), ff));
+
+		__m128i sums = _mm_sad_epu8(counters, zero);
+		numFF += _mm_cvtsi128_si32(sums) + _mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
+	}
+	for(; p < end; p++)
+		numFF += *p == 0xFF;
+
+	//the common case, nothing to insert
+	if(numFF == 0)
+		return end;
+
+	//expand from the back, blocks of 16 without 0xFF are moved as a whole
+	//until the last 0xFF is behind us and the rest is in place already
+	BYTE* src = end;
+	BYTE* dst = end + numFF;
+	while(dst != src)
+	{
+		if(src - begin >= 16)
+		{
+			__m128i v = _mm_loadu_si128((const __m128i*)(src - 16));
+			if(_mm_movemask_epi8(_mm_cmpeq_epi8(v, ff)) == 0)
+			{
+				src -= 16;
+				dst -= 16;
+				_mm_storeu_si128((__m128i*)dst, v);
+				continue;
+			}
+		}
+
+		BYTE b = *--src;
+		if(b == 0xFF)
+			*--dst = 0x00;
+		*--dst = b;
+	}
+
+	return end + numFF;
+}
+
+void JpegEncoderBase::CodeRestartSegment(int segment, int numMCUs, int threadIndex)
+{
+	int firstMCU = segment * mRestartInterval;
+	int lastMCU = JPEG_MIN(firstMCU + mRestartInterval, numMCUs);
+
+	//every segment starts byte aligned with the DC predictors reset
+	EntropyWriter writer;
+	writer.Buffer = 0;
+	writer.NumBits = 0;
+	writer.Walker = &mRestartScratch[threadIndex][0];
+	writer.DeferStuffing = mDeferStuffing;
+
+	EncodeRestartSegment(writer, firstMCU, lastMCU, threadIndex);
+
+	//pad with 1 bits up to the next byte boundary
+	if(writer.NumBits & 7)
+		PutBits(writer, 0xFF >> (writer.NumBits & 7), 8 - (writer.NumBits & 7));
+
+	FlushBits(writer);
+
+	if(writer.DeferStuffing)
+		writer.Walker = StuffBytes(&mRestartScratch[threadIndex][0], writer.Walker);
+
+	mRestartSegments[segment].assign(&mRestartScratch[threadIndex][0], writer.Walker);
+}
+
+void JpegEncoderBase::WriteRestartSegments(int numMCUs, int maxBytesPerMCU)
+{
+	JpegThreadPool& pool = JpegThreadPool::Get();
+
+	int numSegments = (numMCUs + mRestartInterval - 1) / mRestartInterval;
+	int numThreads = pool.GetNumThreads();
+
+	mRestartSegments.resize(numSegments);
+	mRestartScratch.resize(numThreads);
+	for(int i = 0; i < numThreads; i++)
+		mRestartScratch[i].resize(JPEG_MIN(mRestartInterval, numMCUs) * maxBytesPerMCU);
+
+	pool.ParallelFor(numSegments, [this, numMCUs](int segment, int threadIndex) {
+		CodeRestartSegment(segment, numMCUs, threadIndex);
+	});
+
+	//the scan starts byte aligned after the header
+	for(int i = 0; i < numSegments; i++)
+	{
+		ReserveOutput(mBitWriter, mRestartSegments[i].size() + 2);
+
+		if(!mRestartSegments[i].empty())
+			WriteByteArray(&mRestartSegments[i][0], mRestartSegments[i].size());
+
+		if(i < numSegments - 1)
+			WriteHex((unsigned short)(0xFFD0 + (i & 7)));
+	}
+}
+
+uint64_t JpegEncoderBase::MeasureScan(int numMCUs)
+{
+	JpegThreadPool& pool = JpegThreadPool::Get();
+
+	if(mRestartInterval > 0)
+	{
+		int numSegments = (numMCUs + mRestartInterval - 1) / mRestartInterval;
+		if(numSegments <= 0)
+			return 0;
+
+		//every segment is padded to a whole byte and followed by an RSTn marker but the last
+		std::vector<uint64_t> numBytes(numSegments);
+		pool.ParallelFor(numSegments, [this, numMCUs, &numBytes](int segment, int threadIndex) {
+			int firstMCU = segment * mRestartInterval;
+			int lastMCU = JPEG_MIN(firstMCU + mRestartInterval, numMCUs);
+			numBytes[segment] = (MeasureRestartSegment(firstMCU, lastMCU) + 7) / 8 + 2;
+		});
+
+		uint64_t totalBytes = 0;
+		for(int i = 0; i < numSegments; i++)
+			totalBytes += numBytes[i];
+
+		return totalBytes - 2;
+	}
+
+	int numSegments = JPEG_MIN(numMCUs, pool.GetNumThreads() * ScanSegmentsPerThread);
+	if(numSegments <= 0)
+		return 0;
+
+	std::vector<uint64_t> numBits(numSegments);
+	pool.ParallelFor(numSegments, [this, numMCUs, numSegments, &numBits](int index, int threadIndex) {
+		int firstMCU = (int)((long long)numMCUs * index / numSegments);
+		int lastMCU = (int)((long long)numMCUs * (index + 1) / numSegments);
+		numBits[index] = MeasureScanSegment(firstMCU, lastMCU);
+	});
+
+	uint64_t totalBits = 0;
+	for(int i = 0; i < numSegments; i++)
+		totalBits += numBits[i];
+
+	return (totalBits + 7) / 8;
+}
+
+void JpegEncoderBase::CodeScanSegment(ScanSegment& segment, int maxBytesPerMCU)
+{
+	//one extra byte for the bits of the previous segment in front
+	segment.Data.resize((segment.LastMCU - segment.FirstMCU) * maxBytesPerMCU + 1);
+
+	//start at the bit offset within the byte, the bits in front are zero
+	EntropyWriter writer;
+	writer.Buffer = 0;
+	writer.NumBits = (int)(segment.FirstBit & 7);
+	writer.Walker = &segment.Data[0];
+	writer.DeferStuffing = mDeferStuffing;
+
+	EncodeScanSegment(writer, segment.FirstMCU, segment.LastMCU);
+	FlushBits(writer);
+
+	//the tail is not written yet and gets stuffed when it is joined with the next segment
+	if(writer.DeferStuffing)
+		writer.Walker = StuffBytes(&segment.Data[0], writer.Walker);
+
+	segment.NumBytes = (int)(writer.Walker - &segment.Data[0]);
+	segment.Tail = (BYTE)(writer.Buffer >> 56);
+	segment.NumTailBits = writer.NumBits;
+}
+
+void JpegEncoderBase::WriteScanSegments(int numMCUs, int maxBytesPerMCU)
+{
+	JpegThreadPool& pool = JpegThreadPool::Get();
+
+	int numSegments = JPEG_MIN(numMCUs, pool.GetNumThreads() * ScanSegmentsPerThread);
+	if(numSegments <= 0)
+		return;
+
+	mScanSegments.resize(numSegments);
+
+	pool.ParallelFor(numSegments, [this, numMCUs, numSegments](int index, int threadIndex) {
+		ScanSegment& segment = mScanSegments[index];
+		segment.FirstMCU = (int)((long long)numMCUs * index / numSegments);
+		segment.LastMCU = (int)((long long)numMCUs * (index + 1) / numSegments);
+		segment.NumBits = MeasureScanSegment(segment.FirstMCU, segment.LastMCU);
+	});
+
+	//bits the writer still holds come first
+	FlushBits(mBitWriter);
+
+	uint64_t bitPos = mBitWriter.NumBits;
+	for(int i = 0; i < numSegments; i++)
+	{
+		mScanSegments[i].FirstBit = bitPos;
+		bitPos += mScanSegments[i].NumBits;
+	}
+
+	pool.ParallelFor(numSegments, [this, maxBytesPerMCU](int index, int threadIndex) {
+		CodeScanSegment(mScanSegments[index], maxBytesPerMCU);
+	});
+
+	//every shared byte may need a stuffed 0x00
+	size_t numBytes = numSegments;
+	for(int i = 0; i < numSegments; i++)
+		numBytes += mScanSegments[i].NumBytes;
+
+	ReserveOutput(mBitWriter, numBytes);
+
+	//put the shared bytes together, stuffing is known from here on so every segment gets its place
+	BYTE pending = (BYTE)(mBitWriter.Buffer >> 56);
+	int numPending = mBitWriter.NumBits;
+	BYTE* walker = mBitWriter.Walker;
+
+	for(int i = 0; i < numSegments; i++)
+	{
+		ScanSegment& segment = mScanSegments[i];
+
+		segment.Skip = 0;
+		if(segment.NumBytes > 0)
+		{
+			if(numPending > 0)
+			{
+				//could not be 0xFF on its own with the high bits zero, so it was never stuffed
+				BYTE b = pending | segment.Data[0];
+				*walker++ = b;
+				if(b == 0xFF)
+					*walker++ = 0x00;
+
+				segment.Skip = 1;
+			}
+
+			pending = segment.Tail;
+		}
+		else
+		{
+			pending |= segment.Tail;
+		}
+		numPending = segment.NumTailBits;
+
+		segment.Target = walker;
+		walker += segment.NumBytes - segment.Skip;
+	}
+
+	pool.ParallelFor(numSegments, [this](int index, int threadIndex) {
+		ScanSegment& segment = mScanSegments[index];
+		if(segment.NumBytes > segment.Skip)
+			memcpy(segment.Target, &segment.Data[segment.Skip], segment.NumBytes - segment.Skip);
+	});
+
+	mBitWriter.Walker = walker;
+	mBitWriter.Buffer = (uint64_t)pending << 56;
+	mBitWriter.NumBits = numPending;
+}
+
 //JPG header
 void JpegEncoderBase::WriteAPP0Info()
 {
@@ -380,13 +1618,10 @@ void JpegEncoderBase::WriteS0FInfo()
 	BYTE nrofcomponents = 3;//Should be 3: We encode a truecolor JPG
 	BYTE IdY = 1;  // = 1
 
-	BYTE HVY = 0; // vertical sampling in high nibble, horizontal in low nibble
-	if(mSubsampleType == JENC_CHROMA_SUBSAMPLE_4_4_4)
-		HVY = 0x11;
-	else if(mSubsampleType == JENC_CHROMA_SUBSAMPLE_4_2_2)
-		HVY = (0x11 << 1) - 1;
-	else if(mSubsampleType == JENC_CHROMA_SUBSAMPLE_4_2_0)
-		HVY = (0x11 << 1);
+	JpegMCULayoutInfo layout;
+	GetMCULayoutInfo(mSubsampleType, layout);
+
+	BYTE HVY = (BYTE)((layout.SamplingH << 4) | layout.SamplingV); // horizontal sampling in high nibble, vertical in low nibble
 	
 	BYTE QTY = 0;  // Quantization Table number for Y = 0
 	BYTE IdCb = 2; // = 2
@@ -413,31 +1648,50 @@ void JpegEncoderBase::WriteS0FInfo()
     Write(QTCr);
 }
 
-void JpegEncoderBase::WriteHuffmanInfo()
+void JpegEncoderBase::WriteHuffmanInfo(const BYTE nrCodes[][17], const BYTE values[][256])
 {
 	USHORT marker = 0xFFC4;
-	USHORT length = 0x01A2;
-	BYTE HTYDCinfo = 0x00; // bit 0..3: number of HT (0..3), for Y =0
-	//bit 4  :type of HT, 0 = DC table,1 = AC table
-	//bit 5..7: not used, must be 0
-	BYTE HTYACinfo = 0x10; // = 0x10
-	BYTE HTCbDCinfo = 0x01; // = 1
-	BYTE HTCbACinfo = 0x11; //  = 0x11
+	BYTE HTinfo[NUM_HUFFMAN_TABLES] =
+	{
+		0x00,	// bit 0..3: number of HT (0..3), for Y =0
+				//bit 4  :type of HT, 0 = DC table,1 = AC table
+				//bit 5..7: not used, must be 0
+		0x10,	// = 0x10
+		0x01,	// = 1
+		0x11	//  = 0x11
+	};
+
+	//0x01A2 for the standard tables
+	int numValues[NUM_HUFFMAN_TABLES];
+	USHORT length = 2;
+	for(int i = 0; i < NUM_HUFFMAN_TABLES; i++)
+	{
+		numValues[i] = 0;
+		for(int j = 1; j <= 16; j++)
+			numValues[i] += nrCodes[i][j];
+
+		length += (USHORT)(1 + 16 + numValues[i]);
+	}
 
 	WriteHex(marker);
-	WriteHex(length);              
-	Write(HTYDCinfo);
-	WriteByteArray(&StandardDCLuminanceNRCodes[1], sizeof(StandardDCLuminanceNRCodes) - 1);
-	WriteByteArray(&StandardDCLuminanceValues[0], sizeof(StandardDCLuminanceValues));
-	Write(HTYACinfo);
-	WriteByteArray(&StandardACLuminanceNRCodes[1], sizeof(StandardACLuminanceNRCodes) - 1);
-	WriteByteArray(&StandardACLuminanceValues[0], sizeof(StandardACLuminanceValues));
-	Write(HTCbDCinfo);
-	WriteByteArray(&StandardDCChromianceNRCodes[1], sizeof(StandardDCChromianceNRCodes) - 1);
-	WriteByteArray(&StandardDCChromianceValues[0], sizeof(StandardDCChromianceValues));
-	Write(HTCbACinfo);
-	WriteByteArray(&StandardACChromianceNRCodes[1], sizeof(StandardACChromianceNRCodes) - 1);
-	WriteByteArray(&StandardACChromianceValues[0], sizeof(StandardACChromianceValues));
+	WriteHex(length);
+
+	for(int i = 0; i < NUM_HUFFMAN_TABLES; i++)
+	{
+		Write(HTinfo[i]);
+		WriteByteArray(&nrCodes[i][1], 16);
+		WriteByteArray(&values[i][0], numValues[i]);
+	}
+}
+
+void JpegEncoderBase::WriteDRIInfo()
+{
+	USHORT marker = 0xFFDD;
+	USHORT length = 4;
+
+	WriteHex(marker);
+	WriteHex(length);
+	WriteHex((USHORT)mRestartInterval);
 }
 
 void JpegEncoderBase::WriteS0SInfo()
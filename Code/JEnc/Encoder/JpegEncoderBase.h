@@ -5,13 +5,18 @@
 //--------------------------------------------------------------------------------------
 #pragma once
 
-#include <Windows.h>
 #include <fstream>
 #include <iostream>
 #include <iomanip>
+#include <vector>
 
 #include "../Include/JEnc.h"
 #include "../../Shared/JpegCommon.h"
+#include "JpegMCULayout.h"
+
+typedef unsigned char BYTE;
+typedef unsigned short USHORT;
+typedef unsigned int UINT;
 
 struct BitString
 {
@@ -19,6 +24,91 @@ struct BitString
 	USHORT length;
 };
 
+//64 bit output buffer for the entropy coder, bits are filled in from the top
+//and leave in 32 bit words, every encoder instance and thread has its own
+struct EntropyWriter
+{
+	uint64_t Buffer;
+	int NumBits;
+	BYTE* Walker;
+
+	//write 0xFF bytes without the 0x00 behind them, StuffBytes adds them afterwards
+	bool DeferStuffing;
+};
+
+//upper bound for the entropy coded size of one block including byte stuffing,
+//16 bit DC code with 11 magnitude bits and 63 16 bit AC codes with 10 magnitude bits
+#define JPEG_MAX_ENTROPY_BYTES_PER_BLOCK	(2 * ((16 + 11 + 63 * (16 + 10) + 7) / 8))
+
+static inline void EmitByte(EntropyWriter& writer, BYTE b)
+{
+	*writer.Walker++ = b;
+	if(b == 0xFF && !writer.DeferStuffing)
+		*writer.Walker++ = 0x00;
+}
+
+//length is at most 32
+static inline void PutBits(EntropyWriter& writer, unsigned int code, unsigned int length)
+{
+	writer.Buffer |= (uint64_t)code << (64 - writer.NumBits - length);
+	writer.NumBits += length;
+
+	if(writer.NumBits >= 32)
+	{
+		unsigned int word = (unsigned int)(writer.Buffer >> 32);
+
+		//no 0xFF byte, no stuffing needed
+		unsigned int inverted = ~word;
+		if(writer.DeferStuffing || ((inverted - 0x01010101) & ~inverted & 0x80808080) == 0)
+		{
+			writer.Walker[0] = (BYTE)(word >> 24);
+			writer.Walker[1] = (BYTE)(word >> 16);
+			writer.Walker[2] = (BYTE)(word >> 8);
+			writer.Walker[3] = (BYTE)word;
+			writer.Walker += 4;
+		}
+		else
+		{
+			EmitByte(writer, (BYTE)(word >> 24));
+			EmitByte(writer, (BYTE)(word >> 16));
+			EmitByte(writer, (BYTE)(word >> 8));
+			EmitByte(writer, (BYTE)word);
+		}
+
+		writer.Buffer <<= 32;
+		writer.NumBits -= 32;
+	}
+}
+
+//appends numBits of a big endian bit stream, 32 bits per PutBits at whatever
+//bit offset the writer is at, stuffing is done per word by PutBits
+static inline void PutBitStream(EntropyWriter& writer, const BYTE* data, int numBits)
+{
+	for(; numBits >= 32; numBits -= 32, data += 4)
+		PutBits(writer, ((unsigned int)data[0] << 24) | ((unsigned int)data[1] << 16) | ((unsigned int)data[2] << 8) | data[3], 32);
+
+	if(numBits > 0)
+	{
+		unsigned int word = ((unsigned int)data[0] << 24) | ((unsigned int)data[1] << 16) | ((unsigned int)data[2] << 8) | data[3];
+		PutBits(writer, word >> (32 - numBits), numBits);
+	}
+}
+
+//inserts a 0x00 behind every 0xFF in [begin, end), the buffer needs room for them
+//behind end, returns the new end
+BYTE* StuffBytes(BYTE* begin, BYTE* end);
+
+//writes all complete bytes, up to 7 bits stay in the buffer
+static inline void FlushBits(EntropyWriter& writer)
+{
+	while(writer.NumBits >= 8)
+	{
+		EmitByte(writer, (BYTE)(writer.Buffer >> 56));
+		writer.Buffer <<= 8;
+		writer.NumBits -= 8;
+	}
+}
+
 class JpegEncoderBase : public JEnc
 {
 public:
@@ -26,30 +116,98 @@ public:
 	virtual ~JpegEncoderBase();
 
 	JEncResult Encode(JEncRGBDataDesc rgbDataDesc, int quality);
+#if defined(JENC_D3D)
 	JEncResult Encode(JEncD3DDataDesc d3dDataDesc, int quality);
 	JEncResult Encode(DX12_JEncD3DDataDesc d3dDataDesc, int quality);
+#endif
+	JEncResult EncodeTables(int quality);
+
+	JEncResult EstimateSize(JEncRGBDataDesc rgbDataDesc, int quality);
+#if defined(JENC_D3D)
+	JEncResult EstimateSize(JEncD3DDataDesc d3dDataDesc, int quality);
+	JEncResult EstimateSize(DX12_JEncD3DDataDesc d3dDataDesc, int quality);
+#endif
+
+	virtual bool SetOption(JENC_OPTIONS option, int value);
+	virtual bool SetOutputSink(const JEncOutputSink& sink);
+
+	virtual bool Reserve(unsigned int maxWidth, unsigned int maxHeight, JENC_CHROMA_SUBSAMPLE subsampleType);
+
+	//options and output sink of other for an encode context, nothing of the state of its last
+	//Encode is taken over
+	virtual void CopyConfiguration(const JpegEncoderBase& other);
 
 	virtual bool Init() { return true; }
 
+	//see GetJpegEncoderMaxOutputSize
+	static uint64_t GetMaxOutputSize(int width, int height, JENC_CHROMA_SUBSAMPLE subsampleType, int quality, int restartInterval);
+
+	//length limited optimal code of Annex K.2, the way the IJG library builds it
+	static void ComputeOptimalHuffmanTable(const unsigned int* symbolCounts, BYTE* outNRCodes, BYTE* outValues);
+
+	//the order of the Huffman tables in all per table arrays
+	enum { HUFFMAN_Y_DC, HUFFMAN_Y_AC, HUFFMAN_CBCR_DC, HUFFMAN_CBCR_AC, NUM_HUFFMAN_TABLES };
+
+	//DHT contents of the Annex K tables, unused values are 0
+	static void GetStandardHuffmanTables(BYTE outNRCodes[][17], BYTE outValues[][256]);
+
 protected:
 
 	virtual void WriteImageData(JEncRGBDataDesc rgbDataDesc) = 0;
+#if defined(JENC_D3D)
 	virtual void WriteImageData(JEncD3DDataDesc d3dDataDesc) = 0;
 	virtual void WriteImageData(DX12_JEncD3DDataDesc d3dDataDesc) = 0;
+#endif
 	virtual void Reset();
 
-	int				MemoryFileCapacity;
-	int				MemoryFileNumBytesWritten;
+	//buffers of images up to numMCUsX x numMCUsY MCUs, called by Reserve
+	virtual bool ReserveBuffers(int numMCUsX, int numMCUsY) { return true; }
+
+	//entropy coded bytes of the image with the tables it would get, see MeasureScan
+	virtual uint64_t MeasureImageData(JEncRGBDataDesc rgbDataDesc) = 0;
+#if defined(JENC_D3D)
+	virtual uint64_t MeasureImageData(JEncD3DDataDesc d3dDataDesc) = 0;
+	virtual uint64_t MeasureImageData(DX12_JEncD3DDataDesc d3dDataDesc) = 0;
+#endif
+	//header of the image MeasureImageData measured, the one of the current tables by default
+	virtual unsigned int GetMeasuredHeaderSize();
+
+	//header with other Huffman tables than the current ones
+	unsigned int GetHeaderSize(const BYTE nrCodes[][17], const BYTE values[][256]);
+
+	//encoder owned output buffer, the whole stream for JENC_SINK_INTERNAL and
+	//the current chunk for JENC_SINK_CALLBACK
+	size_t			MemoryFileCapacity;
 	BYTE*			MemoryFile;
-	BYTE*			MemoryFileWalker;
 
-	BYTE			NumBitsInUShort[32767];
+	//magnitude category of 0..32766, one table shared by all encoders
+	const BYTE*		NumBitsInUShort;
 
 	BitString Y_DC_Huffman_Table[12];
 	BitString Cb_DC_Huffman_Table[12];
 	BitString Y_AC_Huffman_Table[256];
 	BitString Cb_AC_Huffman_Table[256];
 
+	//DHT contents of the tables above, the number of codes of every length 1..16 (index 0
+	//unused) and the symbols in code order. The Annex K tables unless a frame was optimized.
+	BYTE mHuffmanNRCodes[NUM_HUFFMAN_TABLES][17];
+	BYTE mHuffmanValues[NUM_HUFFMAN_TABLES][256];
+	bool mStandardHuffmanTables;
+
+	//symbolCounts holds 256 counts per table in the order above, symbols that never
+	//occur get no code
+	void SetOptimalHuffmanTables(const unsigned int* symbolCounts);
+	void SetStandardHuffmanTables();
+	//tables built elsewhere, in the order above
+	void SetHuffmanTables(const BYTE nrCodes[][17], const BYTE values[][256]);
+	static bool IsStandardHuffmanTables(const BYTE nrCodes[][17], const BYTE values[][256]);
+	static void ComputeHuffmanTable(BitString* outTable, const BYTE* inTable, const BYTE* nrCodes);
+	virtual void HuffmanTablesChanged() {};
+
+	//picks the Huffman tables of the image before the header is written, two pass encoders
+	//gather their symbol statistics here
+	virtual void SelectHuffmanTables(JEncRGBDataDesc rgbDataDesc) {};
+
 	float DCT_matrix[64];
 	float DCT_matrix_transpose[64];
 
@@ -62,12 +220,52 @@ protected:
 	inline void Write(BYTE b);
 	inline void Write(char c);
 	inline void WriteHex(unsigned short data);
-	inline void WriteByteArray(BYTE* arr, size_t size);
-	void WriteBits(const BitString& bs);
+	inline void WriteByteArray(const BYTE* arr, size_t size);
+	void WriteBits(const BitString& bs) { PutBits(mBitWriter, bs.value, bs.length); }
+
+	//pad the last byte and write the End of Image marker
+	void FinalizeData();
+
+	//take over and hand back the WriteBits state
+	void BeginEntropyCoding(EntropyWriter& writer);
+	void EndEntropyCoding(EntropyWriter& writer);
+
+	//makes sure numBytes can be written at writer.Walker, which may move. Only called between
+	//MCUs with mBitWriter or a writer from BeginEntropyCoding, the hot loops never check.
+	inline void ReserveOutput(EntropyWriter& writer, size_t numBytes)
+	{
+		//deferred bytes may still double when they are stuffed
+		size_t numUnstuffed = writer.DeferStuffing ? writer.Walker - mEntropyStart : 0;
+		if((size_t)(mOutputEnd - writer.Walker) < numBytes + numUnstuffed)
+			MakeRoom(writer, numBytes);
+	}
+
+	//upper bound for numMCUs coded in one piece, bits left in the writer and stuffing included
+	size_t MaxEntropyBytes(int numMCUs) const { return 2 * ((size_t)numMCUs * mMaxEntropyBitsPerMCU / 8 + 9); }
 
+	//entropy codes numMCUs in segments of mRestartInterval MCUs on all cores and writes them
+	//separated by RSTn markers, EncodeRestartSegment is called once for every segment
+	void WriteRestartSegments(int numMCUs, int maxBytesPerMCU);
+	virtual void EncodeRestartSegment(EntropyWriter& writer, int firstMCU, int lastMCU, int threadIndex) {};
 
-	UINT mByteBuffer;
-	signed char mCurrentBytePos;
+	//entropy codes numMCUs as one scan without restart markers on all cores. The exact bit
+	//length of every segment comes from MeasureScanSegment, a prefix sum over those gives the
+	//bit offsets and every segment is coded at its offset by EncodeScanSegment, which has to
+	//continue the DC predictors from the MCU before firstMCU. Only the bytes shared by two
+	//segments are put together serially.
+	void WriteScanSegments(int numMCUs, int maxBytesPerMCU);
+	virtual uint64_t MeasureScanSegment(int firstMCU, int lastMCU) { return 0; };
+	virtual void EncodeScanSegment(EntropyWriter& writer, int firstMCU, int lastMCU) {};
+
+	//bytes WriteRestartSegments or WriteScanSegments would write for numMCUs without the byte
+	//stuffing, padding and RSTn markers included. Measured on all cores with MeasureScanSegment,
+	//or MeasureRestartSegment, which starts the DC predictors at zero, for every restart segment.
+	uint64_t MeasureScan(int numMCUs);
+	virtual uint64_t MeasureRestartSegment(int firstMCU, int lastMCU) { return 0; };
+
+
+	//bit buffer and write position in the memory file, the header is written through it as well
+	EntropyWriter mBitWriter;
 
 
 	int mImageWidth;
@@ -81,23 +279,97 @@ protected:
 
 	JENC_CHROMA_SUBSAMPLE mSubsampleType;
 
+	//MCUs per restart segment, 0 when restart markers are disabled
+	int mRestartInterval;
+
+	//JENC_OPTION_DETERMINISTIC, integer color transform, islow FDCT and integer quantization only
+	bool mDeterministic;
+
+	//JENC_OPTION_DEFERRED_STUFFING, entropy coded segments are stuffed in one pass after packing
+	bool mDeferStuffing;
+
 private:
 
+	//output sink state, the sink of the current Encode call may come from TargetMemory
+	JEncOutputSink mSink;
+	JENC_SINK_TYPE mOutputType;
+	BYTE* mFixedMemory;
+	size_t mFixedCapacity;
+	BYTE* mOutputBegin;		//first byte that is not handed to the callback or in the fixed buffer yet
+	BYTE* mOutputEnd;		//end of the room behind the walker
+	uint64_t mNumBytesFlushed;
+	bool mOutputFailed;
+
+	//worst case entropy coded bits of one MCU at the current quality
+	uint64_t mMaxEntropyBitsPerMCU;
+
+	void BeginOutput(unsigned char* targetMemory, unsigned int targetMemorySize);
+	void EndOutput(JEncResult& result);
+	unsigned int NumBytesWritten() const { return (unsigned int)(mNumBytesFlushed + (mBitWriter.Walker - mOutputBegin)); }
+
+	void MakeRoom(EntropyWriter& writer, size_t numBytes);
+	void AllocateMemoryFile(size_t capacity);
+
+	static uint64_t GetMaxEntropyBitsPerMCU(JENC_CHROMA_SUBSAMPLE subsampleType, const BYTE* YQuantizationTable, const BYTE* CbCrQuantizationTable,
+		const BitString* YDC, const BitString* YAC, const BitString* CbCrDC, const BitString* CbCrAC);
+	static unsigned int GetHeaderSize(bool restartMarkers);
+	static uint64_t GetMaxOutputSize(uint64_t numMCUs, uint64_t maxBitsPerMCU, unsigned int segmentEndBytes, int restartInterval);
+
+	void CodeRestartSegment(int segment, int numMCUs, int threadIndex);
+
+	//start of the bytes BeginEntropyCoding hands out, stuffed by EndEntropyCoding when deferred
+	BYTE* mEntropyStart;
+
+	std::vector< std::vector<BYTE> > mRestartSegments;
+	std::vector< std::vector<BYTE> > mRestartScratch;
+
+	struct ScanSegment
+	{
+		int FirstMCU;
+		int LastMCU;
+		uint64_t FirstBit;
+		uint64_t NumBits;
+
+		//complete bytes, the first one shares its high bits with the previous segment
+		//unless FirstBit is byte aligned, the remaining bits are left in Tail
+		std::vector<BYTE> Data;
+		int NumBytes;
+		BYTE Tail;
+		int NumTailBits;
+
+		//where Data[Skip..NumBytes) goes in the memory file
+		BYTE* Target;
+		int Skip;
+	};
+
+	void CodeScanSegment(ScanSegment& segment, int maxBytesPerMCU);
+
+	std::vector<ScanSegment> mScanSegments;
+
 	void CalculateComputationDimensions(int imageWidth, int imageHeight);
 	virtual void ComputationDimensionsChanged() {};
 
 	bool ValidateQuantizationTables(int quality);
 	virtual void QuantizationTablesChanged() {};
 
-	bool ValidateMemoryFile(unsigned char* targetMemory);
 	void WriteHeader();
 
-	void ComputeHuffmanTable(BitString* outTable, BYTE* inTable, BYTE* nrCodes);
+	//the header is the same for every frame of a quality, restart interval and JENC_TABLES, it
+	//is built once and only the image size in SOF0 is patched when the dimensions change
+	JENC_TABLES mTables;
+	std::vector<BYTE> mHeader;
+	size_t mHeaderDimensionsOffset;
+
+	void BuildHeader();
+	void PatchHeaderDimensions();
+
+	void UpdateHuffmanTables();
 
 	//JPG header
 	void WriteAPP0Info();
 	void WriteQuantizationInfo();
 	void WriteS0FInfo();
-	void WriteHuffmanInfo();
+	void WriteHuffmanInfo(const BYTE nrCodes[][17], const BYTE values[][256]);
+	void WriteDRIInfo();
 	void WriteS0SInfo();
 };
\ No newline at end of file
@@ -0,0 +1,1076 @@
+//--------------------------------------------------------------------------------------
+// Real-Time JPEG Compression using DirectCompute - Demo
+//
+// Copyright (c) Stefan Petersson 2012. All rights reserved.
+//--------------------------------------------------------------------------------------
+#include "JpegEncoderCPU.h"
+#include "JpegFDCT.h"
+#include "JpegQuantize.h"
+#include "JpegThreadPool.h"
+
+#include <emmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+JpegEncoderCPU::JpegEncoderCPU(JENC_CHROMA_SUBSAMPLE subsampleType)
+{
+	mSubsampleType = subsampleType;
+
+	InitState();
+
+	std::shared_ptr<JpegEncoderCPUConfig> config = std::make_shared<JpegEncoderCPUConfig>();
+	config->SubsampleType = subsampleType;
+	config->DCTMethod = JENC_DCT_ISLOW;
+	config->OptimizeHuffman = false;
+	config->AdaptiveHuffmanInterval = 0;
+	config->Divisors = BuildDivisors(config->DCTMethod);
+
+	//the base starts out with the standard tables
+	BuildHuffmanCodes(config->DC_Codes[0], config->AC_Codes[0], Y_DC_Huffman_Table, Y_AC_Huffman_Table);
+	BuildHuffmanCodes(config->DC_Codes[1], config->AC_Codes[1], Cb_DC_Huffman_Table, Cb_AC_Huffman_Table);
+
+	SetConfig(config);
+}
+
+JpegEncoderCPU::JpegEncoderCPU(const std::shared_ptr<const JpegEncoderCPUConfig>& config)
+{
+	mSubsampleType = config->SubsampleType;
+
+	InitState();
+	SetConfig(config);
+
+	mHuffmanAdapter.Reset(config->AdaptiveHuffmanInterval);
+}
+
+void JpegEncoderCPU::InitState()
+{
+	mImageWidth = 0;
+	mImageHeight = 0;
+
+	mMCUWidth = 8;
+	mMCUHeight = 8;
+	mNumMCU[0] = 0;
+	mNumMCU[1] = 0;
+	mNumBlocksPerMCU = 3;
+
+	mCountSymbols = false;
+	mAdaptedTables = false;
+
+	mY_Divisors = NULL;
+	mCbCr_Divisors = NULL;
+
+	mNumRowSlots = 0;
+	mNextPipelineRow = 0;
+	mNumEncodedRows = 0;
+	mEntropyCoderBusy = false;
+
+	mRGBDataDesc = NULL;
+}
+
+JpegEncoderCPU::~JpegEncoderCPU()
+{
+
+}
+
+bool JpegEncoderCPU::Init()
+{
+	JpegMCULayoutInfo layout;
+	if(!GetMCULayoutInfo(mSubsampleType, layout))
+		return false;
+
+	//all Y blocks of the MCU followed by one Cb and one Cr block
+	mMCUWidth = layout.Width;
+	mMCUHeight = layout.Height;
+	mNumBlocksPerMCU = layout.NumBlocks;
+
+	return true;
+}
+
+bool JpegEncoderCPU::SetOption(JENC_OPTIONS option, int value)
+{
+	if(option == JENC_OPTION_DCT_METHOD)
+	{
+		if(value < JENC_DCT_ISLOW || value > JENC_DCT_FLOAT)
+			return false;
+
+		//ifast and float are not part of the deterministic pipeline
+		if(mDeterministic && value != JENC_DCT_ISLOW)
+			return false;
+
+		SetDCTMethod((JENC_DCT_METHOD)value);
+		return true;
+	}
+
+	if(option == JENC_OPTION_DETERMINISTIC)
+	{
+		if(!JpegEncoderBase::SetOption(option, value))
+			return false;
+
+		//the rest of the CPU path is integer already, islow divisors are q * 8 and
+		//never take the float reciprocal fallback of QuantizeBlock
+		if(mDeterministic)
+			SetDCTMethod(JENC_DCT_ISLOW);
+
+		//adapted tables change at the same frame no matter how fast they are built
+		mHuffmanAdapter.SetFixedSchedule(mDeterministic);
+
+		return true;
+	}
+
+	if(option == JENC_OPTION_OPTIMIZE_HUFFMAN)
+	{
+		if(value != 0 && value != 1)
+			return false;
+
+		std::shared_ptr<JpegEncoderCPUConfig> config = CopyConfig();
+		config->OptimizeHuffman = value != 0;
+		SetConfig(config);
+		return true;
+	}
+
+	if(option == JENC_OPTION_ADAPTIVE_HUFFMAN)
+	{
+		if(value < 0 || value > 0xFFFF)
+			return false;
+
+		std::shared_ptr<JpegEncoderCPUConfig> config = CopyConfig();
+		config->AdaptiveHuffmanInterval = value;
+		SetConfig(config);
+
+		//a new stream starts from the standard tables
+		mHuffmanAdapter.Reset(value);
+		mAdaptedTables = false;
+		return true;
+	}
+
+	return JpegEncoderBase::SetOption(option, value);
+}
+
+void JpegEncoderCPU::CopyConfiguration(const JpegEncoderBase& other)
+{
+	JpegEncoderBase::CopyConfiguration(other);
+
+	mHuffmanAdapter.SetFixedSchedule(mDeterministic);
+}
+
+void JpegEncoderCPU::SetDCTMethod(JENC_DCT_METHOD method)
+{
+	if(method == mConfig->DCTMethod)
+		return;
+
+	//divisors depend on the FDCT scaling
+	std::shared_ptr<JpegEncoderCPUConfig> config = CopyConfig();
+	config->DCTMethod = method;
+	config->Divisors = BuildDivisors(method);
+	SetConfig(config);
+}
+
+void JpegEncoderCPU::SetConfig(const std::shared_ptr<const JpegEncoderCPUConfig>& config)
+{
+	mConfig = config;
+
+	//the divisors and standard codes in use belong to the config
+	if(mQualitySetting != 0)
+		QuantizationTablesChanged();
+
+	HuffmanTablesChanged();
+}
+
+std::shared_ptr<const std::vector<QuantizationDivisors> > JpegEncoderCPU::BuildDivisors(JENC_DCT_METHOD method)
+{
+	//all qualities up front, nobody writes to them once the config is shared
+	std::shared_ptr<std::vector<QuantizationDivisors> > divisors = std::make_shared<std::vector<QuantizationDivisors> >(100 * 2);
+
+	BYTE table[64];
+	for(int quality = 1; quality <= 100; quality++)
+	{
+		ComputeQuantizationTable(table, StandardLuminanceQuantizationTable, quality);
+		ComputeQuantizationDivisors(method, table, &(*divisors)[(quality - 1) * 2]);
+
+		ComputeQuantizationTable(table, StandardChromianceQuantizationTable, quality);
+		ComputeQuantizationDivisors(method, table, &(*divisors)[(quality - 1) * 2 + 1]);
+	}
+
+	return divisors;
+}
+
+void JpegEncoderCPU::ComputationDimensionsChanged()
+{
+	mNumMCU[0] = mComputationWidthY / mMCUWidth;
+	mNumMCU[1] = mComputationHeightY / mMCUHeight;
+
+	AllocateRowBuffers(JpegThreadPool::Get().GetNumThreads());
+}
+
+void JpegEncoderCPU::AllocateRowBuffers(int numThreads)
+{
+	int stripWidth = mNumMCU[0] * mMCUWidth;
+	int chromaWidth = mNumMCU[0] * 8;
+
+	mRowBuffers.resize(numThreads);
+	for(size_t i = 0; i < mRowBuffers.size(); i++)
+	{
+		mRowBuffers[i].Y.resize(stripWidth * mMCUHeight);
+		mRowBuffers[i].Cb.resize(chromaWidth * 8);
+		mRowBuffers[i].Cr.resize(chromaWidth * 8);
+	}
+}
+
+bool JpegEncoderCPU::ReserveBuffers(int numMCUsX, int numMCUsY)
+{
+	int numThreads = JpegThreadPool::Get().GetNumThreads();
+
+	//the resizes of smaller frames stay within the capacity
+	mRowBuffers.resize(numThreads);
+	for(size_t i = 0; i < mRowBuffers.size(); i++)
+	{
+		mRowBuffers[i].Y.reserve(numMCUsX * mMCUWidth * mMCUHeight);
+		mRowBuffers[i].Cb.reserve(numMCUsX * 8 * 8);
+		mRowBuffers[i].Cr.reserve(numMCUsX * 8 * 8);
+	}
+
+	//threaded encodes keep a few rows, two pass encodes the whole frame and EstimateSize
+	//allocates it on its own
+	if(numThreads > 1)
+	{
+		mRowSlots.reserve((size_t)2 * numThreads * numMCUsX * mNumBlocksPerMCU * 64);
+		mPipelineRowReady.reserve(numMCUsY);
+	}
+
+	if(mConfig->OptimizeHuffman)
+		mPipelineBlocks.reserve((size_t)numMCUsX * numMCUsY * mNumBlocksPerMCU * 64);
+
+	mSymbolCounts.reserve(numThreads * NUM_HUFFMAN_TABLES * 256);
+
+	return true;
+}
+
+void JpegEncoderCPU::QuantizationTablesChanged()
+{
+	const QuantizationDivisors* divisors = &(*mConfig->Divisors)[(mQualitySetting - 1) * 2];
+
+	mY_Divisors = divisors;
+	mCbCr_Divisors = divisors + 1;
+}
+
+void JpegEncoderCPU::HuffmanTablesChanged()
+{
+	if(mStandardHuffmanTables)
+	{
+		for(int i = 0; i < 2; i++)
+		{
+			mDC_Codes[i] = mConfig->DC_Codes[i];
+			mAC_Codes[i] = mConfig->AC_Codes[i];
+		}
+		return;
+	}
+
+	BuildHuffmanCodes(mFrameDC_Codes[0], mFrameAC_Codes[0], Y_DC_Huffman_Table, Y_AC_Huffman_Table);
+	BuildHuffmanCodes(mFrameDC_Codes[1], mFrameAC_Codes[1], Cb_DC_Huffman_Table, Cb_AC_Huffman_Table);
+
+	for(int i = 0; i < 2; i++)
+	{
+		mDC_Codes[i] = mFrameDC_Codes[i];
+		mAC_Codes[i] = mFrameAC_Codes[i];
+	}
+}
+
+void JpegEncoderCPU::SelectHuffmanTables(JEncRGBDataDesc rgbDataDesc)
+{
+	mCountSymbols = false;
+
+	int numCounts = NUM_HUFFMAN_TABLES * 256;
+
+	if(!mConfig->OptimizeHuffman && mHuffmanAdapter.GetInterval() > 0 && rgbDataDesc.Data)
+	{
+		//new tables only ever come in here, between two frames
+		if(mHuffmanAdapter.SwapTables() || !mAdaptedTables)
+		{
+			SetHuffmanTables(mHuffmanAdapter.GetNRCodes(), mHuffmanAdapter.GetValues());
+			mAdaptedTables = true;
+		}
+
+		mSymbolCounts.assign(JpegThreadPool::Get().GetNumThreads() * numCounts, 0);
+		mCountSymbols = true;
+		return;
+	}
+
+	mAdaptedTables = false;
+
+	if(!mConfig->OptimizeHuffman || !rgbDataDesc.Data)
+	{
+		SetStandardHuffmanTables();
+		return;
+	}
+
+	JpegThreadPool& pool = JpegThreadPool::Get();
+	int numThreads = pool.GetNumThreads();
+
+	//first pass, the rows are counted once all of them are there as the
+	//DC differences reach back into the row before
+	StoreRows(&rgbDataDesc);
+
+	mSymbolCounts.assign(numThreads * numCounts, 0);
+
+	pool.ParallelFor(mNumMCU[1], [this, numCounts](int row, int threadIndex) {
+		CountRowSymbols(row, &mSymbolCounts[threadIndex * numCounts]);
+	});
+
+	for(int i = 1; i < numThreads; i++)
+	{
+		for(int j = 0; j < numCounts; j++)
+			mSymbolCounts[j] += mSymbolCounts[i * numCounts + j];
+	}
+
+	SetOptimalHuffmanTables(&mSymbolCounts[0]);
+}
+
+// BT.601 weights in 1.15 fixed point, the Y weights sum to 1 and the Cb/Cr weights to 0
+#define YCC_FIX_BITS	15
+
+#define FIX_Y_R		9798
+#define FIX_Y_G		19235
+#define FIX_Y_B		3735
+#define FIX_CB_R	-5529
+#define FIX_CB_G	-10855
+#define FIX_CB_B	16384
+#define FIX_CR_R	16384
+#define FIX_CR_G	-13720
+#define FIX_CR_B	-2664
+
+// two 16 bit values in every 32 bit lane, as consumed by _mm_madd_epi16
+static inline __m128i SetPair(short lo, short hi)
+{
+	return _mm_set1_epi32((int)(((unsigned int)(unsigned short)hi << 16) | (unsigned short)lo));
+}
+
+// 8 RGBA pixels -> 8 R, G and B values in 16 bit lanes, pixels beyond the image
+// width repeat the last one like the point clamp sampler of the GPU path
+static inline void LoadPixels(const BYTE* rgba, int x, int imageWidth, __m128i& r, __m128i& g, __m128i& b)
+{
+	__m128i p0, p1;
+	if(x + 8 <= imageWidth)
+	{
+		p0 = _mm_loadu_si128((const __m128i*)(rgba + x * 4));
+		p1 = _mm_loadu_si128((const __m128i*)(rgba + x * 4 + 16));
+	}
+	else
+	{
+		alignas(16) UINT pixels[8];
+		for(int i = 0; i < 8; i++)
+			pixels[i] = ((const UINT*)rgba)[JPEG_MIN(x + i, imageWidth - 1)];
+
+		p0 = _mm_load_si128((const __m128i*)pixels);
+		p1 = _mm_load_si128((const __m128i*)(pixels + 4));
+	}
+
+	const __m128i byteMask = _mm_set1_epi32(0xFF);
+
+	r = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, RED_CHANNEL * 8), byteMask), _mm_and_si128(_mm_srli_epi32(p1, RED_CHANNEL * 8), byteMask));
+	g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, GREEN_CHANNEL * 8), byteMask), _mm_and_si128(_mm_srli_epi32(p1, GREEN_CHANNEL * 8), byteMask));
+	b = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, BLUE_CHANNEL * 8), byteMask), _mm_and_si128(_mm_srli_epi32(p1, BLUE_CHANNEL * 8), byteMask));
+}
+
+// (weightR * r + weightG * g + weightB * b + rounding) >> shift for 8 lanes, count holds the
+// number of summed pixels which scales the rounding term stored in the high half of weightB
+static inline __m128i ApplyWeights(__m128i r, __m128i g, __m128i b, __m128i count, __m128i weightRG, __m128i weightB, int shift)
+{
+	__m128i lo = _mm_add_epi32(
+		_mm_madd_epi16(_mm_unpacklo_epi16(r, g), weightRG),
+		_mm_madd_epi16(_mm_unpacklo_epi16(b, count), weightB));
+	__m128i hi = _mm_add_epi32(
+		_mm_madd_epi16(_mm_unpackhi_epi16(r, g), weightRG),
+		_mm_madd_epi16(_mm_unpackhi_epi16(b, count), weightB));
+
+	return _mm_packs_epi32(_mm_srai_epi32(lo, shift), _mm_srai_epi32(hi, shift));
+}
+
+// RGBA -> level shifted Y and subsampled Cb/Cr for MCUs [firstMCU, lastMCU) of one row in a single pass.
+// The RGB values of the 1, 2 or 4 pixels sharing a chroma sample are summed first,
+// since the transform is linear this equals averaging Cb and Cr.
+static void ConvertMCURow(const BYTE* const* srcRows, int imageWidth, int stripWidth, int chromaScaleX, int chromaScaleY,
+	int firstMCU, int lastMCU, short* outY, short* outCb, short* outCr)
+{
+	int chromaWidth = stripWidth / chromaScaleX;
+	int numSummed = chromaScaleX * chromaScaleY;
+	int chromaShift = YCC_FIX_BITS + (numSummed == 4 ? 2 : numSummed == 2 ? 1 : 0);
+
+	const __m128i one = _mm_set1_epi16(1);
+	const __m128i count = _mm_set1_epi16((short)numSummed);
+	const __m128i levelShift = _mm_set1_epi16(128);
+	const __m128i minValue = _mm_set1_epi16(-128);
+	const __m128i maxValue = _mm_set1_epi16(127);
+
+	const __m128i weightY_RG = SetPair(FIX_Y_R, FIX_Y_G);
+	const __m128i weightY_B = SetPair(FIX_Y_B, 1 << (YCC_FIX_BITS - 1));
+	const __m128i weightCb_RG = SetPair(FIX_CB_R, FIX_CB_G);
+	const __m128i weightCb_B = SetPair(FIX_CB_B, 1 << (YCC_FIX_BITS - 1));
+	const __m128i weightCr_RG = SetPair(FIX_CR_R, FIX_CR_G);
+	const __m128i weightCr_B = SetPair(FIX_CR_B, 1 << (YCC_FIX_BITS - 1));
+
+	for(int cy = 0; cy < 8; cy++)
+	{
+		for(int cx = firstMCU * 8; cx < lastMCU * 8; cx += 8)
+		{
+			//RGB sums over the rows, one register per 8 pixels
+			__m128i sumR[2] = { _mm_setzero_si128(), _mm_setzero_si128() };
+			__m128i sumG[2] = { _mm_setzero_si128(), _mm_setzero_si128() };
+			__m128i sumB[2] = { _mm_setzero_si128(), _mm_setzero_si128() };
+
+			for(int sy = 0; sy < chromaScaleY; sy++)
+			{
+				int y = cy * chromaScaleY + sy;
+
+				for(int sx = 0; sx < chromaScaleX; sx++)
+				{
+					int x = cx * chromaScaleX + sx * 8;
+
+					__m128i r, g, b;
+					LoadPixels(srcRows[y], x, imageWidth, r, g, b);
+
+					__m128i lum = ApplyWeights(r, g, b, one, weightY_RG, weightY_B, YCC_FIX_BITS);
+					_mm_storeu_si128((__m128i*)(outY + y * stripWidth + x), _mm_sub_epi16(lum, levelShift));
+
+					sumR[sx] = _mm_add_epi16(sumR[sx], r);
+					sumG[sx] = _mm_add_epi16(sumG[sx], g);
+					sumB[sx] = _mm_add_epi16(sumB[sx], b);
+				}
+			}
+
+			//add horizontal neighbours
+			if(chromaScaleX == 2)
+			{
+				sumR[0] = _mm_packs_epi32(_mm_madd_epi16(sumR[0], one), _mm_madd_epi16(sumR[1], one));
+				sumG[0] = _mm_packs_epi32(_mm_madd_epi16(sumG[0], one), _mm_madd_epi16(sumG[1], one));
+				sumB[0] = _mm_packs_epi32(_mm_madd_epi16(sumB[0], one), _mm_madd_epi16(sumB[1], one));
+			}
+
+			__m128i cb = ApplyWeights(sumR[0], sumG[0], sumB[0], count, weightCb_RG, weightCb_B, chromaShift);
+			__m128i cr = ApplyWeights(sumR[0], sumG[0], sumB[0], count, weightCr_RG, weightCr_B, chromaShift);
+
+			_mm_storeu_si128((__m128i*)(outCb + cy * chromaWidth + cx), _mm_max_epi16(minValue, _mm_min_epi16(maxValue, cb)));
+			_mm_storeu_si128((__m128i*)(outCr + cy * chromaWidth + cx), _mm_max_epi16(minValue, _mm_min_epi16(maxValue, cr)));
+		}
+	}
+}
+
+void JpegEncoderCPU::LoadMCURow(const JEncRGBDataDesc* rgbDataDesc, int row, int firstMCU, int lastMCU, MCURowBuffer* buffer)
+{
+	const BYTE* data = (const BYTE*)rgbDataDesc->Data;
+
+	const BYTE* srcRows[16];
+	for(int y = 0; y < mMCUHeight; y++)
+		srcRows[y] = data + JPEG_MIN(row * mMCUHeight + y, mImageHeight - 1) * rgbDataDesc->RowPitch;
+
+	ConvertMCURow(srcRows, mImageWidth, mNumMCU[0] * mMCUWidth, mMCUWidth / 8, mMCUHeight / 8,
+		firstMCU, lastMCU, &buffer->Y[0], &buffer->Cb[0], &buffer->Cr[0]);
+}
+
+void JpegEncoderCPU::TransformMCU(const MCURowBuffer* buffer, int mcu, short* DU)
+{
+	int stripWidth = mNumMCU[0] * mMCUWidth;
+	int chromaWidth = mNumMCU[0] * 8;
+
+	const short* stripY = &buffer->Y[mcu * mMCUWidth];
+
+	for(int by = 0; by < mMCUHeight; by += 8)
+	{
+		for(int bx = 0; bx < mMCUWidth; bx += 8)
+		{
+			TransformBlock(stripY + by * stripWidth + bx, stripWidth, mY_Divisors, DU);
+			DU += 64;
+		}
+	}
+
+	TransformBlock(&buffer->Cb[mcu * 8], chromaWidth, mCbCr_Divisors, DU);
+	TransformBlock(&buffer->Cr[mcu * 8], chromaWidth, mCbCr_Divisors, DU + 64);
+}
+
+void JpegEncoderCPU::TransformBlock(const short* src, int srcPitch, const QuantizationDivisors* divisors, short* DU)
+{
+	if(mConfig->DCTMethod == JENC_DCT_FLOAT)
+		ComputeFDCTQuantized_Float(src, srcPitch, divisors, DU);
+	else if(mConfig->DCTMethod == JENC_DCT_IFAST)
+		ComputeFDCTQuantized_IFast(src, srcPitch, divisors, DU);
+	else
+		ComputeFDCTQuantized_ISlow(src, srcPitch, divisors, DU);
+}
+
+void JpegEncoderCPU::BuildHuffmanCodes(HuffmanCode* outDC, HuffmanCode* outAC, const BitString* HTDC, const BitString* HTAC)
+{
+	//DC symbols are the number of magnitude bits
+	for(int i = 0; i < 12; i++)
+	{
+		outDC[i].Code = (unsigned int)HTDC[i].value << i;
+		outDC[i].Length = HTDC[i].length + i;
+	}
+
+	//AC symbols are run << 4 | number of magnitude bits
+	for(int i = 0; i < 256; i++)
+	{
+		int nbits = i & 0x0F;
+		outAC[i].Code = (unsigned int)HTAC[i].value << nbits;
+		outAC[i].Length = HTAC[i].length + nbits;
+	}
+}
+
+static inline int CountTrailingZeroes(uint64_t value)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward64(&index, value);
+	return (int)index;
+#else
+	return __builtin_ctzll(value);
+#endif
+}
+
+static inline uint64_t GetNonZeroACMask(const short* DU)
+{
+	const __m128i zero = _mm_setzero_si128();
+	uint64_t nonZero = 0;
+	for(int i = 0; i < 64; i += 16)
+	{
+		__m128i isZero = _mm_packs_epi16(
+			_mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)(DU + i)), zero),
+			_mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)(DU + i + 8)), zero));
+
+		nonZero |= (uint64_t)(~_mm_movemask_epi8(isZero) & 0xFFFF) << i;
+	}
+
+	return nonZero & ~1ull;
+}
+
+void JpegEncoderCPU::DoHuffmanEncoding(EntropyWriter& writer, const short* DU, short& prevDC, const HuffmanCode* DCCodes, const HuffmanCode* ACCodes)
+{
+	// append DC bits
+	int diff = DU[0] - prevDC;
+	prevDC = DU[0];
+
+	int sign = diff >> 31;
+	int nbits = NumBitsInUShort[(diff ^ sign) - sign];
+
+	PutBits(writer, DCCodes[nbits].Code | ((diff + sign) & ((1 << nbits) - 1)), DCCodes[nbits].Length);
+
+	// one bit per non-zero AC coefficient, so the loop below only visits those
+	uint64_t nonZero = GetNonZeroACMask(DU);
+
+	// append AC bits, same symbols as BuildBitStrings in the shader
+	int last = 0;
+	while(nonZero)
+	{
+		int k = CountTrailingZeroes(nonZero);
+		int zeroes = k - last - 1;
+
+		//append 16 zeroes markers
+		while(zeroes > 15)
+		{
+			PutBits(writer, ACCodes[0xF0].Code, ACCodes[0xF0].Length);
+			zeroes -= 16;
+		}
+
+		int value = DU[k];
+		sign = value >> 31;
+		nbits = NumBitsInUShort[(value ^ sign) - sign];
+
+		const HuffmanCode& code = ACCodes[(zeroes << 4) + nbits];
+		PutBits(writer, code.Code | ((value + sign) & ((1 << nbits) - 1)), code.Length);
+
+		last = k;
+		nonZero &= nonZero - 1;
+	}
+
+	//End of Block unless the last coefficient was non-zero
+	if(last != 63)
+		PutBits(writer, ACCodes[0x00].Code, ACCodes[0x00].Length);
+}
+
+//the symbols DoHuffmanEncoding codes
+void JpegEncoderCPU::CountSymbols(const short* DU, short& prevDC, unsigned int* DCCounts, unsigned int* ACCounts)
+{
+	int diff = DU[0] - prevDC;
+	prevDC = DU[0];
+
+	int sign = diff >> 31;
+	DCCounts[NumBitsInUShort[(diff ^ sign) - sign]]++;
+
+	uint64_t nonZero = GetNonZeroACMask(DU);
+
+	int last = 0;
+	while(nonZero)
+	{
+		int k = CountTrailingZeroes(nonZero);
+		int zeroes = k - last - 1;
+
+		ACCounts[0xF0] += zeroes >> 4;
+		zeroes &= 15;
+
+		int value = DU[k];
+		sign = value >> 31;
+		ACCounts[(zeroes << 4) + NumBitsInUShort[(value ^ sign) - sign]]++;
+
+		last = k;
+		nonZero &= nonZero - 1;
+	}
+
+	if(last != 63)
+		ACCounts[0x00]++;
+}
+
+//the bits DoHuffmanEncoding writes
+unsigned int JpegEncoderCPU::MeasureBlock(const short* DU, short& prevDC, const HuffmanCode* DCCodes, const HuffmanCode* ACCodes)
+{
+	int diff = DU[0] - prevDC;
+	prevDC = DU[0];
+
+	int sign = diff >> 31;
+	unsigned int numBits = DCCodes[NumBitsInUShort[(diff ^ sign) - sign]].Length;
+
+	uint64_t nonZero = GetNonZeroACMask(DU);
+
+	int last = 0;
+	while(nonZero)
+	{
+		int k = CountTrailingZeroes(nonZero);
+		int zeroes = k - last - 1;
+
+		numBits += (zeroes >> 4) * ACCodes[0xF0].Length;
+		zeroes &= 15;
+
+		int value = DU[k];
+		sign = value >> 31;
+		numBits += ACCodes[(zeroes << 4) + NumBitsInUShort[(value ^ sign) - sign]].Length;
+
+		last = k;
+		nonZero &= nonZero - 1;
+	}
+
+	if(last != 63)
+		numBits += ACCodes[0x00].Length;
+
+	return numBits;
+}
+
+uint64_t JpegEncoderCPU::MeasureMCUs(int firstMCU, int lastMCU, short* prevDC)
+{
+	int numBlocksY = mNumBlocksPerMCU - 2;
+	const short* DU = &mPipelineBlocks[firstMCU * mNumBlocksPerMCU * 64];
+
+	uint64_t numBits = 0;
+	for(int mcu = firstMCU; mcu < lastMCU; mcu++)
+	{
+		for(int i = 0; i < numBlocksY; i++)
+			numBits += MeasureBlock(DU + i * 64, prevDC[0], mDC_Codes[0], mAC_Codes[0]);
+
+		numBits += MeasureBlock(DU + numBlocksY * 64, prevDC[1], mDC_Codes[1], mAC_Codes[1]);
+		numBits += MeasureBlock(DU + (numBlocksY + 1) * 64, prevDC[2], mDC_Codes[1], mAC_Codes[1]);
+
+		DU += mNumBlocksPerMCU * 64;
+	}
+
+	return numBits;
+}
+
+uint64_t JpegEncoderCPU::MeasureScanSegment(int firstMCU, int lastMCU)
+{
+	//the predictors continue from the MCU before
+	short prevDC[3] = { 0, 0, 0 };
+	if(firstMCU > 0)
+	{
+		int numBlocksY = mNumBlocksPerMCU - 2;
+		const short* prev = &mPipelineBlocks[(firstMCU - 1) * mNumBlocksPerMCU * 64];
+
+		prevDC[0] = prev[(numBlocksY - 1) * 64];
+		prevDC[1] = prev[numBlocksY * 64];
+		prevDC[2] = prev[(numBlocksY + 1) * 64];
+	}
+
+	return MeasureMCUs(firstMCU, lastMCU, prevDC);
+}
+
+uint64_t JpegEncoderCPU::MeasureRestartSegment(int firstMCU, int lastMCU)
+{
+	short prevDC[3] = { 0, 0, 0 };
+
+	return MeasureMCUs(firstMCU, lastMCU, prevDC);
+}
+
+void JpegEncoderCPU::CountRowSymbols(int row, unsigned int* symbolCounts)
+{
+	int numBlocksY = mNumBlocksPerMCU - 2;
+	int blocksPerMCU = mNumBlocksPerMCU * 64;
+
+	const short* DU = &mPipelineBlocks[row * mNumMCU[0] * blocksPerMCU];
+	short prevDC[3] = { 0, 0, 0 };
+
+	for(int i = 0; i < mNumMCU[0]; i++)
+	{
+		//predictors start over in every restart segment and continue from the row before otherwise
+		int mcu = row * mNumMCU[0] + i;
+		if(mRestartInterval > 0 && mcu % mRestartInterval == 0)
+		{
+			prevDC[0] = prevDC[1] = prevDC[2] = 0;
+		}
+		else if(i == 0 && mcu > 0)
+		{
+			const short* prev = DU - blocksPerMCU;
+			prevDC[0] = prev[(numBlocksY - 1) * 64];
+			prevDC[1] = prev[numBlocksY * 64];
+			prevDC[2] = prev[(numBlocksY + 1) * 64];
+		}
+
+		CountMCU(DU, prevDC, symbolCounts);
+		DU += blocksPerMCU;
+	}
+}
+
+void JpegEncoderCPU::CountMCU(const short* DU, short* prevDC, unsigned int* symbolCounts)
+{
+	int numBlocksY = mNumBlocksPerMCU - 2;
+
+	unsigned int* YDC = symbolCounts + HUFFMAN_Y_DC * 256;
+	unsigned int* YAC = symbolCounts + HUFFMAN_Y_AC * 256;
+	unsigned int* CbCrDC = symbolCounts + HUFFMAN_CBCR_DC * 256;
+	unsigned int* CbCrAC = symbolCounts + HUFFMAN_CBCR_AC * 256;
+
+	for(int i = 0; i < numBlocksY; i++)
+		CountSymbols(DU + i * 64, prevDC[0], YDC, YAC);
+
+	CountSymbols(DU + numBlocksY * 64, prevDC[1], CbCrDC, CbCrAC);
+	CountSymbols(DU + (numBlocksY + 1) * 64, prevDC[2], CbCrDC, CbCrAC);
+}
+
+//JENC_OPTION_ADAPTIVE_HUFFMAN statistics come from every SymbolSampleRowStep-th MCU row,
+//with the DC predictors starting at zero in each of them
+static const int SymbolSampleRowStep = 4;
+
+bool JpegEncoderCPU::IsSampledRow(int row) const
+{
+	return mCountSymbols && row % SymbolSampleRowStep == 0;
+}
+
+void JpegEncoderCPU::EncodeMCU(EntropyWriter& writer, const short* DU, short* prevDC)
+{
+	int numBlocksY = mNumBlocksPerMCU - 2;
+
+	for(int i = 0; i < numBlocksY; i++)
+	{
+		DoHuffmanEncoding(writer, DU, prevDC[0], mDC_Codes[0], mAC_Codes[0]);
+		DU += 64;
+	}
+
+	DoHuffmanEncoding(writer, DU, prevDC[1], mDC_Codes[1], mAC_Codes[1]);
+	DoHuffmanEncoding(writer, DU + 64, prevDC[2], mDC_Codes[1], mAC_Codes[1]);
+}
+
+void JpegEncoderCPU::EncodeRestartSegment(EntropyWriter& writer, int firstMCU, int lastMCU, int threadIndex)
+{
+	alignas(16) short DU[6 * 64];
+	short prevDC[3] = { 0, 0, 0 };
+
+	//transformed by SelectHuffmanTables already
+	if(mConfig->OptimizeHuffman)
+	{
+		const short* stored = &mPipelineBlocks[firstMCU * mNumBlocksPerMCU * 64];
+		for(int mcu = firstMCU; mcu < lastMCU; mcu++)
+		{
+			EncodeMCU(writer, stored, prevDC);
+			stored += mNumBlocksPerMCU * 64;
+		}
+
+		return;
+	}
+
+	MCURowBuffer* buffer = &mRowBuffers[threadIndex];
+
+	//convert only the part of each MCU row covered by the segment
+	int mcu = firstMCU;
+	while(mcu < lastMCU)
+	{
+		int row = mcu / mNumMCU[0];
+		int first = mcu % mNumMCU[0];
+		int last = JPEG_MIN(mNumMCU[0], first + lastMCU - mcu);
+
+		LoadMCURow(mRGBDataDesc, row, first, last, buffer);
+
+		bool sampled = IsSampledRow(row);
+		short samplePrevDC[3] = { 0, 0, 0 };
+
+		for(int i = first; i < last; i++)
+		{
+			TransformMCU(buffer, i, DU);
+			EncodeMCU(writer, DU, prevDC);
+
+			if(sampled)
+				CountMCU(DU, samplePrevDC, &mSymbolCounts[threadIndex * NUM_HUFFMAN_TABLES * 256]);
+		}
+
+		mcu += last - first;
+	}
+}
+
+void JpegEncoderCPU::StoreRows(const JEncRGBDataDesc* rgbDataDesc)
+{
+	JpegThreadPool& pool = JpegThreadPool::Get();
+
+	int numThreads = pool.GetNumThreads();
+	if((int)mRowBuffers.size() != numThreads)
+		AllocateRowBuffers(numThreads);
+
+	int rowSize = mNumMCU[0] * mNumBlocksPerMCU * 64;
+	mPipelineBlocks.resize(mNumMCU[1] * rowSize);
+
+	mRGBDataDesc = rgbDataDesc;
+
+	pool.ParallelFor(mNumMCU[1], [this, rowSize](int row, int threadIndex) {
+		StoreRow(row, threadIndex, &mPipelineBlocks[(size_t)row * rowSize]);
+	});
+
+	mRGBDataDesc = NULL;
+}
+
+void JpegEncoderCPU::StoreRow(int row, int threadIndex, short* DU)
+{
+	MCURowBuffer* buffer = &mRowBuffers[threadIndex];
+
+	LoadMCURow(mRGBDataDesc, row, 0, mNumMCU[0], buffer);
+
+	for(int mcu = 0; mcu < mNumMCU[0]; mcu++)
+		TransformMCU(buffer, mcu, DU + mcu * mNumBlocksPerMCU * 64);
+}
+
+void JpegEncoderCPU::TransformRow(int row, int threadIndex)
+{
+	//the row the coder is waiting for always has a free slot, the tasks take rows in order
+	//so it is being transformed by a task that does not wait
+	{
+		std::unique_lock<std::mutex> lock(mPipelineMutex);
+		mRowSlotFree.wait(lock, [this, row]() { return row < mNumEncodedRows + mNumRowSlots; });
+	}
+
+	short* DU = GetRowSlot(row);
+	StoreRow(row, threadIndex, DU);
+
+	if(IsSampledRow(row))
+	{
+		short prevDC[3] = { 0, 0, 0 };
+
+		for(int mcu = 0; mcu < mNumMCU[0]; mcu++)
+			CountMCU(DU + mcu * mNumBlocksPerMCU * 64, prevDC, &mSymbolCounts[threadIndex * NUM_HUFFMAN_TABLES * 256]);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mPipelineMutex);
+		mPipelineRowReady[row] = 1;
+	}
+
+	EncodeReadyRows();
+}
+
+void JpegEncoderCPU::EncodeReadyRows()
+{
+	//only one thread codes at a time, rows finished meanwhile are picked up
+	//before it lets go so a finished row never waits for its coder
+	std::unique_lock<std::mutex> lock(mPipelineMutex);
+	if(mEntropyCoderBusy)
+		return;
+
+	mEntropyCoderBusy = true;
+
+	while(mNumEncodedRows < mNumMCU[1] && mPipelineRowReady[mNumEncodedRows])
+	{
+		const short* DU = GetRowSlot(mNumEncodedRows);
+		lock.unlock();
+
+		ReserveOutput(mPipelineWriter, MaxEntropyBytes(mNumMCU[0]));
+
+		for(int mcu = 0; mcu < mNumMCU[0]; mcu++)
+		{
+			EncodeMCU(mPipelineWriter, DU, mPipelinePrevDC);
+			DU += mNumBlocksPerMCU * 64;
+		}
+
+		lock.lock();
+		mNumEncodedRows++;
+		mRowSlotFree.notify_all();
+	}
+
+	mEntropyCoderBusy = false;
+}
+
+uint64_t JpegEncoderCPU::MeasureImageData(JEncRGBDataDesc rgbDataDesc)
+{
+	if(!rgbDataDesc.Data)
+		return 0;
+
+	//the tables the frame would get, optimized ones are built from the stored blocks. Adapted
+	//ones are peeked at and measured with codes of their own, the encoder keeps its tables and
+	//header, the adapter swaps them in for the next Encode as usual and gets no statistics from
+	//a measurement.
+	if(!mConfig->OptimizeHuffman && mHuffmanAdapter.GetInterval() > 0)
+	{
+		const BYTE (*nrCodes)[17];
+		const BYTE (*values)[256];
+		mHuffmanAdapter.PeekTables(nrCodes, values);
+
+		HuffmanCode DCCodes[2][12];
+		HuffmanCode ACCodes[2][256];
+		for(int i = 0; i < 2; i++)
+		{
+			BitString HTDC[12], HTAC[256];
+			memset(HTDC, 0, sizeof(HTDC));
+			memset(HTAC, 0, sizeof(HTAC));
+			ComputeHuffmanTable(HTDC, values[2 * i], nrCodes[2 * i]);
+			ComputeHuffmanTable(HTAC, values[2 * i + 1], nrCodes[2 * i + 1]);
+
+			BuildHuffmanCodes(DCCodes[i], ACCodes[i], HTDC, HTAC);
+		}
+
+		const HuffmanCode* codes[4] = { mDC_Codes[0], mDC_Codes[1], mAC_Codes[0], mAC_Codes[1] };
+		for(int i = 0; i < 2; i++)
+		{
+			mDC_Codes[i] = DCCodes[i];
+			mAC_Codes[i] = ACCodes[i];
+		}
+
+		StoreRows(&rgbDataDesc);
+		uint64_t numBytes = MeasureScan(mNumMCU[0] * mNumMCU[1]);
+
+		for(int i = 0; i < 2; i++)
+		{
+			mDC_Codes[i] = codes[i];
+			mAC_Codes[i] = codes[2 + i];
+		}
+
+		return numBytes;
+	}
+
+	SelectHuffmanTables(rgbDataDesc);
+
+	if(!mConfig->OptimizeHuffman)
+		StoreRows(&rgbDataDesc);
+
+	return MeasureScan(mNumMCU[0] * mNumMCU[1]);
+}
+
+unsigned int JpegEncoderCPU::GetMeasuredHeaderSize()
+{
+	if(mConfig->OptimizeHuffman || mHuffmanAdapter.GetInterval() == 0)
+		return JpegEncoderBase::GetMeasuredHeaderSize();
+
+	const BYTE (*nrCodes)[17];
+	const BYTE (*values)[256];
+	mHuffmanAdapter.PeekTables(nrCodes, values);
+
+	return GetHeaderSize(nrCodes, values);
+}
+
+void JpegEncoderCPU::WriteImageData(JEncRGBDataDesc rgbDataDesc)
+{
+	if(!rgbDataDesc.Data)
+		return;
+
+	JpegThreadPool& pool = JpegThreadPool::Get();
+
+	int numThreads = pool.GetNumThreads();
+	if((int)mRowBuffers.size() != numThreads)
+		AllocateRowBuffers(numThreads);
+
+	mRGBDataDesc = &rgbDataDesc;
+
+	if(mRestartInterval > 0)
+	{
+		//independent segments, each one fully encoded by a single thread
+		WriteRestartSegments(mNumMCU[0] * mNumMCU[1], mNumBlocksPerMCU * JPEG_MAX_ENTROPY_BYTES_PER_BLOCK);
+	}
+	else if(mConfig->OptimizeHuffman)
+	{
+		//second pass over the blocks SelectHuffmanTables stored
+		const short* DU = &mPipelineBlocks[0];
+		short prevDC[3] = { 0, 0, 0 };
+
+		EntropyWriter writer;
+		BeginEntropyCoding(writer);
+
+		for(int row = 0; row < mNumMCU[1]; row++)
+		{
+			ReserveOutput(writer, MaxEntropyBytes(mNumMCU[0]));
+
+			for(int mcu = 0; mcu < mNumMCU[0]; mcu++)
+			{
+				EncodeMCU(writer, DU, prevDC);
+				DU += mNumBlocksPerMCU * 64;
+			}
+		}
+
+		EndEntropyCoding(writer);
+	}
+	else if(numThreads == 1 || mNumMCU[1] == 1)
+	{
+		//one MCU at a time from color conversion to Huffman code
+		alignas(16) short DU[6 * 64];
+		short prevDC[3] = { 0, 0, 0 };
+		MCURowBuffer* buffer = &mRowBuffers[0];
+
+		EntropyWriter writer;
+		BeginEntropyCoding(writer);
+
+		for(int row = 0; row < mNumMCU[1]; row++)
+		{
+			ReserveOutput(writer, MaxEntropyBytes(mNumMCU[0]));
+			LoadMCURow(&rgbDataDesc, row, 0, mNumMCU[0], buffer);
+
+			bool sampled = IsSampledRow(row);
+			short samplePrevDC[3] = { 0, 0, 0 };
+
+			for(int mcu = 0; mcu < mNumMCU[0]; mcu++)
+			{
+				TransformMCU(buffer, mcu, DU);
+				EncodeMCU(writer, DU, prevDC);
+
+				if(sampled)
+					CountMCU(DU, samplePrevDC, &mSymbolCounts[0]);
+			}
+		}
+
+		EndEntropyCoding(writer);
+	}
+	else
+	{
+		mNumRowSlots = mNumMCU[1] < 2 * numThreads ? mNumMCU[1] : 2 * numThreads;
+		mRowSlots.resize((size_t)mNumRowSlots * mNumMCU[0] * mNumBlocksPerMCU * 64);
+		mPipelineRowReady.assign(mNumMCU[1], 0);
+		mNextPipelineRow = 0;
+		mNumEncodedRows = 0;
+		mEntropyCoderBusy = false;
+		mPipelinePrevDC[0] = mPipelinePrevDC[1] = mPipelinePrevDC[2] = 0;
+
+		BeginEntropyCoding(mPipelineWriter);
+
+		//one task per thread, each one takes the next row until all are taken
+		pool.ParallelFor(numThreads, [this](int task, int threadIndex) {
+			for(int row = mNextPipelineRow++; row < mNumMCU[1]; row = mNextPipelineRow++)
+				TransformRow(row, threadIndex);
+		});
+
+		EndEntropyCoding(mPipelineWriter);
+	}
+
+	mRGBDataDesc = NULL;
+
+	if(mCountSymbols)
+	{
+		int numCounts = NUM_HUFFMAN_TABLES * 256;
+		for(int i = 1; i < numThreads; i++)
+		{
+			for(int j = 0; j < numCounts; j++)
+				mSymbolCounts[j] += mSymbolCounts[i * numCounts + j];
+		}
+
+		mHuffmanAdapter.AddFrame(&mSymbolCounts[0]);
+		mCountSymbols = false;
+	}
+
+	FinalizeData();
+}
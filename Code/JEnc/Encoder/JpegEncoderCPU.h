@@ -0,0 +1,207 @@
+//--------------------------------------------------------------------------------------
+// Real-Time JPEG Compression using DirectCompute - Demo
+//
+// Copyright (c) Stefan Petersson 2012. All rights reserved.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include "JpegEncoderBase.h"
+#include "JpegQuantize.h"
+#include "JpegHuffmanAdapter.h"
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+
+//Huffman code shifted left by the number of magnitude bits of its symbol,
+//OR-ing in the magnitude gives the complete bit string for a coefficient
+struct HuffmanCode
+{
+	unsigned int Code;
+	unsigned int Length;
+};
+
+//options and read-only tables of a configured CPU encoder. A config never changes once it is
+//built, SetOption puts a new one in place, so an encoder and all of its contexts encode with
+//it at the same time without locking.
+struct JpegEncoderCPUConfig
+{
+	JENC_CHROMA_SUBSAMPLE SubsampleType;
+	JENC_DCT_METHOD DCTMethod;
+
+	//JENC_OPTION_OPTIMIZE_HUFFMAN and JENC_OPTION_ADAPTIVE_HUFFMAN
+	bool OptimizeHuffman;
+	int AdaptiveHuffmanInterval;
+
+	//Y and CbCr divisors of every quality for DCTMethod, quality q at (q - 1) * 2
+	std::shared_ptr<const std::vector<QuantizationDivisors> > Divisors;
+
+	//codes of the standard Huffman tables, luminance [0] and chrominance [1]
+	HuffmanCode DC_Codes[2][12];
+	HuffmanCode AC_Codes[2][256];
+};
+
+//level shifted Y of one row of MCUs and its subsampled chroma
+struct MCURowBuffer
+{
+	std::vector<short> Y;
+	std::vector<short> Cb;
+	std::vector<short> Cr;
+};
+
+/*
+	Host only encoder, used when no D3D device is available.
+	Works on one row of MCUs at a time so the intermediate data stays in
+	cache. Single threaded every MCU goes through color transform, FDCT,
+	quantization and Huffman coding in one go. With more cores, one
+	JpegThreadPool task per thread takes MCU rows in order and transforms
+	them into a ring of two row slots per thread, whichever task completes
+	the next row in order entropy codes all rows that are ready by then and
+	frees their slots. A task waits while the slot of its row is still taken.
+
+	The FDCT is selected with JENC_OPTION_DCT_METHOD, see JpegFDCT.h.
+
+	With JENC_OPTION_OPTIMIZE_HUFFMAN the whole frame is transformed first,
+	the symbols are counted on all cores and the frame is coded from the
+	stored blocks with tables built for it.
+
+	With JENC_OPTION_ADAPTIVE_HUFFMAN every frame is coded in one pass with
+	the tables of a JpegHuffmanAdapter, the symbols of every fourth MCU row
+	are counted on the way and handed to it once the frame is done.
+
+	EstimateSize stores the transformed frame like the optimizing first pass
+	and adds up the code lengths of the blocks without packing any bits. The
+	color conversion and FDCT are most of the work of an Encode, so it takes
+	nearly as long as one, it saves the output buffer and not the time.
+
+	The options, divisors and standard Huffman codes are a shared
+	JpegEncoderCPUConfig, an encode context made for another thread by
+	CreateJpegEncoderContext uses the same one and only has the buffers
+	and per frame state of its own.
+*/
+class JpegEncoderCPU : public JpegEncoderBase
+{
+public:
+	JpegEncoderCPU(JENC_CHROMA_SUBSAMPLE subsampleType);
+	//encode context with the config of a configured encoder
+	JpegEncoderCPU(const std::shared_ptr<const JpegEncoderCPUConfig>& config);
+	virtual ~JpegEncoderCPU();
+
+	virtual bool Init();
+
+	virtual bool SetOption(JENC_OPTIONS option, int value);
+	virtual void CopyConfiguration(const JpegEncoderBase& other);
+
+	const std::shared_ptr<const JpegEncoderCPUConfig>& GetConfig() const { return mConfig; }
+
+protected:
+	virtual void WriteImageData(JEncRGBDataDesc rgbDataDesc);
+#if defined(JENC_D3D)
+	virtual void WriteImageData(JEncD3DDataDesc d3dDataDesc) {}; // no D3D input on the CPU path
+	virtual void WriteImageData(DX12_JEncD3DDataDesc d3dDataDesc) {}; // no D3D input on the CPU path
+#endif
+
+	virtual uint64_t MeasureImageData(JEncRGBDataDesc rgbDataDesc);
+#if defined(JENC_D3D)
+	virtual uint64_t MeasureImageData(JEncD3DDataDesc d3dDataDesc) { return 0; }; // no D3D input on the CPU path
+	virtual uint64_t MeasureImageData(DX12_JEncD3DDataDesc d3dDataDesc) { return 0; }; // no D3D input on the CPU path
+#endif
+	virtual unsigned int GetMeasuredHeaderSize();
+
+private:
+	virtual void ComputationDimensionsChanged();
+	void AllocateRowBuffers(int numThreads);
+	virtual bool ReserveBuffers(int numMCUsX, int numMCUsY);
+	virtual void QuantizationTablesChanged();
+	virtual void HuffmanTablesChanged();
+	virtual void SelectHuffmanTables(JEncRGBDataDesc rgbDataDesc);
+	void SetDCTMethod(JENC_DCT_METHOD method);
+
+	void InitState();
+	//SetOption changes a copy, contexts keep using the config they have
+	std::shared_ptr<JpegEncoderCPUConfig> CopyConfig() const { return std::make_shared<JpegEncoderCPUConfig>(*mConfig); }
+	void SetConfig(const std::shared_ptr<const JpegEncoderCPUConfig>& config);
+	static std::shared_ptr<const std::vector<QuantizationDivisors> > BuildDivisors(JENC_DCT_METHOD method);
+
+	void LoadMCURow(const JEncRGBDataDesc* rgbDataDesc, int row, int firstMCU, int lastMCU, MCURowBuffer* buffer);
+	void TransformMCU(const MCURowBuffer* buffer, int mcu, short* DU);
+	void StoreRows(const JEncRGBDataDesc* rgbDataDesc);
+	void StoreRow(int row, int threadIndex, short* DU);
+	void TransformRow(int row, int threadIndex);
+	void EncodeReadyRows();
+	void TransformBlock(const short* src, int srcPitch, const QuantizationDivisors* divisors, short* DU);
+
+	static void BuildHuffmanCodes(HuffmanCode* outDC, HuffmanCode* outAC, const BitString* HTDC, const BitString* HTAC);
+
+	virtual void EncodeRestartSegment(EntropyWriter& writer, int firstMCU, int lastMCU, int threadIndex);
+
+	void EncodeMCU(EntropyWriter& writer, const short* DU, short* prevDC);
+	void DoHuffmanEncoding(EntropyWriter& writer, const short* DU, short& prevDC, const HuffmanCode* DCCodes, const HuffmanCode* ACCodes);
+
+	//code lengths of the blocks in mPipelineBlocks, nothing is packed
+	virtual uint64_t MeasureScanSegment(int firstMCU, int lastMCU);
+	virtual uint64_t MeasureRestartSegment(int firstMCU, int lastMCU);
+	uint64_t MeasureMCUs(int firstMCU, int lastMCU, short* prevDC);
+	unsigned int MeasureBlock(const short* DU, short& prevDC, const HuffmanCode* DCCodes, const HuffmanCode* ACCodes);
+
+	void CountRowSymbols(int row, unsigned int* symbolCounts);
+	void CountMCU(const short* DU, short* prevDC, unsigned int* symbolCounts);
+	void CountSymbols(const short* DU, short& prevDC, unsigned int* DCCounts, unsigned int* ACCounts);
+
+	std::shared_ptr<const JpegEncoderCPUConfig> mConfig;
+
+	//JENC_OPTION_OPTIMIZE_HUFFMAN, the frame is coded from mPipelineBlocks with symbol counts
+	//of every thread in mSymbolCounts, NUM_HUFFMAN_TABLES * 256 each
+	std::vector<unsigned int> mSymbolCounts;
+
+	//JENC_OPTION_ADAPTIVE_HUFFMAN, mCountSymbols while a frame is sampled into mSymbolCounts,
+	//mAdaptedTables while the tables in use are the adapter's
+	JpegHuffmanAdapter mHuffmanAdapter;
+	bool mCountSymbols;
+	bool mAdaptedTables;
+	bool IsSampledRow(int row) const;
+
+	//MCU geometry, 8x8 (4:4:4), 16x8 (4:2:2) or 16x16 (4:2:0) pixels
+	int mMCUWidth;
+	int mMCUHeight;
+	int mNumMCU[2];
+	int mNumBlocksPerMCU;
+
+	//DC and AC codes for luminance [0] and chrominance [1], the config's for the standard
+	//tables, otherwise the frame codes built from the optimized or adapted tables
+	const HuffmanCode* mDC_Codes[2];
+	const HuffmanCode* mAC_Codes[2];
+	HuffmanCode mFrameDC_Codes[2][12];
+	HuffmanCode mFrameAC_Codes[2][256];
+
+	//one row buffer per thread
+	std::vector<MCURowBuffer> mRowBuffers;
+
+	//source of the frame being encoded, for the pool tasks
+	const JEncRGBDataDesc* mRGBDataDesc;
+
+	//quantized MCU rows of the whole frame for the two pass encode and EstimateSize,
+	//coefficients in zigzag order, one 64 entry block after the other in MCU order
+	std::vector<short> mPipelineBlocks;
+
+	//ring of MCU rows between the transform tasks and the entropy coder, row r goes to slot
+	//r % mNumRowSlots once row r - mNumRowSlots is coded
+	std::vector<short> mRowSlots;
+	int mNumRowSlots;
+	std::atomic<int> mNextPipelineRow;
+	std::vector<char> mPipelineRowReady;
+	int mNumEncodedRows;
+	bool mEntropyCoderBusy;
+	EntropyWriter mPipelineWriter;
+	short mPipelinePrevDC[3];
+	std::mutex mPipelineMutex;
+	std::condition_variable mRowSlotFree;
+
+	short* GetRowSlot(int row) { return &mRowSlots[(size_t)(row % mNumRowSlots) * mNumMCU[0] * mNumBlocksPerMCU * 64]; }
+
+	//divisors of the current quality in mConfig
+	const QuantizationDivisors* mY_Divisors;
+	const QuantizationDivisors* mCbCr_Divisors;
+};
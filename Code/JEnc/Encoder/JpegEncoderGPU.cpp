@@ -6,6 +6,7 @@
 #include "JpegEncoderGPU.h"
 
 #include <tchar.h>
+#include <stdio.h>
 
 
 JpegEncoderGPU::JpegEncoderGPU(ID3D11Device* d3dDevice,	ID3D11DeviceContext* d3dContext)
@@ -33,6 +34,12 @@ JpegEncoderGPU::JpegEncoderGPU(ID3D11Device* d3dDevice,	ID3D11DeviceContext* d3d
 	mImageWidth = 0;
 	mImageHeight = 0;
 	mEntropyBlockSize = 0;
+	mNumOverflowSlots = 0;
+	mResetEntropySlots = true;
+	mEntropyCapacity = 0;
+
+	mMappedEntropyData = NULL;
+	mMeasureOnly = false;
 
 	mDoCreateBuffers = true;
 
@@ -40,6 +47,8 @@ JpegEncoderGPU::JpegEncoderGPU(ID3D11Device* d3dDevice,	ID3D11DeviceContext* d3d
 	mShader_Y_Component = NULL;
 	mShader_Cb_Component = NULL;
 	mShader_Cr_Component = NULL;
+	mShader_ScanBlocks = NULL;
+	mShader_CompactBlocks = NULL;
 }
 
 JpegEncoderGPU::~JpegEncoderGPU()
@@ -55,6 +64,58 @@ void JpegEncoderGPU::ReleaseShaders()
 	SAFE_DELETE(mShader_Y_Component);
 	SAFE_DELETE(mShader_Cb_Component);
 	SAFE_DELETE(mShader_Cr_Component);
+	SAFE_DELETE(mShader_ScanBlocks);
+	SAFE_DELETE(mShader_CompactBlocks);
+}
+
+bool JpegEncoderGPU::SetOption(JENC_OPTIONS option, int value)
+{
+	if(option == JENC_OPTION_DETERMINISTIC)
+	{
+		bool wasDeterministic = mDeterministic;
+		if(!JpegEncoderBase::SetOption(option, value))
+			return false;
+
+		if(mDeterministic == wasDeterministic)
+			return true;
+
+		//the integer path is compiled into the shaders, rebuild them for the layout
+		SAFE_DELETE(mShader_Y_Component);
+		SAFE_DELETE(mShader_Cb_Component);
+		SAFE_DELETE(mShader_Cr_Component);
+		SAFE_DELETE(mShader_ScanBlocks);
+		SAFE_DELETE(mShader_CompactBlocks);
+
+		if(!Init())
+			return false;
+
+		if(mQualitySetting != 0)
+			QuantizationTablesChanged();
+
+		return true;
+	}
+
+	return JpegEncoderBase::SetOption(option, value);
+}
+
+ComputeShader* JpegEncoderGPU::CreateComponentShader(const JpegMCULayoutInfo& layout, const char* component, const char* componentDefine, const char* entryPoint)
+{
+	char blobName[32];
+	sprintf_s(blobName, sizeof(blobName), "%s_%s", layout.Name, component);
+
+	char samplingH[2] = { (char)('0' + layout.SamplingH), 0 };
+	char samplingV[2] = { (char)('0' + layout.SamplingV), 0 };
+
+	D3D10_SHADER_MACRO shaderDefines[] = {
+		{ layout.ShaderDefine, "1" },
+		{ componentDefine, "1" },
+		{ "MCU_H", samplingH },
+		{ "MCU_V", samplingV },
+		{ "DETERMINISTIC", mDeterministic ? "1" : "0" },
+		{ NULL, NULL}
+	};
+
+	return mComputeSys->CreateComputeShader(mComputeShaderFile, blobName, entryPoint, shaderDefines);
 }
 
 void JpegEncoderGPU::ReleaseBuffers()
@@ -80,15 +141,20 @@ void JpegEncoderGPU::ReleaseQuantizationBuffers()
 	SAFE_DELETE(mCB_CbCr_Quantization_Table);
 }
 
-void JpegEncoderGPU::DoHuffmanEncoding(int* DU, short& prevDC, BitString* HTDC)
+void JpegEncoderGPU::DoHuffmanEncoding(int block, short& prevDC, BitString* HTDC)
 {
-	static const unsigned short mask[] = {1,2,4,8,16,32,64,128,256,512,1024,2048,4096,8192,16384,32768};
-	static BitString bs;
-    short tmp1, tmp2;
+	DoHuffmanEncoding(mBitWriter, block, prevDC, HTDC);
+}
 
-    // appeend DC bits
-	tmp1 = tmp2 = (short)(DU[0] - prevDC);
-    prevDC = DU[0];
+// DC difference and the AC bits generated by the GPU, safe to call from several threads with their own writers
+void JpegEncoderGPU::DoHuffmanEncoding(EntropyWriter& writer, int block, short& prevDC, const BitString* HTDC)
+{
+	int header = mMappedEntropyData[block];
+	short DC = JpegEntropySlotSizer::GetDC(header);
+	short tmp1, tmp2;
+
+	tmp1 = tmp2 = (short)(DC - prevDC);
+	prevDC = DC;
 
 	if(tmp1 < 0)
 	{
@@ -96,39 +162,34 @@ void JpegEncoderGPU::DoHuffmanEncoding(int* DU, short& prevDC, BitString* HTDC)
 		tmp2--;
 	}
 
-	//count numberof bits
 	int nbits = NumBitsInUShort[tmp1];
 
-	WriteBits(HTDC[nbits]);
+	PutBits(writer, HTDC[nbits].value, HTDC[nbits].length);
 
 	if(nbits)
-    {
-		bs.value = tmp2 & (mask[nbits] - 1); 
-		bs.length = nbits;
-		WriteBits(bs);
-    }
+		PutBits(writer, tmp2 & ((1 << nbits) - 1), nbits);
 
+	//the AC bits generated by the GPU, the shader stores them big endian
+	const int* AC = mMappedEntropyData + mEntropySlots.GetNumBlocks() + 1 + mBlockOffsets[block];
+	PutBitStream(writer, (const BYTE*)AC, JpegEntropySlotSizer::GetNumBits(header));
+}
 
-	// append ac bits generated by the GPU
-	BYTE* ac_entropy_data = (BYTE*)&DU[1];
-	int num_ac_bits = DU[mEntropyBlockSize-1];
-	
-	bs.length = 8;
-	int num_bytes = num_ac_bits / 8;
-	while(num_bytes-- > 0)
-	{
-		bs.value = *ac_entropy_data++;
-		WriteBits(bs);
-	}
+void JpegEncoderGPU::EncodeRestartSegments(int* entropyData, int numMCUs, int numBlocksPerMCU)
+{
+	mMappedEntropyData = entropyData;
 
-	//append last bits
-	num_ac_bits = num_ac_bits % 8;
-	if(num_ac_bits > 0)
-	{
-		bs.value = *ac_entropy_data++ >> (8 - num_ac_bits);
-		bs.length = num_ac_bits;
-		WriteBits(bs);
-	}
+	WriteRestartSegments(numMCUs, numBlocksPerMCU * JPEG_MAX_ENTROPY_BYTES_PER_BLOCK);
+
+	mMappedEntropyData = NULL;
+}
+
+void JpegEncoderGPU::EncodeScanSegments(int* entropyData, int numMCUs, int numBlocksPerMCU)
+{
+	mMappedEntropyData = entropyData;
+
+	WriteScanSegments(numMCUs, numBlocksPerMCU * JPEG_MAX_ENTROPY_BYTES_PER_BLOCK);
+
+	mMappedEntropyData = NULL;
 }
 
 void JpegEncoderGPU::Dispatch()
@@ -160,14 +221,32 @@ void JpegEncoderGPU::Dispatch()
 	mShader_Cr_Component->Set();
 	mD3DDeviceContext->Dispatch( mNumComputationBlocks_CbCr[0], mNumComputationBlocks_CbCr[1], 1 );
 	mShader_Cr_Component->Unset();
+
+
+	//pack the blocks of all components for the readback
+	int numBlocks = mEntropySlots.GetNumBlocks();
+
+	mShader_ScanBlocks->Set();
+	mD3DDeviceContext->Dispatch( 1, 1, 1 );
+	mShader_ScanBlocks->Unset();
+
+	//the headers ScanBlocks leaves at the front are all a measurement reads
+	if(mMeasureOnly)
+		return;
+
+	mShader_CompactBlocks->Set();
+	mD3DDeviceContext->Dispatch( JPEG_COMPACT_GROUPS_X, (numBlocks + JPEG_COMPACT_GROUPS_X - 1) / JPEG_COMPACT_GROUPS_X, 1 );
+	mShader_CompactBlocks->Unset();
 }
 
 void JpegEncoderGPU::QuantizationTablesChanged()
 {
 	for(int i = 0; i < 64; i++)
 	{
-		Y_Quantization_Table_Float[i] = (float)Y_Quantization_Table[i];
-		CbCr_Quantization_Table_Float[i] = (float)CbCr_Quantization_Table[i];
+		//reciprocals, the shader multiplies instead of dividing,
+		//the deterministic shader divides by the table entry itself
+		Y_Quantization_Table_Float[i] = mDeterministic ? Y_Quantization_Table[i] : 1.0f / Y_Quantization_Table[i];
+		CbCr_Quantization_Table_Float[i] = mDeterministic ? CbCr_Quantization_Table[i] : 1.0f / CbCr_Quantization_Table[i];
 	}
 
     D3D11_BOX box;
@@ -178,9 +257,8 @@ void JpegEncoderGPU::QuantizationTablesChanged()
     box.front = 0;
     box.back = 1;
 
-
-	ReleaseQuantizationBuffers();
-	
+	//a new quality only rewrites the tables, the entropy buffer stays and JpegEntropySlotSizer
+	//follows the new tables from the next frame, blocks that no longer fit take the overflow slots
 	if(mCB_Y_Quantization_Table == NULL)
 		mCB_Y_Quantization_Table = mComputeSys->CreateBuffer(COMPUTE_BUFFER_TYPE::STRUCTURED_BUFFER, sizeof(float), 64, true, false, Y_Quantization_Table_Float, false, "mCB_Y_Quantization_Table");
 	else
@@ -190,8 +268,6 @@ void JpegEncoderGPU::QuantizationTablesChanged()
 		mCB_CbCr_Quantization_Table = mComputeSys->CreateBuffer(COMPUTE_BUFFER_TYPE::STRUCTURED_BUFFER, sizeof(float), 64, true, false, CbCr_Quantization_Table_Float, false, "mCB_CbCr_Quantization_Table");
 	else
 		mD3DDeviceContext->UpdateSubresource(mCB_CbCr_Quantization_Table->GetResource(), 0, &box, CbCr_Quantization_Table_Float, 0, 0);
-
-	mDoCreateBuffers = true;
 }
 
 void JpegEncoderGPU::DoQuantization(ID3D11ShaderResourceView* pSRV)
@@ -224,11 +300,8 @@ void JpegEncoderGPU::DoQuantization(ID3D11ShaderResourceView* pSRV)
 
 int JpegEncoderGPU::CalculateBufferSize(int quality)
 {
-	/*
-		NOTE!!
-		This calculation is not proved to work on all images.
-		If the encoded image is broken, then please try other values here.
-	*/
+	//first guess only, JpegEntropySlotSizer adapts it to the images
+	//and blocks that do not fit go to the overflow slots
 	if(quality < 12)
 		quality = 12;
 	
@@ -239,42 +312,47 @@ int JpegEncoderGPU::CalculateBufferSize(int quality)
 
 HRESULT JpegEncoderGPU::CreateBuffers()
 {
-	ReleaseBuffers();
+	CreateTables();
 
-	int width = mComputationWidthY;
-	int height = mComputationHeightY;
+	//block slots and overflow slots, see JpegEntropySlots.h
+	if(mResetEntropySlots)
+	{
+		int numBlocks = mNumComputationBlocks_Y[0] * mNumComputationBlocks_Y[1] + mNumComputationBlocks_CbCr[0] * mNumComputationBlocks_CbCr[1] * 2;
 
-	//recalculate buffer size
-	mEntropyBlockSize = CalculateBufferSize(mQualitySetting);
+		//a new image size keeps the block size the frames before picked
+		int blockSize = mEntropySlots.GetNumBlocks() > 0 ? mEntropySlots.GetBlockSize() : CalculateBufferSize(mQualitySetting);
 
-	mCB_EntropyResult = mComputeSys->CreateBuffer(
-		COMPUTE_BUFFER_TYPE::STRUCTURED_BUFFER,
-		sizeof(int),
-		(mNumComputationBlocks_Y[0] * mNumComputationBlocks_Y[1] + mNumComputationBlocks_CbCr[0] * mNumComputationBlocks_CbCr[1] * 2) * mEntropyBlockSize,
-		false,
-		true,
-		NULL,
-		true,
-		"mCB_EntropyResult");
+		mEntropySlots.Reset(blockSize, numBlocks);
+		mResetEntropySlots = false;
+	}
+
+	mEntropyBlockSize = mEntropySlots.GetBlockSize();
+	mNumOverflowSlots = mEntropySlots.GetNumOverflowSlots();
+	mBlockOffsets.resize(mEntropySlots.GetNumBlocks());
+
+	//the shaders only go by the layout in ImageData, a larger buffer from an earlier frame is fine
+	ReserveEntropyBuffer(mEntropySlots.GetBufferSize());
+
+	UpdateImageData();
+
+	return S_OK;
+}
+
+void JpegEncoderGPU::CreateTables()
+{
+	if(mCB_SamplerState_PointClamp)
+		return;
 
 	mCB_Huff_Y_AC = mComputeSys->CreateBuffer(COMPUTE_BUFFER_TYPE::STRUCTURED_BUFFER, sizeof(BitString), 256, true, false,  Y_AC_Huffman_Table, false, "mCB_Huff_Y_AC");
 	mCB_Huff_CbCr_AC = mComputeSys->CreateBuffer(COMPUTE_BUFFER_TYPE::STRUCTURED_BUFFER, sizeof(BitString), 256, true, false,  Cb_AC_Huffman_Table, false, "mCB_Huff_CbCr_AC");
 		
 	mCB_DCT_Matrix = mComputeSys->CreateBuffer(COMPUTE_BUFFER_TYPE::STRUCTURED_BUFFER, sizeof(float), 64, true, false, DCT_matrix, false, "mCB_DCT_Matrix");
 	mCB_DCT_Matrix_Transpose = mComputeSys->CreateBuffer(COMPUTE_BUFFER_TYPE::STRUCTURED_BUFFER, sizeof(float), 64, true, false,  DCT_matrix_transpose, false, "mCB_DCT_Matrix_Transpose");
-	
-	ImageData id;
-	id.ImageWidth = (float)mImageWidth;
-	id.ImageHeight = (float)mImageHeight;
-	id.EntropyBlockSize = mEntropyBlockSize;
-
-	id.NumBlocksX = mNumComputationBlocks_Y[0];
-	id.NumBlocksY = mNumComputationBlocks_Y[1];
 
+	//filled by UpdateImageData
+	ImageData id;
+	memset(&id, 0, sizeof(id));
 	mCB_ImageData_Y = mComputeSys->CreateConstantBuffer(sizeof(ImageData), &id, "mCB_ImageData_Y");
-
-	id.NumBlocksX = mNumComputationBlocks_CbCr[0];
-	id.NumBlocksY = mNumComputationBlocks_CbCr[1];
 	mCB_ImageData_CbCr = mComputeSys->CreateConstantBuffer(sizeof(ImageData), &id, "mCB_ImageData_CbCr");
 
 
@@ -292,49 +370,184 @@ HRESULT JpegEncoderGPU::CreateBuffers()
 
 
 	HRESULT hr = mD3DDevice->CreateSamplerState(&samplerDesc, &mCB_SamplerState_PointClamp);
+}
 
-	return S_OK;
+void JpegEncoderGPU::ReserveEntropyBuffer(int numInts)
+{
+	if(mCB_EntropyResult && numInts <= mEntropyCapacity)
+		return;
+
+	mEntropyCapacity = JPEG_MAX(numInts, mEntropyCapacity + mEntropyCapacity / 2);
+
+	SAFE_DELETE(mCB_EntropyResult);
+	mCB_EntropyResult = mComputeSys->CreateBuffer(
+		COMPUTE_BUFFER_TYPE::STRUCTURED_BUFFER,
+		sizeof(int),
+		mEntropyCapacity,
+		false,
+		true,
+		NULL,
+		true,
+		"mCB_EntropyResult");
+}
+
+void JpegEncoderGPU::UpdateImageData()
+{
+	ImageData id;
+	id.ImageWidth = (float)mImageWidth;
+	id.ImageHeight = (float)mImageHeight;
+	id.EntropyBlockSize = mEntropyBlockSize;
+	id.OverflowBase = mEntropySlots.GetOverflowBase();
+	id.NumOverflowSlots = mNumOverflowSlots;
+	id.NumEntropyBlocks = mEntropySlots.GetNumBlocks();
+	id.SlotBase = mEntropySlots.GetSlotBase();
+	id.OffsetBase = mEntropySlots.GetOffsetBase();
+
+	id.NumBlocksX = mNumComputationBlocks_Y[0];
+	id.NumBlocksY = mNumComputationBlocks_Y[1];
+	mD3DDeviceContext->UpdateSubresource(mCB_ImageData_Y, 0, NULL, &id, 0, 0);
+
+	id.NumBlocksX = mNumComputationBlocks_CbCr[0];
+	id.NumBlocksY = mNumComputationBlocks_CbCr[1];
+	mD3DDeviceContext->UpdateSubresource(mCB_ImageData_CbCr, 0, NULL, &id, 0, 0);
+}
+
+void JpegEncoderGPU::HuffmanTablesChanged()
+{
+	//the buffers get the tables of the time they are created
+	if(mCB_Huff_Y_AC == NULL)
+		return;
+
+	mD3DDeviceContext->UpdateSubresource(mCB_Huff_Y_AC->GetResource(), 0, NULL, Y_AC_Huffman_Table, 0, 0);
+	mD3DDeviceContext->UpdateSubresource(mCB_Huff_CbCr_AC->GetResource(), 0, NULL, Cb_AC_Huffman_Table, 0, 0);
+}
+
+bool JpegEncoderGPU::ReserveBuffers(int numMCUsX, int numMCUsY)
+{
+	JpegMCULayoutInfo layout;
+	GetMCULayoutInfo(mSubsampleType, layout);
+
+	CreateTables();
+
+	//the first guess at quality 100 holds the frames of every quality
+	JpegEntropySlotSizer slots;
+	slots.Reset(CalculateBufferSize(100), numMCUsX * numMCUsY * layout.NumBlocks);
+	ReserveEntropyBuffer(slots.GetBufferSize());
+
+	return mCB_EntropyResult != NULL;
 }
 
 void JpegEncoderGPU::ComputationDimensionsChanged()
 {
+	mResetEntropySlots = true;
 	mDoCreateBuffers = true;
 }
 
-void JpegEncoderGPU::FinalizeData()
+void JpegEncoderGPU::UploadRGBData(const JEncRGBDataDesc& rgbDataDesc)
 {
-	//write any remaining bits to complete last block
-	BitString bs;
-	bs.length = 7;
-	bs.value = 0;
-	WriteBits(bs);
+	if(mCT_RGBA)
+	{
+		D3D11_TEXTURE2D_DESC desc;
+		mCT_RGBA->GetResource()->GetDesc(&desc);
+
+		if(desc.Width == rgbDataDesc.Width && desc.Height == rgbDataDesc.Height)
+		{
+			mD3DDeviceContext->UpdateSubresource(mCT_RGBA->GetResource(), 0, NULL, rgbDataDesc.Data, rgbDataDesc.RowPitch, 0);
+			return;
+		}
+
+		SAFE_DELETE(mCT_RGBA);
+	}
 
-	//Write End of Image Marker
-	WriteHex(0xFFD9);
+	mCT_RGBA = mComputeSys->CreateTexture(DXGI_FORMAT_R8G8B8A8_UNORM,
+		rgbDataDesc.Width, rgbDataDesc.Height, rgbDataDesc.RowPitch, rgbDataDesc.Data);
 }
 
 void JpegEncoderGPU::WriteImageData(JEncRGBDataDesc rgbDataDesc)
 {
-	if(!mCT_RGBA)
-	{
-		mCT_RGBA = mComputeSys->CreateTexture(DXGI_FORMAT_R8G8B8A8_UNORM,
-			rgbDataDesc.Width, rgbDataDesc.Height, rgbDataDesc.RowPitch, rgbDataDesc.Data);
-	}
+	UploadRGBData(rgbDataDesc);
+
+	QuantizeAndEncode(NULL);
+
+	FinalizeData();
+}
+
+void JpegEncoderGPU::WriteImageData(JEncD3DDataDesc d3dDataDesc)
+{
+	QuantizeAndEncode(d3dDataDesc.ResourceView);
+
+	FinalizeData();
+}
 
+void JpegEncoderGPU::QuantizeAndEncode(ID3D11ShaderResourceView* pSRV)
+{
 	if(mDoCreateBuffers)
 	{
 		CreateBuffers();
 		mDoCreateBuffers = false;
 	}
 
-	DoQuantization(NULL);
+	DoQuantization(pSRV);
 
-	DoEntropyEncode();
+	int* pEntropyData = ReadEntropyData();
 
-	FinalizeData();
+	//more blocks overflowed than there were overflow slots, the sizer made room for them
+	if(!mEntropySlots.Update(pEntropyData))
+	{
+		mCB_EntropyResult->Unmap();
+
+		CreateBuffers();
+		DoQuantization(pSRV);
+
+		pEntropyData = ReadEntropyData();
+		mEntropySlots.Update(pEntropyData);
+	}
+
+	JpegEntropySlotSizer::ComputeBlockOffsets(pEntropyData, (int)mBlockOffsets.size(), &mBlockOffsets[0]);
+
+	DoEntropyEncode(pEntropyData);
+
+	mCB_EntropyResult->Unmap();
+
+	//the next frame gets the layout the sizer picked from this one
+	if(mEntropySlots.GetBlockSize() != mEntropyBlockSize || mEntropySlots.GetNumOverflowSlots() != mNumOverflowSlots)
+		mDoCreateBuffers = true;
 }
 
-void JpegEncoderGPU::WriteImageData(JEncD3DDataDesc d3dDataDesc)
+int* JpegEncoderGPU::ReadEntropyData()
+{
+	int numBlocks = mEntropySlots.GetNumBlocks();
+	int readbackSize = mEntropySlots.GetReadbackSize();
+
+	mCB_EntropyResult->CopyToStaging(0, readbackSize * sizeof(int));
+	int* pEntropyData = mCB_EntropyResult->Map<int>();
+
+	//more payload than the last frames had, fetch the rest
+	int packedSize = mEntropySlots.GetPackedSize(pEntropyData[numBlocks]);
+	if(packedSize > readbackSize)
+	{
+		mCB_EntropyResult->Unmap();
+
+		mCB_EntropyResult->CopyToStaging(readbackSize * sizeof(int), (packedSize - readbackSize) * sizeof(int));
+		pEntropyData = mCB_EntropyResult->Map<int>();
+	}
+
+	return pEntropyData;
+}
+
+unsigned __int64 JpegEncoderGPU::MeasureImageData(JEncRGBDataDesc rgbDataDesc)
+{
+	UploadRGBData(rgbDataDesc);
+
+	return QuantizeAndMeasure(NULL);
+}
+
+unsigned __int64 JpegEncoderGPU::MeasureImageData(JEncD3DDataDesc d3dDataDesc)
+{
+	return QuantizeAndMeasure(d3dDataDesc.ResourceView);
+}
+
+unsigned __int64 JpegEncoderGPU::QuantizeAndMeasure(ID3D11ShaderResourceView* pSRV)
 {
 	if(mDoCreateBuffers)
 	{
@@ -342,11 +555,26 @@ void JpegEncoderGPU::WriteImageData(JEncD3DDataDesc d3dDataDesc)
 		mDoCreateBuffers = false;
 	}
 
-	DoQuantization(d3dDataDesc.ResourceView);
+	mMeasureOnly = true;
+	DoQuantization(pSRV);
+	mMeasureOnly = false;
 
-	DoEntropyEncode();
+	//the AC bit count and DC of every block, the DC codes follow from the differences,
+	//blocks that ran out of overflow slots still have their count
+	int numBlocks = mEntropySlots.GetNumBlocks();
 
-	FinalizeData();
+	mCB_EntropyResult->CopyToStaging(0, numBlocks * sizeof(int));
+	mMappedEntropyData = mCB_EntropyResult->Map<int>();
+
+	JpegMCULayoutInfo layout;
+	GetMCULayoutInfo(mSubsampleType, layout);
+
+	unsigned __int64 numBytes = MeasureScan(numBlocks / layout.NumBlocks);
+
+	mMappedEntropyData = NULL;
+	mCB_EntropyResult->Unmap();
+
+	return numBytes;
 }
 
 /*
@@ -356,25 +584,41 @@ void JpegEncoderGPU::WriteImageData(JEncD3DDataDesc d3dDataDesc)
 
 HRESULT DX12_JpegEncoderGPU::CreateBuffers()
 {
-	ReleaseBuffers();
+	CreateTables();
 
-	int width = mComputationWidthY;
-	int height = mComputationHeightY;
+	//block slots and overflow slots, see JpegEntropySlots.h
+	if(mResetEntropySlots)
+	{
+		int numBlocks = mNumComputationBlocks_Y[0] * mNumComputationBlocks_Y[1] + mNumComputationBlocks_CbCr[0] * mNumComputationBlocks_CbCr[1] * 2;
 
-	//recalculate buffer size
-	mEntropyBlockSize = CalculateBufferSize(mQualitySetting);
+		//a new image size keeps the block size the frames before picked
+		int blockSize = mEntropySlots.GetNumBlocks() > 0 ? mEntropySlots.GetBlockSize() : CalculateBufferSize(mQualitySetting);
 
-	mCB_EntropyResult = mComputeSys->CreateBuffer(mDescHeapSRVs->GetCPUDescriptorHandleForHeapStart(),
-		DX12_COMPUTE_BUFFER_TYPE::DX12_STRUCTURED_BUFFER,
-		sizeof(int),
-		(mNumComputationBlocks_Y[0] * mNumComputationBlocks_Y[1] + mNumComputationBlocks_CbCr[0] * mNumComputationBlocks_CbCr[1] * 2) * mEntropyBlockSize,
-		false, // SRV
-		true, // UAV
-		NULL,
-		true,
-		L"mCB_EntropyResult");
+		mEntropySlots.Reset(blockSize, numBlocks);
+		mResetEntropySlots = false;
+	}
+
+	mEntropyBlockSize = mEntropySlots.GetBlockSize();
+	mNumOverflowSlots = mEntropySlots.GetNumOverflowSlots();
+	mBlockOffsets.resize(mEntropySlots.GetNumBlocks());
+
+	//the shaders only go by the layout in ImageData, a larger buffer from an earlier frame is fine
+	ReserveEntropyBuffer(mEntropySlots.GetBufferSize());
+
+	UpdateImageData();
+
+	return S_OK;
+}
+
+void DX12_JpegEncoderGPU::CreateTables()
+{
+	if (mCB_SamplerState_PointClamp)
+		return;
+
+	//the Huffman tables go into the heaps of the quantization tables, Reserve may come before them
+	if (mDescHeapSRVsY == NULL || mDescHeapSRVsCbCr == NULL)
+		ReleaseQuantizationBuffers();
 
-	// After QuantizationTablesChanged
 	D3D12_CPU_DESCRIPTOR_HANDLE& cpuDescHandleY = mDescHeapSRVsY->GetCPUDescriptorHandleForHeapStart();
 	cpuDescHandleY.ptr = Y_ptrToHuff;
 	mCB_Huff_Y_AC = mComputeSys->CreateBuffer(cpuDescHandleY, DX12_COMPUTE_BUFFER_TYPE::DX12_STRUCTURED_BUFFER, sizeof(BitString), 256, true, false, Y_AC_Huffman_Table, false, L"mCB_Huff_Y_AC");
@@ -389,45 +633,23 @@ HRESULT DX12_JpegEncoderGPU::CreateBuffers()
 	cpuDescHandle.ptr += mD3D12Wrap->GetDevice()->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
 	mCB_DCT_Matrix_Transpose = mComputeSys->CreateBuffer(cpuDescHandle, DX12_COMPUTE_BUFFER_TYPE::DX12_STRUCTURED_BUFFER, sizeof(float), 64, true, false, DCT_matrix_transpose, false, L"mCB_DCT_Matrix_Transpose");
 
-	ImageData id;
-	id.ImageWidth = (float)mImageWidth;
-	id.ImageHeight = (float)mImageHeight;
-	id.EntropyBlockSize = mEntropyBlockSize;
-
-	id.NumBlocksX = mNumComputationBlocks_Y[0];
-	id.NumBlocksY = mNumComputationBlocks_Y[1];
+	//filled by UpdateImageData, the upload copies the whole 256 bytes of a constant buffer
+	BYTE cb[(sizeof(ImageData) + 255) & ~255] = {};
 
 	//Description for descriptor heap
 	D3D12_DESCRIPTOR_HEAP_DESC dhd = {};
 	dhd.NumDescriptors = 1;
 	dhd.Type = D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV;
 	dhd.Flags = D3D12_DESCRIPTOR_HEAP_FLAG_SHADER_VISIBLE;
-	HRESULT hr = mD3DDevice->CreateDescriptorHeap(&dhd, IID_PPV_ARGS(&mCB_ImageData_Y_Heap));
-	if (hr < 0)
-	{
-		return E_FAIL;
-	}
-	//if (FAILED(mD3DDevice->CreateDescriptorHeap(&dhd, IID_PPV_ARGS(&mCB_ImageData_Y_Heap))))
-	//	return E_FAIL;
+	if (FAILED(mD3DDevice->CreateDescriptorHeap(&dhd, IID_PPV_ARGS(&mCB_ImageData_Y_Heap))))
+		return;
 	mCB_ImageData_Y_Heap->SetName(L"mCB_ImageData_Y_Heap HEAP");
+	mCB_ImageData_Y = mComputeSys->CreateConstantBuffer(mCB_ImageData_Y_Heap, sizeof(ImageData), cb, L"mCB_ImageData_Y");
 
-	mCB_ImageData_Y = mComputeSys->CreateConstantBuffer(mCB_ImageData_Y_Heap, sizeof(ImageData), &id, L"mCB_ImageData_Y");
-
-	id.NumBlocksX = mNumComputationBlocks_CbCr[0];
-	id.NumBlocksY = mNumComputationBlocks_CbCr[1];
-
-	//Description for descriptor heap
-	D3D12_DESCRIPTOR_HEAP_DESC dhd2 = {};
-	dhd2.NumDescriptors = 1;
-	dhd2.Type = D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV;
-	dhd2.Flags = D3D12_DESCRIPTOR_HEAP_FLAG_SHADER_VISIBLE;
-	hr = mD3DDevice->CreateDescriptorHeap(&dhd2, IID_PPV_ARGS(&mCB_ImageData_CbCr_Heap));
-	if (hr < 0)
-	{
-		return E_FAIL;
-	}
+	if (FAILED(mD3DDevice->CreateDescriptorHeap(&dhd, IID_PPV_ARGS(&mCB_ImageData_CbCr_Heap))))
+		return;
 	mCB_ImageData_CbCr_Heap->SetName(L"mCB_ImageData_CbCr_Heap HEAP");
-	mCB_ImageData_CbCr = mComputeSys->CreateConstantBuffer(mCB_ImageData_CbCr_Heap, sizeof(ImageData), &id, L"mCB_ImageData_CbCr");
+	mCB_ImageData_CbCr = mComputeSys->CreateConstantBuffer(mCB_ImageData_CbCr_Heap, sizeof(ImageData), cb, L"mCB_ImageData_CbCr");
 
 
 	D3D12_SAMPLER_DESC samplerDesc;
@@ -447,20 +669,104 @@ HRESULT DX12_JpegEncoderGPU::CreateBuffers()
 	dhd3.NumDescriptors = 1;
 	dhd3.Type = D3D12_DESCRIPTOR_HEAP_TYPE_SAMPLER;
 	dhd3.Flags = D3D12_DESCRIPTOR_HEAP_FLAG_SHADER_VISIBLE;
-	hr = mD3DDevice->CreateDescriptorHeap(&dhd3, IID_PPV_ARGS(&mCB_SamplerState_PointClamp));
+	HRESULT hr = mD3DDevice->CreateDescriptorHeap(&dhd3, IID_PPV_ARGS(&mCB_SamplerState_PointClamp));
 	if (hr < 0)
 	{
-		return E_FAIL;
+		return;
 	}
 	mCB_SamplerState_PointClamp->SetName(L"mCB_SamplerState_PointClamp HEAP");
 
 	mD3DDevice->CreateSampler(&samplerDesc, mCB_SamplerState_PointClamp->GetCPUDescriptorHandleForHeapStart());
-	
-	return S_OK;
+}
+
+void DX12_JpegEncoderGPU::ReserveEntropyBuffer(int numInts)
+{
+	if (mCB_EntropyResult && numInts <= mEntropyCapacity)
+		return;
+
+	mEntropyCapacity = JPEG_MAX(numInts, mEntropyCapacity + mEntropyCapacity / 2);
+
+	// UAV only, the buffer has a heap of its own and the SRV handle is not used
+	D3D12_CPU_DESCRIPTOR_HANDLE noSRV = {};
+
+	SAFE_DELETE(mCB_EntropyResult);
+	mCB_EntropyResult = mComputeSys->CreateBuffer(noSRV,
+		DX12_COMPUTE_BUFFER_TYPE::DX12_STRUCTURED_BUFFER,
+		sizeof(int),
+		mEntropyCapacity,
+		false, // SRV
+		true, // UAV
+		NULL,
+		true,
+		L"mCB_EntropyResult");
+}
+
+void DX12_JpegEncoderGPU::UpdateImageData()
+{
+	ImageData id;
+	id.ImageWidth = (float)mImageWidth;
+	id.ImageHeight = (float)mImageHeight;
+	id.EntropyBlockSize = mEntropyBlockSize;
+	id.OverflowBase = mEntropySlots.GetOverflowBase();
+	id.NumOverflowSlots = mNumOverflowSlots;
+	id.NumEntropyBlocks = mEntropySlots.GetNumBlocks();
+	id.SlotBase = mEntropySlots.GetSlotBase();
+	id.OffsetBase = mEntropySlots.GetOffsetBase();
+
+	// The constant buffers are 256 bytes, UpdateResource copies all of them
+	BYTE cb[(sizeof(ImageData) + 255) & ~255] = {};
+
+	D3D12_SUBRESOURCE_DATA data = {};
+	data.pData = cb;
+	data.RowPitch = sizeof(cb);
+	data.SlicePitch = data.RowPitch;
+
+	id.NumBlocksX = mNumComputationBlocks_Y[0];
+	id.NumBlocksY = mNumComputationBlocks_Y[1];
+	memcpy(cb, &id, sizeof(id));
+	UpdateResource(mCB_ImageData_Y, D3D12_RESOURCE_STATE_VERTEX_AND_CONSTANT_BUFFER, data);
+
+	id.NumBlocksX = mNumComputationBlocks_CbCr[0];
+	id.NumBlocksY = mNumComputationBlocks_CbCr[1];
+	memcpy(cb, &id, sizeof(id));
+	UpdateResource(mCB_ImageData_CbCr, D3D12_RESOURCE_STATE_VERTEX_AND_CONSTANT_BUFFER, data);
+}
+
+void DX12_JpegEncoderGPU::HuffmanTablesChanged()
+{
+	// The buffers get the tables of the time they are created
+	if (mCB_Huff_Y_AC == NULL)
+		return;
+
+	D3D12_SUBRESOURCE_DATA data = {};
+	data.RowPitch = 256 * sizeof(BitString);
+	data.SlicePitch = data.RowPitch;
+
+	data.pData = Y_AC_Huffman_Table;
+	UpdateResource(mCB_Huff_Y_AC->GetResource(), D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE, data);
+
+	data.pData = Cb_AC_Huffman_Table;
+	UpdateResource(mCB_Huff_CbCr_AC->GetResource(), D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE, data);
+}
+
+bool DX12_JpegEncoderGPU::ReserveBuffers(int numMCUsX, int numMCUsY)
+{
+	JpegMCULayoutInfo layout;
+	GetMCULayoutInfo(mSubsampleType, layout);
+
+	CreateTables();
+
+	// The first guess at quality 100 holds the frames of every quality
+	JpegEntropySlotSizer slots;
+	slots.Reset(CalculateBufferSize(100), numMCUsX * numMCUsY * layout.NumBlocks);
+	ReserveEntropyBuffer(slots.GetBufferSize());
+
+	return mCB_EntropyResult != NULL;
 }
 
 void DX12_JpegEncoderGPU::ComputationDimensionsChanged()
 {
+	mResetEntropySlots = true;
 	mDoCreateBuffers = true;
 }
 
@@ -468,45 +774,46 @@ void DX12_JpegEncoderGPU::QuantizationTablesChanged() // nr:1
 {
 	for (int i = 0; i < 64; i++)
 	{
-		Y_Quantization_Table_Float[i] = (float)Y_Quantization_Table[i];
-		CbCr_Quantization_Table_Float[i] = (float)CbCr_Quantization_Table[i];
+		//reciprocals, the shader multiplies instead of dividing,
+		//the deterministic shader divides by the table entry itself
+		Y_Quantization_Table_Float[i] = mDeterministic ? Y_Quantization_Table[i] : 1.0f / Y_Quantization_Table[i];
+		CbCr_Quantization_Table_Float[i] = mDeterministic ? CbCr_Quantization_Table[i] : 1.0f / CbCr_Quantization_Table[i];
 	}
 
-	ReleaseQuantizationBuffers();
-
-	if (mCB_Y_Quantization_Table == NULL)
+	//the first tables come with the descriptor heaps unless CreateTables made them for the Huffman
+	//tables already. After that a new quality only rewrites the tables, the entropy buffer
+	//stays and JpegEntropySlotSizer follows the new tables from the next frame
+	if (mCB_Y_Quantization_Table == NULL || mCB_CbCr_Quantization_Table == NULL)
 	{
+		if (mDescHeapSRVsY == NULL || mDescHeapSRVsCbCr == NULL)
+			ReleaseQuantizationBuffers();
+
 		D3D12_CPU_DESCRIPTOR_HANDLE& cpuDescHandleY = mDescHeapSRVsY->GetCPUDescriptorHandleForHeapStart();
 		cpuDescHandleY.ptr = Y_ptrToQuantizationTable;
 		mCB_Y_Quantization_Table = mComputeSys->CreateBuffer(cpuDescHandleY, DX12_COMPUTE_BUFFER_TYPE::DX12_STRUCTURED_BUFFER, sizeof(float), 64, true, false, Y_Quantization_Table_Float, false, L"mCB_Y_Quantization_Table");
-	}
-	else
-	{
-		UpdateQuantizationTable(mCB_Y_Quantization_Table, Y_Quantization_Table_Float);
-	}
 
-	if (mCB_CbCr_Quantization_Table == NULL)
-	{
 		D3D12_CPU_DESCRIPTOR_HANDLE& cpuDescHandleCbCr = mDescHeapSRVsCbCr->GetCPUDescriptorHandleForHeapStart();
 		cpuDescHandleCbCr.ptr = CbCr_ptrToQuantizationTable;
 		mCB_CbCr_Quantization_Table = mComputeSys->CreateBuffer(cpuDescHandleCbCr, DX12_COMPUTE_BUFFER_TYPE::DX12_STRUCTURED_BUFFER, sizeof(float), 64, true, false, CbCr_Quantization_Table_Float, false, L"mCB_CbCr_Quantization_Table");
 	}
 	else
 	{
-		UpdateQuantizationTable(mCB_Y_Quantization_Table, CbCr_Quantization_Table_Float);
-	}
-	
+		D3D12_SUBRESOURCE_DATA data = {};
+		data.RowPitch = 64 * sizeof(float);
+		data.SlicePitch = data.RowPitch;
 
-	mDoCreateBuffers = true;
+		data.pData = Y_Quantization_Table_Float;
+		UpdateResource(mCB_Y_Quantization_Table->GetResource(), D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE, data);
+
+		data.pData = CbCr_Quantization_Table_Float;
+		UpdateResource(mCB_CbCr_Quantization_Table->GetResource(), D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE, data);
+	}
 }
 
 int DX12_JpegEncoderGPU::CalculateBufferSize(int quality)
 {
-	/*
-	NOTE!!
-	This calculation is not proved to work on all images.
-	If the encoded image is broken, then please try other values here.
-	*/
+	//first guess only, JpegEntropySlotSizer adapts it to the images
+	//and blocks that do not fit go to the overflow slots
 	if (quality < 12)
 		quality = 12;
 
@@ -844,16 +1151,43 @@ HRESULT DX12_JpegEncoderGPU::createPiplineStateObjects()
 	}
 	mPSO_Cr_Component->SetName(L"Compute PSO Y Component");
 
+	// Create compute pipeline states for packing the blocks
+	D3D12_COMPUTE_PIPELINE_STATE_DESC descComputePSO_Scan = {};
+	descComputePSO_Scan.pRootSignature = mRootSignature;
+	descComputePSO_Scan.CS.pShaderBytecode = mShader_ScanBlocks->GetShaderCode()->GetBufferPointer();
+	descComputePSO_Scan.CS.BytecodeLength = mShader_ScanBlocks->GetShaderCode()->GetBufferSize();
+
+	hr = mD3DDevice->CreateComputePipelineState(&descComputePSO_Scan, IID_PPV_ARGS(&mPSO_ScanBlocks));
+	if (FAILED(hr))
+	{
+		PostMessageBoxOnError(hr, L"Failed to create compute PSO for ScanBlocks: ", L"Fatal error", MB_ICONERROR, wHnd);
+		exit(-1);
+	}
+	mPSO_ScanBlocks->SetName(L"Compute PSO ScanBlocks");
+
+	D3D12_COMPUTE_PIPELINE_STATE_DESC descComputePSO_Compact = {};
+	descComputePSO_Compact.pRootSignature = mRootSignature;
+	descComputePSO_Compact.CS.pShaderBytecode = mShader_CompactBlocks->GetShaderCode()->GetBufferPointer();
+	descComputePSO_Compact.CS.BytecodeLength = mShader_CompactBlocks->GetShaderCode()->GetBufferSize();
+
+	hr = mD3DDevice->CreateComputePipelineState(&descComputePSO_Compact, IID_PPV_ARGS(&mPSO_CompactBlocks));
+	if (FAILED(hr))
+	{
+		PostMessageBoxOnError(hr, L"Failed to create compute PSO for CompactBlocks: ", L"Fatal error", MB_ICONERROR, wHnd);
+		exit(-1);
+	}
+	mPSO_CompactBlocks->SetName(L"Compute PSO CompactBlocks");
+
 	return S_OK;
 }
 
-void DX12_JpegEncoderGPU::UpdateQuantizationTable(DX12_ComputeBuffer * quantizationTable, float* quantizationTableFloat)
+void DX12_JpegEncoderGPU::UpdateResource(ID3D12Resource* resource, D3D12_RESOURCE_STATES state, D3D12_SUBRESOURCE_DATA& data)
 {
 	// Create the GPU upload buffer
 	UINT64 uploadBufferSize = 0;
 	{
 		mD3DDevice->GetCopyableFootprints(
-			&quantizationTable->GetResource()->GetDesc(),
+			&resource->GetDesc(),
 			0,
 			1,
 			0,
@@ -894,29 +1228,39 @@ void DX12_JpegEncoderGPU::UpdateQuantizationTable(DX12_ComputeBuffer * quantizat
 	));
 
 	// Copy data to the intermediate upload heap and then schedule a copy
-	// from the upload heap to the Quantization Table(DX12_ComputeBuffer)
-	D3D12_SUBRESOURCE_DATA data = {};
-	data.pData = quantizationTableFloat;
-	data.RowPitch = 64 * sizeof(unsigned char);
-	data.SlicePitch = data.RowPitch * 1;
+	// from the upload heap to the resource
 
-	D3D12_RESOURCE_BARRIER barrier{};
+	// The direct list takes the resource from its state to the copy and back,
+	// a copy list cannot transition to a shader resource state
+	D3D12_RESOURCE_BARRIER barriers[2]{};
 	MakeResourceBarrier(
-		barrier,
+		barriers[0],
+		D3D12_RESOURCE_BARRIER_TYPE_TRANSITION,
+		resource,
+		state,
+		D3D12_RESOURCE_STATE_COPY_DEST
+	);
+	MakeResourceBarrier(
+		barriers[1],
 		D3D12_RESOURCE_BARRIER_TYPE_TRANSITION,
-		uploadHeap,
-		D3D12_RESOURCE_STATE_COPY_SOURCE,
-		D3D12_RESOURCE_STATE_COMMON
+		resource,
+		D3D12_RESOURCE_STATE_COPY_DEST,
+		state
 	);
 
-	ThrowIfFailed(mCopyAllocator->Reset());
-	ThrowIfFailed(mCopyList->Reset(mCopyAllocator, nullptr));
+	ThrowIfFailed(mDirectAllocator->Reset());
+	ThrowIfFailed(mDirectList->Reset(mDirectAllocator, nullptr));
 
-	UpdateSubresources(mCopyList, quantizationTable->GetResource(), uploadHeap, 0, 0, 1, &data);
-	mCopyList->ResourceBarrier(1, &barrier);
+	mDirectList->ResourceBarrier(1, &barriers[0]);
+	UpdateSubresources(mDirectList, resource, uploadHeap, 0, 0, 1, &data);
+	mDirectList->ResourceBarrier(1, &barriers[1]);
+	mDirectList->Close();
 
-	ID3D12CommandList* listsToExecute[] = { mCopyList };
-	mCopyQueue->ExecuteCommandLists(_ARRAYSIZE(listsToExecute), listsToExecute);
+	ID3D12CommandList* listsToExecute[] = { mDirectList };
+	mDirectQueue->ExecuteCommandLists(_ARRAYSIZE(listsToExecute), listsToExecute);
+
+	// The upload heap has to live until the copy is done
+	mD3D12Wrap->WaitForGPUCompletion(mDirectQueue, mD3D12Wrap->GetTestFence());
 
 	SAFE_RELEASE(uploadHeap);
 }
@@ -929,6 +1273,8 @@ void DX12_JpegEncoderGPU::shutdown()
 	SafeRelease(&mPSO_Y_Component);
 	SafeRelease(&mPSO_Cb_Component);
 	SafeRelease(&mPSO_Cr_Component);
+	SafeRelease(&mPSO_ScanBlocks);
+	SafeRelease(&mPSO_CompactBlocks);
 
 	// Command lists
 	SafeRelease(&mDirectQueue);
@@ -966,6 +1312,12 @@ DX12_JpegEncoderGPU::DX12_JpegEncoderGPU(D3D12Wrap* d3dWrap) // nr:0
 	mImageWidth = 0;
 	mImageHeight = 0;
 	mEntropyBlockSize = 0;
+	mNumOverflowSlots = 0;
+	mResetEntropySlots = true;
+	mEntropyCapacity = 0;
+
+	mMappedEntropyData = NULL;
+	mMeasureOnly = false;
 
 	mDoCreateBuffers = true;
 
@@ -992,6 +1344,8 @@ DX12_JpegEncoderGPU::DX12_JpegEncoderGPU(D3D12Wrap* d3dWrap) // nr:0
 	mShader_Y_Component = NULL;
 	mShader_Cb_Component = NULL;
 	mShader_Cr_Component = NULL;
+	mShader_ScanBlocks = NULL;
+	mShader_CompactBlocks = NULL;
 
 	//SAFE_RELEASE(mDescHeapSRVs);
 	D3D12_DESCRIPTOR_HEAP_DESC dhd01 = {};
@@ -1080,86 +1434,109 @@ void DX12_JpegEncoderGPU::ReleaseShaders()
 	SAFE_DELETE(mShader_Y_Component);
 	SAFE_DELETE(mShader_Cb_Component);
 	SAFE_DELETE(mShader_Cr_Component);
+	SAFE_DELETE(mShader_ScanBlocks);
+	SAFE_DELETE(mShader_CompactBlocks);
 }
 
-void DX12_JpegEncoderGPU::DoHuffmanEncoding(int * DU, short & prevDC, BitString * HTDC)
+bool DX12_JpegEncoderGPU::SetOption(JENC_OPTIONS option, int value)
 {
-	static const unsigned short mask[] = { 1,2,4,8,16,32,64,128,256,512,1024,2048,4096,8192,16384,32768 };
-	static BitString bs;
-	short tmp1, tmp2;
+	if(option == JENC_OPTION_DETERMINISTIC)
+	{
+		bool wasDeterministic = mDeterministic;
+		if(!JpegEncoderBase::SetOption(option, value))
+			return false;
 
-	// appeend DC bits
-	tmp1 = tmp2 = (short)(DU[0] - prevDC);
-	prevDC = DU[0];
+		if(mDeterministic == wasDeterministic)
+			return true;
 
-	if (tmp1 < 0)
-	{
-		tmp1 = -tmp1;
-		tmp2--;
-	}
+		//the integer path is compiled into the shaders, rebuild them and their PSOs
+		SafeRelease(&mPSO_Y_Component);
+		SafeRelease(&mPSO_Cb_Component);
+		SafeRelease(&mPSO_Cr_Component);
+		SafeRelease(&mPSO_ScanBlocks);
+		SafeRelease(&mPSO_CompactBlocks);
 
-	//count numberof bits
-	int nbits = NumBitsInUShort[tmp1];
+		SAFE_DELETE(mShader_Y_Component);
+		SAFE_DELETE(mShader_Cb_Component);
+		SAFE_DELETE(mShader_Cr_Component);
+		SAFE_DELETE(mShader_ScanBlocks);
+		SAFE_DELETE(mShader_CompactBlocks);
 
-	WriteBits(HTDC[nbits]);
+		if(!Init())
+			return false;
 
-	if (nbits)
-	{
-		bs.value = tmp2 & (mask[nbits] - 1);
-		bs.length = nbits;
-		WriteBits(bs);
+		if(mQualitySetting != 0)
+			QuantizationTablesChanged();
+
+		return true;
 	}
 
+	return JpegEncoderBase::SetOption(option, value);
+}
 
-	// append ac bits generated by the GPU
-	BYTE* ac_entropy_data = (BYTE*)&DU[1];
-	int num_ac_bits = DU[mEntropyBlockSize - 1];
+DX12_ComputeShader* DX12_JpegEncoderGPU::CreateComponentShader(const JpegMCULayoutInfo& layout, const char* componentDefine, const char* entryPoint)
+{
+	char samplingH[2] = { (char)('0' + layout.SamplingH), 0 };
+	char samplingV[2] = { (char)('0' + layout.SamplingV), 0 };
+
+	D3D10_SHADER_MACRO shaderDefines[] = {
+		{ layout.ShaderDefine, "1" },
+		{ componentDefine, "1" },
+		{ "MCU_H", samplingH },
+		{ "MCU_V", samplingV },
+		{ "DETERMINISTIC", mDeterministic ? "1" : "0" },
+		{ NULL, NULL }
+	};
 
-	bs.length = 8;
-	int num_bytes = num_ac_bits / 8;
-	while (num_bytes-- > 0)
-	{
-		bs.value = *ac_entropy_data++;
-		WriteBits(bs);
-	}
+	return mComputeSys->CreateComputeShader(mComputeShaderFile, entryPoint, shaderDefines);
+}
 
-	//append last bits
-	num_ac_bits = num_ac_bits % 8;
-	if (num_ac_bits > 0)
-	{
-		bs.value = *ac_entropy_data++ >> (8 - num_ac_bits);
-		bs.length = num_ac_bits;
-		WriteBits(bs);
-	}
+void DX12_JpegEncoderGPU::DoHuffmanEncoding(int block, short & prevDC, BitString * HTDC)
+{
+	DoHuffmanEncoding(mBitWriter, block, prevDC, HTDC);
 }
 
-void DX12_JpegEncoderGPU::WriteImageData(JEncRGBDataDesc rgbDataDesc)
+void DX12_JpegEncoderGPU::UploadRGBData(const JEncRGBDataDesc& rgbDataDesc, wchar_t* debugName)
 {
-	if (!mCT_RGBA)
+	if (mCT_RGBA)
 	{
-		HWND wHnd = GetActiveWindow();
-		assert(wHnd);
-		HRESULT hr = createDescriptorHeapForSRVs();
-		if (FAILED(hr))
+		D3D12_RESOURCE_DESC desc = mCT_RGBA->GetResource()->GetDesc();
+
+		if (desc.Width == rgbDataDesc.Width && desc.Height == rgbDataDesc.Height)
 		{
-			PostMessageBoxOnError(hr, L"Failed to create descriptor heaps for the SRVs [WriteImageData]: ", L"Fatal error", MB_ICONERROR, wHnd);
-			exit(-1);
+			D3D12_SUBRESOURCE_DATA data = {};
+			data.pData = rgbDataDesc.Data;
+			data.RowPitch = rgbDataDesc.RowPitch;
+			data.SlicePitch = data.RowPitch * rgbDataDesc.Height;
+
+			UpdateResource(mCT_RGBA->GetResource(), D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE, data);
+			return;
 		}
-		D3D12_CPU_DESCRIPTOR_HANDLE& cpuDescHandle = mDescHeapSRVs->GetCPUDescriptorHandleForHeapStart();
-		cpuDescHandle.ptr = ptrToDescHeapImage;
-		mCT_RGBA = mComputeSys->CreateTexture(cpuDescHandle, DXGI_FORMAT_R8G8B8A8_UNORM,
-			rgbDataDesc.Width, rgbDataDesc.Height, rgbDataDesc.RowPitch, rgbDataDesc.Data, false, L"WriteImageDataTexture HEAP"); // creates first
+
+		// The SRV heap was made for the texture
+		SAFE_DELETE(mCT_RGBA);
+		SAFE_RELEASE(mDescHeapSRVs);
 	}
 
-	if (mDoCreateBuffers)
+	HWND wHnd = GetActiveWindow();
+	assert(wHnd);
+	HRESULT hr = createDescriptorHeapForSRVs();
+	if (FAILED(hr))
 	{
-		CreateBuffers();
-		mDoCreateBuffers = false;
+		PostMessageBoxOnError(hr, L"Failed to create descriptor heaps for the SRVs [UploadRGBData]: ", L"Fatal error", MB_ICONERROR, wHnd);
+		exit(-1);
 	}
+	D3D12_CPU_DESCRIPTOR_HANDLE& cpuDescHandle = mDescHeapSRVs->GetCPUDescriptorHandleForHeapStart();
+	cpuDescHandle.ptr = ptrToDescHeapImage;
+	mCT_RGBA = mComputeSys->CreateTexture(cpuDescHandle, DXGI_FORMAT_R8G8B8A8_UNORM,
+		rgbDataDesc.Width, rgbDataDesc.Height, rgbDataDesc.RowPitch, rgbDataDesc.Data, false, debugName);
+}
 
-	DoQuantization(NULL);
+void DX12_JpegEncoderGPU::WriteImageData(JEncRGBDataDesc rgbDataDesc)
+{
+	UploadRGBData(rgbDataDesc, L"WriteImageDataTexture HEAP"); // creates first
 
-	DoEntropyEncode();
+	QuantizeAndEncode(NULL);
 
 	FinalizeData();
 }
@@ -1172,17 +1549,113 @@ void DX12_JpegEncoderGPU::WriteImageData(DX12_JEncD3DDataDesc d3dDataDesc) // nr
 		ptrToDescHeapImage = d3dDataDesc.ptrToDescHeapImage;
 	}
 
+	QuantizeAndEncode(d3dDataDesc.DescriptorHeap);
+
+	FinalizeData();
+}
+
+unsigned __int64 DX12_JpegEncoderGPU::MeasureImageData(JEncRGBDataDesc rgbDataDesc)
+{
+	UploadRGBData(rgbDataDesc, L"MeasureImageDataTexture HEAP");
+
+	return QuantizeAndMeasure(NULL);
+}
+
+unsigned __int64 DX12_JpegEncoderGPU::MeasureImageData(DX12_JEncD3DDataDesc d3dDataDesc)
+{
+	if (mDescHeapSRVs != d3dDataDesc.DescriptorHeap)
+	{
+		mDescHeapSRVs = d3dDataDesc.DescriptorHeap;
+		ptrToDescHeapImage = d3dDataDesc.ptrToDescHeapImage;
+	}
+
+	return QuantizeAndMeasure(d3dDataDesc.DescriptorHeap);
+}
+
+unsigned __int64 DX12_JpegEncoderGPU::QuantizeAndMeasure(ID3D12DescriptorHeap* pSRV)
+{
 	if (mDoCreateBuffers)
 	{
 		CreateBuffers();
 		mDoCreateBuffers = false;
 	}
 
-	DoQuantization(d3dDataDesc.DescriptorHeap);
+	mMeasureOnly = true;
+	DoQuantization(pSRV);
+	mMeasureOnly = false;
 
-	DoEntropyEncode();
+	// The AC bit count and DC of every block, the DC codes follow from the differences,
+	// blocks that ran out of overflow slots still have their count
+	int numBlocks = mEntropySlots.GetNumBlocks();
 
-	FinalizeData();
+	mCB_EntropyResult->CopyToStaging(0, numBlocks * sizeof(int));
+	mMappedEntropyData = mCB_EntropyResult->Map<int>();
+
+	JpegMCULayoutInfo layout;
+	GetMCULayoutInfo(mSubsampleType, layout);
+
+	unsigned __int64 numBytes = MeasureScan(numBlocks / layout.NumBlocks);
+
+	mMappedEntropyData = NULL;
+	mCB_EntropyResult->Unmap();
+
+	return numBytes;
+}
+
+void DX12_JpegEncoderGPU::QuantizeAndEncode(ID3D12DescriptorHeap* pSRV)
+{
+	if (mDoCreateBuffers)
+	{
+		CreateBuffers();
+		mDoCreateBuffers = false;
+	}
+
+	DoQuantization(pSRV);
+
+	int* pEntropyData = ReadEntropyData();
+
+	//more blocks overflowed than there were overflow slots, the sizer made room for them
+	if (!mEntropySlots.Update(pEntropyData))
+	{
+		mCB_EntropyResult->Unmap();
+
+		CreateBuffers();
+		DoQuantization(pSRV);
+
+		pEntropyData = ReadEntropyData();
+		mEntropySlots.Update(pEntropyData);
+	}
+
+	JpegEntropySlotSizer::ComputeBlockOffsets(pEntropyData, (int)mBlockOffsets.size(), &mBlockOffsets[0]);
+
+	DoEntropyEncode(pEntropyData);
+
+	mCB_EntropyResult->Unmap();
+
+	//the next frame gets the layout the sizer picked from this one
+	if (mEntropySlots.GetBlockSize() != mEntropyBlockSize || mEntropySlots.GetNumOverflowSlots() != mNumOverflowSlots)
+		mDoCreateBuffers = true;
+}
+
+int* DX12_JpegEncoderGPU::ReadEntropyData()
+{
+	int numBlocks = mEntropySlots.GetNumBlocks();
+	int readbackSize = mEntropySlots.GetReadbackSize();
+
+	mCB_EntropyResult->CopyToStaging(0, readbackSize * sizeof(int));
+	int* pEntropyData = mCB_EntropyResult->Map<int>();
+
+	//more payload than the last frames had, fetch the rest
+	int packedSize = mEntropySlots.GetPackedSize(pEntropyData[numBlocks]);
+	if (packedSize > readbackSize)
+	{
+		mCB_EntropyResult->Unmap();
+
+		mCB_EntropyResult->CopyToStaging(readbackSize * sizeof(int), (packedSize - readbackSize) * sizeof(int));
+		pEntropyData = mCB_EntropyResult->Map<int>();
+	}
+
+	return pEntropyData;
 }
 
 void DX12_JpegEncoderGPU::DoQuantization(ID3D12DescriptorHeap * pSRV)
@@ -1224,6 +1697,52 @@ void DX12_JpegEncoderGPU::DoQuantization(ID3D12DescriptorHeap * pSRV)
 	m_DispatchProfiler->CalculateAllDurations();
 }
 
+// DC difference and the AC bits generated by the GPU, safe to call from several threads with their own writers
+void DX12_JpegEncoderGPU::DoHuffmanEncoding(EntropyWriter& writer, int block, short& prevDC, const BitString* HTDC)
+{
+	int header = mMappedEntropyData[block];
+	short DC = JpegEntropySlotSizer::GetDC(header);
+	short tmp1, tmp2;
+
+	tmp1 = tmp2 = (short)(DC - prevDC);
+	prevDC = DC;
+
+	if(tmp1 < 0)
+	{
+		tmp1 = -tmp1;
+		tmp2--;
+	}
+
+	int nbits = NumBitsInUShort[tmp1];
+
+	PutBits(writer, HTDC[nbits].value, HTDC[nbits].length);
+
+	if(nbits)
+		PutBits(writer, tmp2 & ((1 << nbits) - 1), nbits);
+
+	//the AC bits generated by the GPU, the shader stores them big endian
+	const int* AC = mMappedEntropyData + mEntropySlots.GetNumBlocks() + 1 + mBlockOffsets[block];
+	PutBitStream(writer, (const BYTE*)AC, JpegEntropySlotSizer::GetNumBits(header));
+}
+
+void DX12_JpegEncoderGPU::EncodeRestartSegments(int* entropyData, int numMCUs, int numBlocksPerMCU)
+{
+	mMappedEntropyData = entropyData;
+
+	WriteRestartSegments(numMCUs, numBlocksPerMCU * JPEG_MAX_ENTROPY_BYTES_PER_BLOCK);
+
+	mMappedEntropyData = NULL;
+}
+
+void DX12_JpegEncoderGPU::EncodeScanSegments(int* entropyData, int numMCUs, int numBlocksPerMCU)
+{
+	mMappedEntropyData = entropyData;
+
+	WriteScanSegments(numMCUs, numBlocksPerMCU * JPEG_MAX_ENTROPY_BYTES_PER_BLOCK);
+
+	mMappedEntropyData = NULL;
+}
+
 void DX12_JpegEncoderGPU::Dispatch()
 {
 	m_DispatchProfiler->Update();
@@ -1288,20 +1807,23 @@ void DX12_JpegEncoderGPU::Dispatch()
 	m_DispatchProfiler->EndTimestamp(DispatchCrComponent);
 	mDirectList->ResourceBarrier(1, &barrier);
 
+	// Pack the blocks of all components for the readback
+	int numBlocks = mEntropySlots.GetNumBlocks();
+
+	mDirectList->SetPipelineState(mPSO_ScanBlocks);
+	mDirectList->Dispatch(1, 1, 1);
+	mDirectList->ResourceBarrier(1, &barrier);
+
+	// The headers ScanBlocks leaves at the front are all a measurement reads
+	if (!mMeasureOnly)
+	{
+		mDirectList->SetPipelineState(mPSO_CompactBlocks);
+		mDirectList->Dispatch(JPEG_COMPACT_GROUPS_X, (numBlocks + JPEG_COMPACT_GROUPS_X - 1) / JPEG_COMPACT_GROUPS_X, 1);
+		mDirectList->ResourceBarrier(1, &barrier);
+	}
+
 	m_DispatchProfiler->EndTimestamp(DispatchFrameTime);
 	m_DispatchProfiler->EndProfiler();
 
 	mDirectList->Close();
 }
-
-void DX12_JpegEncoderGPU::FinalizeData()
-{
-	//write any remaining bits to complete last block
-	BitString bs;
-	bs.length = 7;
-	bs.value = 0;
-	WriteBits(bs);
-
-	//Write End of Image Marker
-	WriteHex(0xFFD9);
-}
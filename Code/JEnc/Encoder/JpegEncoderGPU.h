@@ -6,6 +6,7 @@
 #pragma once
 
 #include "JpegEncoderBase.h"
+#include "JpegEntropySlots.h"
 
 #include "../../Shared/ComputeShader.h"
 #include "../../Shared/DX12_ComputeShader.h"
@@ -19,6 +20,23 @@ class JpegEncoderGPU : public JpegEncoderBase
 protected:
 
 	int mEntropyBlockSize;
+	int mNumOverflowSlots;
+
+	//block and overflow slot sizes of the next frames
+	JpegEntropySlotSizer mEntropySlots;
+	bool mResetEntropySlots;
+
+	//ints the entropy buffer holds, it is only replaced to grow
+	int mEntropyCapacity;
+
+	//mapped entropy buffer while the blocks are encoded, the packed blocks only
+	int* mMappedEntropyData;
+
+	//set while MeasureImageData runs the kernels, the blocks are not packed
+	bool mMeasureOnly;
+
+	//payload offsets of the mapped blocks
+	std::vector<int> mBlockOffsets;
 
 	struct ImageData
 	{
@@ -29,6 +47,13 @@ protected:
 		UINT	NumBlocksY;
 
 		int		EntropyBlockSize;
+
+		UINT	OverflowBase;
+		UINT	NumOverflowSlots;
+
+		UINT	NumEntropyBlocks;
+		UINT	SlotBase;
+		UINT	OffsetBase;
 	};
 
 	//D3D
@@ -45,6 +70,10 @@ protected:
 	ComputeShader*				mShader_Cb_Component;
 	ComputeShader*				mShader_Cr_Component;
 
+	//packs the block slots for the readback
+	ComputeShader*				mShader_ScanBlocks;
+	ComputeShader*				mShader_CompactBlocks;
+
 	//Output UAV
 	ComputeBuffer*				mCB_EntropyResult;
 
@@ -69,10 +98,26 @@ protected:
 	bool						mDoCreateBuffers;
 
 private:
+	//sets up the entropy layout of the next frames, creates what is still missing
 	HRESULT CreateBuffers();
 	virtual void ComputationDimensionsChanged();
 
 	virtual void QuantizationTablesChanged();
+	virtual void HuffmanTablesChanged();
+
+	//DCT matrices, Huffman tables, sampler and the constant buffers, created once
+	void CreateTables();
+
+	//the buffer is replaced by one with half again the room so a few larger frames do not each recreate it
+	void ReserveEntropyBuffer(int numInts);
+
+	//image size and entropy layout into the constant buffers
+	void UpdateImageData();
+
+	//the texture is only replaced for a new image size
+	void UploadRGBData(const JEncRGBDataDesc& rgbDataDesc);
+
+	virtual bool ReserveBuffers(int numMCUsX, int numMCUsY);
 
 	float Y_Quantization_Table_Float[64];
 	float CbCr_Quantization_Table_Float[64];
@@ -86,24 +131,48 @@ public:
 
 	virtual bool Init() = 0;
 
+	//JENC_OPTION_DETERMINISTIC recompiles the shaders
+	virtual bool SetOption(JENC_OPTIONS option, int value);
+
 protected:
 	void ReleaseBuffers();
 	void ReleaseQuantizationBuffers();
 	void ReleaseShaders();
 
-	void DoHuffmanEncoding(int* DU, short& prevDC, BitString* HTDC);
+	//component is "Y", "Cb" or "Cr", componentDefine the matching COMPONENT_ macro of the shader,
+	//the packing kernels are compiled with the Y macros and their entry point as component
+	ComputeShader* CreateComponentShader(const JpegMCULayoutInfo& layout, const char* component, const char* componentDefine, const char* entryPoint = "ComputeJPEG");
+
+	//block is the index of the block in the mapped entropy buffer
+	void DoHuffmanEncoding(int block, short& prevDC, BitString* HTDC);
+	void DoHuffmanEncoding(EntropyWriter& writer, int block, short& prevDC, const BitString* HTDC);
+
+	//entropyData holds numMCUs MCUs of numBlocksPerMCU blocks, the per segment coding is up to the layout
+	void EncodeRestartSegments(int* entropyData, int numMCUs, int numBlocksPerMCU);
+	void EncodeScanSegments(int* entropyData, int numMCUs, int numBlocksPerMCU);
 
 	virtual void WriteImageData(JEncRGBDataDesc rgbDataDesc);
 	virtual void WriteImageData(JEncD3DDataDesc d3dDataDesc);
 	virtual void WriteImageData(DX12_JEncD3DDataDesc d3dDataDesc) {}; // empty, is needed from the JpegEncoderBase
 
+	virtual unsigned __int64 MeasureImageData(JEncRGBDataDesc rgbDataDesc);
+	virtual unsigned __int64 MeasureImageData(JEncD3DDataDesc d3dDataDesc);
+	virtual unsigned __int64 MeasureImageData(DX12_JEncD3DDataDesc d3dDataDesc) { return 0; }; // empty, is needed from the JpegEncoderBase
+
 	void DoQuantization(ID3D11ShaderResourceView* pSRV);
 
-	virtual void Dispatch();
+	//maps the packed blocks, the readback stops at the end of the payload
+	int* ReadEntropyData();
+
+	//quantization and entropy coding of a frame, runs it again if the overflow slots ran out
+	void QuantizeAndEncode(ID3D11ShaderResourceView* pSRV);
 
-	virtual void DoEntropyEncode() = 0;
+	//quantization of a frame and the bytes it codes to, only the block headers are read back
+	unsigned __int64 QuantizeAndMeasure(ID3D11ShaderResourceView* pSRV);
+
+	virtual void Dispatch();
 
-	void FinalizeData();
+	virtual void DoEntropyEncode(int* pEntropyData) = 0;
 };
 
 /*
@@ -115,6 +184,23 @@ class DX12_JpegEncoderGPU : public JpegEncoderBase
 protected:
 
 	int mEntropyBlockSize;
+	int mNumOverflowSlots;
+
+	//block and overflow slot sizes of the next frames
+	JpegEntropySlotSizer mEntropySlots;
+	bool mResetEntropySlots;
+
+	//ints the entropy buffer holds, it is only replaced to grow
+	int mEntropyCapacity;
+
+	//mapped entropy buffer while the blocks are encoded, the packed blocks only
+	int* mMappedEntropyData;
+
+	//set while MeasureImageData runs the kernels, the blocks are not packed
+	bool mMeasureOnly;
+
+	//payload offsets of the mapped blocks
+	std::vector<int> mBlockOffsets;
 
 	struct ImageData
 	{
@@ -125,6 +211,13 @@ protected:
 		UINT	NumBlocksY;
 
 		int		EntropyBlockSize;
+
+		UINT	OverflowBase;
+		UINT	NumOverflowSlots;
+
+		UINT	NumEntropyBlocks;
+		UINT	SlotBase;
+		UINT	OffsetBase;
 	};
 
 	// Image resource
@@ -138,6 +231,8 @@ protected:
 	ID3D12PipelineState* mPSO_Y_Component = nullptr;
 	ID3D12PipelineState* mPSO_Cb_Component = nullptr;
 	ID3D12PipelineState* mPSO_Cr_Component = nullptr;
+	ID3D12PipelineState* mPSO_ScanBlocks = nullptr;
+	ID3D12PipelineState* mPSO_CompactBlocks = nullptr;
 
 	// Command lists
 	ID3D12CommandQueue* mDirectQueue = nullptr;
@@ -160,6 +255,10 @@ protected:
 	DX12_ComputeShader*				mShader_Cb_Component;
 	DX12_ComputeShader*				mShader_Cr_Component;
 
+	//packs the block slots for the readback
+	DX12_ComputeShader*				mShader_ScanBlocks;
+	DX12_ComputeShader*				mShader_CompactBlocks;
+
 	//Output UAV
 	DX12_ComputeBuffer*				mCB_EntropyResult; // UAV
 
@@ -198,10 +297,26 @@ private:
 	ID3D12DescriptorHeap* mDescHeapSRV01 = nullptr;
 
 private:
+	//sets up the entropy layout of the next frames, creates what is still missing
 	HRESULT CreateBuffers();
 	virtual void ComputationDimensionsChanged();
 
 	virtual void QuantizationTablesChanged();
+	virtual void HuffmanTablesChanged();
+
+	//DCT matrices, Huffman tables, sampler and the constant buffers, created once
+	void CreateTables();
+
+	//the buffer is replaced by one with half again the room so a few larger frames do not each recreate it
+	void ReserveEntropyBuffer(int numInts);
+
+	//image size and entropy layout into the constant buffers
+	void UpdateImageData();
+
+	//the texture is only replaced for a new image size
+	void UploadRGBData(const JEncRGBDataDesc& rgbDataDesc, wchar_t* debugName);
+
+	virtual bool ReserveBuffers(int numMCUsX, int numMCUsY);
 
 	float Y_Quantization_Table_Float[64];
 	float CbCr_Quantization_Table_Float[64];
@@ -213,7 +328,9 @@ private:
 	HRESULT createDescriptorHeapForSRVs2();
 	HRESULT createRootSignature();
 	HRESULT createAllocatorQueueList();
-	void UpdateQuantizationTable(DX12_ComputeBuffer* quantizationTable, float* quantizationTableFloat);
+	//copies data into a resource on the default heap that is in state between frames and waits for it,
+	//buffers take resource width bytes from data
+	void UpdateResource(ID3D12Resource* resource, D3D12_RESOURCE_STATES state, D3D12_SUBRESOURCE_DATA& data);
 	void shutdown();
 
 public:
@@ -222,24 +339,47 @@ public:
 
 	virtual bool Init() = 0;
 
+	//JENC_OPTION_DETERMINISTIC recompiles the shaders
+	virtual bool SetOption(JENC_OPTIONS option, int value);
+
 protected:
 	void ReleaseBuffers();
 	void ReleaseQuantizationBuffers();
 	void ReleaseShaders();
 
-	void DoHuffmanEncoding(int* DU, short& prevDC, BitString* HTDC);
+	//the packing kernels are compiled with the Y macros
+	DX12_ComputeShader* CreateComponentShader(const JpegMCULayoutInfo& layout, const char* componentDefine, const char* entryPoint = "ComputeJPEG");
+
+	//block is the index of the block in the mapped entropy buffer
+	void DoHuffmanEncoding(int block, short& prevDC, BitString* HTDC);
+	void DoHuffmanEncoding(EntropyWriter& writer, int block, short& prevDC, const BitString* HTDC);
+
+	//entropyData holds numMCUs MCUs of numBlocksPerMCU blocks, the per segment coding is up to the layout
+	void EncodeRestartSegments(int* entropyData, int numMCUs, int numBlocksPerMCU);
+	void EncodeScanSegments(int* entropyData, int numMCUs, int numBlocksPerMCU);
 
 	virtual void WriteImageData(JEncRGBDataDesc rgbDataDesc);
 	virtual void WriteImageData(JEncD3DDataDesc d3dDataDesc) {}; // empty, is needed from the JpegEncoderBase
 	virtual void WriteImageData(DX12_JEncD3DDataDesc d3dDataDesc);
+
+	virtual unsigned __int64 MeasureImageData(JEncRGBDataDesc rgbDataDesc);
+	virtual unsigned __int64 MeasureImageData(JEncD3DDataDesc d3dDataDesc) { return 0; }; // empty, is needed from the JpegEncoderBase
+	virtual unsigned __int64 MeasureImageData(DX12_JEncD3DDataDesc d3dDataDesc);
 	
 	void DoQuantization(ID3D12DescriptorHeap* pSRV);
 
-	virtual void Dispatch();
+	//maps the packed blocks, the readback stops at the end of the payload
+	int* ReadEntropyData();
+
+	//quantization and entropy coding of a frame, runs it again if the overflow slots ran out
+	void QuantizeAndEncode(ID3D12DescriptorHeap* pSRV);
 
-	virtual void DoEntropyEncode() = 0;
+	//quantization of a frame and the bytes it codes to, only the block headers are read back
+	unsigned __int64 QuantizeAndMeasure(ID3D12DescriptorHeap* pSRV);
+
+	virtual void Dispatch();
 
-	void FinalizeData();
+	virtual void DoEntropyEncode(int* pEntropyData) = 0;
 
 	// New functions
 	HRESULT createPiplineStateObjects();
@@ -0,0 +1,258 @@
+//--------------------------------------------------------------------------------------
+// Real-Time JPEG Compression using DirectCompute - Demo
+//
+// Copyright (c) Stefan Petersson 2012. All rights reserved.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include "JpegEncoderGPU.h"
+#include "JpegMCULayout.h"
+#include "JpegThreadPool.h"
+
+/*
+	Entropy coding of the GPU output for one MCU layout, shared by the DX11
+	and DX12 encoders. The GPU packs Layout::NumBlocks entropy blocks per
+	MCU in scan order, see JpegEntropySlots.h, the loops below run over them
+	by block index with the block counts known at compile time.
+*/
+template<class Base, class Layout>
+class JpegEncoderGPU_Layout : public Base
+{
+public:
+	template<class... Args>
+	JpegEncoderGPU_Layout(Args... args)
+		: Base(args...)
+	{
+		this->mSubsampleType = Layout::SubsampleType;
+	}
+
+protected:
+	virtual void DoEntropyEncode(int* pEntropyData)
+	{
+		int numMCUs = this->mComputationWidthY / Layout::Width * this->mComputationHeightY / Layout::Height;
+		if(this->mRestartInterval > 0)
+		{
+			this->EncodeRestartSegments(pEntropyData, numMCUs, Layout::NumBlocks);
+		}
+		else if(JpegThreadPool::Get().GetNumThreads() > 1)
+		{
+			this->EncodeScanSegments(pEntropyData, numMCUs, Layout::NumBlocks);
+		}
+		else
+		{
+			short prevDC[3] = { 0, 0, 0 };
+			int numMCUsPerRow = this->mComputationWidthY / Layout::Width;
+
+			this->mMappedEntropyData = pEntropyData;
+
+			EntropyWriter writer;
+			this->BeginEntropyCoding(writer);
+
+			for(int mcu = 0; mcu < numMCUs; mcu += numMCUsPerRow)
+			{
+				this->ReserveOutput(writer, this->MaxEntropyBytes(numMCUsPerRow));
+				EncodeMCUs(writer, mcu * Layout::NumBlocks, numMCUsPerRow, prevDC);
+			}
+
+			this->EndEntropyCoding(writer);
+
+			this->mMappedEntropyData = NULL;
+		}
+	}
+
+	virtual void EncodeRestartSegment(EntropyWriter& writer, int firstMCU, int lastMCU, int threadIndex)
+	{
+		//DC predictors start over in every segment
+		short prevDC[3] = { 0, 0, 0 };
+
+		EncodeMCUs(writer, GetMCU(firstMCU), lastMCU - firstMCU, prevDC);
+	}
+
+	virtual unsigned __int64 MeasureScanSegment(int firstMCU, int lastMCU)
+	{
+		short prevDC[3];
+		GetPreviousDC(firstMCU, prevDC);
+
+		return MeasureMCUs(firstMCU, lastMCU, prevDC);
+	}
+
+	virtual unsigned __int64 MeasureRestartSegment(int firstMCU, int lastMCU)
+	{
+		short prevDC[3] = { 0, 0, 0 };
+
+		return MeasureMCUs(firstMCU, lastMCU, prevDC);
+	}
+
+	virtual void EncodeScanSegment(EntropyWriter& writer, int firstMCU, int lastMCU)
+	{
+		short prevDC[3];
+		GetPreviousDC(firstMCU, prevDC);
+
+		EncodeMCUs(writer, GetMCU(firstMCU), lastMCU - firstMCU, prevDC);
+	}
+
+private:
+	//DC code and magnitude from the DC difference, the AC bit count is stored by the GPU
+	unsigned __int64 MeasureMCUs(int firstMCU, int lastMCU, short prevDC[3]) const
+	{
+		unsigned __int64 numBits = 0;
+		const int* pHeaders = this->mMappedEntropyData + GetMCU(firstMCU);
+
+		for(int mcu = firstMCU; mcu < lastMCU; mcu++)
+		{
+			for(int i = 0; i < Layout::NumBlocks; i++)
+			{
+				int component = i < Layout::NumBlocksY ? 0 : i - Layout::NumBlocksY + 1;
+				const BitString* HTDC = component == 0 ? this->Y_DC_Huffman_Table : this->Cb_DC_Huffman_Table;
+
+				short DC = JpegEntropySlotSizer::GetDC(pHeaders[i]);
+				short diff = (short)(DC - prevDC[component]);
+				prevDC[component] = DC;
+
+				int nbits = this->NumBitsInUShort[diff < 0 ? -diff : diff];
+				numBits += HTDC[nbits].length + nbits + JpegEntropySlotSizer::GetNumBits(pHeaders[i]);
+			}
+
+			pHeaders += Layout::NumBlocks;
+		}
+
+		return numBits;
+	}
+
+	//index of the first block of mcu
+	int GetMCU(int mcu) const
+	{
+		return mcu * Layout::NumBlocks;
+	}
+
+	//DC of the last Y, Cb and Cr block before mcu, the scan starts with zero predictors
+	void GetPreviousDC(int mcu, short prevDC[3]) const
+	{
+		prevDC[0] = prevDC[1] = prevDC[2] = 0;
+		if(mcu == 0)
+			return;
+
+		const int* pHeaders = this->mMappedEntropyData + GetMCU(mcu - 1);
+
+		prevDC[0] = JpegEntropySlotSizer::GetDC(pHeaders[Layout::NumBlocksY - 1]);
+		prevDC[1] = JpegEntropySlotSizer::GetDC(pHeaders[Layout::NumBlocksY]);
+		prevDC[2] = JpegEntropySlotSizer::GetDC(pHeaders[Layout::NumBlocksY + 1]);
+	}
+
+	void EncodeMCUs(EntropyWriter& writer, int block, int numMCUs, short prevDC[3])
+	{
+		while(numMCUs-- > 0)
+		{
+			for(int i = 0; i < Layout::NumBlocksY; i++)
+				this->DoHuffmanEncoding(writer, block + i, prevDC[0], this->Y_DC_Huffman_Table);
+
+			this->DoHuffmanEncoding(writer, block + Layout::NumBlocksY, prevDC[1], this->Cb_DC_Huffman_Table);
+			this->DoHuffmanEncoding(writer, block + Layout::NumBlocksY + 1, prevDC[2], this->Cb_DC_Huffman_Table);
+
+			block += Layout::NumBlocks;
+		}
+	}
+};
+
+template<class Layout>
+class JpegEncoderGPU_MCU : public JpegEncoderGPU_Layout<JpegEncoderGPU, Layout>
+{
+public:
+	JpegEncoderGPU_MCU(ID3D11Device* d3dDevice, ID3D11DeviceContext* d3dContext)
+		: JpegEncoderGPU_Layout<JpegEncoderGPU, Layout>(d3dDevice, d3dContext)
+	{
+	}
+
+	virtual bool Init()
+	{
+		JpegMCULayoutInfo layout;
+		GetMCULayoutInfo(Layout::SubsampleType, layout);
+
+		this->mShader_Y_Component = this->CreateComponentShader(layout, "Y", "COMPONENT_Y");
+		if(!this->mShader_Y_Component)
+		{
+			return false;
+		}
+
+		this->mShader_Cb_Component = this->CreateComponentShader(layout, "Cb", "COMPONENT_CB");
+		if(!this->mShader_Cb_Component)
+		{
+			return false;
+		}
+
+		this->mShader_Cr_Component = this->CreateComponentShader(layout, "Cr", "COMPONENT_CR");
+		if(!this->mShader_Cr_Component)
+		{
+			return false;
+		}
+
+		this->mShader_ScanBlocks = this->CreateComponentShader(layout, "ScanBlocks", "COMPONENT_Y", "ScanBlocks");
+		this->mShader_CompactBlocks = this->CreateComponentShader(layout, "CompactBlocks", "COMPONENT_Y", "CompactBlocks");
+		if(!this->mShader_ScanBlocks || !this->mShader_CompactBlocks)
+		{
+			return false;
+		}
+
+		return true;
+	}
+};
+
+/*
+	JpegEncoderGPU_MCU for directx 12
+*/
+template<class Layout>
+class DX12_JpegEncoderGPU_MCU : public JpegEncoderGPU_Layout<DX12_JpegEncoderGPU, Layout>
+{
+public:
+	DX12_JpegEncoderGPU_MCU(D3D12Wrap* d3dWrap)
+		: JpegEncoderGPU_Layout<DX12_JpegEncoderGPU, Layout>(d3dWrap)
+	{
+	}
+
+	virtual bool Init()
+	{
+		JpegMCULayoutInfo layout;
+		GetMCULayoutInfo(Layout::SubsampleType, layout);
+
+		this->mShader_Y_Component = this->CreateComponentShader(layout, "COMPONENT_Y");
+		if (!this->mShader_Y_Component)
+		{
+			return false;
+		}
+
+		this->mShader_Cb_Component = this->CreateComponentShader(layout, "COMPONENT_CB");
+		if (!this->mShader_Cb_Component)
+		{
+			return false;
+		}
+
+		this->mShader_Cr_Component = this->CreateComponentShader(layout, "COMPONENT_CR");
+		if (!this->mShader_Cr_Component)
+		{
+			return false;
+		}
+
+		this->mShader_ScanBlocks = this->CreateComponentShader(layout, "COMPONENT_Y", "ScanBlocks");
+		this->mShader_CompactBlocks = this->CreateComponentShader(layout, "COMPONENT_Y", "CompactBlocks");
+		if (!this->mShader_ScanBlocks || !this->mShader_CompactBlocks)
+		{
+			return false;
+		}
+
+		// Create the PSOs
+		if (FAILED(this->createPiplineStateObjects()))
+		{
+			exit(-1);
+		}
+
+		return true;
+	}
+};
+
+typedef JpegEncoderGPU_MCU<JpegMCULayout_444> JpegEncoderGPU_444;
+typedef JpegEncoderGPU_MCU<JpegMCULayout_422> JpegEncoderGPU_422;
+typedef JpegEncoderGPU_MCU<JpegMCULayout_420> JpegEncoderGPU_420;
+
+typedef DX12_JpegEncoderGPU_MCU<JpegMCULayout_444> DX12_JpegEncoderGPU_444;
+typedef DX12_JpegEncoderGPU_MCU<JpegMCULayout_422> DX12_JpegEncoderGPU_422;
+typedef DX12_JpegEncoderGPU_MCU<JpegMCULayout_420> DX12_JpegEncoderGPU_420;
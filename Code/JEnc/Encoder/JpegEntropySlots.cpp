@@ -0,0 +1,163 @@
+//--------------------------------------------------------------------------------------
+// Real-Time JPEG Compression using DirectCompute - Demo
+//
+// Copyright (c) Stefan Petersson 2012. All rights reserved.
+//--------------------------------------------------------------------------------------
+#include "JpegEntropySlots.h"
+
+//never fewer overflow slots, a handful of noisy blocks should not cost a second pass
+static const int MinOverflowSlots = 16;
+
+//a new layout has to save this many percent of the readback, recreating the buffers is not free
+static const int MinSavingPercent = 10;
+
+JpegEntropySlotSizer::JpegEntropySlotSizer()
+{
+	mBlockSize = 0;
+	mNumBlocks = 0;
+	mNumOverflowSlots = MinOverflowSlots;
+	mNumPayloadWords = -1;
+}
+
+void JpegEntropySlotSizer::Reset(int blockSize, int numBlocks)
+{
+	mBlockSize = blockSize;
+	mNumBlocks = numBlocks;
+
+	//without statistics one block in 64 may overflow
+	mNumOverflowSlots = GetNumOverflowSlots(numBlocks / 128);
+	mNumPayloadWords = -1;
+}
+
+int JpegEntropySlotSizer::GetReadbackSize() const
+{
+	if(mNumPayloadWords < 0)
+		return GetSlotBase();
+
+	//some room for the next frame, a second copy costs more than a few kilobytes
+	return GetPackedSize(mNumPayloadWords + mNumPayloadWords / 8 + 1024);
+}
+
+int JpegEntropySlotSizer::GetPackedSize(int numPayloadWords) const
+{
+	int capacity = GetPayloadCapacity();
+
+	return mNumBlocks + 1 + (numPayloadWords < capacity ? numPayloadWords : capacity);
+}
+
+int JpegEntropySlotSizer::GetNumOverflowSlots(int numOverflowBlocks) const
+{
+	//twice the blocks for the next frame to grow into, a power of two for the slot index mask
+	int numSlots = MinOverflowSlots;
+	while(numSlots < 2 * numOverflowBlocks)
+		numSlots *= 2;
+
+	return numSlots;
+}
+
+bool JpegEntropySlotSizer::Update(const int* entropyData)
+{
+	mHistogram.assign(JPEG_OVERFLOW_SLOT_WORDS + 1, 0);
+
+	mNumPayloadWords = entropyData[mNumBlocks];
+
+	int numOverflowBlocks = 0;
+	for(int i = 0; i < mNumBlocks; i++)
+	{
+		int numBits = GetNumBits(entropyData[i]);
+		int numWords = (numBits + 31) / 32;
+
+		mHistogram[numWords < JPEG_OVERFLOW_SLOT_WORDS ? numWords : JPEG_OVERFLOW_SLOT_WORDS]++;
+		numOverflowBlocks += numBits > (mBlockSize - 2) * 32;
+	}
+
+	//some blocks lost their bits, keep the block size so the frame comes out the same again
+	if(numOverflowBlocks > mNumOverflowSlots)
+	{
+		mNumOverflowSlots = GetNumOverflowSlots(numOverflowBlocks);
+		return false;
+	}
+
+	//buffer size of every block size for this frame, blocks above it in the overflow area
+	long long bestSize = 0;
+	int bestBlockSize = mBlockSize;
+	long long currentSize = 0;
+
+	int numAbove = mNumBlocks - mHistogram[0];
+	for(int numWords = 1; numWords <= JPEG_OVERFLOW_SLOT_WORDS; numWords++)
+	{
+		numAbove -= mHistogram[numWords];
+
+		long long size = (long long)mNumBlocks * (numWords + 2) + (long long)GetNumOverflowSlots(numAbove) * JPEG_OVERFLOW_SLOT_WORDS;
+		if(bestSize == 0 || size < bestSize)
+		{
+			bestSize = size;
+			bestBlockSize = numWords + 2;
+		}
+
+		if(numWords + 2 == mBlockSize)
+			currentSize = size;
+	}
+
+	//the current layout is kept unless the new one saves enough or the overflow area gets tight
+	bool overflowTight = 2 * numOverflowBlocks > mNumOverflowSlots;
+	if(overflowTight || bestSize * 100 < currentSize * (100 - MinSavingPercent))
+	{
+		int numAboveBest = 0;
+		for(int numWords = bestBlockSize - 1; numWords <= JPEG_OVERFLOW_SLOT_WORDS; numWords++)
+			numAboveBest += mHistogram[numWords];
+
+		mBlockSize = bestBlockSize;
+		mNumOverflowSlots = GetNumOverflowSlots(numAboveBest);
+	}
+
+	return true;
+}
+
+void JpegEntropySlotSizer::PackBlocks(int* entropyData) const
+{
+	int* payload = entropyData + mNumBlocks + 1;
+	int* offsets = entropyData + GetOffsetBase();
+	int capacity = GetPayloadCapacity();
+
+	//ScanBlocks, headers and offsets
+	int offset = 0;
+	for(int i = 0; i < mNumBlocks; i++)
+	{
+		const int* DU = entropyData + GetSlotBase() + i * mBlockSize;
+		int numBits = DU[mBlockSize - 1];
+
+		entropyData[i] = (numBits << 16) | (DU[0] & 0xFFFF);
+		offsets[i] = offset;
+		offset += (numBits + 31) / 32;
+	}
+
+	entropyData[mNumBlocks] = offset;
+
+	//CompactBlocks, the AC words from the block slot or its overflow slot
+	for(int i = 0; i < mNumBlocks; i++)
+	{
+		const int* DU = entropyData + GetSlotBase() + i * mBlockSize;
+		int numBits = DU[mBlockSize - 1];
+		int numWords = (numBits + 31) / 32;
+
+		const int* AC = DU + 1;
+		if(numBits > (mBlockSize - 2) * 32)
+			AC = entropyData + GetOverflowBase() + 1 + ((unsigned int)DU[1] & (mNumOverflowSlots - 1)) * JPEG_OVERFLOW_SLOT_WORDS;
+
+		for(int w = 0; w < numWords && offsets[i] + w < capacity; w++)
+			payload[offsets[i] + w] = AC[w];
+	}
+}
+
+int JpegEntropySlotSizer::ComputeBlockOffsets(const int* entropyData, int numBlocks, int* outOffsets)
+{
+	int offset = 0;
+	for(int i = 0; i < numBlocks; i++)
+	{
+		outOffsets[i] = offset;
+		offset += (GetNumBits(entropyData[i]) + 31) / 32;
+	}
+
+	return offset;
+}
@@ -0,0 +1,93 @@
+//--------------------------------------------------------------------------------------
+// Real-Time JPEG Compression using DirectCompute - Demo
+//
+// Copyright (c) Stefan Petersson 2012. All rights reserved.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include <vector>
+
+//AC words of the largest possible block, 63 16 bit codes with 10 magnitude bits
+#define JPEG_OVERFLOW_SLOT_WORDS	52
+
+//groups per row of the CompactBlocks dispatch, the rows are added as needed
+#define JPEG_COMPACT_GROUPS_X		256
+
+/*
+	Layout of the GPU entropy buffer in ints. ComputeJPEG writes every block
+	to a slot of BlockSize ints, the DC, BlockSize - 2 words of AC bits and
+	the AC bit count. A block with more AC bits than that takes the next of
+	the overflow slots through an atomic counter and leaves its index in the
+	first AC word, so nothing is ever cut off. ScanBlocks and CompactBlocks
+	then pack the blocks to the front of the buffer, which is all the CPU
+	reads back:
+
+		[NumBlocks]				headers, AC bit count << 16 | DC
+		[1]						payload words
+		[PayloadCapacity]		AC words of all blocks in scan order, no gaps
+		[NumBlocks * BlockSize]	block slots
+		[1]						overflow counter, never reset, only the low bits count
+		[NumOverflowSlots * JPEG_OVERFLOW_SLOT_WORDS]
+		[NumBlocks]				payload offsets of the blocks
+
+	The offset of a block is the sum of the AC words of the blocks before it,
+	the CPU computes them again from the headers with ComputeBlockOffsets.
+
+	The slot size is picked from the AC bit counts of the previous frame, as
+	small as it gets before the overflow slots cost more memory than they
+	save. The layout only changes when that saves a good part of the buffer.
+*/
+class JpegEntropySlotSizer
+{
+public:
+	JpegEntropySlotSizer();
+
+	//first guess before there are any statistics
+	void Reset(int blockSize, int numBlocks);
+
+	int GetBlockSize() const { return mBlockSize; }
+	int GetNumBlocks() const { return mNumBlocks; }
+	int GetNumOverflowSlots() const { return mNumOverflowSlots; }
+
+	//the regions above, in ints from the start of the buffer
+	int GetPayloadCapacity() const { return mNumBlocks * (mBlockSize - 2) + mNumOverflowSlots * JPEG_OVERFLOW_SLOT_WORDS; }
+	int GetSlotBase() const { return mNumBlocks + 1 + GetPayloadCapacity(); }
+	int GetOverflowBase() const { return GetSlotBase() + mNumBlocks * mBlockSize; }
+	int GetOffsetBase() const { return GetOverflowBase() + 1 + mNumOverflowSlots * JPEG_OVERFLOW_SLOT_WORDS; }
+	int GetBufferSize() const { return GetOffsetBase() + mNumBlocks; }
+
+	//ints to read back for the packed blocks of a frame, from the payload of the last one
+	int GetReadbackSize() const;
+
+	//ints of the packed blocks once the payload size of the frame is known
+	int GetPackedSize(int numPayloadWords) const;
+
+	//collects the AC bit counts from the headers of a frame and picks the layout of the next one,
+	//so the caller keeps the layout the frame was written with. Returns false if more blocks
+	//overflowed than there were overflow slots, the overflow area is grown to fit them and the
+	//frame has to be run again with the same block size.
+	bool Update(const int* entropyData);
+
+	//CPU reference of ScanBlocks and CompactBlocks in Jpeg_CS.hlsl, packs the block slots of
+	//entropyData the way the GPU does
+	void PackBlocks(int* entropyData) const;
+
+	//payload offsets of the blocks from their headers, returns the number of payload words
+	static int ComputeBlockOffsets(const int* entropyData, int numBlocks, int* outOffsets);
+
+	static short GetDC(int header) { return (short)(header & 0xFFFF); }
+	static int GetNumBits(int header) { return (int)((unsigned int)header >> 16); }
+
+private:
+	int GetNumOverflowSlots(int numOverflowBlocks) const;
+
+	int mBlockSize;
+	int mNumBlocks;
+	int mNumOverflowSlots;
+
+	//payload words of the last frame, -1 before the first one
+	int mNumPayloadWords;
+
+	//blocks per number of AC words
+	std::vector<int> mHistogram;
+};
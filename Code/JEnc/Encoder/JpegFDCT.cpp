@@ -0,0 +1,813 @@
+//--------------------------------------------------------------------------------------
+// Real-Time JPEG Compression using DirectCompute - Demo
+//
+// Copyright (c) Stefan Petersson 2012. All rights reserved.
+//--------------------------------------------------------------------------------------
+#include "JpegFDCT.h"
+#include "JpegQuantize.h"
+
+#include "../../Shared/JpegCommon.h"
+
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+// CPU feature detection
+//////////////////////////////////////////////////////////////////////////
+static bool DetectAVX2()
+{
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if(info[0] < 7)
+		return false;
+
+	//OSXSAVE and AVX, then make sure the OS saves the ymm registers
+	__cpuid(info, 1);
+	if((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0)
+		return false;
+	if((_xgetbv(0) & 6) != 6)
+		return false;
+
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+static const bool sUseAVX2 = DetectAVX2();
+
+bool FDCT_UsesAVX2()
+{
+	return sUseAVX2;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// islow, Loeffler-Ligtenberg-Moschytz with 13 bit constants
+//////////////////////////////////////////////////////////////////////////
+#define ISLOW_CONST_BITS	13
+#define ISLOW_PASS1_BITS	2
+
+#define FIX_0_298631336		2446
+#define FIX_0_390180644		3196
+#define FIX_0_541196100		4433
+#define FIX_0_765366865		6270
+#define FIX_0_899976223		7373
+#define FIX_1_175875602		9633
+#define FIX_1_501321110		12299
+#define FIX_1_847759065		15137
+#define FIX_1_961570560		16069
+#define FIX_2_053119869		16819
+#define FIX_2_562915447		20995
+#define FIX_3_072711026		25172
+
+#define DESCALE(x, n)		(((x) + (1 << ((n) - 1))) >> (n))
+
+// one 1D pass over 8 values spaced stride apart, pass 1 works on rows and
+// keeps PASS1_BITS of extra precision, pass 2 works on columns and removes it
+template<int pass, typename In, typename Out>
+static inline void ISlow1D(const In* in, int inStride, Out* out, int outStride)
+{
+	int tmp0 = in[0 * inStride] + in[7 * inStride];
+	int tmp7 = in[0 * inStride] - in[7 * inStride];
+	int tmp1 = in[1 * inStride] + in[6 * inStride];
+	int tmp6 = in[1 * inStride] - in[6 * inStride];
+	int tmp2 = in[2 * inStride] + in[5 * inStride];
+	int tmp5 = in[2 * inStride] - in[5 * inStride];
+	int tmp3 = in[3 * inStride] + in[4 * inStride];
+	int tmp4 = in[3 * inStride] - in[4 * inStride];
+
+	const int descale = pass == 1 ? ISLOW_CONST_BITS - ISLOW_PASS1_BITS : ISLOW_CONST_BITS + ISLOW_PASS1_BITS;
+
+	//even part
+	int tmp10 = tmp0 + tmp3;
+	int tmp13 = tmp0 - tmp3;
+	int tmp11 = tmp1 + tmp2;
+	int tmp12 = tmp1 - tmp2;
+
+	if(pass == 1)
+	{
+		out[0 * outStride] = (Out)((tmp10 + tmp11) << ISLOW_PASS1_BITS);
+		out[4 * outStride] = (Out)((tmp10 - tmp11) << ISLOW_PASS1_BITS);
+	}
+	else
+	{
+		out[0 * outStride] = (Out)DESCALE(tmp10 + tmp11, ISLOW_PASS1_BITS);
+		out[4 * outStride] = (Out)DESCALE(tmp10 - tmp11, ISLOW_PASS1_BITS);
+	}
+
+	int z1 = (tmp12 + tmp13) * FIX_0_541196100;
+	out[2 * outStride] = (Out)DESCALE(z1 + tmp13 * FIX_0_765366865, descale);
+	out[6 * outStride] = (Out)DESCALE(z1 + tmp12 * -FIX_1_847759065, descale);
+
+	//odd part
+	z1 = tmp4 + tmp7;
+	int z2 = tmp5 + tmp6;
+	int z3 = tmp4 + tmp6;
+	int z4 = tmp5 + tmp7;
+	int z5 = (z3 + z4) * FIX_1_175875602;
+
+	tmp4 *= FIX_0_298631336;
+	tmp5 *= FIX_2_053119869;
+	tmp6 *= FIX_3_072711026;
+	tmp7 *= FIX_1_501321110;
+	z1 *= -FIX_0_899976223;
+	z2 *= -FIX_2_562915447;
+	z3 *= -FIX_1_961570560;
+	z4 *= -FIX_0_390180644;
+
+	z3 += z5;
+	z4 += z5;
+
+	out[7 * outStride] = (Out)DESCALE(tmp4 + z1 + z3, descale);
+	out[5 * outStride] = (Out)DESCALE(tmp5 + z2 + z4, descale);
+	out[3 * outStride] = (Out)DESCALE(tmp6 + z2 + z3, descale);
+	out[1 * outStride] = (Out)DESCALE(tmp7 + z1 + z4, descale);
+}
+
+void ComputeFDCT_ISlow_Scalar(const short* samples, int pitch, short coefficients[64])
+{
+	int workspace[64];
+
+	for(int y = 0; y < 8; y++)
+		ISlow1D<1>(samples + y * pitch, 1, workspace + y * 8, 1);
+
+	for(int x = 0; x < 8; x++)
+		ISlow1D<2>(workspace + x, 8, coefficients + x, 8);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// ifast, Arai-Agui-Nakajima with 8 bit constants, output scaled by the AAN factors
+//////////////////////////////////////////////////////////////////////////
+#define IFAST_CONST_BITS	8
+
+#define FIX_0_382683433_FAST	98
+#define FIX_0_541196100_FAST	139
+#define FIX_0_707106781_FAST	181
+#define FIX_1_306562965_FAST	334
+
+#define IFAST_MULTIPLY(x, c)	(((x) * (c)) >> IFAST_CONST_BITS)
+
+template<typename In, typename Out>
+static inline void IFast1D(const In* in, int inStride, Out* out, int outStride)
+{
+	int tmp0 = in[0 * inStride] + in[7 * inStride];
+	int tmp7 = in[0 * inStride] - in[7 * inStride];
+	int tmp1 = in[1 * inStride] + in[6 * inStride];
+	int tmp6 = in[1 * inStride] - in[6 * inStride];
+	int tmp2 = in[2 * inStride] + in[5 * inStride];
+	int tmp5 = in[2 * inStride] - in[5 * inStride];
+	int tmp3 = in[3 * inStride] + in[4 * inStride];
+	int tmp4 = in[3 * inStride] - in[4 * inStride];
+
+	//even part
+	int tmp10 = tmp0 + tmp3;
+	int tmp13 = tmp0 - tmp3;
+	int tmp11 = tmp1 + tmp2;
+	int tmp12 = tmp1 - tmp2;
+
+	out[0 * outStride] = (Out)(tmp10 + tmp11);
+	out[4 * outStride] = (Out)(tmp10 - tmp11);
+
+	int z1 = IFAST_MULTIPLY(tmp12 + tmp13, FIX_0_707106781_FAST);
+	out[2 * outStride] = (Out)(tmp13 + z1);
+	out[6 * outStride] = (Out)(tmp13 - z1);
+
+	//odd part
+	tmp10 = tmp4 + tmp5;
+	tmp11 = tmp5 + tmp6;
+	tmp12 = tmp6 + tmp7;
+
+	int z5 = IFAST_MULTIPLY(tmp10 - tmp12, FIX_0_382683433_FAST);
+	int z2 = IFAST_MULTIPLY(tmp10, FIX_0_541196100_FAST) + z5;
+	int z4 = IFAST_MULTIPLY(tmp12, FIX_1_306562965_FAST) + z5;
+	int z3 = IFAST_MULTIPLY(tmp11, FIX_0_707106781_FAST);
+
+	int z11 = tmp7 + z3;
+	int z13 = tmp7 - z3;
+
+	out[5 * outStride] = (Out)(z13 + z2);
+	out[3 * outStride] = (Out)(z13 - z2);
+	out[1 * outStride] = (Out)(z11 + z4);
+	out[7 * outStride] = (Out)(z11 - z4);
+}
+
+void ComputeFDCT_IFast_Scalar(const short* samples, int pitch, short coefficients[64])
+{
+	int workspace[64];
+
+	for(int y = 0; y < 8; y++)
+		IFast1D(samples + y * pitch, 1, workspace + y * 8, 1);
+
+	for(int x = 0; x < 8; x++)
+		IFast1D(workspace + x, 8, coefficients + x, 8);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// float, Arai-Agui-Nakajima, output scaled by the AAN factors
+//////////////////////////////////////////////////////////////////////////
+template<typename In>
+static inline void Float1D(const In* in, int inStride, float* out, int outStride)
+{
+	float tmp0 = (float)in[0 * inStride] + (float)in[7 * inStride];
+	float tmp7 = (float)in[0 * inStride] - (float)in[7 * inStride];
+	float tmp1 = (float)in[1 * inStride] + (float)in[6 * inStride];
+	float tmp6 = (float)in[1 * inStride] - (float)in[6 * inStride];
+	float tmp2 = (float)in[2 * inStride] + (float)in[5 * inStride];
+	float tmp5 = (float)in[2 * inStride] - (float)in[5 * inStride];
+	float tmp3 = (float)in[3 * inStride] + (float)in[4 * inStride];
+	float tmp4 = (float)in[3 * inStride] - (float)in[4 * inStride];
+
+	//even part
+	float tmp10 = tmp0 + tmp3;
+	float tmp13 = tmp0 - tmp3;
+	float tmp11 = tmp1 + tmp2;
+	float tmp12 = tmp1 - tmp2;
+
+	out[0 * outStride] = tmp10 + tmp11;
+	out[4 * outStride] = tmp10 - tmp11;
+
+	float z1 = (tmp12 + tmp13) * 0.707106781f;
+	out[2 * outStride] = tmp13 + z1;
+	out[6 * outStride] = tmp13 - z1;
+
+	//odd part
+	tmp10 = tmp4 + tmp5;
+	tmp11 = tmp5 + tmp6;
+	tmp12 = tmp6 + tmp7;
+
+	float z5 = (tmp10 - tmp12) * 0.382683433f;
+	float z2 = tmp10 * 0.541196100f + z5;
+	float z4 = tmp12 * 1.306562965f + z5;
+	float z3 = tmp11 * 0.707106781f;
+
+	float z11 = tmp7 + z3;
+	float z13 = tmp7 - z3;
+
+	out[5 * outStride] = z13 + z2;
+	out[3 * outStride] = z13 - z2;
+	out[1 * outStride] = z11 + z4;
+	out[7 * outStride] = z11 - z4;
+}
+
+void ComputeFDCT_Float_Scalar(const short* samples, int pitch, float coefficients[64])
+{
+	float workspace[64];
+
+	for(int y = 0; y < 8; y++)
+		Float1D(samples + y * pitch, 1, workspace + y * 8, 1);
+
+	for(int x = 0; x < 8; x++)
+		Float1D(workspace + x, 8, coefficients + x, 8);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// AVX2, one register per row, the butterflies work on all 8 rows (or
+// columns) at once and two transposes move between the passes
+//////////////////////////////////////////////////////////////////////////
+
+//GCC and Clang only emit AVX2 in functions marked for it, so the rest of
+//the file still runs on CPUs without it
+#if defined(_MSC_VER)
+#define JPEG_TARGET_AVX2
+#else
+#define JPEG_TARGET_AVX2	__attribute__((target("avx2")))
+#endif
+
+JPEG_TARGET_AVX2 static inline void Transpose8x8(__m256i r[8])
+{
+	__m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+	__m256i t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+	__m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]);
+	__m256i t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+	__m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]);
+	__m256i t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+	__m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]);
+	__m256i t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+
+	__m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+	__m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+	__m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+	__m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+	__m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+	__m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+	__m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+	__m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+
+	r[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+	r[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+	r[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+	r[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+	r[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+	r[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+	r[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+	r[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+JPEG_TARGET_AVX2 static inline void Transpose8x8(__m256 r[8])
+{
+	__m256 t0 = _mm256_unpacklo_ps(r[0], r[1]);
+	__m256 t1 = _mm256_unpackhi_ps(r[0], r[1]);
+	__m256 t2 = _mm256_unpacklo_ps(r[2], r[3]);
+	__m256 t3 = _mm256_unpackhi_ps(r[2], r[3]);
+	__m256 t4 = _mm256_unpacklo_ps(r[4], r[5]);
+	__m256 t5 = _mm256_unpackhi_ps(r[4], r[5]);
+	__m256 t6 = _mm256_unpacklo_ps(r[6], r[7]);
+	__m256 t7 = _mm256_unpackhi_ps(r[6], r[7]);
+
+	__m256 u0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+	__m256 u1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+	__m256 u2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+	__m256 u3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+	__m256 u4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+	__m256 u5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+	__m256 u6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+	__m256 u7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+
+	r[0] = _mm256_permute2f128_ps(u0, u4, 0x20);
+	r[1] = _mm256_permute2f128_ps(u1, u5, 0x20);
+	r[2] = _mm256_permute2f128_ps(u2, u6, 0x20);
+	r[3] = _mm256_permute2f128_ps(u3, u7, 0x20);
+	r[4] = _mm256_permute2f128_ps(u0, u4, 0x31);
+	r[5] = _mm256_permute2f128_ps(u1, u5, 0x31);
+	r[6] = _mm256_permute2f128_ps(u2, u6, 0x31);
+	r[7] = _mm256_permute2f128_ps(u3, u7, 0x31);
+}
+
+JPEG_TARGET_AVX2 static inline void LoadRows(const short* samples, int pitch, __m256i rows[8])
+{
+	for(int y = 0; y < 8; y++)
+		rows[y] = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(samples + y * pitch)));
+}
+
+JPEG_TARGET_AVX2 static inline void StoreRows(const __m256i rows[8], short coefficients[64])
+{
+	//packs works per 128 bit lane, restore the row order afterwards
+	for(int y = 0; y < 8; y += 2)
+	{
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(rows[y], rows[y + 1]), _MM_SHUFFLE(3, 1, 2, 0));
+		_mm256_storeu_si256((__m256i*)(coefficients + y * 8), packed);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// AVX2 islow on 16 bit words, a register holds two rows (or columns) of the
+// block. pmaddwd does the rotations with the constants of each output
+// folded together, which gives the same integers as ISlow1D. Every value
+// fits 16 bits for 8 bit samples, the bounds are the ones of libjpeg-turbo's
+// jfdctint-avx2.
+//////////////////////////////////////////////////////////////////////////
+
+#define SWAP_LANES(x)	_mm256_permute2x128_si256(x, x, 0x01)
+
+//the same pair of 16 bit constants in every dword of a lane
+JPEG_TARGET_AVX2 static inline __m256i PairConstants(short lo0, short lo1, short hi0, short hi1)
+{
+	return _mm256_setr_epi16(lo0, lo1, lo0, lo1, lo0, lo1, lo0, lo1, hi0, hi1, hi0, hi1, hi0, hi1, hi0, hi1);
+}
+
+// r[i] holds rows i and i + 4, returns columns 0 1, 3 2, 4 5 and 7 6 which
+// lines up the butterflies of the next pass without lane swaps
+JPEG_TARGET_AVX2 static inline void Transpose8x8Words(__m256i r[4])
+{
+	__m256i s0 = _mm256_unpacklo_epi16(r[0], r[1]);
+	__m256i s1 = _mm256_unpackhi_epi16(r[0], r[1]);
+	__m256i s2 = _mm256_unpacklo_epi16(r[2], r[3]);
+	__m256i s3 = _mm256_unpackhi_epi16(r[2], r[3]);
+
+	__m256i t0 = _mm256_unpacklo_epi32(s0, s2);
+	__m256i t1 = _mm256_unpackhi_epi32(s0, s2);
+	__m256i t2 = _mm256_unpacklo_epi32(s1, s3);
+	__m256i t3 = _mm256_unpackhi_epi32(s1, s3);
+
+	//every lane has the upper or lower half of two columns, regroup per column
+	r[0] = _mm256_permute4x64_epi64(t0, _MM_SHUFFLE(3, 1, 2, 0));
+	r[1] = _mm256_permute4x64_epi64(t1, _MM_SHUFFLE(2, 0, 3, 1));
+	r[2] = _mm256_permute4x64_epi64(t2, _MM_SHUFFLE(3, 1, 2, 0));
+	r[3] = _mm256_permute4x64_epi64(t3, _MM_SHUFFLE(2, 0, 3, 1));
+}
+
+template<int descale>
+JPEG_TARGET_AVX2 static inline __m256i DescalePack(__m256i lo, __m256i hi)
+{
+	const __m256i round = _mm256_set1_epi32(1 << (descale - 1));
+	lo = _mm256_srai_epi32(_mm256_add_epi32(lo, round), descale);
+	hi = _mm256_srai_epi32(_mm256_add_epi32(hi, round), descale);
+	return _mm256_packs_epi32(lo, hi);
+}
+
+//the odd outputs written out per input, same sums as the z1..z5 of ISlow1D
+#define ODD_4_1		(FIX_1_175875602 - FIX_0_899976223)
+#define ODD_4_3		(FIX_1_175875602 - FIX_1_961570560)
+#define ODD_4_5		(FIX_1_175875602)
+#define ODD_4_7		(FIX_0_298631336 - FIX_0_899976223 - FIX_1_961570560 + FIX_1_175875602)
+#define ODD_5_1		(FIX_1_175875602 - FIX_0_390180644)
+#define ODD_5_3		(FIX_1_175875602 - FIX_2_562915447)
+#define ODD_5_5		(FIX_2_053119869 - FIX_2_562915447 - FIX_0_390180644 + FIX_1_175875602)
+#define ODD_5_7		(FIX_1_175875602)
+#define ODD_6_1		(FIX_1_175875602)
+#define ODD_6_3		(FIX_3_072711026 - FIX_2_562915447 - FIX_1_961570560 + FIX_1_175875602)
+#define ODD_6_5		(FIX_1_175875602 - FIX_2_562915447)
+#define ODD_6_7		(FIX_1_175875602 - FIX_1_961570560)
+#define ODD_7_1		(FIX_1_501321110 - FIX_0_899976223 - FIX_0_390180644 + FIX_1_175875602)
+#define ODD_7_3		(FIX_1_175875602)
+#define ODD_7_5		(FIX_1_175875602 - FIX_0_390180644)
+#define ODD_7_7		(FIX_1_175875602 - FIX_0_899976223)
+
+// r holds vectors 0 1, 3 2, 4 5 and 7 6, on return outputs i and i + 4
+template<int pass>
+JPEG_TARGET_AVX2 static inline void ISlow1D_AVX2(__m256i r[4])
+{
+	const int descale = pass == 1 ? ISLOW_CONST_BITS - ISLOW_PASS1_BITS : ISLOW_CONST_BITS + ISLOW_PASS1_BITS;
+
+	__m256i tmp01 = _mm256_add_epi16(r[0], r[3]);
+	__m256i tmp76 = _mm256_sub_epi16(r[0], r[3]);
+	__m256i tmp32 = _mm256_add_epi16(r[1], r[2]);
+	__m256i tmp45 = _mm256_sub_epi16(r[1], r[2]);
+
+	//even part
+	__m256i tmp1011 = _mm256_add_epi16(tmp01, tmp32);
+	__m256i tmp1312 = _mm256_sub_epi16(tmp01, tmp32);
+
+	//tmp10 + tmp11 and tmp10 - tmp11
+	__m256i out04 = _mm256_add_epi16(SWAP_LANES(tmp1011), _mm256_sign_epi16(tmp1011, PairConstants(1, 1, -1, -1)));
+	if(pass == 1)
+		r[0] = _mm256_slli_epi16(out04, ISLOW_PASS1_BITS);
+	else
+		r[0] = _mm256_srai_epi16(_mm256_add_epi16(out04, _mm256_set1_epi16(1 << (ISLOW_PASS1_BITS - 1))), ISLOW_PASS1_BITS);
+
+	//(tmp13, tmp12) pairs in the low lane, (tmp12, tmp13) in the high one
+	__m256i tmp1213 = SWAP_LANES(tmp1312);
+	__m256i lo = _mm256_unpacklo_epi16(tmp1312, tmp1213);
+	__m256i hi = _mm256_unpackhi_epi16(tmp1312, tmp1213);
+	const __m256i k26 = PairConstants(FIX_0_541196100 + FIX_0_765366865, FIX_0_541196100, FIX_0_541196100 - FIX_1_847759065, FIX_0_541196100);
+	r[2] = DescalePack<descale>(_mm256_madd_epi16(lo, k26), _mm256_madd_epi16(hi, k26));
+
+	//odd part, (tmp4, tmp7) and (tmp5, tmp6) pairs, the swapped copy has the other two
+	__m256i x1lo = _mm256_unpacklo_epi16(tmp45, tmp76);
+	__m256i x1hi = _mm256_unpackhi_epi16(tmp45, tmp76);
+	__m256i x2lo = SWAP_LANES(x1lo);
+	__m256i x2hi = SWAP_LANES(x1hi);
+
+	const __m256i k15a = PairConstants(ODD_4_1, ODD_7_1, ODD_5_5, ODD_6_5);
+	const __m256i k15b = PairConstants(ODD_5_1, ODD_6_1, ODD_4_5, ODD_7_5);
+	const __m256i k37a = PairConstants(ODD_4_3, ODD_7_3, ODD_5_7, ODD_6_7);
+	const __m256i k37b = PairConstants(ODD_5_3, ODD_6_3, ODD_4_7, ODD_7_7);
+
+	r[1] = DescalePack<descale>(_mm256_add_epi32(_mm256_madd_epi16(x1lo, k15a), _mm256_madd_epi16(x2lo, k15b)),
+		_mm256_add_epi32(_mm256_madd_epi16(x1hi, k15a), _mm256_madd_epi16(x2hi, k15b)));
+	r[3] = DescalePack<descale>(_mm256_add_epi32(_mm256_madd_epi16(x1lo, k37a), _mm256_madd_epi16(x2lo, k37b)),
+		_mm256_add_epi32(_mm256_madd_epi16(x1hi, k37a), _mm256_madd_epi16(x2hi, k37b)));
+}
+
+// r[i] gets rows i and i + 4
+JPEG_TARGET_AVX2 static inline void LoadRowPairs(const short* src, int pitch, __m256i r[4])
+{
+	for(int y = 0; y < 4; y++)
+	{
+		__m128i lo = _mm_loadu_si128((const __m128i*)(src + y * pitch));
+		__m128i hi = _mm_loadu_si128((const __m128i*)(src + (y + 4) * pitch));
+		r[y] = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+	}
+}
+
+JPEG_TARGET_AVX2 static inline void StoreRowPairs(const __m256i r[4], short coefficients[64])
+{
+	for(int y = 0; y < 4; y++)
+	{
+		_mm_storeu_si128((__m128i*)(coefficients + y * 8), _mm256_castsi256_si128(r[y]));
+		_mm_storeu_si128((__m128i*)(coefficients + (y + 4) * 8), _mm256_extracti128_si256(r[y], 1));
+	}
+}
+
+JPEG_TARGET_AVX2 static inline void ISlowRowPairs_AVX2(const short* samples, int pitch, __m256i r[4])
+{
+	LoadRowPairs(samples, pitch, r);
+
+	//rows
+	Transpose8x8Words(r);
+	ISlow1D_AVX2<1>(r);
+
+	//columns
+	Transpose8x8Words(r);
+	ISlow1D_AVX2<2>(r);
+}
+
+JPEG_TARGET_AVX2 static void ComputeFDCT_ISlow_AVX2(const short* samples, int pitch, short coefficients[64])
+{
+	__m256i r[4];
+	ISlowRowPairs_AVX2(samples, pitch, r);
+	StoreRowPairs(r, coefficients);
+}
+
+#define MULFAST(x, c)	_mm256_srai_epi32(_mm256_mullo_epi32(x, _mm256_set1_epi32(c)), IFAST_CONST_BITS)
+
+JPEG_TARGET_AVX2 static inline void IFast1D_AVX2(__m256i d[8])
+{
+	__m256i tmp0 = _mm256_add_epi32(d[0], d[7]);
+	__m256i tmp7 = _mm256_sub_epi32(d[0], d[7]);
+	__m256i tmp1 = _mm256_add_epi32(d[1], d[6]);
+	__m256i tmp6 = _mm256_sub_epi32(d[1], d[6]);
+	__m256i tmp2 = _mm256_add_epi32(d[2], d[5]);
+	__m256i tmp5 = _mm256_sub_epi32(d[2], d[5]);
+	__m256i tmp3 = _mm256_add_epi32(d[3], d[4]);
+	__m256i tmp4 = _mm256_sub_epi32(d[3], d[4]);
+
+	//even part
+	__m256i tmp10 = _mm256_add_epi32(tmp0, tmp3);
+	__m256i tmp13 = _mm256_sub_epi32(tmp0, tmp3);
+	__m256i tmp11 = _mm256_add_epi32(tmp1, tmp2);
+	__m256i tmp12 = _mm256_sub_epi32(tmp1, tmp2);
+
+	d[0] = _mm256_add_epi32(tmp10, tmp11);
+	d[4] = _mm256_sub_epi32(tmp10, tmp11);
+
+	__m256i z1 = MULFAST(_mm256_add_epi32(tmp12, tmp13), FIX_0_707106781_FAST);
+	d[2] = _mm256_add_epi32(tmp13, z1);
+	d[6] = _mm256_sub_epi32(tmp13, z1);
+
+	//odd part
+	tmp10 = _mm256_add_epi32(tmp4, tmp5);
+	tmp11 = _mm256_add_epi32(tmp5, tmp6);
+	tmp12 = _mm256_add_epi32(tmp6, tmp7);
+
+	__m256i z5 = MULFAST(_mm256_sub_epi32(tmp10, tmp12), FIX_0_382683433_FAST);
+	__m256i z2 = _mm256_add_epi32(MULFAST(tmp10, FIX_0_541196100_FAST), z5);
+	__m256i z4 = _mm256_add_epi32(MULFAST(tmp12, FIX_1_306562965_FAST), z5);
+	__m256i z3 = MULFAST(tmp11, FIX_0_707106781_FAST);
+
+	__m256i z11 = _mm256_add_epi32(tmp7, z3);
+	__m256i z13 = _mm256_sub_epi32(tmp7, z3);
+
+	d[5] = _mm256_add_epi32(z13, z2);
+	d[3] = _mm256_sub_epi32(z13, z2);
+	d[1] = _mm256_add_epi32(z11, z4);
+	d[7] = _mm256_sub_epi32(z11, z4);
+}
+
+JPEG_TARGET_AVX2 static void ComputeFDCT_IFast_AVX2(const short* samples, int pitch, short coefficients[64])
+{
+	__m256i d[8];
+	LoadRows(samples, pitch, d);
+
+	Transpose8x8(d);
+	IFast1D_AVX2(d);
+
+	Transpose8x8(d);
+	IFast1D_AVX2(d);
+
+	StoreRows(d, coefficients);
+}
+
+JPEG_TARGET_AVX2 static inline void Float1D_AVX(__m256 d[8])
+{
+	__m256 tmp0 = _mm256_add_ps(d[0], d[7]);
+	__m256 tmp7 = _mm256_sub_ps(d[0], d[7]);
+	__m256 tmp1 = _mm256_add_ps(d[1], d[6]);
+	__m256 tmp6 = _mm256_sub_ps(d[1], d[6]);
+	__m256 tmp2 = _mm256_add_ps(d[2], d[5]);
+	__m256 tmp5 = _mm256_sub_ps(d[2], d[5]);
+	__m256 tmp3 = _mm256_add_ps(d[3], d[4]);
+	__m256 tmp4 = _mm256_sub_ps(d[3], d[4]);
+
+	//even part
+	__m256 tmp10 = _mm256_add_ps(tmp0, tmp3);
+	__m256 tmp13 = _mm256_sub_ps(tmp0, tmp3);
+	__m256 tmp11 = _mm256_add_ps(tmp1, tmp2);
+	__m256 tmp12 = _mm256_sub_ps(tmp1, tmp2);
+
+	d[0] = _mm256_add_ps(tmp10, tmp11);
+	d[4] = _mm256_sub_ps(tmp10, tmp11);
+
+	__m256 z1 = _mm256_mul_ps(_mm256_add_ps(tmp12, tmp13), _mm256_set1_ps(0.707106781f));
+	d[2] = _mm256_add_ps(tmp13, z1);
+	d[6] = _mm256_sub_ps(tmp13, z1);
+
+	//odd part
+	tmp10 = _mm256_add_ps(tmp4, tmp5);
+	tmp11 = _mm256_add_ps(tmp5, tmp6);
+	tmp12 = _mm256_add_ps(tmp6, tmp7);
+
+	__m256 z5 = _mm256_mul_ps(_mm256_sub_ps(tmp10, tmp12), _mm256_set1_ps(0.382683433f));
+	__m256 z2 = _mm256_add_ps(_mm256_mul_ps(tmp10, _mm256_set1_ps(0.541196100f)), z5);
+	__m256 z4 = _mm256_add_ps(_mm256_mul_ps(tmp12, _mm256_set1_ps(1.306562965f)), z5);
+	__m256 z3 = _mm256_mul_ps(tmp11, _mm256_set1_ps(0.707106781f));
+
+	__m256 z11 = _mm256_add_ps(tmp7, z3);
+	__m256 z13 = _mm256_sub_ps(tmp7, z3);
+
+	d[5] = _mm256_add_ps(z13, z2);
+	d[3] = _mm256_sub_ps(z13, z2);
+	d[1] = _mm256_add_ps(z11, z4);
+	d[7] = _mm256_sub_ps(z11, z4);
+}
+
+JPEG_TARGET_AVX2 static void ComputeFDCT_Float_AVX(const short* samples, int pitch, float coefficients[64])
+{
+	__m256 d[8];
+	for(int y = 0; y < 8; y++)
+		d[y] = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(samples + y * pitch))));
+
+	Transpose8x8(d);
+	Float1D_AVX(d);
+
+	Transpose8x8(d);
+	Float1D_AVX(d);
+
+	for(int y = 0; y < 8; y++)
+		_mm256_storeu_ps(coefficients + y * 8, d[y]);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// AVX2 quantization straight from the FDCT registers, same arithmetic as
+// QuantizeBlock. The rows stay in the row pair layout above, pshufb then
+// gathers the zigzag order: output register k takes DU[16k..16k+15] from
+// every row, with the lane swapped copies so each lane can reach all rows.
+//////////////////////////////////////////////////////////////////////////
+
+alignas(32) static unsigned char sZigZagMasks[4][8][32];
+
+static bool BuildZigZagMasks()
+{
+	//source s has row s in the low lane and row s + 4 (mod 8) in the high one
+	for(int k = 0; k < 4; k++)
+	{
+		for(int s = 0; s < 8; s++)
+			for(int i = 0; i < 32; i++)
+				sZigZagMasks[k][s][i] = 0x80;
+
+		for(int lane = 0; lane < 2; lane++)
+		{
+			for(int j = 0; j < 8; j++)
+			{
+				int n = ZigZagIndices[k * 16 + lane * 8 + j];
+				int s = lane == 0 ? n / 8 : (n / 8 + 4) % 8;
+				sZigZagMasks[k][s][lane * 16 + j * 2] = (unsigned char)((n % 8) * 2);
+				sZigZagMasks[k][s][lane * 16 + j * 2 + 1] = (unsigned char)((n % 8) * 2 + 1);
+			}
+		}
+	}
+
+	return true;
+}
+
+static const bool sZigZagMasksBuilt = BuildZigZagMasks();
+
+JPEG_TARGET_AVX2 static inline void StoreZigZag(const __m256i r[4], short DU[64])
+{
+	__m256i sources[8];
+	for(int s = 0; s < 4; s++)
+	{
+		sources[s] = r[s];
+		sources[s + 4] = SWAP_LANES(r[s]);
+	}
+
+	for(int k = 0; k < 4; k++)
+	{
+		__m256i out = _mm256_shuffle_epi8(sources[0], _mm256_load_si256((const __m256i*)sZigZagMasks[k][0]));
+		for(int s = 1; s < 8; s++)
+			out = _mm256_or_si256(out, _mm256_shuffle_epi8(sources[s], _mm256_load_si256((const __m256i*)sZigZagMasks[k][s])));
+
+		_mm256_storeu_si256((__m256i*)(DU + k * 16), out);
+	}
+}
+
+JPEG_TARGET_AVX2 static inline __m256i LoadDivisorPair(const unsigned short* table, int y)
+{
+	__m128i lo = _mm_loadu_si128((const __m128i*)(table + y * 8));
+	__m128i hi = _mm_loadu_si128((const __m128i*)(table + (y + 4) * 8));
+	return _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+}
+
+JPEG_TARGET_AVX2 static inline void QuantizeRowPairs(__m256i r[4], const QuantizationDivisors* divisors, short DU[64])
+{
+	for(int y = 0; y < 4; y++)
+	{
+		//work on the magnitude, abs of -32768 is read as unsigned 32768
+		__m256i x = _mm256_abs_epi16(r[y]);
+		x = _mm256_add_epi16(x, LoadDivisorPair(divisors->Correction, y));
+		x = _mm256_mulhi_epu16(x, LoadDivisorPair(divisors->Reciprocal, y));
+		x = _mm256_mulhi_epu16(x, LoadDivisorPair(divisors->Scale, y));
+		r[y] = _mm256_sign_epi16(x, r[y]);
+	}
+
+	StoreZigZag(r, DU);
+}
+
+// rows y and y + 4 of eight 32 bit rows into one register of words
+JPEG_TARGET_AVX2 static inline void PackRowPairs(const __m256i d[8], __m256i r[4])
+{
+	for(int y = 0; y < 4; y++)
+		r[y] = _mm256_permute4x64_epi64(_mm256_packs_epi32(d[y], d[y + 4]), _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+JPEG_TARGET_AVX2 static void ComputeFDCTQuantized_ISlow_AVX2(const short* samples, int pitch, const QuantizationDivisors* divisors, short DU[64])
+{
+	__m256i r[4];
+	ISlowRowPairs_AVX2(samples, pitch, r);
+	QuantizeRowPairs(r, divisors, DU);
+}
+
+JPEG_TARGET_AVX2 static void ComputeFDCTQuantized_IFast_AVX2(const short* samples, int pitch, const QuantizationDivisors* divisors, short DU[64])
+{
+	__m256i d[8];
+	LoadRows(samples, pitch, d);
+
+	Transpose8x8(d);
+	IFast1D_AVX2(d);
+
+	Transpose8x8(d);
+	IFast1D_AVX2(d);
+
+	__m256i r[4];
+	PackRowPairs(d, r);
+	QuantizeRowPairs(r, divisors, DU);
+}
+
+JPEG_TARGET_AVX2 static void ComputeFDCTQuantized_Float_AVX2(const short* samples, int pitch, const QuantizationDivisors* divisors, short DU[64])
+{
+	__m256 d[8];
+	for(int y = 0; y < 8; y++)
+		d[y] = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(samples + y * pitch))));
+
+	Transpose8x8(d);
+	Float1D_AVX(d);
+
+	Transpose8x8(d);
+	Float1D_AVX(d);
+
+	//round to nearest integer
+	__m256i rows[8];
+	for(int y = 0; y < 8; y++)
+		rows[y] = _mm256_cvtps_epi32(_mm256_mul_ps(d[y], _mm256_loadu_ps(divisors->FloatReciprocal + y * 8)));
+
+	__m256i r[4];
+	PackRowPairs(rows, r);
+	StoreZigZag(r, DU);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// public entry points
+//////////////////////////////////////////////////////////////////////////
+void ComputeFDCT_ISlow(const short* samples, int pitch, short coefficients[64])
+{
+	if(sUseAVX2)
+		ComputeFDCT_ISlow_AVX2(samples, pitch, coefficients);
+	else
+		ComputeFDCT_ISlow_Scalar(samples, pitch, coefficients);
+}
+
+void ComputeFDCT_IFast(const short* samples, int pitch, short coefficients[64])
+{
+	if(sUseAVX2)
+		ComputeFDCT_IFast_AVX2(samples, pitch, coefficients);
+	else
+		ComputeFDCT_IFast_Scalar(samples, pitch, coefficients);
+}
+
+void ComputeFDCT_Float(const short* samples, int pitch, float coefficients[64])
+{
+	if(sUseAVX2)
+		ComputeFDCT_Float_AVX(samples, pitch, coefficients);
+	else
+		ComputeFDCT_Float_Scalar(samples, pitch, coefficients);
+}
+
+void ComputeFDCTQuantized_ISlow(const short* samples, int pitch, const QuantizationDivisors* divisors, short DU[64])
+{
+	if(sUseAVX2 && !divisors->UseFloatReciprocal)
+		ComputeFDCTQuantized_ISlow_AVX2(samples, pitch, divisors, DU);
+	else
+	{
+		alignas(16) short coefficients[64];
+		ComputeFDCT_ISlow(samples, pitch, coefficients);
+		QuantizeBlock(coefficients, divisors, DU);
+	}
+}
+
+void ComputeFDCTQuantized_IFast(const short* samples, int pitch, const QuantizationDivisors* divisors, short DU[64])
+{
+	if(sUseAVX2 && !divisors->UseFloatReciprocal)
+		ComputeFDCTQuantized_IFast_AVX2(samples, pitch, divisors, DU);
+	else
+	{
+		alignas(16) short coefficients[64];
+		ComputeFDCT_IFast(samples, pitch, coefficients);
+		QuantizeBlock(coefficients, divisors, DU);
+	}
+}
+
+void ComputeFDCTQuantized_Float(const short* samples, int pitch, const QuantizationDivisors* divisors, short DU[64])
+{
+	if(sUseAVX2)
+		ComputeFDCTQuantized_Float_AVX2(samples, pitch, divisors, DU);
+	else
+	{
+		alignas(16) float coefficients[64];
+		ComputeFDCT_Float_Scalar(samples, pitch, coefficients);
+		QuantizeBlock(coefficients, divisors, DU);
+	}
+}
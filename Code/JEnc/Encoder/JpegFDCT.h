@@ -0,0 +1,64 @@
+//--------------------------------------------------------------------------------------
+// Real-Time JPEG Compression using DirectCompute - Demo
+//
+// Copyright (c) Stefan Petersson 2012. All rights reserved.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include "../Include/JEncCommon.h"
+
+/*
+	Separable forward DCT kernels for the CPU encoder, following libjpeg's
+	jfdctint.c (islow), jfdctfst.c (ifast) and jfdctflt.c (float).
+
+	Input is one 8x8 block of level shifted samples (-128..127) read with a row
+	pitch given in samples, output is in natural (row major) order and scaled:
+
+		ComputeFDCT_ISlow	8 * DCT
+		ComputeFDCT_IFast	8 * AANScaleFactor[v] * AANScaleFactor[u] * DCT
+		ComputeFDCT_Float	8 * AANScaleFactor[v] * AANScaleFactor[u] * DCT
+
+	ComputeQuantizationDivisors in JpegQuantize.h folds that scaling into the
+	quantization divisors. Each kernel has an AVX2 path which is picked at
+	runtime and produces the exact same output as the scalar code, islow
+	keeps two rows of 16 bit words per register, ifast and float one row of
+	32 bit lanes.
+
+	ComputeFDCTQuantized_* go on to QuantizeBlock in one call, with AVX2 the
+	quantization and zigzag reordering run on the FDCT registers instead of
+	going through memory.
+
+	PSNR on ssc_800.bmp, 4:4:4, in dB at quality 85 / 100, and the speedup of
+	ComputeFDCTQuantized_* over the SSE matrix DCT with divisions it replaced:
+
+		islow	37.52 / 51.97	~3.8x
+		ifast	37.47 / 47.46	~3.1x, the 8 bit constants cost a lot at high quality
+		float	37.52 / 51.94	~3.3x
+
+	The zigzag reordering is about a third of the islow time, AVX2 has no
+	word permute across lanes so it takes 32 pshufb.
+*/
+
+static const double AANScaleFactor[8] =
+{
+	1.0, 1.387039845, 1.306562965, 1.175875602,
+	1.0, 0.785694958, 0.541196100, 0.275899379
+};
+
+void ComputeFDCT_ISlow(const short* samples, int pitch, short coefficients[64]);
+void ComputeFDCT_IFast(const short* samples, int pitch, short coefficients[64]);
+void ComputeFDCT_Float(const short* samples, int pitch, float coefficients[64]);
+
+struct QuantizationDivisors;
+
+// FDCT followed by QuantizeBlock, DU is in zigzag order
+void ComputeFDCTQuantized_ISlow(const short* samples, int pitch, const QuantizationDivisors* divisors, short DU[64]);
+void ComputeFDCTQuantized_IFast(const short* samples, int pitch, const QuantizationDivisors* divisors, short DU[64]);
+void ComputeFDCTQuantized_Float(const short* samples, int pitch, const QuantizationDivisors* divisors, short DU[64]);
+
+bool FDCT_UsesAVX2();
+
+//the portable kernels, the ones above fall back to them without AVX2
+void ComputeFDCT_ISlow_Scalar(const short* samples, int pitch, short coefficients[64]);
+void ComputeFDCT_IFast_Scalar(const short* samples, int pitch, short coefficients[64]);
+void ComputeFDCT_Float_Scalar(const short* samples, int pitch, float coefficients[64]);
@@ -0,0 +1,200 @@
+//--------------------------------------------------------------------------------------
+// Real-Time JPEG Compression using DirectCompute - Demo
+//
+// Copyright (c) Stefan Petersson 2012. All rights reserved.
+//--------------------------------------------------------------------------------------
+#include "JpegHuffmanAdapter.h"
+#include "JpegEncoderBase.h"
+
+#include <cmath>
+
+//how much worse than on the first frame with them the tables may code a frame
+//before they are rebuilt ahead of the interval
+static const double DriftPercent = 5.0;
+
+//symbols that can occur in a baseline scan keep a code even if the statistics never saw them,
+//this count is added to every one of them
+static const unsigned int MinSymbolCount = 1;
+
+JpegHuffmanAdapter::JpegHuffmanAdapter()
+{
+	mInterval = 0;
+	mFixedSchedule = false;
+	mRebuilding = false;
+
+	Reset(0);
+}
+
+JpegHuffmanAdapter::~JpegHuffmanAdapter()
+{
+	WaitForRebuild();
+}
+
+void JpegHuffmanAdapter::Reset(int interval)
+{
+	WaitForRebuild();
+
+	mInterval = interval;
+	mNumFrames = 0;
+	mBaseCost = 0.0;
+	mAdapted = false;
+	mCounts.assign(NUM_TABLES * 256, 0);
+
+	JpegEncoderBase::GetStandardHuffmanTables(mNRCodes, mValues);
+
+	SetCodeLengths();
+}
+
+void JpegHuffmanAdapter::AddFrame(const unsigned int* symbolCounts)
+{
+	if(mInterval <= 0)
+		return;
+
+	for(int i = 0; i < NUM_TABLES * 256; i++)
+		mCounts[i] += symbolCounts[i];
+
+	mNumFrames++;
+
+	double cost = GetCodingCost(symbolCounts);
+	if(mBaseCost == 0.0)
+		mBaseCost = cost;
+
+	if(mRebuilding)
+		return;
+
+	//the standard tables go as soon as there is a frame to build from, the cost is floating
+	//point and left out on a fixed schedule
+	bool drift = !mFixedSchedule && cost > mBaseCost * (1.0 + DriftPercent / 100.0);
+	if(!mAdapted || mNumFrames >= mInterval || drift)
+		StartRebuild();
+}
+
+bool JpegHuffmanAdapter::SwapTables()
+{
+	if(!mRebuilding)
+		return false;
+
+	if(mFixedSchedule)
+		JpegThreadPool::Get().Wait(mRebuild);
+	else if(!mRebuild.IsDone())
+		return false;
+
+	mRebuilding = false;
+
+	memcpy(mNRCodes, mRebuiltNRCodes, sizeof(mNRCodes));
+	memcpy(mValues, mRebuiltValues, sizeof(mValues));
+	SetCodeLengths();
+
+	mBaseCost = 0.0;
+	mAdapted = true;
+
+	return true;
+}
+
+void JpegHuffmanAdapter::PeekTables(const BYTE (*&outNRCodes)[17], const BYTE (*&outValues)[256])
+{
+	if(mRebuilding)
+		JpegThreadPool::Get().Wait(mRebuild);
+
+	outNRCodes = mRebuilding ? mRebuiltNRCodes : mNRCodes;
+	outValues = mRebuilding ? mRebuiltValues : mValues;
+}
+
+void JpegHuffmanAdapter::StartRebuild()
+{
+	//the builder takes 32 bit counts, long streams are scaled down keeping every seen symbol
+	uint64_t maxCount = 0;
+	for(int i = 0; i < NUM_TABLES * 256; i++)
+	{
+		if(mCounts[i] > maxCount)
+			maxCount = mCounts[i];
+	}
+
+	uint64_t scale = maxCount / 0x7FFFFFFF + 1;
+
+	std::vector<unsigned int> counts(NUM_TABLES * 256);
+	for(int i = 0; i < NUM_TABLES * 256; i++)
+		counts[i] = (unsigned int)((mCounts[i] + scale - 1) / scale);
+
+	//DC categories 0..11, AC EOB, ZRL and run 0..15 with size 1..10
+	for(int table = 0; table < NUM_TABLES; table += 2)
+	{
+		unsigned int* DC = &counts[table * 256];
+		unsigned int* AC = &counts[(table + 1) * 256];
+
+		for(int i = 0; i < 12; i++)
+			DC[i] += MinSymbolCount;
+
+		AC[0x00] += MinSymbolCount;
+		AC[0xF0] += MinSymbolCount;
+		for(int run = 0; run < 16; run++)
+		{
+			for(int size = 1; size <= 10; size++)
+				AC[(run << 4) | size] += MinSymbolCount;
+		}
+	}
+
+	mCounts.assign(NUM_TABLES * 256, 0);
+	mNumFrames = 0;
+
+	mRebuilding = true;
+	JpegThreadPool::Get().Start(mRebuild, [this, counts](int index, int threadIndex)
+	{
+		for(int i = 0; i < NUM_TABLES; i++)
+		{
+			memset(mRebuiltValues[i], 0, 256);
+			JpegEncoderBase::ComputeOptimalHuffmanTable(&counts[i * 256], mRebuiltNRCodes[i], mRebuiltValues[i]);
+		}
+	});
+}
+
+void JpegHuffmanAdapter::WaitForRebuild()
+{
+	JpegThreadPool::Get().Wait(mRebuild);
+
+	mRebuilding = false;
+}
+
+void JpegHuffmanAdapter::SetCodeLengths()
+{
+	memset(mCodeLengths, 0, sizeof(mCodeLengths));
+
+	for(int table = 0; table < NUM_TABLES; table++)
+	{
+		int value = 0;
+		for(int length = 1; length <= 16; length++)
+		{
+			for(int i = 0; i < mNRCodes[table][length]; i++)
+				mCodeLengths[table][mValues[table][value++]] = length;
+		}
+	}
+}
+
+double JpegHuffmanAdapter::GetCodingCost(const unsigned int* symbolCounts) const
+{
+	double bits = 0.0;
+	double entropy = 0.0;
+
+	for(int table = 0; table < NUM_TABLES; table++)
+	{
+		const unsigned int* counts = symbolCounts + table * 256;
+
+		double total = 0.0;
+		for(int i = 0; i < 256; i++)
+			total += counts[i];
+
+		for(int i = 0; i < 256; i++)
+		{
+			if(counts[i] == 0)
+				continue;
+
+			//a symbol without a code would not have been coded, count it as the longest code
+			int length = mCodeLengths[table][i] ? mCodeLengths[table][i] : 16;
+
+			bits += (double)counts[i] * length;
+			entropy -= counts[i] * log(counts[i] / total) / log(2.0);
+		}
+	}
+
+	return entropy > 0.0 ? bits / entropy : 1.0;
+}
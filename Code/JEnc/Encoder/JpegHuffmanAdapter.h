@@ -0,0 +1,87 @@
+//--------------------------------------------------------------------------------------
+// Real-Time JPEG Compression using DirectCompute - Demo
+//
+// Copyright (c) Stefan Petersson 2012. All rights reserved.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include "JpegEncoderBase.h"
+#include "JpegThreadPool.h"
+
+#include <vector>
+
+/*
+	Huffman tables that follow the statistics of a video stream. The encoder
+	hands in the symbol counts of every frame it codes. After Interval frames,
+	or as soon as the current tables do noticeably worse on a frame than on
+	the first one coded with them, the counts gathered since the last rebuild
+	go to a JpegThreadPool task that builds new tables. The encoder picks them
+	up with SwapTables before it writes the header of a frame, so every frame
+	is coded with one set of tables.
+
+	The counts come from a sample of every frame and the next frame may have
+	symbols the last ones did not, so every symbol that can occur keeps a code.
+
+	On a fixed schedule, for JENC_OPTION_DETERMINISTIC, the tables are only
+	rebuilt every Interval frames and SwapTables waits for the rebuild, so the
+	frame that gets new tables never depends on thread timing.
+*/
+class JpegHuffmanAdapter
+{
+public:
+	JpegHuffmanAdapter();
+	~JpegHuffmanAdapter();
+
+	//frames between rebuilds, 0 disables the adapter, the tables start over from the standard ones
+	void Reset(int interval);
+	int GetInterval() const { return mInterval; }
+
+	//no rebuilds on drift and no frame coded before a started rebuild is swapped in
+	void SetFixedSchedule(bool fixedSchedule) { mFixedSchedule = fixedSchedule; }
+
+	//symbol counts of a frame coded with the current tables, 256 per table in the order of
+	//JpegEncoderBase::NUM_HUFFMAN_TABLES
+	void AddFrame(const unsigned int* symbolCounts);
+
+	//takes the tables of a finished rebuild, on a fixed schedule of any started one,
+	//returns true if the current tables changed
+	bool SwapTables();
+
+	//the tables the next SwapTables leaves in place, without taking them. Waits for a started
+	//rebuild, the next SwapTables takes exactly its tables then.
+	void PeekTables(const BYTE (*&outNRCodes)[17], const BYTE (*&outValues)[256]);
+
+	//DHT contents like JpegEncoderBase::mHuffmanNRCodes and mHuffmanValues
+	const BYTE (*GetNRCodes() const)[17] { return mNRCodes; }
+	const BYTE (*GetValues() const)[256] { return mValues; }
+
+private:
+	void StartRebuild();
+	void WaitForRebuild();
+	void SetCodeLengths();
+
+	//bits of the frame with the current tables over its entropy, 1.0 is as good as it gets
+	double GetCodingCost(const unsigned int* symbolCounts) const;
+
+	int mInterval;
+	int mNumFrames;
+	bool mFixedSchedule;
+
+	enum { NUM_TABLES = JpegEncoderBase::NUM_HUFFMAN_TABLES };
+
+	BYTE mNRCodes[NUM_TABLES][17];
+	BYTE mValues[NUM_TABLES][256];
+	int mCodeLengths[NUM_TABLES][256];
+
+	//coding cost of the first frame with the current tables, 0 until there is one
+	double mBaseCost;
+	bool mAdapted;
+
+	//counts since the last rebuild
+	std::vector<uint64_t> mCounts;
+
+	JpegThreadPool::AsyncTask mRebuild;
+	bool mRebuilding;
+	BYTE mRebuiltNRCodes[NUM_TABLES][17];
+	BYTE mRebuiltValues[NUM_TABLES][256];
+};
@@ -0,0 +1,78 @@
+//--------------------------------------------------------------------------------------
+// Real-Time JPEG Compression using DirectCompute - Demo
+//
+// Copyright (c) Stefan Petersson 2012. All rights reserved.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include "../Include/JEncCommon.h"
+
+/*
+	Compile time MCU layout, H x V Y blocks followed by one Cb and one Cr
+	block. Chroma is always sampled once per MCU, so H and V are the luma
+	sampling factors of the SOF segment and the chroma subsampling factors.
+
+	The entropy loops of the GPU encoders are instantiated per layout and
+	the same numbers reach the shader as MCU_H / MCU_V, see GetOutputIndex
+	in Jpeg_CS.hlsl. A new layout needs a JENC_CHROMA_SUBSAMPLE value, a
+	typedef and a case in GetMCULayoutInfo here and chroma downsampling in
+	the shader.
+*/
+template<int H, int V, JENC_CHROMA_SUBSAMPLE Type>
+struct JpegMCULayout
+{
+	static const JENC_CHROMA_SUBSAMPLE SubsampleType = Type;
+
+	enum
+	{
+		SamplingH = H,
+		SamplingV = V,
+
+		Width = 8 * H,
+		Height = 8 * V,
+
+		NumBlocksY = H * V,
+		NumBlocks = H * V + 2
+	};
+};
+
+typedef JpegMCULayout<1, 1, JENC_CHROMA_SUBSAMPLE_4_4_4> JpegMCULayout_444;
+typedef JpegMCULayout<2, 1, JENC_CHROMA_SUBSAMPLE_4_2_2> JpegMCULayout_422;
+typedef JpegMCULayout<2, 2, JENC_CHROMA_SUBSAMPLE_4_2_0> JpegMCULayout_420;
+
+//the same numbers at runtime, for code that only knows the subsample type
+struct JpegMCULayoutInfo
+{
+	int SamplingH;
+	int SamplingV;
+
+	int Width;
+	int Height;
+
+	int NumBlocksY;
+	int NumBlocks;
+
+	const char* Name;			//"444", used for shader blob file names
+	const char* ShaderDefine;	//"C_4_4_4", selects the chroma downsampling in the shader
+};
+
+template<class Layout>
+inline JpegMCULayoutInfo MakeMCULayoutInfo(const char* name, const char* shaderDefine)
+{
+	JpegMCULayoutInfo info = { Layout::SamplingH, Layout::SamplingV, Layout::Width, Layout::Height,
+		Layout::NumBlocksY, Layout::NumBlocks, name, shaderDefine };
+	return info;
+}
+
+// returns false for unknown subsample types
+inline bool GetMCULayoutInfo(JENC_CHROMA_SUBSAMPLE subsampleType, JpegMCULayoutInfo& outInfo)
+{
+	switch(subsampleType)
+	{
+	case JENC_CHROMA_SUBSAMPLE_4_4_4: outInfo = MakeMCULayoutInfo<JpegMCULayout_444>("444", "C_4_4_4"); return true;
+	case JENC_CHROMA_SUBSAMPLE_4_2_2: outInfo = MakeMCULayoutInfo<JpegMCULayout_422>("422", "C_4_2_2"); return true;
+	case JENC_CHROMA_SUBSAMPLE_4_2_0: outInfo = MakeMCULayoutInfo<JpegMCULayout_420>("420", "C_4_2_0"); return true;
+	}
+
+	return false;
+}
@@ -0,0 +1,131 @@
+//--------------------------------------------------------------------------------------
+// Real-Time JPEG Compression using DirectCompute - Demo
+//
+// Copyright (c) Stefan Petersson 2012. All rights reserved.
+//--------------------------------------------------------------------------------------
+#include "JpegQuantize.h"
+#include "JpegFDCT.h"
+
+#include "../../Shared/JpegCommon.h"
+
+#include <emmintrin.h>
+
+// returns false if the divisor is too small to be expressed with a 16 bit scale
+static bool ComputeReciprocal(unsigned int divisor, unsigned short& reciprocal, unsigned short& correction, unsigned short& scale)
+{
+	if(divisor < 4)
+	{
+		reciprocal = 0;
+		correction = 0;
+		scale = 0;
+		return false;
+	}
+
+	//r = 16 + floor(log2(divisor))
+	int r = 16;
+	for(unsigned int d = divisor >> 1; d; d >>= 1)
+		r++;
+
+	unsigned int fq = (1u << r) / divisor;
+	unsigned int fr = (1u << r) % divisor;
+	unsigned int c = divisor / 2;
+
+	if(fr == 0)
+	{
+		//power of two, fq would need 17 bits
+		fq >>= 1;
+		r--;
+	}
+	else if(fr <= divisor / 2)
+	{
+		c++;
+	}
+	else
+	{
+		fq++;
+	}
+
+	reciprocal = (unsigned short)fq;
+
+	//ties are rounded towards zero, rounding them up costs ~9% in size at
+	//quality 100 (divisor 8 hits a tie for every 8th coefficient) for no gain
+	correction = (unsigned short)(c - ((divisor & 1) == 0));
+	scale = (unsigned short)(1u << (32 - r));
+	return true;
+}
+
+void ComputeQuantizationDivisors(JENC_DCT_METHOD method, const unsigned char quantizationTable[64], QuantizationDivisors* outDivisors)
+{
+	outDivisors->UseFloatReciprocal = method == JENC_DCT_FLOAT;
+
+	for(int i = 0; i < 64; i++)
+	{
+		int natural = ZigZagIndices[i];
+		double divisor = quantizationTable[i] * 8.0;
+
+		//undo the scaling of the AAN kernels
+		if(method != JENC_DCT_ISLOW)
+			divisor *= AANScaleFactor[natural / 8] * AANScaleFactor[natural % 8];
+
+		if(!ComputeReciprocal((unsigned int)(divisor + 0.5), outDivisors->Reciprocal[natural],
+			outDivisors->Correction[natural], outDivisors->Scale[natural]))
+			outDivisors->UseFloatReciprocal = true;
+
+		outDivisors->FloatReciprocal[natural] = (float)(1.0 / divisor);
+	}
+}
+
+void QuantizeBlock(const short coefficients[64], const QuantizationDivisors* divisors, short DU[64])
+{
+	if(divisors->UseFloatReciprocal)
+	{
+		alignas(16) float floatCoefficients[64];
+		for(int i = 0; i < 64; i += 8)
+		{
+			__m128i c = _mm_loadu_si128((const __m128i*)(coefficients + i));
+			__m128i sign = _mm_srai_epi16(c, 15);
+			_mm_store_ps(floatCoefficients + i, _mm_cvtepi32_ps(_mm_unpacklo_epi16(c, sign)));
+			_mm_store_ps(floatCoefficients + i + 4, _mm_cvtepi32_ps(_mm_unpackhi_epi16(c, sign)));
+		}
+
+		QuantizeBlock(floatCoefficients, divisors, DU);
+		return;
+	}
+
+	alignas(16) short quantized[64];
+
+	for(int i = 0; i < 64; i += 8)
+	{
+		__m128i c = _mm_loadu_si128((const __m128i*)(coefficients + i));
+
+		//work on the magnitude, the sign is put back afterwards
+		__m128i sign = _mm_srai_epi16(c, 15);
+		__m128i x = _mm_sub_epi16(_mm_xor_si128(c, sign), sign);
+
+		x = _mm_add_epi16(x, _mm_loadu_si128((const __m128i*)(divisors->Correction + i)));
+		x = _mm_mulhi_epu16(x, _mm_loadu_si128((const __m128i*)(divisors->Reciprocal + i)));
+		x = _mm_mulhi_epu16(x, _mm_loadu_si128((const __m128i*)(divisors->Scale + i)));
+
+		_mm_store_si128((__m128i*)(quantized + i), _mm_sub_epi16(_mm_xor_si128(x, sign), sign));
+	}
+
+	for(int i = 0; i < 64; i++)
+		DU[i] = quantized[ZigZagIndices[i]];
+}
+
+void QuantizeBlock(const float coefficients[64], const QuantizationDivisors* divisors, short DU[64])
+{
+	alignas(16) short quantized[64];
+
+	for(int i = 0; i < 64; i += 8)
+	{
+		__m128 lo = _mm_mul_ps(_mm_loadu_ps(coefficients + i), _mm_loadu_ps(divisors->FloatReciprocal + i));
+		__m128 hi = _mm_mul_ps(_mm_loadu_ps(coefficients + i + 4), _mm_loadu_ps(divisors->FloatReciprocal + i + 4));
+
+		//round to nearest integer
+		_mm_store_si128((__m128i*)(quantized + i), _mm_packs_epi32(_mm_cvtps_epi32(lo), _mm_cvtps_epi32(hi)));
+	}
+
+	for(int i = 0; i < 64; i++)
+		DU[i] = quantized[ZigZagIndices[i]];
+}
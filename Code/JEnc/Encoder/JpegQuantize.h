@@ -0,0 +1,38 @@
+//--------------------------------------------------------------------------------------
+// Real-Time JPEG Compression using DirectCompute - Demo
+//
+// Copyright (c) Stefan Petersson 2012. All rights reserved.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include "../Include/JEncCommon.h"
+
+/*
+	Divide free quantization for the CPU encoder, same scheme as libjpeg-turbo
+	except that ties are rounded towards zero.
+
+	Every divisor d is replaced by a reciprocal, a rounding correction and a
+	scale so that for 0 <= x < 32768
+
+		((x + Correction) * Reciprocal >> 16) * Scale >> 16 == (x + (d - 1) / 2) / d
+
+	which is two _mm_mulhi_epu16 per eight coefficients. Divisors below 4 do
+	not fit that scheme (only possible with the ifast FDCT at high quality),
+	such tables and the float FDCT multiply with FloatReciprocal instead.
+	All tables are in natural order to match the FDCT output, QuantizeBlock
+	writes the result in zigzag order.
+*/
+struct QuantizationDivisors
+{
+	unsigned short Reciprocal[64];
+	unsigned short Correction[64];
+	unsigned short Scale[64];
+	float FloatReciprocal[64];
+	bool UseFloatReciprocal;
+};
+
+// quantizationTable is in zigzag order, as stored in the DQT segment
+void ComputeQuantizationDivisors(JENC_DCT_METHOD method, const unsigned char quantizationTable[64], QuantizationDivisors* outDivisors);
+
+void QuantizeBlock(const short coefficients[64], const QuantizationDivisors* divisors, short DU[64]);
+void QuantizeBlock(const float coefficients[64], const QuantizationDivisors* divisors, short DU[64]);
@@ -0,0 +1,139 @@
+//--------------------------------------------------------------------------------------
+// Real-Time JPEG Compression using DirectCompute - Demo
+//
+// Copyright (c) Stefan Petersson 2012. All rights reserved.
+//--------------------------------------------------------------------------------------
+#include "JpegRateControl.h"
+#include "../../Shared/JpegCommon.h"
+
+#include <cmath>
+
+//slope of the log size over the log scale until frames at different qualities tell better,
+//and how far the frames may move it
+static const double DefaultSlope = 0.6;
+static const double MinSlope = 0.3;
+static const double MaxSlope = 1.5;
+
+//weight of the slope between the last two frames against the ones before
+static const double SlopeWeight = 0.25;
+
+//two frames closer than this in log scale say more about the content than about the slope
+static const double MinSlopeDelta = 0.05;
+
+//buffer level the budget steers for, as a part of BufferSize, and the frames it takes to get there
+static const double TargetFullness = 0.25;
+static const int CorrectionFrames = 8;
+
+//part of the room left in the buffer a frame may take, the guess may be off by the rest
+static const double OverflowMargin = 0.8;
+
+//frames per second of the default buffer when the desc only gives TargetFrameSize
+static const float DefaultFrameRate = 30.0f;
+
+//quality goes down as far as the budget needs at once, but up only by this much per frame
+static const int MaxQualityStep = 5;
+
+JpegRateControl::JpegRateControl(const JEncRateControlDesc& desc)
+{
+	float frameRate = desc.FrameRate > 0.0f ? desc.FrameRate : DefaultFrameRate;
+
+	if(desc.TargetFrameSize > 0)
+		mTargetFrameSize = desc.TargetFrameSize;
+	else if(desc.FrameRate > 0.0f)
+		mTargetFrameSize = desc.TargetBitRate / 8.0 / desc.FrameRate;
+	else
+		mTargetFrameSize = 0.0;
+
+	mBufferSize = desc.BufferSize > 0 ? desc.BufferSize : mTargetFrameSize * frameRate;
+
+	mMinQuality = desc.MinQuality > 0 ? JPEG_MIN(desc.MinQuality, 100) : 1;
+	mMaxQuality = desc.MaxQuality > 0 ? JPEG_MIN(desc.MaxQuality, 100) : 100;
+	if(mMaxQuality < mMinQuality)
+		mMaxQuality = mMinQuality;
+
+	mInitialQuality = desc.InitialQuality > 0 ? desc.InitialQuality : 75;
+	mInitialQuality = JPEG_MIN(JPEG_MAX(mInitialQuality, mMinQuality), mMaxQuality);
+
+	mLogScale[0] = 0.0;
+	for(int quality = 1; quality <= 100; quality++)
+	{
+		unsigned char table[64];
+		ComputeQuantizationTable(table, StandardLuminanceQuantizationTable, quality);
+
+		double sum = 0.0;
+		for(int i = 0; i < 64; i++)
+			sum -= log((double)table[i]);
+
+		mLogScale[quality] = sum / 64.0;
+	}
+
+	Reset();
+}
+
+void JpegRateControl::Reset()
+{
+	mFullness = 0.0;
+	mQuality = mInitialQuality;
+
+	mSlope = DefaultSlope;
+	mNumFrames = 0;
+	mLastQuality = mInitialQuality;
+	mLastLogSize = 0.0;
+}
+
+void JpegRateControl::FrameEncoded(int quality, unsigned int frameSize)
+{
+	if(!IsValid())
+		return;
+
+	quality = JPEG_MIN(JPEG_MAX(quality, 1), 100);
+
+	mFullness = JPEG_MAX(mFullness + frameSize - mTargetFrameSize, 0.0);
+
+	double logSize = log((double)JPEG_MAX(frameSize, 1u));
+
+	if(mNumFrames > 0)
+	{
+		double delta = mLogScale[quality] - mLogScale[mLastQuality];
+		if(fabs(delta) >= MinSlopeDelta)
+		{
+			double slope = (logSize - mLastLogSize) / delta;
+			slope = JPEG_MIN(JPEG_MAX(slope, MinSlope), MaxSlope);
+
+			mSlope += (slope - mSlope) * SlopeWeight;
+		}
+	}
+
+	mNumFrames++;
+	mLastQuality = quality;
+	mLastLogSize = logSize;
+
+	//steer for the target level, but never past the end of the buffer
+	double budget = mTargetFrameSize + (mBufferSize * TargetFullness - mFullness) / CorrectionFrames;
+	double room = mBufferSize - mFullness + mTargetFrameSize;
+	budget = JPEG_MIN(budget, room * OverflowMargin);
+
+	mQuality = PickQuality(budget);
+}
+
+int JpegRateControl::PickQuality(double budget) const
+{
+	int quality = mMinQuality;
+
+	if(budget >= 1.0)
+	{
+		double logBudget = log(budget);
+
+		for(int q = mMaxQuality; q > mMinQuality; q--)
+		{
+			double logSize = mLastLogSize + mSlope * (mLogScale[q] - mLogScale[mLastQuality]);
+			if(logSize <= logBudget)
+			{
+				quality = q;
+				break;
+			}
+		}
+	}
+
+	return JPEG_MIN(quality, JPEG_MAX(mLastQuality + MaxQualityStep, mMinQuality));
+}
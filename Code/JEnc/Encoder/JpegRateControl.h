@@ -0,0 +1,60 @@
+//--------------------------------------------------------------------------------------
+// Real-Time JPEG Compression using DirectCompute - Demo
+//
+// Copyright (c) Stefan Petersson 2012. All rights reserved.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include "../Include/JEnc.h"
+
+/*
+	Constant bitrate rate control. The link buffer fills with every frame
+	and drains by the target frame size, like the VBV of a video encoder.
+	The size budget of the next frame is the target plus a share of how far the
+	buffer is below a quarter full, and never more than fits into it.
+
+	The log of the frame size is close to a straight line over the mean log
+	of the luminance quantizers, the slope stays between about 0.4 and 1.2
+	from quality 5 to 100. The line goes through the last frame, which is the
+	best guess for the content of the next one, and its slope is learned from
+	frames that were coded at different qualities. The next quality is the
+	highest one the line puts within the budget.
+*/
+class JpegRateControl : public JEncRateControl
+{
+public:
+	JpegRateControl(const JEncRateControlDesc& desc);
+	virtual ~JpegRateControl() {}
+
+	//false if the desc gives no bytes per frame
+	bool IsValid() const { return mTargetFrameSize > 0.0; }
+
+	virtual int GetQuality() { return mQuality; }
+
+	virtual void FrameEncoded(int quality, unsigned int frameSize);
+
+	virtual unsigned int GetBufferFullness() { return (unsigned int)mFullness; }
+
+	virtual void Reset();
+
+private:
+	int PickQuality(double budget) const;
+
+	double mTargetFrameSize;
+	double mBufferSize;
+	int mMinQuality;
+	int mMaxQuality;
+	int mInitialQuality;
+
+	//mean -log of the luminance quantizers of every quality, 1..100
+	double mLogScale[101];
+
+	double mFullness;
+	int mQuality;
+
+	//log size over mLogScale, the last frame is the point the line goes through
+	double mSlope;
+	int mNumFrames;
+	int mLastQuality;
+	double mLastLogSize;
+};
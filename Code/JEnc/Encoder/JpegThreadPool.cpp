@@ -0,0 +1,259 @@
+//--------------------------------------------------------------------------------------
+// Real-Time JPEG Compression using DirectCompute - Demo
+//
+// Copyright (c) Stefan Petersson 2012. All rights reserved.
+//--------------------------------------------------------------------------------------
+#include "JpegThreadPool.h"
+
+//set while a thread runs pool tasks, nested ParallelFor calls run serially
+static thread_local bool tInsidePoolTask = false;
+
+//ranges dealt out per thread, more ranges balance better but cost more locking
+static const int RangesPerThread = 4;
+
+JpegThreadPool& JpegThreadPool::Get()
+{
+	//never destroyed, joining threads while the dll is unloaded deadlocks on the loader lock
+	static JpegThreadPool* pool = new JpegThreadPool();
+	return *pool;
+}
+
+JpegThreadPool::JpegThreadPool()
+{
+	mNumQueuedTasks = 0;
+	mShutdown = false;
+
+	SetNumThreads(0);
+}
+
+JpegThreadPool::~JpegThreadPool()
+{
+	StopWorkers();
+}
+
+void JpegThreadPool::SetNumThreads(int numThreads)
+{
+	std::lock_guard<std::mutex> lock(mConfigMutex);
+
+	if(numThreads <= 0)
+		numThreads = (int)std::thread::hardware_concurrency();
+	if(numThreads < 1)
+		numThreads = 1;
+
+	if(numThreads == GetNumThreads())
+		return;
+
+	StopWorkers();
+	StartWorkers(numThreads - 1);
+}
+
+int JpegThreadPool::GetNumThreads() const
+{
+	return (int)mWorkers.size() + 1;
+}
+
+void JpegThreadPool::StartWorkers(int numWorkers)
+{
+	mShutdown = false;
+
+	for(int i = 0; i < numWorkers; i++)
+		mWorkers.push_back(std::unique_ptr<Worker>(new Worker()));
+
+	//all deques have to exist before anybody tries to steal
+	for(int i = 0; i < numWorkers; i++)
+		mWorkers[i]->Thread = std::thread(&JpegThreadPool::WorkerMain, this, i);
+}
+
+void JpegThreadPool::StopWorkers()
+{
+	{
+		std::lock_guard<std::mutex> lock(mSleepMutex);
+		mShutdown = true;
+	}
+	mWakeWorkers.notify_all();
+
+	for(size_t i = 0; i < mWorkers.size(); i++)
+		mWorkers[i]->Thread.join();
+
+	mWorkers.clear();
+}
+
+void JpegThreadPool::ParallelFor(int count, const TaskBody& body)
+{
+	if(count <= 0)
+		return;
+
+	int numWorkers = (int)mWorkers.size();
+
+	if(numWorkers == 0 || count == 1 || tInsidePoolTask)
+	{
+		bool wasInside = tInsidePoolTask;
+		tInsidePoolTask = true;
+
+		for(int i = 0; i < count; i++)
+			body(i, 0);
+
+		tInsidePoolTask = wasInside;
+		return;
+	}
+
+	int numRanges = count < (numWorkers + 1) * RangesPerThread ? count : (numWorkers + 1) * RangesPerThread;
+
+	Job job;
+	job.Body = &body;
+	job.NumPendingTasks = numRanges;
+
+	//consecutive ranges go to consecutive workers so the front of every deque
+	//holds the earliest part of the job
+	for(int r = 0; r < numRanges; r++)
+	{
+		Task task;
+		task.Owner = &job;
+		task.Begin = (int)((long long)count * r / numRanges);
+		task.End = (int)((long long)count * (r + 1) / numRanges);
+
+		Worker* worker = mWorkers[r % numWorkers].get();
+
+		std::lock_guard<std::mutex> lock(worker->Mutex);
+		worker->Tasks.push_back(task);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mSleepMutex);
+		mNumQueuedTasks += numRanges;
+	}
+	mWakeWorkers.notify_all();
+
+	//help out with this job only, the per thread scratch of other jobs belongs to their callers
+	Task task;
+	while(TakeTask(-1, &job, task))
+		RunTask(task, 0);
+
+	std::unique_lock<std::mutex> lock(mSleepMutex);
+	mJobDone.wait(lock, [&job]() { return job.NumPendingTasks == 0; });
+}
+
+void JpegThreadPool::Start(AsyncTask& task, const TaskBody& body)
+{
+	task.mBody = body;
+	task.mJob.Body = &task.mBody;
+
+	if(mWorkers.empty() || tInsidePoolTask)
+	{
+		task.mBody(0, 0);
+		return;
+	}
+
+	task.mJob.NumPendingTasks = 1;
+
+	Task queued;
+	queued.Owner = &task.mJob;
+	queued.Begin = 0;
+	queued.End = 1;
+
+	//the back of a deque, idle workers steal it from there first
+	{
+		std::lock_guard<std::mutex> lock(mWorkers[0]->Mutex);
+		mWorkers[0]->Tasks.push_back(queued);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mSleepMutex);
+		mNumQueuedTasks++;
+	}
+	mWakeWorkers.notify_all();
+}
+
+void JpegThreadPool::Wait(AsyncTask& task)
+{
+	if(task.IsDone())
+		return;
+
+	Task queued;
+	if(TakeTask(-1, &task.mJob, queued))
+		RunTask(queued, 0);
+
+	std::unique_lock<std::mutex> lock(mSleepMutex);
+	mJobDone.wait(lock, [&task]() { return task.IsDone(); });
+}
+
+bool JpegThreadPool::TakeTask(int workerIndex, const Job* job, Task& outTask)
+{
+	int numWorkers = (int)mWorkers.size();
+
+	if(workerIndex >= 0)
+	{
+		Worker* own = mWorkers[workerIndex].get();
+
+		std::lock_guard<std::mutex> lock(own->Mutex);
+		if(!own->Tasks.empty())
+		{
+			outTask = own->Tasks.front();
+			own->Tasks.pop_front();
+			mNumQueuedTasks--;
+			return true;
+		}
+	}
+
+	for(int i = 0; i < numWorkers; i++)
+	{
+		int victimIndex = (workerIndex + 1 + i) % numWorkers;
+		if(victimIndex == workerIndex)
+			continue;
+
+		Worker* victim = mWorkers[victimIndex].get();
+
+		std::lock_guard<std::mutex> lock(victim->Mutex);
+		for(std::deque<Task>::iterator it = victim->Tasks.end(); it != victim->Tasks.begin(); )
+		{
+			--it;
+			if(job && it->Owner != job)
+				continue;
+
+			outTask = *it;
+			victim->Tasks.erase(it);
+			mNumQueuedTasks--;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void JpegThreadPool::RunTask(const Task& task, int threadIndex)
+{
+	bool wasInside = tInsidePoolTask;
+	tInsidePoolTask = true;
+
+	const TaskBody& body = *task.Owner->Body;
+	for(int i = task.Begin; i < task.End; i++)
+		body(i, threadIndex);
+
+	tInsidePoolTask = wasInside;
+
+	//the job may be gone as soon as the count hits zero
+	if(--task.Owner->NumPendingTasks == 0)
+	{
+		std::lock_guard<std::mutex> lock(mSleepMutex);
+		mJobDone.notify_all();
+	}
+}
+
+void JpegThreadPool::WorkerMain(int workerIndex)
+{
+	for(;;)
+	{
+		Task task;
+		if(TakeTask(workerIndex, NULL, task))
+		{
+			RunTask(task, workerIndex + 1);
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(mSleepMutex);
+		mWakeWorkers.wait(lock, [this]() { return mShutdown || mNumQueuedTasks > 0; });
+
+		if(mShutdown)
+			return;
+	}
+}
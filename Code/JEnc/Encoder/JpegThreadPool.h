@@ -0,0 +1,114 @@
+//--------------------------------------------------------------------------------------
+// Real-Time JPEG Compression using DirectCompute - Demo
+//
+// Copyright (c) Stefan Petersson 2012. All rights reserved.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+
+/*
+	Work stealing thread pool shared by all encoder instances.
+
+	ParallelFor cuts [0, count) into small ranges and deals them out to the
+	deques of the worker threads. A worker takes ranges from the front of its
+	own deque, which keeps MCU rows roughly in order, and steals from the back
+	of the others once it runs dry, so rows of uneven cost even out on their
+	own. The calling thread helps with its own job until it is done.
+
+	threadIndex is 0 for the calling thread and 1..GetNumThreads()-1 for the
+	workers, it is unique within one ParallelFor call and meant for indexing
+	per thread scratch buffers. A ParallelFor issued from inside a task runs
+	serially on that thread with threadIndex 0.
+
+	An AsyncTask is a single body queued like one range of a job, a worker
+	runs it while the thread that started it goes on. Wait runs it on the
+	calling thread if no worker took it yet.
+*/
+class JpegThreadPool
+{
+public:
+	typedef std::function<void(int index, int threadIndex)> TaskBody;
+
+private:
+	struct Job
+	{
+		const TaskBody* Body;
+		std::atomic<int> NumPendingTasks;
+	};
+
+public:
+	class AsyncTask
+	{
+	public:
+		AsyncTask() { mJob.NumPendingTasks = 0; }
+		~AsyncTask() { JpegThreadPool::Get().Wait(*this); }
+
+		bool IsDone() const { return mJob.NumPendingTasks == 0; }
+
+	private:
+		friend class JpegThreadPool;
+
+		TaskBody mBody;
+		Job mJob;
+	};
+
+	static JpegThreadPool& Get();
+
+	//numThreads includes the calling thread, 0 picks one thread per core,
+	//must not be called while anything is encoding
+	void SetNumThreads(int numThreads);
+	int GetNumThreads() const;
+
+	void ParallelFor(int count, const TaskBody& body);
+
+	//body gets index 0, without workers it runs right away. task must not be started again
+	//before it is done.
+	void Start(AsyncTask& task, const TaskBody& body);
+	void Wait(AsyncTask& task);
+
+private:
+
+	struct Task
+	{
+		Job* Owner;
+		int Begin;
+		int End;
+	};
+
+	struct Worker
+	{
+		std::mutex Mutex;
+		std::deque<Task> Tasks;
+		std::thread Thread;
+	};
+
+	JpegThreadPool();
+	~JpegThreadPool();
+
+	void StartWorkers(int numWorkers);
+	void StopWorkers();
+
+	void WorkerMain(int workerIndex);
+
+	//own deque first, then the back of everybody else's, job limits the search to one job
+	bool TakeTask(int workerIndex, const Job* job, Task& outTask);
+	void RunTask(const Task& task, int threadIndex);
+
+	std::vector< std::unique_ptr<Worker> > mWorkers;
+
+	std::atomic<int> mNumQueuedTasks;
+	std::mutex mSleepMutex;
+	std::condition_variable mWakeWorkers;
+	std::condition_variable mJobDone;
+	bool mShutdown;
+
+	std::mutex mConfigMutex;
+};
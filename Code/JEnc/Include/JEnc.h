@@ -17,15 +17,100 @@ extern "C"
 
 		virtual JEncResult Encode(JEncRGBDataDesc rgbDataDesc, int quality) = 0;
 
+#if defined(JENC_D3D)
 		virtual JEncResult Encode(JEncD3DDataDesc d3dDataDesc, int quality) = 0;
 		virtual JEncResult Encode(DX12_JEncD3DDataDesc d3dDataDesc, int quality) = 0;
+#endif
+
+		// tables-only stream of SOI, DQT, DHT and EOI for JENC_TABLES_NONE frames of the quality,
+		// written to the output sink like a frame with all of it counted in HeaderSize
+		virtual JEncResult EncodeTables(int quality) = 0;
+
+		// size the image would take at the quality without encoding it, the code lengths are added
+		// up and nothing is written to the output sink, Bits is NULL. HeaderSize is exact, DataSize
+		// leaves out the 0x00 stuffed after 0xFF bytes, well below one percent for usual images. It
+		// transforms the whole image like Encode does and takes nearly as long.
+		// Adapted Huffman tables (JENC_OPTION_ADAPTIVE_HUFFMAN) are the ones the next Encode gets,
+		// the encoder is left as it was.
+		virtual JEncResult EstimateSize(JEncRGBDataDesc rgbDataDesc, int quality) = 0;
+#if defined(JENC_D3D)
+		virtual JEncResult EstimateSize(JEncD3DDataDesc d3dDataDesc, int quality) = 0;
+		virtual JEncResult EstimateSize(DX12_JEncD3DDataDesc d3dDataDesc, int quality) = 0;
+#endif
+
+		// returns false if the option or value is not supported by the encoder type
+		virtual bool SetOption(JENC_OPTIONS option, int value) = 0;
+
+		// where the encoded stream goes, returns false for an invalid sink
+		virtual bool SetOutputSink(const JEncOutputSink& sink) = 0;
+
+		// allocates the buffers of images up to maxWidth x maxHeight ahead of the first Encode, smaller
+		// images and other qualities reuse them. The output buffer of JENC_SINK_INTERNAL is only sized
+		// for the quality of the last Encode, before the first one it grows with the frames. Returns
+		// false if the encoder was created for another subsampleType or for sizes above 65535.
+		virtual bool Reserve(unsigned int maxWidth, unsigned int maxHeight, JENC_CHROMA_SUBSAMPLE subsampleType) = 0;
+	};
+
+	// Constant bitrate for a stream of frames. Encode every frame at GetQuality() and report its
+	// HeaderSize + DataSize to FrameEncoded, the quality of the next frame follows from how the last
+	// frames did at their qualities and how full the link buffer is. A new quality per frame costs
+	// the encoders no more than writing the quantization tables, the buffers stay.
+	class DECLDIR JEncRateControl
+	{
+	public:
+		virtual ~JEncRateControl() {}
+
+		virtual int GetQuality() = 0;
+
+		virtual void FrameEncoded(int quality, unsigned int frameSize) = 0;
+
+		// bytes in the link buffer after the frames so far, above BufferSize means it overflowed
+		virtual unsigned int GetBufferFullness() = 0;
+
+		// empty buffer, no history and the initial quality again
+		virtual void Reset() = 0;
 	};
 
+	// The device and context are only used by GPU_ENCODER and may be NULL for CPU_ENCODER,
+	// without JENC_D3D there is no GPU_ENCODER and this returns NULL for it
 	DECLDIR JEnc* CreateJpegEncoderInstance(JENC_TYPE encoderType, JENC_CHROMA_SUBSAMPLE subsampleType,
 		struct ID3D11Device* d3dDevice, struct ID3D11DeviceContext* d3dContext);
 
+#if defined(JENC_D3D)
 	// Create a jpeg encoder instace with directx 12
 	DECLDIR JEnc* DX12_CreateJpegEncoderInstance(JENC_TYPE encoderType, JENC_CHROMA_SUBSAMPLE subsampleType,
 		struct D3D12Wrap* d3dWrap);
+#endif
+
+	// Encode context of a configured encoder for another thread. It shares the options, quantization
+	// divisors and Huffman codes of encoder read-only and only has buffers of its own, so with one
+	// context per thread independent images are encoded in parallel without any locking. Options set
+	// on encoder later do not reach existing contexts. Give every context its own sink unless it is
+	// JENC_SINK_INTERNAL, adaptive Huffman tables start over from the standard ones. Delete it like
+	// any encoder. NULL for the GPU encoders, which take one Encode at a time on their device context.
+	DECLDIR JEnc* CreateJpegEncoderContext(JEnc* encoder);
+
+	// Returns NULL if the desc gives no bytes per frame.
+	DECLDIR JEncRateControl* CreateJpegRateControlInstance(const JEncRateControlDesc& desc);
+
+	// Upper bound for the size of an encoded image with the standard Huffman tables, header and
+	// EOI included. It takes the energy a block of 8 bit samples can hold and counts every run of
+	// ones that could make 0xFF bytes as stuffed, which leaves it well above any image: at 4:4:4
+	// it is about 1.9 bytes per pixel at quality 10 and 10 at quality 100, where noise takes 0.2
+	// and 4. Returns 0 for invalid arguments or sizes that do not fit into 32 bits.
+	DECLDIR unsigned int GetJpegEncoderMaxOutputSize(unsigned int width, unsigned int height,
+		JENC_CHROMA_SUBSAMPLE subsampleType, int quality, int restartInterval);
+
+	// All encoder instances share one pool of worker threads. numThreads includes the
+	// calling thread, 0 uses one thread per core. Must not be called while encoding.
+	DECLDIR void SetJpegEncoderThreadCount(int numThreads);
+	DECLDIR int GetJpegEncoderThreadCount();
+
+	// Calls func(index, threadIndex, userData) for every index in [0, count) on the pool
+	// and returns when all calls are done. threadIndex is below GetJpegEncoderThreadCount()
+	// and never used by two calls of one JEncParallelFor at the same time, several threads may
+	// call JEncParallelFor at once.
+	typedef void (*JEncTaskFunc)(int index, int threadIndex, void* userData);
+	DECLDIR void JEncParallelFor(int count, JEncTaskFunc func, void* userData);
 }
 #endif
\ No newline at end of file
@@ -10,14 +10,24 @@
 #pragma once
 #endif
 
-#if defined DLL_EXPORT
+#if !defined(_WIN32)
+#define DECLDIR __attribute__((visibility("default")))
+#elif defined DLL_EXPORT
 #define DECLDIR __declspec(dllexport)
 #else
 #define DECLDIR __declspec(dllimport)
 #endif
 
+//D3D11 and D3D12 input and the GPU encoders only exist on Windows, JENC_NO_D3D leaves
+//them out there too for a CPU only build
+#if defined(_WIN32) && !defined(JENC_NO_D3D)
+#define JENC_D3D
+#endif
+
 #include <string>
+#include <cstring>
 #include <cmath>
+#include <cstdint>
 
 enum JENC_TYPE
 {
@@ -28,6 +38,28 @@ enum JENC_TYPE
 enum JENC_OPTIONS
 {
 //	COUNT_ZEROES_ON_GPU = 1	//will only work with GPU_ENCODER type
+	JENC_OPTION_DCT_METHOD = 2,	//JENC_DCT_METHOD value, will only work with CPU_ENCODER type
+	JENC_OPTION_RESTART_INTERVAL = 3,	//MCUs per restart interval, 0 disables restart markers
+	JENC_OPTION_DETERMINISTIC = 4,		//1 = integer only pipeline, same bytes on every machine, driver and thread count
+	JENC_OPTION_DEFERRED_STUFFING = 5,	//1 = pack entropy coded data without byte stuffing and insert the 0x00 bytes in one SIMD pass afterwards
+	JENC_OPTION_TABLES = 6,				//JENC_TABLES value, which tables every frame carries
+	JENC_OPTION_OPTIMIZE_HUFFMAN = 7,	//1 = two passes with Huffman tables built for every image, will only work with CPU_ENCODER type
+	JENC_OPTION_ADAPTIVE_HUFFMAN = 8	//frames between Huffman table rebuilds from the statistics of the stream (0..65535), 0 = standard tables, only every that many frames with JENC_OPTION_DETERMINISTIC, will only work with CPU_ENCODER type
+};
+
+//abbreviated frames for MJPEG and RTP (RFC 2435), frames with optimized or adapted Huffman tables always carry DHT
+enum JENC_TABLES
+{
+	JENC_TABLES_ALL,		//DQT and DHT in every frame, default
+	JENC_TABLES_NO_DHT,		//no DHT, MJPEG (AVI1) decoders insert the standard tables
+	JENC_TABLES_NONE		//neither DQT nor DHT, the decoder gets them once from EncodeTables
+};
+
+enum JENC_DCT_METHOD
+{
+	JENC_DCT_ISLOW,		//accurate integer, default
+	JENC_DCT_IFAST,		//less accurate integer
+	JENC_DCT_FLOAT		//floating point
 };
 
 enum JENC_CHROMA_SUBSAMPLE
@@ -37,6 +69,8 @@ enum JENC_CHROMA_SUBSAMPLE
 	JENC_CHROMA_SUBSAMPLE_4_2_0
 };
 
+//TargetMemory overrides the output sink for one Encode call, it has to hold TargetMemorySize
+//bytes or GetJpegEncoderMaxOutputSize() bytes when TargetMemorySize is 0
 struct JEncRGBDataDesc
 {
 	unsigned char* Data;
@@ -44,6 +78,7 @@ struct JEncRGBDataDesc
 	unsigned int Height;
 	unsigned int RowPitch;
 	unsigned char* TargetMemory;
+	unsigned int TargetMemorySize;
 
 	JEncRGBDataDesc()
 	{
@@ -51,12 +86,14 @@ struct JEncRGBDataDesc
 	}
 };
 
+#if defined(JENC_D3D)
 struct JEncD3DDataDesc
 {
 	struct ID3D11ShaderResourceView* ResourceView;
 	unsigned int Width;
 	unsigned int Height;
 	unsigned char* TargetMemory;
+	unsigned int TargetMemorySize;
 	
 	JEncD3DDataDesc()
 	{
@@ -67,23 +104,88 @@ struct JEncD3DDataDesc
 struct DX12_JEncD3DDataDesc
 {
 	struct ID3D12DescriptorHeap* DescriptorHeap;
-	unsigned __int64 ptrToCB_DCT_Matrix;
-	unsigned __int64 ptrToDescHeapImage;
+	uint64_t ptrToCB_DCT_Matrix;
+	uint64_t ptrToDescHeapImage;
 	unsigned int Width;
 	unsigned int Height;
 	unsigned char* TargetMemory;
+	unsigned int TargetMemorySize;
 
 	DX12_JEncD3DDataDesc()
 	{
 		memset(this, 0, sizeof(DX12_JEncD3DDataDesc));
 	}
 };
+#endif
 
 struct JEncResult
 {
 	void* Bits;
 	unsigned int HeaderSize;
 	unsigned int DataSize;
+
+	//the stream did not fit the JENC_SINK_FIXED buffer or the sink callback gave up, Bits is
+	//NULL but HeaderSize and DataSize still tell how much room the stream would have taken
+	bool Overflow;
+};
+
+//constant bitrate for a stream of frames, see JEncRateControl. Either TargetFrameSize or
+//TargetBitRate and FrameRate give the bytes per frame the link takes away
+struct JEncRateControlDesc
+{
+	unsigned int TargetBitRate;		//bits per second
+	float FrameRate;				//frames per second of the stream
+	unsigned int TargetFrameSize;	//bytes per frame, used instead of TargetBitRate and FrameRate if not 0
+
+	//bytes the link can buffer (VBV), a frame bigger than what is left plus one frame of the target
+	//rate overflows it. 0 = one second of the target rate, 30 frames without FrameRate
+	unsigned int BufferSize;
+
+	//quality range to pick from, 0 = 1 and 100
+	int MinQuality;
+	int MaxQuality;
+
+	//quality of the first frame, 0 = 75
+	int InitialQuality;
+
+	JEncRateControlDesc()
+	{
+		memset(this, 0, sizeof(JEncRateControlDesc));
+	}
+};
+
+enum JENC_SINK_TYPE
+{
+	JENC_SINK_INTERNAL,	//encoder owned buffer that grows as needed, Bits is valid until the next Encode call (default)
+	JENC_SINK_FIXED,	//caller owned Memory of Capacity bytes, never written past the end
+	JENC_SINK_CALLBACK	//Callback gets the stream in chunks as they complete, nothing is kept and Bits is NULL
+};
+
+//gets the next size bytes of the stream, returning false drops the rest and sets JEncResult::Overflow.
+//The header always comes as a chunk of its own straight from the encoder's cached copy, data is
+//only valid during the call
+typedef bool (*JEncSinkFunc)(const unsigned char* data, unsigned int size, void* userData);
+
+struct JEncOutputSink
+{
+	JENC_SINK_TYPE Type;
+
+	//JENC_SINK_FIXED
+	unsigned char* Memory;
+	unsigned int Capacity;
+
+	//JENC_SINK_CALLBACK
+	JEncSinkFunc Callback;
+	void* UserData;
+
+	//size of the internal buffer to start with and of the callback chunks, 0 = 64 KB,
+	//chunks get bigger when a single MCU row could need more than that
+	unsigned int ChunkSize;
+
+	JEncOutputSink()
+	{
+		memset(this, 0, sizeof(JEncOutputSink));
+	}
 };
 
 #endif
\ No newline at end of file
@@ -5,9 +5,12 @@
 //--------------------------------------------------------------------------------------
 #include <JEnc.h>
 
-#include "Encoder\JpegEncoderGPU_444.h"
-#include "Encoder\JpegEncoderGPU_422.h"
-#include "Encoder\JpegEncoderGPU_420.h"
+#if defined(JENC_D3D)
+#include "Encoder/JpegEncoderGPU_MCU.h"
+#endif
+#include "Encoder/JpegEncoderCPU.h"
+#include "Encoder/JpegThreadPool.h"
+#include "Encoder/JpegRateControl.h"
 
 #include "stdafx.h"
 
@@ -17,6 +20,7 @@ DECLDIR JEnc* CreateJpegEncoderInstance(JENC_TYPE encoderType, JENC_CHROMA_SUBSA
 {
 	JpegEncoderBase* enc = NULL;
 
+#if defined(JENC_D3D)
 	if(encoderType == GPU_ENCODER)
 	{
 		if(subsampleType == JENC_CHROMA_SUBSAMPLE_4_4_4)
@@ -26,6 +30,11 @@ DECLDIR JEnc* CreateJpegEncoderInstance(JENC_TYPE encoderType, JENC_CHROMA_SUBSA
 		else if(subsampleType == JENC_CHROMA_SUBSAMPLE_4_2_0)
 			enc = myNew JpegEncoderGPU_420(d3dDevice, d3dContext);
 	}
+#endif
+	if(encoderType == CPU_ENCODER)
+	{
+		enc = myNew JpegEncoderCPU(subsampleType);
+	}
 
 	if(enc)
 	{
@@ -39,6 +48,7 @@ DECLDIR JEnc* CreateJpegEncoderInstance(JENC_TYPE encoderType, JENC_CHROMA_SUBSA
 	return enc;
 }
 
+#if defined(JENC_D3D)
 DECLDIR JEnc* DX12_CreateJpegEncoderInstance(JENC_TYPE encoderType, JENC_CHROMA_SUBSAMPLE subsampleType,
 	struct D3D12Wrap* d3dWrap)
 {
@@ -53,6 +63,10 @@ DECLDIR JEnc* DX12_CreateJpegEncoderInstance(JENC_TYPE encoderType, JENC_CHROMA_
 		else if (subsampleType == JENC_CHROMA_SUBSAMPLE_4_2_0)
 			enc = myNew DX12_JpegEncoderGPU_420(d3dWrap);
 	}
+	else if (encoderType == CPU_ENCODER)
+	{
+		enc = myNew JpegEncoderCPU(subsampleType);
+	}
 
 	if (enc)
 	{
@@ -64,4 +78,64 @@ DECLDIR JEnc* DX12_CreateJpegEncoderInstance(JENC_TYPE encoderType, JENC_CHROMA_
 	}
 
 	return enc;
+}
+#endif
+
+DECLDIR JEnc* CreateJpegEncoderContext(JEnc* encoder)
+{
+	//the GPU encoders take one Encode at a time on their device context
+	JpegEncoderCPU* cpuEncoder = dynamic_cast<JpegEncoderCPU*>(encoder);
+	if(!cpuEncoder)
+		return NULL;
+
+	JpegEncoderCPU* context = myNew JpegEncoderCPU(cpuEncoder->GetConfig());
+	if(!context->Init())
+	{
+		delete context;
+		return NULL;
+	}
+
+	context->CopyConfiguration(*cpuEncoder);
+
+	return context;
+}
+
+DECLDIR JEncRateControl* CreateJpegRateControlInstance(const JEncRateControlDesc& desc)
+{
+	JpegRateControl* rateControl = myNew JpegRateControl(desc);
+
+	if(!rateControl->IsValid())
+	{
+		delete rateControl;
+		rateControl = NULL;
+	}
+
+	return rateControl;
+}
+
+DECLDIR unsigned int GetJpegEncoderMaxOutputSize(unsigned int width, unsigned int height,
+	JENC_CHROMA_SUBSAMPLE subsampleType, int quality, int restartInterval)
+{
+	if(width > 0xFFFF || height > 0xFFFF)
+		return 0;
+
+	uint64_t size = JpegEncoderBase::GetMaxOutputSize((int)width, (int)height, subsampleType, quality, restartInterval);
+	return size <= 0xFFFFFFFF ? (unsigned int)size : 0;
+}
+
+DECLDIR void SetJpegEncoderThreadCount(int numThreads)
+{
+	JpegThreadPool::Get().SetNumThreads(numThreads);
+}
+
+DECLDIR int GetJpegEncoderThreadCount()
+{
+	return JpegThreadPool::Get().GetNumThreads();
+}
+
+DECLDIR void JEncParallelFor(int count, JEncTaskFunc func, void* userData)
+{
+	JpegThreadPool::Get().ParallelFor(count, [func, userData](int index, int threadIndex) {
+		func(index, threadIndex, userData);
+	});
 }
\ No newline at end of file
@@ -0,0 +1,1252 @@
+//--------------------------------------------------------------------------------------
+// Real-Time JPEG Compression using DirectCompute - Demo
+//
+// Copyright (c) Stefan Petersson 2012. All rights reserved.
+//--------------------------------------------------------------------------------------
+#include <JEnc.h>
+
+#include "../Encoder/JpegFDCT.h"
+#include "../Encoder/JpegQuantize.h"
+#include "../Encoder/JpegEntropySlots.h"
+#include "../../Shared/JpegCommon.h"
+
+#include <cmath>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+/*
+	Checks of the CPU encoder that need no reference data besides the hashes
+	below. Encoded streams are compared by hash, so a change of the output
+	bytes shows up here even when the images still decode fine. Update the
+	hashes only for changes that are meant to change the output.
+*/
+
+static int sNumFailures = 0;
+
+#define CHECK(x) \
+	do { if(!(x)) { printf("%s(%d): CHECK(%s) failed\n", __FILE__, __LINE__, #x); sNumFailures++; } } while(0)
+
+//small linear congruential generator, the same numbers everywhere
+static unsigned int sRandom = 1;
+
+static int Random(int range)
+{
+	sRandom = sRandom * 1103515245 + 12345;
+	return (int)((sRandom >> 8) % (unsigned int)range);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// golden hashes of the encoded streams
+//////////////////////////////////////////////////////////////////////////
+
+//FNV-1a
+static unsigned long long HashBytes(const unsigned char* data, unsigned int size)
+{
+	unsigned long long hash = 14695981039346656037ULL;
+	for(unsigned int i = 0; i < size; i++)
+		hash = (hash ^ data[i]) * 1099511628211ULL;
+
+	return hash;
+}
+
+//gradients, edges and some noise, sizes that are no multiple of any MCU
+static void BuildTestImage(std::vector<unsigned char>& pixels, int width, int height)
+{
+	sRandom = 1;
+	pixels.resize(width * height * 4);
+
+	for(int y = 0; y < height; y++)
+	{
+		for(int x = 0; x < width; x++)
+		{
+			unsigned char* p = &pixels[(y * width + x) * 4];
+			int noise = Random(33) - 16;
+			int edge = ((x / 24 + y / 16) & 1) ? 60 : 0;
+
+			p[0] = (unsigned char)JPEG_MIN(JPEG_MAX(x * 255 / width + noise, 0), 255);
+			p[1] = (unsigned char)JPEG_MIN(JPEG_MAX(y * 255 / height + edge - 30, 0), 255);
+			p[2] = (unsigned char)JPEG_MIN(JPEG_MAX(128 + (int)(100.0 * sin(x * 0.11) * cos(y * 0.07)) + noise, 0), 255);
+			p[3] = 255;
+		}
+	}
+}
+
+struct GoldenCase
+{
+	JENC_CHROMA_SUBSAMPLE SubsampleType;
+	int RestartInterval;
+	JENC_DCT_METHOD DCTMethod;
+	unsigned long long Hash;
+};
+
+//203 x 141 at quality 75, islow with JENC_OPTION_DETERMINISTIC
+static const GoldenCase GoldenCases[] =
+{
+	{ JENC_CHROMA_SUBSAMPLE_4_4_4, 0, JENC_DCT_ISLOW, 0x7BADE86561000EDDULL },
+	{ JENC_CHROMA_SUBSAMPLE_4_4_4, 0, JENC_DCT_IFAST, 0x0C8F9F5480A09A9AULL },
+	{ JENC_CHROMA_SUBSAMPLE_4_4_4, 0, JENC_DCT_FLOAT, 0x683ED2BFA1ED24BFULL },
+	{ JENC_CHROMA_SUBSAMPLE_4_4_4, 7, JENC_DCT_ISLOW, 0xAC34D22ED6FDAE1DULL },
+	{ JENC_CHROMA_SUBSAMPLE_4_4_4, 7, JENC_DCT_IFAST, 0x58E0F7F270D07B4FULL },
+	{ JENC_CHROMA_SUBSAMPLE_4_4_4, 7, JENC_DCT_FLOAT, 0x5BDA8F836CCFC3F6ULL },
+	{ JENC_CHROMA_SUBSAMPLE_4_2_2, 0, JENC_DCT_ISLOW, 0xF14BC32627FC55B6ULL },
+	{ JENC_CHROMA_SUBSAMPLE_4_2_2, 0, JENC_DCT_IFAST, 0xED27B8A5BBBDA106ULL },
+	{ JENC_CHROMA_SUBSAMPLE_4_2_2, 0, JENC_DCT_FLOAT, 0x8C94BE1238971559ULL },
+	{ JENC_CHROMA_SUBSAMPLE_4_2_2, 7, JENC_DCT_ISLOW, 0xC281539C5A315366ULL },
+	{ JENC_CHROMA_SUBSAMPLE_4_2_2, 7, JENC_DCT_IFAST, 0xB845B86E136EA266ULL },
+	{ JENC_CHROMA_SUBSAMPLE_4_2_2, 7, JENC_DCT_FLOAT, 0xCAB403EE8A5170BFULL },
+	{ JENC_CHROMA_SUBSAMPLE_4_2_0, 0, JENC_DCT_ISLOW, 0x74379B5107B4D7D9ULL },
+	{ JENC_CHROMA_SUBSAMPLE_4_2_0, 0, JENC_DCT_IFAST, 0x48582A2C674D46A3ULL },
+	{ JENC_CHROMA_SUBSAMPLE_4_2_0, 0, JENC_DCT_FLOAT, 0x414CE4389DAA9525ULL },
+	{ JENC_CHROMA_SUBSAMPLE_4_2_0, 7, JENC_DCT_ISLOW, 0xE01CD1B399485523ULL },
+	{ JENC_CHROMA_SUBSAMPLE_4_2_0, 7, JENC_DCT_IFAST, 0xA4CFC2DD217610C8ULL },
+	{ JENC_CHROMA_SUBSAMPLE_4_2_0, 7, JENC_DCT_FLOAT, 0x81278C87F7A30203ULL },
+};
+
+static void TestGoldenHashes()
+{
+	const int width = 203;
+	const int height = 141;
+
+	std::vector<unsigned char> pixels;
+	BuildTestImage(pixels, width, height);
+
+	JEncRGBDataDesc desc;
+	desc.Data = &pixels[0];
+	desc.Width = width;
+	desc.Height = height;
+	desc.RowPitch = width * 4;
+
+	//the same bytes on one thread and on several
+	const int threadCounts[] = { 1, 4 };
+
+	for(int t = 0; t < 2; t++)
+	{
+		SetJpegEncoderThreadCount(threadCounts[t]);
+
+		for(size_t i = 0; i < sizeof(GoldenCases) / sizeof(GoldenCases[0]); i++)
+		{
+			const GoldenCase& c = GoldenCases[i];
+
+			JEnc* encoder = CreateJpegEncoderInstance(CPU_ENCODER, c.SubsampleType, NULL, NULL);
+			CHECK(encoder != NULL);
+			if(!encoder)
+				continue;
+
+			if(c.DCTMethod == JENC_DCT_ISLOW)
+				CHECK(encoder->SetOption(JENC_OPTION_DETERMINISTIC, 1));
+			else
+				CHECK(encoder->SetOption(JENC_OPTION_DCT_METHOD, c.DCTMethod));
+			CHECK(encoder->SetOption(JENC_OPTION_RESTART_INTERVAL, c.RestartInterval));
+
+			JEncResult result = encoder->Encode(desc, 75);
+			CHECK(result.Bits != NULL && !result.Overflow);
+
+			unsigned long long hash = result.Bits ? HashBytes((const unsigned char*)result.Bits, result.HeaderSize + result.DataSize) : 0;
+			if(hash != c.Hash)
+			{
+				printf("golden case %d (subsampling %d, restart interval %d, DCT method %d) on %d threads: hash 0x%016llXULL\n",
+					(int)i, (int)c.SubsampleType, c.RestartInterval, (int)c.DCTMethod, threadCounts[t], hash);
+				sNumFailures++;
+			}
+
+			delete encoder;
+		}
+	}
+
+	SetJpegEncoderThreadCount(0);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// JpegEntropySlotSizer::PackBlocks
+//////////////////////////////////////////////////////////////////////////
+static void TestPackBlocks()
+{
+	//slots of 4 ints, 2 AC words, so anything above 64 bits goes to an overflow slot
+	JpegEntropySlotSizer sizer;
+	sizer.Reset(4, 5);
+
+	std::vector<int> data(sizer.GetBufferSize(), 0x55555555);
+	int* slots = &data[sizer.GetSlotBase()];
+	int* overflow = &data[sizer.GetOverflowBase() + 1];
+
+	//DC, AC words, AC bit count
+	const int blocks[5][4] =
+	{
+		{ 12,		0x11111111, 0x55555555,	20 },	//one word
+		{ -3,		0x55555555, 0x55555555,	0 },	//no AC bits
+		{ 1000,		0x22222222, 0x33333333,	64 },	//full slot
+		{ -2048,	3,			0x55555555,	90 },	//overflow slot 3, three words
+		{ 0,		0x77777777, 0x55555555,	1 },	//one bit
+	};
+	for(int i = 0; i < 5; i++)
+		for(int j = 0; j < 4; j++)
+			slots[i * 4 + j] = blocks[i][j];
+
+	//the overflow counter hands out slots from the low bits of DU[1]
+	overflow[3 * JPEG_OVERFLOW_SLOT_WORDS + 0] = 0x44444444;
+	overflow[3 * JPEG_OVERFLOW_SLOT_WORDS + 1] = 0x55667788;
+	overflow[3 * JPEG_OVERFLOW_SLOT_WORDS + 2] = (int)0x99AABBCC;
+
+	sizer.PackBlocks(&data[0]);
+
+	const int headers[5] =
+	{
+		(20 << 16) | 12,
+		(0 << 16) | 0xFFFD,
+		(64 << 16) | 1000,
+		(90 << 16) | 0xF800,
+		(1 << 16) | 0,
+	};
+	for(int i = 0; i < 5; i++)
+		CHECK(data[i] == headers[i]);
+
+	const int payload[7] = { 0x11111111, 0x22222222, 0x33333333, 0x44444444, 0x55667788, (int)0x99AABBCC, 0x77777777 };
+	CHECK(data[5] == 7);
+	for(int i = 0; i < 7; i++)
+		CHECK(data[6 + i] == payload[i]);
+
+	const int offsets[5] = { 0, 1, 1, 3, 6 };
+	int computedOffsets[5];
+	CHECK(JpegEntropySlotSizer::ComputeBlockOffsets(&data[0], 5, computedOffsets) == 7);
+	for(int i = 0; i < 5; i++)
+	{
+		CHECK(data[sizer.GetOffsetBase() + i] == offsets[i]);
+		CHECK(computedOffsets[i] == offsets[i]);
+	}
+
+	CHECK(JpegEntropySlotSizer::GetDC(data[3]) == -2048);
+	CHECK(JpegEntropySlotSizer::GetNumBits(data[3]) == 90);
+	CHECK(sizer.GetPackedSize(7) == 5 + 1 + 7);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// quantization reciprocals against division
+//////////////////////////////////////////////////////////////////////////
+static void TestQuantization(JENC_DCT_METHOD method)
+{
+	unsigned int* baseTables[2] = { StandardLuminanceQuantizationTable, StandardChromianceQuantizationTable };
+
+	int numMismatches = 0;
+	for(int quality = 1; quality <= 100; quality++)
+	{
+		for(int t = 0; t < 2; t++)
+		{
+			unsigned char table[64];
+			ComputeQuantizationTable(table, baseTables[t], quality);
+
+			QuantizationDivisors divisors;
+			ComputeQuantizationDivisors(method, table, &divisors);
+
+			//tables with divisors below 4 take the float reciprocals
+			if(divisors.UseFloatReciprocal)
+				continue;
+
+			//divisors in zigzag order, the order of DU
+			int divisor[64];
+			for(int i = 0; i < 64; i++)
+			{
+				int natural = ZigZagIndices[i];
+				double d = table[i] * 8.0;
+				if(method != JENC_DCT_ISLOW)
+					d *= AANScaleFactor[natural / 8] * AANScaleFactor[natural % 8];
+				divisor[i] = (int)(d + 0.5);
+			}
+
+			for(int x = 0; x < 32768; x++)
+			{
+				//every other coefficient negative, the rounding is symmetric
+				short coefficients[64];
+				for(int i = 0; i < 64; i++)
+					coefficients[i] = (short)((i & 1) ? -x : x);
+
+				short DU[64];
+				QuantizeBlock(coefficients, &divisors, DU);
+
+				for(int i = 0; i < 64; i++)
+				{
+					int magnitude = (x + (divisor[i] - 1) / 2) / divisor[i];
+					int expected = (ZigZagIndices[i] & 1) ? -magnitude : magnitude;
+					numMismatches += DU[i] != expected;
+				}
+			}
+		}
+	}
+
+	CHECK(numMismatches == 0);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// scalar against AVX2 FDCT, and the fused quantization against QuantizeBlock
+//////////////////////////////////////////////////////////////////////////
+static void TestFDCT()
+{
+	if(!FDCT_UsesAVX2())
+	{
+		printf("no AVX2, FDCT kernels not compared\n");
+		return;
+	}
+
+	//every method at a few qualities, ifast at 100 takes the float reciprocals
+	const int qualities[4] = { 10, 50, 90, 100 };
+	QuantizationDivisors divisors[3][4];
+	for(int q = 0; q < 4; q++)
+	{
+		unsigned char table[64];
+		ComputeQuantizationTable(table, StandardLuminanceQuantizationTable, qualities[q]);
+
+		for(int method = 0; method < 3; method++)
+			ComputeQuantizationDivisors((JENC_DCT_METHOD)method, table, &divisors[method][q]);
+	}
+
+	//the sign of every basis function, as blocks of -128 and 127 they give
+	//the largest coefficients and intermediates
+	int basisSign[8][8];
+	for(int u = 0; u < 8; u++)
+		for(int x = 0; x < 8; x++)
+			basisSign[u][x] = cos((2 * x + 1) * u * 3.14159265358979 / 16) < 0 ? -1 : 1;
+
+	//blocks read with a pitch of 11 samples, extremes first and then noise
+	const int pitch = 11;
+	short samples[8 * pitch];
+
+	sRandom = 7;
+	for(int n = 0; n < 10000; n++)
+	{
+		for(int y = 0; y < 8; y++)
+		{
+			for(int x = 0; x < pitch; x++)
+			{
+				int value;
+				if(n == 0)
+					value = -128;
+				else if(n == 1)
+					value = 127;
+				else if(n == 2)
+					value = ((x + y) & 1) ? 127 : -128;
+				else if(n < 3 + 128 && x < 8)
+				{
+					int basis = (n - 3) / 2;
+					int sign = basisSign[basis / 8][y] * basisSign[basis % 8][x] * ((n & 1) ? 1 : -1);
+					value = sign > 0 ? 127 : -128;
+				}
+				else
+					value = Random(256) - 128;
+
+				samples[y * pitch + x] = (short)value;
+			}
+		}
+
+		short coefficients[64], reference[64];
+		ComputeFDCT_ISlow(samples, pitch, coefficients);
+		ComputeFDCT_ISlow_Scalar(samples, pitch, reference);
+		CHECK(memcmp(coefficients, reference, sizeof(reference)) == 0);
+
+		ComputeFDCT_IFast(samples, pitch, coefficients);
+		ComputeFDCT_IFast_Scalar(samples, pitch, reference);
+		CHECK(memcmp(coefficients, reference, sizeof(reference)) == 0);
+
+		float floatCoefficients[64], floatReference[64];
+		ComputeFDCT_Float(samples, pitch, floatCoefficients);
+		ComputeFDCT_Float_Scalar(samples, pitch, floatReference);
+		CHECK(memcmp(floatCoefficients, floatReference, sizeof(floatReference)) == 0);
+
+		for(int q = 0; q < 4; q++)
+		{
+			short DU[64], referenceDU[64];
+
+			ComputeFDCTQuantized_ISlow(samples, pitch, &divisors[JENC_DCT_ISLOW][q], DU);
+			ComputeFDCT_ISlow_Scalar(samples, pitch, reference);
+			QuantizeBlock(reference, &divisors[JENC_DCT_ISLOW][q], referenceDU);
+			CHECK(memcmp(DU, referenceDU, sizeof(referenceDU)) == 0);
+
+			ComputeFDCTQuantized_IFast(samples, pitch, &divisors[JENC_DCT_IFAST][q], DU);
+			ComputeFDCT_IFast_Scalar(samples, pitch, reference);
+			QuantizeBlock(reference, &divisors[JENC_DCT_IFAST][q], referenceDU);
+			CHECK(memcmp(DU, referenceDU, sizeof(referenceDU)) == 0);
+
+			ComputeFDCTQuantized_Float(samples, pitch, &divisors[JENC_DCT_FLOAT][q], DU);
+			QuantizeBlock(floatReference, &divisors[JENC_DCT_FLOAT][q], referenceDU);
+			CHECK(memcmp(DU, referenceDU, sizeof(referenceDU)) == 0);
+		}
+
+		if(sNumFailures)
+			break;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// output sinks and GetJpegEncoderMaxOutputSize
+//////////////////////////////////////////////////////////////////////////
+
+//noise, saturated noise or every block one basis function as -128 / 127 samples,
+//the images that take the most bits
+static void BuildWorstCaseImage(std::vector<unsigned char>& pixels, int width, int height, int kind)
+{
+	sRandom = 3;
+	pixels.resize(width * height * 4);
+
+	for(int y = 0; y < height; y++)
+	{
+		for(int x = 0; x < width; x++)
+		{
+			unsigned char* p = &pixels[(y * width + x) * 4];
+			for(int c = 0; c < 3; c++)
+			{
+				if(kind == 0)
+					p[c] = (unsigned char)Random(256);
+				else if(kind == 1)
+					p[c] = Random(2) ? 255 : 0;
+				else
+				{
+					int block = (y / 8) * (width / 8 + 1) + x / 8 + c * 17;
+					int u = block % 8;
+					int v = (block / 8) % 8;
+					double basis = cos((2 * (x % 8) + 1) * u * 3.14159265358979 / 16) * cos((2 * (y % 8) + 1) * v * 3.14159265358979 / 16);
+					p[c] = (basis < 0) != ((block / 64) & 1) ? 255 : 0;
+				}
+			}
+			p[3] = 255;
+		}
+	}
+}
+
+static bool AppendChunk(const unsigned char* data, unsigned int size, void* userData)
+{
+	std::vector<unsigned char>* stream = (std::vector<unsigned char>*)userData;
+	stream->insert(stream->end(), data, data + size);
+	return true;
+}
+
+static void TestOutputSinks()
+{
+	const JENC_CHROMA_SUBSAMPLE subsampleTypes[3] = { JENC_CHROMA_SUBSAMPLE_4_4_4, JENC_CHROMA_SUBSAMPLE_4_2_2, JENC_CHROMA_SUBSAMPLE_4_2_0 };
+
+	//the largest streams stay within the bound, every DCT method at both ends of the quality range
+	const int width = 67;
+	const int height = 45;
+
+	std::vector<unsigned char> pixels;
+	JEncRGBDataDesc desc;
+	desc.Width = width;
+	desc.Height = height;
+	desc.RowPitch = width * 4;
+
+	const int qualities[3] = { 10, 75, 100 };
+	for(int kind = 0; kind < 3; kind++)
+	{
+		BuildWorstCaseImage(pixels, width, height, kind);
+		desc.Data = &pixels[0];
+
+		for(int s = 0; s < 3; s++)
+		{
+			JEnc* encoder = CreateJpegEncoderInstance(CPU_ENCODER, subsampleTypes[s], NULL, NULL);
+			CHECK(encoder != NULL);
+			if(!encoder)
+				continue;
+
+			for(int method = 0; method < 3; method++)
+			{
+				CHECK(encoder->SetOption(JENC_OPTION_DCT_METHOD, method));
+
+				for(int restartInterval = 0; restartInterval <= 3; restartInterval += 3)
+				{
+					CHECK(encoder->SetOption(JENC_OPTION_RESTART_INTERVAL, restartInterval));
+
+					for(int q = 0; q < 3; q++)
+					{
+						JEncResult result = encoder->Encode(desc, qualities[q]);
+						unsigned int bound = GetJpegEncoderMaxOutputSize(width, height, subsampleTypes[s], qualities[q], restartInterval);
+						CHECK(result.Bits != NULL && !result.Overflow);
+						CHECK(result.HeaderSize + result.DataSize <= bound);
+					}
+				}
+			}
+
+			delete encoder;
+		}
+	}
+
+	//callback chunks and a fixed buffer against the internal buffer, small chunks so the stream
+	//comes in many of them
+	BuildTestImage(pixels, 203, 141);
+	desc.Data = &pixels[0];
+	desc.Width = 203;
+	desc.Height = 141;
+	desc.RowPitch = 203 * 4;
+
+	for(int restartInterval = 0; restartInterval <= 7; restartInterval += 7)
+	{
+		JEnc* encoder = CreateJpegEncoderInstance(CPU_ENCODER, JENC_CHROMA_SUBSAMPLE_4_2_0, NULL, NULL);
+		CHECK(encoder != NULL);
+		if(!encoder)
+			continue;
+
+		CHECK(encoder->SetOption(JENC_OPTION_RESTART_INTERVAL, restartInterval));
+
+		JEncResult result = encoder->Encode(desc, 90);
+		CHECK(result.Bits != NULL && !result.Overflow);
+		unsigned int size = result.HeaderSize + result.DataSize;
+		std::vector<unsigned char> expected((unsigned char*)result.Bits, (unsigned char*)result.Bits + size);
+
+		std::vector<unsigned char> stream;
+		JEncOutputSink sink;
+		sink.Type = JENC_SINK_CALLBACK;
+		sink.Callback = AppendChunk;
+		sink.UserData = &stream;
+		sink.ChunkSize = 1000;
+		CHECK(encoder->SetOutputSink(sink));
+
+		result = encoder->Encode(desc, 90);
+		CHECK(result.Bits == NULL && !result.Overflow);
+		CHECK(result.HeaderSize + result.DataSize == size);
+		CHECK(stream == expected);
+
+		//a guard behind the fixed buffer, it fits exactly or is one byte or half of the stream short
+		const unsigned int guardSize = 4096;
+		const unsigned int capacities[3] = { size, size - 1, size / 2 };
+		for(int c = 0; c < 3; c++)
+		{
+			std::vector<unsigned char> memory(capacities[c] + guardSize, 0xA5);
+
+			sink = JEncOutputSink();
+			sink.Type = JENC_SINK_FIXED;
+			sink.Memory = &memory[0];
+			sink.Capacity = capacities[c];
+			CHECK(encoder->SetOutputSink(sink));
+
+			result = encoder->Encode(desc, 90);
+			CHECK(result.HeaderSize + result.DataSize == size);
+
+			if(capacities[c] == size)
+			{
+				CHECK(result.Bits == &memory[0] && !result.Overflow);
+				CHECK(memcmp(&memory[0], &expected[0], size) == 0);
+			}
+			else
+				CHECK(result.Bits == NULL && result.Overflow);
+
+			bool guardIntact = true;
+			for(unsigned int i = capacities[c]; i < memory.size(); i++)
+				guardIntact &= memory[i] == 0xA5;
+			CHECK(guardIntact);
+		}
+
+		delete encoder;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// JENC_OPTION_DEFERRED_STUFFING against stuffing on the way
+//////////////////////////////////////////////////////////////////////////
+static void TestDeferredStuffing()
+{
+	//noise at quality 100 makes 0xFF bytes all over, thread counts and restart intervals
+	//split the stream in different places
+	const int width = 203;
+	const int height = 141;
+
+	std::vector<unsigned char> pixels;
+	JEncRGBDataDesc desc;
+	desc.Width = width;
+	desc.Height = height;
+	desc.RowPitch = width * 4;
+
+	const int threadCounts[2] = { 1, 4 };
+	const int restartIntervals[3] = { 0, 1, 7 };
+
+	for(int kind = 0; kind < 2; kind++)
+	{
+		BuildWorstCaseImage(pixels, width, height, kind);
+		desc.Data = &pixels[0];
+
+		for(int t = 0; t < 2; t++)
+		{
+			SetJpegEncoderThreadCount(threadCounts[t]);
+
+			for(int r = 0; r < 3; r++)
+			{
+				JEnc* reference = CreateJpegEncoderInstance(CPU_ENCODER, JENC_CHROMA_SUBSAMPLE_4_2_0, NULL, NULL);
+				JEnc* deferred = CreateJpegEncoderInstance(CPU_ENCODER, JENC_CHROMA_SUBSAMPLE_4_2_0, NULL, NULL);
+				CHECK(reference != NULL && deferred != NULL);
+				if(!reference || !deferred)
+				{
+					delete reference;
+					delete deferred;
+					continue;
+				}
+
+				CHECK(reference->SetOption(JENC_OPTION_RESTART_INTERVAL, restartIntervals[r]));
+				CHECK(deferred->SetOption(JENC_OPTION_RESTART_INTERVAL, restartIntervals[r]));
+				CHECK(deferred->SetOption(JENC_OPTION_DEFERRED_STUFFING, 1));
+
+				JEncResult expected = reference->Encode(desc, 100);
+				JEncResult result = deferred->Encode(desc, 100);
+				CHECK(expected.Bits != NULL && result.Bits != NULL);
+
+				unsigned int size = expected.HeaderSize + expected.DataSize;
+				CHECK(result.HeaderSize + result.DataSize == size);
+				if(expected.Bits && result.Bits && result.HeaderSize + result.DataSize == size)
+					CHECK(memcmp(result.Bits, expected.Bits, size) == 0);
+
+				//the images have to make the encoder stuff at all
+				int numStuffed = 0;
+				const unsigned char* bits = (const unsigned char*)expected.Bits;
+				for(unsigned int i = expected.HeaderSize; bits && i + 1 < size; i++)
+					numStuffed += bits[i] == 0xFF && bits[i + 1] == 0x00;
+				CHECK(numStuffed > 100);
+
+				delete reference;
+				delete deferred;
+			}
+		}
+	}
+
+	SetJpegEncoderThreadCount(0);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// abbreviated frames, JENC_OPTION_TABLES and EncodeTables
+//////////////////////////////////////////////////////////////////////////
+struct MarkerSegment
+{
+	int Marker;
+	std::vector<unsigned char> Payload;
+};
+
+//marker segments after SOI up to SOS or EOI, returns the offset behind them
+static unsigned int ParseMarkerSegments(const unsigned char* bits, unsigned int size, std::vector<MarkerSegment>& segments)
+{
+	segments.clear();
+	if(size < 2 || bits[0] != 0xFF || bits[1] != 0xD8)
+		return 0;
+
+	unsigned int pos = 2;
+	while(pos + 4 <= size && bits[pos] == 0xFF && bits[pos + 1] != 0xD9)
+	{
+		unsigned int length = (bits[pos + 2] << 8) | bits[pos + 3];
+		if(pos + 2 + length > size)
+			break;
+
+		MarkerSegment segment;
+		segment.Marker = bits[pos + 1];
+		segment.Payload.assign(bits + pos + 4, bits + pos + 2 + length);
+		segments.push_back(segment);
+
+		pos += 2 + length;
+		if(segment.Marker == 0xDA)
+			break;
+	}
+
+	return pos;
+}
+
+static const MarkerSegment* FindMarkerSegment(const std::vector<MarkerSegment>& segments, int marker)
+{
+	for(size_t i = 0; i < segments.size(); i++)
+	{
+		if(segments[i].Marker == marker)
+			return &segments[i];
+	}
+
+	return NULL;
+}
+
+static void TestAbbreviatedFrames()
+{
+	const int width = 203;
+	const int height = 141;
+
+	std::vector<unsigned char> pixels;
+	BuildTestImage(pixels, width, height);
+
+	JEncRGBDataDesc desc;
+	desc.Data = &pixels[0];
+	desc.Width = width;
+	desc.Height = height;
+	desc.RowPitch = width * 4;
+
+	for(int tables = JENC_TABLES_NO_DHT; tables <= JENC_TABLES_NONE; tables++)
+	{
+		for(int restartInterval = 0; restartInterval <= 5; restartInterval += 5)
+		{
+			JEnc* full = CreateJpegEncoderInstance(CPU_ENCODER, JENC_CHROMA_SUBSAMPLE_4_2_2, NULL, NULL);
+			JEnc* abbreviated = CreateJpegEncoderInstance(CPU_ENCODER, JENC_CHROMA_SUBSAMPLE_4_2_2, NULL, NULL);
+			CHECK(full != NULL && abbreviated != NULL);
+			if(!full || !abbreviated)
+			{
+				delete full;
+				delete abbreviated;
+				continue;
+			}
+
+			CHECK(full->SetOption(JENC_OPTION_RESTART_INTERVAL, restartInterval));
+			CHECK(abbreviated->SetOption(JENC_OPTION_RESTART_INTERVAL, restartInterval));
+			CHECK(abbreviated->SetOption(JENC_OPTION_TABLES, tables));
+
+			JEncResult result = full->Encode(desc, 70);
+			CHECK(result.Bits != NULL);
+			std::vector<unsigned char> fullFrame((unsigned char*)result.Bits, (unsigned char*)result.Bits + result.HeaderSize + result.DataSize);
+			unsigned int fullHeaderSize = result.HeaderSize;
+
+			result = abbreviated->Encode(desc, 70);
+			CHECK(result.Bits != NULL);
+			std::vector<unsigned char> frame((unsigned char*)result.Bits, (unsigned char*)result.Bits + result.HeaderSize + result.DataSize);
+			unsigned int frameHeaderSize = result.HeaderSize;
+
+			result = abbreviated->EncodeTables(70);
+			CHECK(result.Bits != NULL && result.DataSize == 0);
+			std::vector<unsigned char> tablesOnly((unsigned char*)result.Bits, (unsigned char*)result.Bits + result.HeaderSize);
+
+			std::vector<MarkerSegment> fullSegments, frameSegments, tableSegments;
+			unsigned int fullScan = ParseMarkerSegments(&fullFrame[0], (unsigned int)fullFrame.size(), fullSegments);
+			unsigned int frameScan = ParseMarkerSegments(&frame[0], (unsigned int)frame.size(), frameSegments);
+			ParseMarkerSegments(&tablesOnly[0], (unsigned int)tablesOnly.size(), tableSegments);
+
+			//the header carries the tables it was asked to and nothing else changes
+			CHECK(fullScan == fullHeaderSize && frameScan == frameHeaderSize);
+			CHECK(FindMarkerSegment(fullSegments, 0xDB) && FindMarkerSegment(fullSegments, 0xC4));
+			CHECK(FindMarkerSegment(frameSegments, 0xC4) == NULL);
+			CHECK((FindMarkerSegment(frameSegments, 0xDB) == NULL) == (tables == JENC_TABLES_NONE));
+			CHECK(tableSegments.size() == 2 && FindMarkerSegment(tableSegments, 0xDB) && FindMarkerSegment(tableSegments, 0xC4));
+
+			//tables from the frame or else from EncodeTables, as a decoder would take them, give the
+			//tables of the full frame
+			const int tableMarkers[2] = { 0xDB, 0xC4 };
+			for(int i = 0; i < 2; i++)
+			{
+				const MarkerSegment* segment = FindMarkerSegment(frameSegments, tableMarkers[i]);
+				if(!segment)
+					segment = FindMarkerSegment(tableSegments, tableMarkers[i]);
+
+				const MarkerSegment* expected = FindMarkerSegment(fullSegments, tableMarkers[i]);
+				CHECK(segment && expected && segment->Payload == expected->Payload);
+			}
+
+			//all other segments and the scan are the same
+			std::vector<MarkerSegment> fullRest, frameRest;
+			for(size_t i = 0; i < fullSegments.size(); i++)
+			{
+				if(fullSegments[i].Marker != 0xDB && fullSegments[i].Marker != 0xC4)
+					fullRest.push_back(fullSegments[i]);
+			}
+			for(size_t i = 0; i < frameSegments.size(); i++)
+			{
+				if(frameSegments[i].Marker != 0xDB)
+					frameRest.push_back(frameSegments[i]);
+			}
+
+			CHECK(fullRest.size() == frameRest.size());
+			for(size_t i = 0; i < fullRest.size() && i < frameRest.size(); i++)
+				CHECK(fullRest[i].Marker == frameRest[i].Marker && fullRest[i].Payload == frameRest[i].Payload);
+
+			CHECK(fullFrame.size() - fullScan == frame.size() - frameScan);
+			if(fullFrame.size() - fullScan == frame.size() - frameScan)
+				CHECK(memcmp(&fullFrame[fullScan], &frame[frameScan], frame.size() - frameScan) == 0);
+
+			delete full;
+			delete abbreviated;
+		}
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// baseline Huffman decoding of the scan, the quantized coefficients of a frame
+//////////////////////////////////////////////////////////////////////////
+struct HuffmanDecodeTable
+{
+	int MaxCode[18];	//largest code of every length, -1 without any
+	int ValueOffset[17];
+	unsigned char Values[256];
+};
+
+static void BuildHuffmanDecodeTable(const unsigned char* nrCodes, const unsigned char* values, HuffmanDecodeTable& table)
+{
+	int code = 0;
+	int numValues = 0;
+	for(int length = 1; length <= 16; length++)
+	{
+		table.ValueOffset[length] = numValues - code;
+		code += nrCodes[length - 1];
+		numValues += nrCodes[length - 1];
+		table.MaxCode[length] = nrCodes[length - 1] ? code - 1 : -1;
+		code <<= 1;
+	}
+	table.MaxCode[17] = 0x7FFFFFFF;
+
+	memcpy(table.Values, values, numValues);
+}
+
+struct ScanReader
+{
+	const unsigned char* Bits;
+	unsigned int Pos;
+	unsigned int End;
+	unsigned int Buffer;
+	int NumBits;
+	bool Failed;
+
+	int ReadBit()
+	{
+		if(NumBits == 0)
+		{
+			//0xFF is followed by a stuffed 0x00, anything else is a marker the scan must not run into
+			if(Pos >= End || (Bits[Pos] == 0xFF && (Pos + 1 >= End || Bits[Pos + 1] != 0x00)))
+			{
+				Failed = true;
+				return 0;
+			}
+
+			Buffer = Bits[Pos];
+			Pos += Bits[Pos] == 0xFF ? 2 : 1;
+			NumBits = 8;
+		}
+
+		NumBits--;
+		return (Buffer >> NumBits) & 1;
+	}
+
+	int Receive(int numBits)
+	{
+		int value = 0;
+		for(int i = 0; i < numBits; i++)
+			value = (value << 1) | ReadBit();
+
+		//the lower half of the category stands for the negative values
+		if(numBits > 0 && value < (1 << (numBits - 1)))
+			value -= (1 << numBits) - 1;
+
+		return value;
+	}
+
+	int Decode(const HuffmanDecodeTable& table)
+	{
+		int code = ReadBit();
+		int length = 1;
+		while(length <= 16 && code > table.MaxCode[length])
+		{
+			code = (code << 1) | ReadBit();
+			length++;
+		}
+
+		if(length > 16 || Failed)
+		{
+			Failed = true;
+			return 0;
+		}
+
+		return table.Values[table.ValueOffset[length] + code];
+	}
+};
+
+//coefficients of every block in scan order, zigzag within the block. False if the stream does
+//not decode, does not use up the scan exactly or has RSTn markers out of place.
+static bool DecodeFrame(const unsigned char* bits, unsigned int size, std::vector<short>& coefficients)
+{
+	coefficients.clear();
+
+	std::vector<MarkerSegment> segments;
+	unsigned int scanStart = ParseMarkerSegments(bits, size, segments);
+
+	const MarkerSegment* frame = FindMarkerSegment(segments, 0xC0);
+	if(!frame || frame->Payload.size() != 15 || size < scanStart + 2 || bits[size - 2] != 0xFF || bits[size - 1] != 0xD9)
+		return false;
+
+	//tables 0 of Y and 1 of Cb and Cr, the way the encoder writes them
+	HuffmanDecodeTable DCTables[2], ACTables[2];
+	const MarkerSegment* huffman = FindMarkerSegment(segments, 0xC4);
+	if(!huffman)
+		return false;
+
+	for(size_t pos = 0; pos + 17 <= huffman->Payload.size(); )
+	{
+		int tableClass = huffman->Payload[pos] >> 4;
+		int index = huffman->Payload[pos] & 15;
+		const unsigned char* nrCodes = &huffman->Payload[pos + 1];
+
+		int numValues = 0;
+		for(int i = 0; i < 16; i++)
+			numValues += nrCodes[i];
+
+		if(index > 1 || pos + 17 + numValues > huffman->Payload.size())
+			return false;
+
+		BuildHuffmanDecodeTable(nrCodes, &huffman->Payload[pos + 17], tableClass ? ACTables[index] : DCTables[index]);
+		pos += 17 + numValues;
+	}
+
+	int height = (frame->Payload[1] << 8) | frame->Payload[2];
+	int width = (frame->Payload[3] << 8) | frame->Payload[4];
+	int samplingH = frame->Payload[7] >> 4;
+	int samplingV = frame->Payload[7] & 15;
+
+	const MarkerSegment* restart = FindMarkerSegment(segments, 0xDD);
+	int restartInterval = restart ? (restart->Payload[0] << 8) | restart->Payload[1] : 0;
+
+	int numMCUs = ((width + 8 * samplingH - 1) / (8 * samplingH)) * ((height + 8 * samplingV - 1) / (8 * samplingV));
+	int numBlocksY = samplingH * samplingV;
+
+	ScanReader reader;
+	memset(&reader, 0, sizeof(reader));
+	reader.Bits = bits;
+	reader.Pos = scanStart;
+	reader.End = size - 2;
+
+	int prevDC[3] = { 0, 0, 0 };
+	for(int mcu = 0; mcu < numMCUs; mcu++)
+	{
+		//padding bits are dropped and the RSTn marker follows
+		if(restartInterval > 0 && mcu > 0 && mcu % restartInterval == 0)
+		{
+			int marker = 0xD0 + ((mcu / restartInterval - 1) & 7);
+			if(reader.Pos + 2 > reader.End || bits[reader.Pos] != 0xFF || bits[reader.Pos + 1] != marker)
+				return false;
+
+			reader.Pos += 2;
+			reader.NumBits = 0;
+			prevDC[0] = prevDC[1] = prevDC[2] = 0;
+		}
+
+		for(int block = 0; block < numBlocksY + 2; block++)
+		{
+			int component = block < numBlocksY ? 0 : block - numBlocksY + 1;
+			int table = component > 0 ? 1 : 0;
+
+			short DU[64];
+			memset(DU, 0, sizeof(DU));
+
+			prevDC[component] += reader.Receive(reader.Decode(DCTables[table]));
+			DU[0] = (short)prevDC[component];
+
+			for(int k = 1; k < 64; k++)
+			{
+				int symbol = reader.Decode(ACTables[table]);
+				int run = symbol >> 4;
+				int category = symbol & 15;
+
+				if(category == 0)
+				{
+					if(run != 15)
+						break;
+
+					k += 15;
+					continue;
+				}
+
+				k += run;
+				if(k > 63)
+					return false;
+
+				DU[k] = (short)reader.Receive(category);
+			}
+
+			if(reader.Failed)
+				return false;
+
+			coefficients.insert(coefficients.end(), DU, DU + 64);
+		}
+	}
+
+	return reader.Pos == reader.End;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// JENC_OPTION_OPTIMIZE_HUFFMAN
+//////////////////////////////////////////////////////////////////////////
+static void TestOptimizedHuffman()
+{
+	const int width = 203;
+	const int height = 141;
+
+	std::vector<unsigned char> pixels;
+	BuildTestImage(pixels, width, height);
+
+	JEncRGBDataDesc desc;
+	desc.Data = &pixels[0];
+	desc.Width = width;
+	desc.Height = height;
+	desc.RowPitch = width * 4;
+
+	const JENC_CHROMA_SUBSAMPLE subsampleTypes[2] = { JENC_CHROMA_SUBSAMPLE_4_4_4, JENC_CHROMA_SUBSAMPLE_4_2_0 };
+	for(int s = 0; s < 2; s++)
+	{
+		for(int restartInterval = 0; restartInterval <= 7; restartInterval += 7)
+		{
+			JEnc* standard = CreateJpegEncoderInstance(CPU_ENCODER, subsampleTypes[s], NULL, NULL);
+			JEnc* optimized = CreateJpegEncoderInstance(CPU_ENCODER, subsampleTypes[s], NULL, NULL);
+			CHECK(standard != NULL && optimized != NULL);
+			if(!standard || !optimized)
+			{
+				delete standard;
+				delete optimized;
+				continue;
+			}
+
+			CHECK(standard->SetOption(JENC_OPTION_RESTART_INTERVAL, restartInterval));
+			CHECK(optimized->SetOption(JENC_OPTION_RESTART_INTERVAL, restartInterval));
+			CHECK(optimized->SetOption(JENC_OPTION_OPTIMIZE_HUFFMAN, 1));
+
+			JEncResult result = standard->Encode(desc, 75);
+			CHECK(result.Bits != NULL);
+			std::vector<unsigned char> standardFrame((unsigned char*)result.Bits, (unsigned char*)result.Bits + result.HeaderSize + result.DataSize);
+
+			result = optimized->Encode(desc, 75);
+			CHECK(result.Bits != NULL);
+			std::vector<unsigned char> optimizedFrame((unsigned char*)result.Bits, (unsigned char*)result.Bits + result.HeaderSize + result.DataSize);
+
+			//smaller with the tables in the header, and the same coefficients come out
+			CHECK(optimizedFrame.size() < standardFrame.size());
+
+			std::vector<short> standardCoefficients, optimizedCoefficients;
+			CHECK(DecodeFrame(&standardFrame[0], (unsigned int)standardFrame.size(), standardCoefficients));
+			CHECK(DecodeFrame(&optimizedFrame[0], (unsigned int)optimizedFrame.size(), optimizedCoefficients));
+			CHECK(!optimizedCoefficients.empty() && optimizedCoefficients == standardCoefficients);
+
+			delete standard;
+			delete optimized;
+		}
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// JENC_OPTION_ADAPTIVE_HUFFMAN
+//////////////////////////////////////////////////////////////////////////
+static void TestAdaptiveHuffman()
+{
+	const int width = 203;
+	const int height = 141;
+
+	std::vector<unsigned char> image, pixels(width * height * 4);
+	BuildTestImage(image, width, height);
+
+	JEncRGBDataDesc desc;
+	desc.Data = &pixels[0];
+	desc.Width = width;
+	desc.Height = height;
+	desc.RowPitch = width * 4;
+
+	//a panning stream, with JENC_OPTION_DETERMINISTIC the tables change at the same frames and
+	//the frames are the same bytes on one thread and on several
+	const int numFrames = 10;
+	const int threadCounts[2] = { 1, 4 };
+	std::vector<unsigned char> frames[2][numFrames];
+
+	for(int t = 0; t < 2; t++)
+	{
+		SetJpegEncoderThreadCount(threadCounts[t]);
+
+		JEnc* encoder = CreateJpegEncoderInstance(CPU_ENCODER, JENC_CHROMA_SUBSAMPLE_4_2_0, NULL, NULL);
+		CHECK(encoder != NULL);
+		if(!encoder)
+			continue;
+
+		CHECK(encoder->SetOption(JENC_OPTION_DETERMINISTIC, 1));
+		CHECK(encoder->SetOption(JENC_OPTION_ADAPTIVE_HUFFMAN, 3));
+
+		for(int frame = 0; frame < numFrames; frame++)
+		{
+			for(int y = 0; y < height; y++)
+				memcpy(&pixels[y * width * 4], &image[(y * width + frame * 5) * 4], (width - frame * 5) * 4);
+
+			JEncResult result = encoder->Encode(desc, 75);
+			CHECK(result.Bits != NULL && !result.Overflow);
+			if(result.Bits)
+				frames[t][frame].assign((unsigned char*)result.Bits, (unsigned char*)result.Bits + result.HeaderSize + result.DataSize);
+		}
+
+		delete encoder;
+	}
+
+	SetJpegEncoderThreadCount(0);
+
+	//the first frame has the standard tables, later ones adapted tables that decode
+	std::vector<unsigned char> standardTables;
+	int numAdapted = 0;
+	for(int frame = 0; frame < numFrames; frame++)
+	{
+		CHECK(frames[0][frame] == frames[1][frame]);
+
+		std::vector<short> coefficients;
+		CHECK(!frames[0][frame].empty() && DecodeFrame(&frames[0][frame][0], (unsigned int)frames[0][frame].size(), coefficients));
+
+		std::vector<MarkerSegment> segments;
+		if(!frames[0][frame].empty())
+			ParseMarkerSegments(&frames[0][frame][0], (unsigned int)frames[0][frame].size(), segments);
+
+		const MarkerSegment* huffman = FindMarkerSegment(segments, 0xC4);
+		CHECK(huffman != NULL);
+		if(!huffman)
+			continue;
+
+		if(frame == 0)
+			standardTables = huffman->Payload;
+		else if(huffman->Payload != standardTables)
+			numAdapted++;
+	}
+	CHECK(numAdapted > 0);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// JEncRateControl
+//////////////////////////////////////////////////////////////////////////
+static void TestRateControl()
+{
+	const int width = 203;
+	const int height = 141;
+
+	std::vector<unsigned char> image, pixels(width * height * 4);
+	BuildTestImage(image, width, height);
+
+	JEncRGBDataDesc desc;
+	desc.Data = &pixels[0];
+	desc.Width = width;
+	desc.Height = height;
+	desc.RowPitch = width * 4;
+
+	JEnc* encoder = CreateJpegEncoderInstance(CPU_ENCODER, JENC_CHROMA_SUBSAMPLE_4_2_0, NULL, NULL);
+	CHECK(encoder != NULL);
+	if(!encoder)
+		return;
+
+	//targets the sizes of a low and a high quality frame, starting far from either
+	const int targetQualities[2] = { 30, 90 };
+
+	for(int i = 0; i < 2; i++)
+	{
+		memcpy(&pixels[0], &image[0], pixels.size());
+		JEncResult result = encoder->Encode(desc, targetQualities[i]);
+		unsigned int targetSize = result.HeaderSize + result.DataSize;
+
+		JEncRateControlDesc rateDesc;
+		rateDesc.TargetFrameSize = targetSize;
+		rateDesc.InitialQuality = 100 - targetQualities[i];
+
+		JEncRateControl* rateControl = CreateJpegRateControlInstance(rateDesc);
+		CHECK(rateControl != NULL);
+		if(!rateControl)
+			continue;
+
+		//a panning stream, an empty buffer lets the first frames go above the target until it is a
+		//quarter full, the last frames have to average out at the target
+		const int numFrames = 60;
+		double lastSizes = 0.0;
+		for(int frame = 0; frame < numFrames; frame++)
+		{
+			int offset = frame % 20;
+			for(int y = 0; y < height; y++)
+				memcpy(&pixels[y * width * 4], &image[(y * width + offset) * 4], (width - offset) * 4);
+
+			int quality = rateControl->GetQuality();
+			result = encoder->Encode(desc, quality);
+			CHECK(result.Bits != NULL);
+
+			unsigned int frameSize = result.HeaderSize + result.DataSize;
+			rateControl->FrameEncoded(quality, frameSize);
+
+			//30 frames of the target by default
+			CHECK(rateControl->GetBufferFullness() <= 30 * targetSize);
+
+			if(frame >= numFrames - 20)
+				lastSizes += frameSize;
+		}
+
+		double meanSize = lastSizes / 20;
+		CHECK(meanSize > 0.9 * targetSize && meanSize < 1.1 * targetSize);
+
+		delete rateControl;
+	}
+
+	delete encoder;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// CreateJpegEncoderContext
+//////////////////////////////////////////////////////////////////////////
+static void EncodeOnContext(JEnc* context, const JEncRGBDataDesc* desc, std::vector<unsigned char>* stream)
+{
+	JEncResult result = context->Encode(*desc, 80);
+	if(result.Bits)
+		stream->assign((unsigned char*)result.Bits, (unsigned char*)result.Bits + result.HeaderSize + result.DataSize);
+}
+
+static void TestEncoderContexts()
+{
+	const int width = 203;
+	const int height = 141;
+
+	std::vector<unsigned char> pixels;
+	BuildTestImage(pixels, width, height);
+
+	JEncRGBDataDesc desc;
+	desc.Data = &pixels[0];
+	desc.Width = width;
+	desc.Height = height;
+	desc.RowPitch = width * 4;
+
+	//options the contexts take over from the encoder
+	for(int optimize = 0; optimize < 2; optimize++)
+	{
+		JEnc* encoder = CreateJpegEncoderInstance(CPU_ENCODER, JENC_CHROMA_SUBSAMPLE_4_2_2, NULL, NULL);
+		CHECK(encoder != NULL);
+		if(!encoder)
+			continue;
+
+		CHECK(encoder->SetOption(JENC_OPTION_DCT_METHOD, JENC_DCT_IFAST));
+		CHECK(encoder->SetOption(JENC_OPTION_RESTART_INTERVAL, 6));
+		CHECK(encoder->SetOption(JENC_OPTION_TABLES, JENC_TABLES_NO_DHT));
+		CHECK(encoder->SetOption(JENC_OPTION_OPTIMIZE_HUFFMAN, optimize));
+
+		std::vector<unsigned char> expected;
+		EncodeOnContext(encoder, &desc, &expected);
+		CHECK(!expected.empty());
+
+		//two contexts encoding at the same time on threads of their own, each the same bytes as the encoder
+		JEnc* contexts[2] = { CreateJpegEncoderContext(encoder), CreateJpegEncoderContext(encoder) };
+		CHECK(contexts[0] != NULL && contexts[1] != NULL);
+
+		if(contexts[0] && contexts[1])
+		{
+			std::vector<unsigned char> streams[2];
+			std::thread thread(EncodeOnContext, contexts[1], &desc, &streams[1]);
+			EncodeOnContext(contexts[0], &desc, &streams[0]);
+			thread.join();
+
+			CHECK(streams[0] == expected);
+			CHECK(streams[1] == expected);
+
+			//and again on the encoder after them
+			std::vector<unsigned char> stream;
+			EncodeOnContext(encoder, &desc, &stream);
+			CHECK(stream == expected);
+		}
+
+		delete contexts[0];
+		delete contexts[1];
+		delete encoder;
+	}
+}
+
+int main()
+{
+	TestFDCT();
+	TestQuantization(JENC_DCT_ISLOW);
+	TestQuantization(JENC_DCT_IFAST);
+	TestPackBlocks();
+	TestGoldenHashes();
+	TestOutputSinks();
+	TestDeferredStuffing();
+	TestAbbreviatedFrames();
+	TestOptimizedHuffman();
+	TestAdaptiveHuffman();
+	TestRateControl();
+	TestEncoderContexts();
+
+	if(sNumFailures)
+	{
+		printf("%d failures\n", sNumFailures);
+		return 1;
+	}
+
+	printf("all passed\n");
+	return 0;
+}
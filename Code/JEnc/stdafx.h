@@ -6,10 +6,14 @@
 #ifndef _STDAFX__H
 #define _STDAFX__H
 
+#if defined(_MSC_VER)
 #pragma warning(disable : 4099)
+#endif
 
+#if defined(_WIN32)
 #include <windows.h>
 #include <tchar.h>
+#endif
 
 #include <string>
 #include <vector>
@@ -31,11 +35,15 @@
 //////////////////////////////////////////////////////////////////////////
 // to find memory leaks
 //////////////////////////////////////////////////////////////////////////
+#if defined(_MSC_VER)
 #define _CRTDBG_MAP_ALLOC
 #include <stdlib.h>
 #include <crtdbg.h>
+#else
+#include <stdlib.h>
+#endif
 
-#ifdef _DEBUG
+#if defined(_DEBUG) && defined(_MSC_VER)
 #define myMalloc(s)       _malloc_dbg(s, _NORMAL_BLOCK, __FILE__, __LINE__)
 #define myCalloc(c, s)    _calloc_dbg(c, s, _NORMAL_BLOCK, __FILE__, __LINE__)
 #define myRealloc(p, s)   _realloc_dbg(p, s, _NORMAL_BLOCK, __FILE__, __LINE__)
@@ -42,6 +42,13 @@ public:
 	void CopyToStaging()
 	{ _D3DContext->CopyResource(_Staging, _Resource); }
 
+	//only the bytes [byteOffset, byteOffset + numBytes) of the buffer
+	void CopyToStaging(UINT byteOffset, UINT numBytes)
+	{
+		D3D11_BOX box = { byteOffset, 0, 0, byteOffset + numBytes, 1, 1 };
+		_D3DContext->CopySubresourceRegion(_Staging, 0, byteOffset, 0, 0, _Resource, 0, &box);
+	}
+
 	template<class T>
 	T* Map()
 	{
@@ -71,6 +71,31 @@ public:
 		m_D3D12Wrap->WaitForGPUCompletion(m_copyQueue, m_D3D12Wrap->GetTestFence());
 	}
 
+	//only the bytes [byteOffset, byteOffset + numBytes) of the buffer
+	void CopyToStaging(UINT byteOffset, UINT numBytes)
+	{
+		D3D12_RESOURCE_BARRIER barrier{};
+		MakeResourceBarrier(
+			barrier,
+			D3D12_RESOURCE_BARRIER_TYPE_UAV,
+			m_resource,
+			D3D12_RESOURCE_STATES(0), //UAV does not need transition states
+			D3D12_RESOURCE_STATES(0)
+		);
+
+		m_copyCmdAllocator->Reset();
+		m_colyCommandList->Reset(m_copyCmdAllocator, nullptr);
+
+		m_colyCommandList->ResourceBarrier(1, &barrier);
+		m_colyCommandList->CopyBufferRegion(m_staging, byteOffset, m_resource, byteOffset, numBytes);
+
+		m_colyCommandList->Close();
+		ID3D12CommandList* ppCommandLists[] = { m_colyCommandList };
+		m_copyQueue->ExecuteCommandLists(_ARRAYSIZE(ppCommandLists), ppCommandLists);
+
+		m_D3D12Wrap->WaitForGPUCompletion(m_copyQueue, m_D3D12Wrap->GetTestFence());
+	}
+
 	template<class T>
 	T* Map()
 	{
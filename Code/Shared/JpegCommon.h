@@ -174,7 +174,7 @@ static void ComputeQuantizationTable(unsigned char* outTable, unsigned int* inTa
 	{
 		int j = int(inTable[i] * q);
 
-		outTable[i] = unsigned char(JPEG_MIN(JPEG_MAX(j, 1), 255));
+		outTable[i] = (unsigned char)(JPEG_MIN(JPEG_MAX(j, 1), 255));
 	}
 }
 